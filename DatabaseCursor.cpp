@@ -46,13 +46,15 @@ DatabaseCursor::~DatabaseCursor(void)
 
 bool DatabaseCursor::reset()
 {
+	//The read lock was released if the cursor was shut down
+	bool with_read_lock = is_shutdown;
 	tries = 60;
 	lastErr = SQLITE_OK;
 	_has_error = false;
 	is_shutdown = false;
 	transaction_lock = false;
 
-	query->setupStepping(timeoutms, false);
+	query->setupStepping(timeoutms, with_read_lock);
 
 #ifdef LOG_READ_QUERIES
 	active_query = new ScopedAddActiveQuery(query);
@@ -63,6 +65,41 @@ bool DatabaseCursor::reset()
 bool DatabaseCursor::next(db_single_result &res)
 {
 	res.clear();
+	return step(&res);
+}
+
+bool DatabaseCursor::nextRow()
+{
+	return step(NULL);
+}
+
+int DatabaseCursor::getInt(int column)
+{
+	return static_cast<int>(query->getColumnInt64(column));
+}
+
+int64 DatabaseCursor::getInt64(int column)
+{
+	return query->getColumnInt64(column);
+}
+
+double DatabaseCursor::getDouble(int column)
+{
+	return query->getColumnDouble(column);
+}
+
+void DatabaseCursor::getStr(int column, std::string& val)
+{
+	query->getColumnStr(column, val);
+}
+
+bool DatabaseCursor::isNull(int column)
+{
+	return query->isColumnNull(column);
+}
+
+bool DatabaseCursor::step(db_single_result* res)
+{
 	do
 	{
 		bool reset=false;
@@ -15,6 +15,18 @@ public:
 
 	bool next(db_single_result &res);
 
+	bool nextRow();
+
+	int getInt(int column);
+
+	int64 getInt64(int column);
+
+	double getDouble(int column);
+
+	void getStr(int column, std::string& val);
+
+	bool isNull(int column);
+
 	bool reset();
 
 	bool has_error();
@@ -22,6 +34,8 @@ public:
 	virtual void shutdown();
 
 private:
+	bool step(db_single_result* res);
+
 	CQuery *query;
 
 	bool transaction_lock;
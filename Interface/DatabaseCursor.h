@@ -8,6 +8,21 @@ class IDatabaseCursor
 public:
 	virtual bool next(db_single_result &res)=0;
 
+	//Steps to the next row without converting it to strings. The columns of
+	//the current row are read by index with the get functions below
+	virtual bool nextRow()=0;
+
+	virtual int getInt(int column)=0;
+
+	virtual int64 getInt64(int column)=0;
+
+	virtual double getDouble(int column)=0;
+
+	//Assigns text or blob column data to val (reusing its buffer)
+	virtual void getStr(int column, std::string& val)=0;
+
+	virtual bool isNull(int column)=0;
+
 	virtual bool has_error()=0;
 
 	virtual bool reset() = 0;
@@ -39,6 +54,11 @@ public:
 		return cursor->has_error();
 	}
 
+	IDatabaseCursor* get()
+	{
+		return cursor;
+	}
+
 private:
 	IDatabaseCursor* cursor;
 };
@@ -25,6 +25,11 @@ const int MODE_RW_DIRECT = 16;
 const int MODE_RW_CREATE_DIRECT = 17;
 const int MODE_RW_CREATE_DELETE = 18;
 const int MODE_RW_DELETE = 19;
+//Like MODE_RW/MODE_RW_CREATE, but writes may be queued (io_uring on Linux). Errors
+//of queued writes are only reported by the next call, so the file has to be synced
+//(checking the result) before it is closed
+const int MODE_RW_ASYNC = 20;
+const int MODE_RW_CREATE_ASYNC = 21;
 //Linux only
 const int MODE_RW_READNONE=10;
 
@@ -345,7 +345,7 @@ db_results CQuery::Read(int *timeoutms)
 	do
 	{
 		bool reset=false;
-		err=step(res, timeoutms, tries, transaction_lock, reset);
+		err=step(&res, timeoutms, tries, transaction_lock, reset);
 		if(reset)
 		{
 			rows.clear();
@@ -385,7 +385,7 @@ namespace
 	}
 }
 
-int CQuery::step(db_single_result& res, int *timeoutms, int& tries, bool& transaction_lock, bool& reset)
+int CQuery::step(db_single_result* res, int *timeoutms, int& tries, bool& transaction_lock, bool& reset)
 {
 	int err=sqlite3_step(ps);
 	if( resultOkay(err) )
@@ -427,6 +427,11 @@ int CQuery::step(db_single_result& res, int *timeoutms, int& tries, bool& transa
 		}
 		else if( err==SQLITE_ROW )
 		{
+			if(res==NULL)
+			{
+				return err;
+			}
+
 			int column=0;
 			std::string column_name;
 			while( !(column_name=ustring_sqlite3_column_name(ps, column) ).empty() )
@@ -444,7 +449,7 @@ int CQuery::step(db_single_result& res, int *timeoutms, int& tries, bool& transa
 					data_size = sqlite3_column_bytes(ps, column);
 				}
 				std::string datastr(reinterpret_cast<const char*>(data), reinterpret_cast<const char*>(data)+data_size);				
-				res.insert( std::pair<std::string, std::string>(column_name, datastr) );
+				res->insert( std::pair<std::string, std::string>(column_name, datastr) );
 				++column;
 			}
 		}
@@ -465,6 +470,35 @@ int CQuery::step(db_single_result& res, int *timeoutms, int& tries, bool& transa
 	return err;
 }
 
+int64 CQuery::getColumnInt64(int column)
+{
+	return sqlite3_column_int64(ps, column);
+}
+
+double CQuery::getColumnDouble(int column)
+{
+	return sqlite3_column_double(ps, column);
+}
+
+void CQuery::getColumnStr(int column, std::string& val)
+{
+	const char* data = reinterpret_cast<const char*>(sqlite3_column_blob(ps, column));
+	int data_size = sqlite3_column_bytes(ps, column);
+	if(data==NULL)
+	{
+		val.clear();
+	}
+	else
+	{
+		val.assign(data, data_size);
+	}
+}
+
+bool CQuery::isColumnNull(int column)
+{
+	return sqlite3_column_type(ps, column)==SQLITE_NULL;
+}
+
 IDatabaseCursor* CQuery::Cursor(int *timeoutms)
 {
 	if(cursor==NULL)
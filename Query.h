@@ -49,7 +49,13 @@ public:
 	void setupStepping(int *timeoutms, bool with_read_lock);
 	void shutdownStepping(int err, int *timeoutms, bool& transaction_lock);
 
-	int step(db_single_result& res, int *timeoutms, int& tries, bool& transaction_lock, bool& reset);
+	//Does not convert the row if res is NULL
+	int step(db_single_result* res, int *timeoutms, int& tries, bool& transaction_lock, bool& reset);
+
+	int64 getColumnInt64(int column);
+	double getColumnDouble(int column);
+	void getColumnStr(int column, std::string& val);
+	bool isColumnNull(int column);
 
 	bool resultOkay(int rc);
 
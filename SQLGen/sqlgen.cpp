@@ -495,6 +495,56 @@ std::string return_blob(size_t tabs, std::string value_name, std::string sql_nam
 	return ret;
 }
 
+std::vector<std::string> getSelectVars(const std::string& parsedSql)
+{
+	std::vector<std::string> return_exp_vars;
+	size_t select_pos = strlower(parsedSql).find("select");
+	size_t from_pos = strlower(parsedSql).find("from");
+	if (select_pos == std::string::npos)
+	{
+		return return_exp_vars;
+	}
+	std::string select_vars = trim(parsedSql.substr(select_pos + 6, from_pos - select_pos - 6));
+	if (!select_vars.empty() && select_vars != "*")
+	{
+		Tokenize(select_vars, return_exp_vars, ",");
+		for (size_t i = 0; i < return_exp_vars.size(); ++i)
+		{
+			return_exp_vars[i] = trim(return_exp_vars[i]);
+			size_t as_pos = strlower(return_exp_vars[i]).find(" as ");
+			if (as_pos != std::string::npos)
+			{
+				return_exp_vars[i] = trim(return_exp_vars[i].substr(as_pos + 4));
+			}
+			else if (return_exp_vars[i].find(".") != std::string::npos)
+			{
+				return_exp_vars[i] = getafter(".", return_exp_vars[i]);
+			}
+		}
+	}
+	return return_exp_vars;
+}
+
+std::string cursor_get(std::string tabs, std::string value_name, ReturnType rtype, size_t column)
+{
+	if(rtype.type=="int")
+	{
+		return tabs+value_name+"=cursor->getInt("+convert(column)+");\r\n";
+	}
+	else if(rtype.type=="int64")
+	{
+		return tabs+value_name+"=cursor->getInt64("+convert(column)+");\r\n";
+	}
+	else if(rtype.type=="double")
+	{
+		return tabs+value_name+"=cursor->getDouble("+convert(column)+");\r\n";
+	}
+	else
+	{
+		return tabs+"cursor->getStr("+convert(column)+", "+value_name+");\r\n";
+	}
+}
+
 AnnotatedCode generateSqlFunction(IDatabase* db, AnnotatedCode input, GeneratedData& gen_data, bool check)
 {
 	std::string sql=input.annotations["sql"];
@@ -517,8 +567,15 @@ AnnotatedCode generateSqlFunction(IDatabase* db, AnnotatedCode input, GeneratedD
 	query_name="q_"+query_name;
 
 	bool return_vector=false;
+	bool return_cursor=false;
 
-	if(return_type.find("vector")==0)
+	if(return_type.find("cursor")==0)
+	{
+		struct_name=getbetween("<", ">", return_type);
+		return_type="IDatabaseCursor*";
+		return_cursor=true;
+	}
+	else if(return_type.find("vector")==0)
 	{
 		return_type="std::"+return_type;
 	}
@@ -588,7 +645,11 @@ AnnotatedCode generateSqlFunction(IDatabase* db, AnnotatedCode input, GeneratedD
 		use_struct=true;
 	}
 	
-	if(return_vector)
+	if(return_cursor)
+	{
+		generateStructure(struct_name, return_types, gen_data, false);
+	}
+	else if(return_vector)
 	{
 		if(return_types.size()>1)
 		{
@@ -638,27 +699,9 @@ AnnotatedCode generateSqlFunction(IDatabase* db, AnnotatedCode input, GeneratedD
 
 		if (stmt_type == StatementType_Select)
 		{
-			size_t select_pos = strlower(parsedSql).find("select");
-			size_t from_pos = strlower(parsedSql).find("from");
-			std::string select_vars = trim(parsedSql.substr(select_pos + 6, from_pos - select_pos - 6));
-			if (!select_vars.empty() && select_vars != "*")
+			std::vector<std::string> return_exp_vars = getSelectVars(parsedSql);
+			if (!return_exp_vars.empty())
 			{
-				std::vector<std::string> return_exp_vars;
-				Tokenize(select_vars, return_exp_vars, ",");
-				for (size_t i = 0; i < return_exp_vars.size(); ++i)
-				{
-					return_exp_vars[i] = trim(return_exp_vars[i]);
-					size_t as_pos = strlower(return_exp_vars[i]).find(" as ");
-					if (as_pos != std::string::npos)
-					{
-						return_exp_vars[i] = trim(return_exp_vars[i].substr(as_pos + 4));
-					}
-					else if (return_exp_vars[i].find(".") != std::string::npos)
-					{
-						return_exp_vars[i] = getafter(".", return_exp_vars[i]);
-					}
-				}
-
 				for (size_t i = 0; i < return_types.size(); ++i)
 				{
 					if (std::find(return_exp_vars.begin(), return_exp_vars.end(), return_types[i].name)
@@ -672,6 +715,28 @@ AnnotatedCode generateSqlFunction(IDatabase* db, AnnotatedCode input, GeneratedD
 		}
 	}	
 
+	//Cursor rows are read by column index
+	std::vector<size_t> cursor_columns;
+	if(return_cursor)
+	{
+		if(stmt_type!=StatementType_Select)
+		{
+			std::cout << "ERROR cursor functions need a SELECT statement. Function: " << func << std::endl;
+			return AnnotatedCode(input.annotations, "");
+		}
+		std::vector<std::string> return_exp_vars = getSelectVars(parsedSql);
+		for (size_t i = 0; i < return_types.size(); ++i)
+		{
+			std::vector<std::string>::iterator it = std::find(return_exp_vars.begin(), return_exp_vars.end(), return_types[i].name);
+			if (it == return_exp_vars.end())
+			{
+				std::cout << "ERROR Cannot find column of '" << return_types[i].name << "' in SQL: " << parsedSql << " Function: " << func << std::endl;
+				return AnnotatedCode(input.annotations, "");
+			}
+			cursor_columns.push_back(it - return_exp_vars.begin());
+		}
+	}
+
 	std::string return_outer=return_type;
 	if(return_vector)
 	{
@@ -709,7 +774,7 @@ AnnotatedCode generateSqlFunction(IDatabase* db, AnnotatedCode input, GeneratedD
 		return_outer=(classname.empty()?"":classname+"::")+struct_name;
 		return_type=struct_name;
 	}
-	else if(struct_name!="string" && struct_name!="void" && struct_name!="int"
+	else if(!return_cursor && struct_name!="string" && struct_name!="void" && struct_name!="int"
 		&& struct_name!="bool" && struct_name!="int64")
 	{
 		return_outer=(classname.empty()?"":classname+"::")+struct_name;
@@ -792,7 +857,34 @@ AnnotatedCode generateSqlFunction(IDatabase* db, AnnotatedCode input, GeneratedD
 
 	bool has_return=false;
 
-	if(stmt_type==StatementType_Select)
+	if(stmt_type==StatementType_Select && return_cursor)
+	{
+		if(!params.empty())
+		{
+			code+="\t"+query_name+"->Reset();\r\n";
+		}
+		code+="\treturn "+query_name+"->Cursor();\r\n";
+		code+="}";
+
+		//Reads the next row into the structure without converting the
+		//columns to strings. Generated into the header
+		std::string nextdecl="\tbool "+func_s_name+"Next(IDatabaseCursor* cursor, "+struct_name+"& row)\r\n";
+		nextdecl+="\t{\r\n";
+		nextdecl+="\t\tif(!cursor->nextRow())\r\n";
+		nextdecl+="\t\t{\r\n";
+		nextdecl+="\t\t\treturn false;\r\n";
+		nextdecl+="\t\t}\r\n";
+		for(size_t i=0;i<return_types.size();++i)
+		{
+			nextdecl+=cursor_get("\t\t", "row."+return_types[i].name, return_types[i], cursor_columns[i]);
+		}
+		nextdecl+="\t\treturn true;\r\n";
+		nextdecl+="\t}\r\n";
+		gen_data.funcdecls+=nextdecl;
+
+		return AnnotatedCode(input.annotations, code);
+	}
+	else if(stmt_type==StatementType_Select)
 	{
 		code+="\tdb_results res="+query_name+"->Read();\r\n";
 	}
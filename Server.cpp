@@ -48,6 +48,7 @@
 #include "StreamPipe.h"
 #include "ThreadPool.h"
 #include "file.h"
+#include "file_uring.h"
 #include "utf8/utf8.h"
 #include "MemoryPipe.h"
 #include "MemorySettingsReader.h"
@@ -170,6 +171,7 @@ CServer::CServer()
 	circular_log_buffer_idx=0;
 	has_circular_log_buffer=false;
 	failbits=0;
+	use_io_uring=false;
 
 	startup_complete=false;
 	
@@ -379,6 +381,7 @@ void CServer::setServerParameters(const str_map &pServerParams)
 {
 	IScopedLock lock(param_mutex);
 	server_params=pServerParams;
+	updateFileParameters();
 }
 
 std::string CServer::getServerParameter(const std::string &key)
@@ -402,6 +405,14 @@ void CServer::setServerParameter(const std::string &key, const std::string &valu
 {
 	IScopedLock lock(param_mutex);
 	server_params[key]=value;
+	updateFileParameters();
+}
+
+void CServer::updateFileParameters()
+{
+	str_map::iterator iter=server_params.find("file_io_uring");
+	use_io_uring = iter!=server_params.end()
+		&& (iter->second=="true" || iter->second=="1");
 }
 
 void CServer::Log( const std::string &pStr, int LogLevel)
@@ -1698,6 +1709,21 @@ void CServer::addRequest(void)
 
 IFsFile* CServer::openFile(std::string pFilename, int pMode)
 {
+#ifdef MODE_LIN
+	if(use_io_uring
+		&& UringFile::is_async_mode(pMode)
+		&& UringFile::is_supported())
+	{
+		UringFile *file=new UringFile;
+		if(!file->Open(pFilename, pMode) )
+		{
+			delete file;
+			return NULL;
+		}
+		return file;
+	}
+#endif
+
 	File *file=new File;
 	if(!file->Open(pFilename, pMode) )
 	{
@@ -224,6 +224,8 @@ private:
 
 	void rotateLogfile();
 
+	void updateFileParameters();
+
 	IPipe* ConnectStream(const SLookupBlockingResult& lookup_result, unsigned short pPort, unsigned int pTimeoutms);
 
 
@@ -279,6 +281,7 @@ private:
 	POSTFILE_KEY curr_postfilekey;
 
 	str_map server_params;
+	volatile bool use_io_uring;
 
 	PLUGIN_ID curr_pluginid;
 
@@ -38,6 +38,14 @@ bool File::Open(std::string pfn, int mode)
 	{
 		mode = MODE_RW_CREATE;
 	}
+	if (mode == MODE_RW_ASYNC)
+	{
+		mode = MODE_RW;
+	}
+	if (mode == MODE_RW_CREATE_ASYNC)
+	{
+		mode = MODE_RW_CREATE;
+	}
 
 	fn=pfn;
 	std::ios::openmode _mode;
@@ -135,6 +135,14 @@ bool File::Open(std::string pfn, int mode)
 	{
 		mode = MODE_READ_DEVICE;
 	}
+	if (mode == MODE_RW_ASYNC)
+	{
+		mode = MODE_RW;
+	}
+	if (mode == MODE_RW_CREATE_ASYNC)
+	{
+		mode = MODE_RW_CREATE;
+	}
 
 	fn=pfn;
 	int flags=0;
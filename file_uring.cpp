@@ -0,0 +1,717 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#define _FILE_OFFSET_BITS 64
+#define _LARGEFILE_SOURCE
+#define _LARGEFILE64_SOURCE
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "Server.h"
+#include "file_uring.h"
+#include "stringtools.h"
+
+#ifdef MODE_LIN
+#include "config.h"
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define HAS_IO_URING
+#endif
+
+#if defined(__FreeBSD__) || defined(__APPLE__)
+#define pwrite64 pwrite
+#define lseek64 lseek
+#endif
+
+namespace
+{
+	const unsigned int c_queue_depth = 8;
+	//Multiple of the page size, so the buffers can be used with O_DIRECT
+	const size_t c_buffer_size = 128 * 1024;
+	const unsigned int c_submit_batch = 4;
+	const size_t c_no_buffer = static_cast<size_t>(-1);
+}
+
+volatile bool UringFile::unsupported = false;
+
+UringFile::UringFile()
+	: ring_fd(-1), file_fd(-1), fixed_buffers(false),
+	sq_ptr(NULL), sq_ptr_size(0), cq_ptr(NULL), cq_ptr_size(0), sqes_ptr(NULL), sqes_size(0),
+	to_submit(0), n_inflight(0), filling(c_no_buffer), has_failed(false), next_seq(0), pos(0)
+{
+}
+
+UringFile::~UringFile()
+{
+	if (ring_fd != -1)
+	{
+		if (!flush())
+		{
+			Server->Log("Error writing pending data to \"" + getFilename() + "\"", LL_ERROR);
+		}
+		destroy_ring();
+	}
+}
+
+bool UringFile::Open(std::string pfn, int mode)
+{
+	if (!File::Open(pfn, mode))
+	{
+		return false;
+	}
+
+	if (is_async_mode(mode))
+	{
+		init_ring();
+	}
+
+	return true;
+}
+
+bool UringFile::is_supported()
+{
+#ifdef HAS_IO_URING
+	return !unsupported;
+#else
+	return false;
+#endif
+}
+
+bool UringFile::is_async_mode(int mode)
+{
+	return mode == MODE_RW_ASYNC
+		|| mode == MODE_RW_CREATE_ASYNC;
+}
+
+bool UringFile::has_ring()
+{
+	return ring_fd != -1;
+}
+
+bool UringFile::init_ring()
+{
+#ifdef HAS_IO_URING
+	if (unsupported)
+	{
+		return false;
+	}
+
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int rfd = static_cast<int>(syscall(__NR_io_uring_setup, c_queue_depth, &params));
+	if (rfd < 0)
+	{
+		int err = errno;
+		if (err == ENOSYS || err == EPERM)
+		{
+			Server->Log("io_uring is not available (errno=" + convert(err) + "). Using synchronous file I/O.", LL_INFO);
+			unsupported = true;
+		}
+		else
+		{
+			Server->Log("Error setting up io_uring for \"" + getFilename() + "\". errno=" + convert(err), LL_DEBUG);
+		}
+		return false;
+	}
+
+	ring_fd = rfd;
+	file_fd = File::getOsHandle(false);
+
+	sq_ptr_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	cq_ptr_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single_mmap)
+	{
+		sq_ptr_size = cq_ptr_size = (std::max)(sq_ptr_size, cq_ptr_size);
+	}
+
+	sq_ptr = mmap(NULL, sq_ptr_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if (sq_ptr == MAP_FAILED)
+	{
+		sq_ptr = NULL;
+		destroy_ring();
+		return false;
+	}
+
+	if (single_mmap)
+	{
+		cq_ptr = sq_ptr;
+	}
+	else
+	{
+		cq_ptr = mmap(NULL, cq_ptr_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+		if (cq_ptr == MAP_FAILED)
+		{
+			cq_ptr = NULL;
+			destroy_ring();
+			return false;
+		}
+	}
+
+	sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	sqes_ptr = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if (sqes_ptr == MAP_FAILED)
+	{
+		sqes_ptr = NULL;
+		destroy_ring();
+		return false;
+	}
+
+	char* sq_base = reinterpret_cast<char*>(sq_ptr);
+	sq_head = reinterpret_cast<unsigned int*>(sq_base + params.sq_off.head);
+	sq_tail = reinterpret_cast<unsigned int*>(sq_base + params.sq_off.tail);
+	sq_mask = reinterpret_cast<unsigned int*>(sq_base + params.sq_off.ring_mask);
+	sq_array = reinterpret_cast<unsigned int*>(sq_base + params.sq_off.array);
+
+	char* cq_base = reinterpret_cast<char*>(cq_ptr);
+	cq_head = reinterpret_cast<unsigned int*>(cq_base + params.cq_off.head);
+	cq_tail = reinterpret_cast<unsigned int*>(cq_base + params.cq_off.tail);
+	cq_mask = reinterpret_cast<unsigned int*>(cq_base + params.cq_off.ring_mask);
+	cqes = cq_base + params.cq_off.cqes;
+
+	std::vector<struct iovec> iovecs(c_queue_depth);
+	buffers.resize(c_queue_depth);
+	for (size_t i = 0; i < buffers.size(); ++i)
+	{
+		void* data;
+		if (posix_memalign(&data, 4096, c_buffer_size) != 0)
+		{
+			destroy_ring();
+			return false;
+		}
+		buffers[i].data = reinterpret_cast<char*>(data);
+		buffers[i].offset = 0;
+		buffers[i].used = 0;
+		buffers[i].seq = 0;
+		buffers[i].state = EBufferState_Free;
+		iovecs[i].iov_base = data;
+		iovecs[i].iov_len = c_buffer_size;
+	}
+
+	//Registering may fail because of the locked memory limit. Normal writes work as well
+	fixed_buffers = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, &iovecs[0], static_cast<unsigned int>(iovecs.size())) == 0;
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+void UringFile::destroy_ring()
+{
+	if (sqes_ptr != NULL)
+	{
+		munmap(sqes_ptr, sqes_size);
+		sqes_ptr = NULL;
+	}
+	if (cq_ptr != NULL && cq_ptr != sq_ptr)
+	{
+		munmap(cq_ptr, cq_ptr_size);
+	}
+	cq_ptr = NULL;
+	if (sq_ptr != NULL)
+	{
+		munmap(sq_ptr, sq_ptr_size);
+		sq_ptr = NULL;
+	}
+	if (ring_fd != -1)
+	{
+		close(ring_fd);
+		ring_fd = -1;
+	}
+	for (size_t i = 0; i < buffers.size(); ++i)
+	{
+		free(buffers[i].data);
+	}
+	buffers.clear();
+	filling = c_no_buffer;
+	to_submit = 0;
+	n_inflight = 0;
+}
+
+bool UringFile::queue_buffer(size_t idx)
+{
+	SBuffer& buf = buffers[idx];
+
+	//Writes of overlapping ranges may complete in any order
+	if (!has_failed
+		&& !wait_overlapping(buf.offset, buf.used))
+	{
+		has_failed = true;
+	}
+
+	if (has_failed)
+	{
+		//Written after the failed writes by retry_failed()
+		buf.state = EBufferState_Failed;
+		return false;
+	}
+
+#ifdef HAS_IO_URING
+	unsigned int tail = *sq_tail;
+	unsigned int index = tail & *sq_mask;
+	struct io_uring_sqe* sqe = reinterpret_cast<struct io_uring_sqe*>(sqes_ptr) + index;
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = fixed_buffers ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+	sqe->fd = file_fd;
+	sqe->addr = reinterpret_cast<uint64_t>(buf.data);
+	sqe->len = static_cast<unsigned int>(buf.used);
+	sqe->off = buf.offset;
+	if (fixed_buffers)
+	{
+		sqe->buf_index = static_cast<unsigned short>(idx);
+	}
+	sqe->user_data = idx;
+	sq_array[index] = index;
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+#endif
+
+	buf.state = EBufferState_Queued;
+	++to_submit;
+	++n_inflight;
+
+	if (to_submit >= c_submit_batch)
+	{
+		return submit(0);
+	}
+
+	return true;
+}
+
+bool UringFile::submit(unsigned int min_complete)
+{
+#ifdef HAS_IO_URING
+	while (to_submit > 0 || min_complete > 0)
+	{
+		int rc = static_cast<int>(syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+			min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0));
+		if (rc < 0)
+		{
+			int err = errno;
+			if (err == EINTR)
+			{
+				continue;
+			}
+			else if (err == EAGAIN || err == EBUSY)
+			{
+				//Completion queue is full
+				reap();
+				continue;
+			}
+
+			Server->Log("Error submitting writes to \"" + getFilename() + "\". errno=" + convert(err), LL_ERROR);
+			return false;
+		}
+
+		to_submit -= (std::min)(to_submit, static_cast<unsigned int>(rc));
+		return true;
+	}
+#endif
+	return true;
+}
+
+void UringFile::reap()
+{
+#ifdef HAS_IO_URING
+	unsigned int head = *cq_head;
+	unsigned int tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail)
+	{
+		struct io_uring_cqe* cqe = reinterpret_cast<struct io_uring_cqe*>(cqes) + (head & *cq_mask);
+		complete(static_cast<size_t>(cqe->user_data), cqe->res);
+		++head;
+	}
+	__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+#endif
+}
+
+void UringFile::complete(size_t idx, int res)
+{
+	SBuffer& buf = buffers[idx];
+	--n_inflight;
+
+	size_t done = res > 0 ? static_cast<size_t>(res) : 0;
+	if (done < buf.used)
+	{
+		//Short write or error. Retry the rest synchronously
+		while (done < buf.used)
+		{
+			ssize_t w = pwrite64(file_fd, buf.data + done, buf.used - done, buf.offset + done);
+			if (w <= 0)
+			{
+				break;
+			}
+			done += w;
+		}
+
+		if (done < buf.used)
+		{
+			Server->Log("Asynchronous write to \"" + getFilename() + "\" failed. errno=" + convert(res < 0 ? -res : errno), LL_DEBUG);
+			if (done > 0)
+			{
+				memmove(buf.data, buf.data + done, buf.used - done);
+				buf.offset += done;
+				buf.used -= done;
+			}
+			buf.state = EBufferState_Failed;
+			has_failed = true;
+			return;
+		}
+	}
+
+	buf.state = EBufferState_Free;
+}
+
+bool UringFile::wait_overlapping(int64 offset, size_t size)
+{
+	while (true)
+	{
+		bool overlaps = false;
+		for (size_t i = 0; i < buffers.size(); ++i)
+		{
+			if (buffers[i].state == EBufferState_Queued
+				&& buffers[i].offset < offset + static_cast<int64>(size)
+				&& offset < buffers[i].offset + static_cast<int64>(buffers[i].used))
+			{
+				overlaps = true;
+				break;
+			}
+		}
+
+		if (!overlaps)
+		{
+			return !has_failed;
+		}
+
+		if (!submit(1))
+		{
+			return false;
+		}
+
+		reap();
+	}
+}
+
+bool UringFile::get_free_buffer(size_t& idx)
+{
+	while (true)
+	{
+		for (size_t i = 0; i < buffers.size(); ++i)
+		{
+			if (buffers[i].state == EBufferState_Free)
+			{
+				idx = i;
+				return true;
+			}
+		}
+
+		if (n_inflight == 0)
+		{
+			return false;
+		}
+
+		if (!submit(1))
+		{
+			return false;
+		}
+
+		reap();
+	}
+}
+
+bool UringFile::retry_failed()
+{
+	if (filling != c_no_buffer)
+	{
+		buffers[filling].state = EBufferState_Failed;
+		filling = c_no_buffer;
+	}
+
+	while (n_inflight > 0)
+	{
+		if (!submit(1))
+		{
+			return false;
+		}
+		reap();
+	}
+
+	std::vector<std::pair<int64, size_t> > failed;
+	for (size_t i = 0; i < buffers.size(); ++i)
+	{
+		if (buffers[i].state == EBufferState_Failed)
+		{
+			failed.push_back(std::make_pair(buffers[i].seq, i));
+		}
+	}
+
+	//In the order the data was written
+	std::sort(failed.begin(), failed.end());
+
+	for (size_t i = 0; i < failed.size(); ++i)
+	{
+		SBuffer& buf = buffers[failed[i].second];
+		while (buf.used > 0)
+		{
+			ssize_t w = pwrite64(file_fd, buf.data, buf.used, buf.offset);
+			if (w <= 0)
+			{
+				return false;
+			}
+			memmove(buf.data, buf.data + w, buf.used - w);
+			buf.offset += w;
+			buf.used -= w;
+		}
+		buf.state = EBufferState_Free;
+	}
+
+	has_failed = false;
+	return true;
+}
+
+bool UringFile::flush()
+{
+	if (ring_fd == -1)
+	{
+		return true;
+	}
+
+	if (filling != c_no_buffer)
+	{
+		size_t idx = filling;
+		filling = c_no_buffer;
+		queue_buffer(idx);
+	}
+
+	while (n_inflight > 0)
+	{
+		if (!submit(1))
+		{
+			return false;
+		}
+		reap();
+	}
+
+	if (has_failed)
+	{
+		return retry_failed();
+	}
+
+	return true;
+}
+
+_u32 UringFile::Read(char* buffer, _u32 bsize, bool *has_error)
+{
+	if (ring_fd == -1)
+	{
+		return File::Read(buffer, bsize, has_error);
+	}
+
+	_u32 r = Read(pos, buffer, bsize, has_error);
+	pos += r;
+	return r;
+}
+
+_u32 UringFile::Read(int64 spos, char* buffer, _u32 bsize, bool *has_error)
+{
+	if (!flush())
+	{
+		if (has_error) *has_error = true;
+		return 0;
+	}
+
+	return File::Read(spos, buffer, bsize, has_error);
+}
+
+_u32 UringFile::Write(const char* buffer, _u32 bsize, bool *has_error)
+{
+	if (ring_fd == -1)
+	{
+		return File::Write(buffer, bsize, has_error);
+	}
+
+	_u32 w = Write(pos, buffer, bsize, has_error);
+	pos += w;
+	return w;
+}
+
+_u32 UringFile::Write(int64 spos, const char* buffer, _u32 bsize, bool *has_error)
+{
+	if (ring_fd == -1)
+	{
+		return File::Write(spos, buffer, bsize, has_error);
+	}
+
+	if (has_failed
+		&& !retry_failed())
+	{
+		if (has_error) *has_error = true;
+		return 0;
+	}
+
+	size_t written = 0;
+	while (written < bsize)
+	{
+		int64 woffset = spos + written;
+
+		if (filling != c_no_buffer)
+		{
+			SBuffer& buf = buffers[filling];
+			if (buf.offset + static_cast<int64>(buf.used) != woffset)
+			{
+				size_t idx = filling;
+				filling = c_no_buffer;
+				queue_buffer(idx);
+			}
+		}
+
+		if (filling == c_no_buffer)
+		{
+			size_t idx;
+			if (has_failed
+				|| !get_free_buffer(idx))
+			{
+				if (has_error) *has_error = true;
+				return static_cast<_u32>(written);
+			}
+
+			SBuffer& buf = buffers[idx];
+			buf.state = EBufferState_Filling;
+			buf.offset = woffset;
+			buf.used = 0;
+			buf.seq = next_seq++;
+			filling = idx;
+		}
+
+		SBuffer& buf = buffers[filling];
+		size_t tocopy = (std::min)(c_buffer_size - buf.used, bsize - written);
+		memcpy(buf.data + buf.used, buffer + written, tocopy);
+		buf.used += tocopy;
+		written += tocopy;
+
+		if (buf.used == c_buffer_size)
+		{
+			size_t idx = filling;
+			filling = c_no_buffer;
+			queue_buffer(idx);
+		}
+	}
+
+	return bsize;
+}
+
+bool UringFile::Seek(_i64 spos)
+{
+	if (ring_fd == -1)
+	{
+		return File::Seek(spos);
+	}
+
+	pos = spos;
+	return true;
+}
+
+_i64 UringFile::Size(void)
+{
+	flush();
+	return File::Size();
+}
+
+_i64 UringFile::RealSize()
+{
+	flush();
+	return File::RealSize();
+}
+
+bool UringFile::PunchHole(_i64 spos, _i64 size)
+{
+	if (!flush())
+	{
+		return false;
+	}
+	return File::PunchHole(spos, size);
+}
+
+bool UringFile::Sync()
+{
+	if (!flush())
+	{
+		return false;
+	}
+	return File::Sync();
+}
+
+bool UringFile::Resize(int64 new_size, bool set_sparse)
+{
+	if (!flush())
+	{
+		return false;
+	}
+	return File::Resize(new_size, set_sparse);
+}
+
+void UringFile::resetSparseExtentIter()
+{
+	flush();
+	File::resetSparseExtentIter();
+}
+
+IFsFile::SSparseExtent UringFile::nextSparseExtent()
+{
+	flush();
+	return File::nextSparseExtent();
+}
+
+std::vector<IFsFile::SFileExtent> UringFile::getFileExtents(int64 starting_offset, int64 block_size, bool& more_data)
+{
+	flush();
+	return File::getFileExtents(starting_offset, block_size, more_data);
+}
+
+IFsFile::os_file_handle UringFile::getOsHandle(bool release_handle)
+{
+	if (ring_fd != -1)
+	{
+		if (!flush())
+		{
+			Server->Log("Error writing pending data to \"" + getFilename() + "\" before handing out its handle", LL_ERROR);
+		}
+
+		//Callers may use the handle position
+		lseek64(file_fd, pos, SEEK_SET);
+
+		if (release_handle)
+		{
+			destroy_ring();
+		}
+	}
+
+	return File::getOsHandle(release_handle);
+}
+
+#endif //MODE_LIN
@@ -0,0 +1,115 @@
+#ifndef FILE_URING_H
+#define FILE_URING_H
+
+#include "file.h"
+#include <vector>
+
+#ifdef MODE_LIN
+
+//File which writes through an io_uring instance. Writes are copied into a
+//small set of (registered) buffers, contiguous writes are merged and full
+//buffers are submitted in batches without waiting for them. Everything else
+//(reads, size changes, sync, ...) waits for the pending writes first.
+//A write which fails asynchronously is kept and retried by the next call. Until
+//it succeeds all writes fail, so callers can free space and retry as with File.
+//Only used for files opened with MODE_RW_ASYNC/MODE_RW_CREATE_ASYNC, whose
+//callers check Sync() before closing them (errors in the destructor are only logged).
+//If io_uring is not available the file behaves exactly like File.
+class UringFile : public File
+{
+public:
+	UringFile();
+	~UringFile();
+
+	bool Open(std::string pfn, int mode=MODE_READ);
+
+	static bool is_supported();
+
+	//Modes for which the factory may return an UringFile
+	static bool is_async_mode(int mode);
+
+	bool has_ring();
+
+	_u32 Read(char* buffer, _u32 bsize, bool *has_error=NULL);
+	_u32 Read(int64 spos, char* buffer, _u32 bsize, bool *has_error = NULL);
+	_u32 Write(const char* buffer, _u32 bsize, bool *has_error=NULL);
+	_u32 Write(int64 spos, const char* buffer, _u32 bsize, bool *has_error = NULL);
+	bool Seek(_i64 spos);
+	_i64 Size(void);
+	_i64 RealSize();
+	bool PunchHole( _i64 spos, _i64 size );
+	bool Sync();
+	bool Resize(int64 new_size, bool set_sparse=true);
+	void resetSparseExtentIter();
+	SSparseExtent nextSparseExtent();
+	std::vector<SFileExtent> getFileExtents(int64 starting_offset, int64 block_size, bool& more_data);
+	IFsFile::os_file_handle getOsHandle(bool release_handle = false);
+
+	//Submits all pending writes and waits for them
+	bool flush();
+
+private:
+	enum EBufferState
+	{
+		EBufferState_Free,
+		EBufferState_Filling,
+		EBufferState_Queued,
+		EBufferState_Failed
+	};
+
+	struct SBuffer
+	{
+		char* data;
+		int64 offset;
+		size_t used;
+		int64 seq;
+		EBufferState state;
+	};
+
+	bool init_ring();
+	void destroy_ring();
+
+	bool queue_buffer(size_t idx);
+	bool submit(unsigned int min_complete);
+	void reap();
+	void complete(size_t idx, int res);
+	bool wait_overlapping(int64 offset, size_t size);
+	bool get_free_buffer(size_t& idx);
+	bool retry_failed();
+
+	int ring_fd;
+	int file_fd;
+	bool fixed_buffers;
+
+	void* sq_ptr;
+	size_t sq_ptr_size;
+	void* cq_ptr;
+	size_t cq_ptr_size;
+	void* sqes_ptr;
+	size_t sqes_size;
+
+	unsigned int* sq_head;
+	unsigned int* sq_tail;
+	unsigned int* sq_mask;
+	unsigned int* sq_array;
+	unsigned int* cq_head;
+	unsigned int* cq_tail;
+	unsigned int* cq_mask;
+	void* cqes;
+
+	unsigned int to_submit;
+	size_t n_inflight;
+
+	std::vector<SBuffer> buffers;
+	size_t filling;
+	bool has_failed;
+	int64 next_seq;
+
+	int64 pos;
+
+	static volatile bool unsupported;
+};
+
+#endif //MODE_LIN
+
+#endif //FILE_URING_H
@@ -40,6 +40,10 @@ bool File::Open(std::string pfn, int mode)
 		mode = MODE_RW;
 	if(mode==MODE_RW_CREATE_DIRECT)
 		mode = MODE_RW_CREATE;
+	if(mode==MODE_RW_ASYNC)
+		mode = MODE_RW;
+	if(mode==MODE_RW_CREATE_ASYNC)
+		mode = MODE_RW_CREATE;
 	
 	fn=pfn;
 	DWORD dwCreationDisposition;
@@ -78,7 +78,8 @@ VHDFile::VHDFile(const std::string &fn, bool pRead_only, uint64 pDstsize, unsign
 	curr_offset=0;
 	currblock=0xFFFFFFFF;
 
-	backing_file = Server->openFile(fn, (read_only ? MODE_READ : MODE_RW));
+	//finish() syncs the file and reports errors of queued writes
+	backing_file = Server->openFile(fn, (read_only ? MODE_READ : MODE_RW_ASYNC));
 
 	bool openedExisting = true;
 
@@ -86,7 +87,7 @@ VHDFile::VHDFile(const std::string &fn, bool pRead_only, uint64 pDstsize, unsign
 	{
 		if(read_only==false)
 		{
-			backing_file = Server->openFile(fn, MODE_RW_CREATE);
+			backing_file = Server->openFile(fn, MODE_RW_CREATE_ASYNC);
 			openedExisting=false;
 		}
 		if(backing_file==NULL)
@@ -173,13 +174,13 @@ VHDFile::VHDFile(const std::string &fn, const std::string &parent_fn, bool pRead
 	curr_offset=0;
 	currblock=0xFFFFFFFF;
 
-	backing_file=Server->openFile(fn, (read_only?MODE_READ:MODE_RW) );
+	backing_file=Server->openFile(fn, (read_only?MODE_READ:MODE_RW_ASYNC) );
 	bool openedExisting = true;
 	if(!backing_file)
 	{
 		if(read_only==false)
 		{
-			backing_file=Server->openFile(fn, MODE_RW_CREATE);
+			backing_file=Server->openFile(fn, MODE_RW_CREATE_ASYNC);
 			openedExisting=false;
 		}
 		if(backing_file==NULL)
@@ -529,7 +529,7 @@ std::string add_trailing_slash(const std::string &strDirName)
 IndexThread::IndexThread(void)
 	: index_error(false), last_filebackup_filetime(0), index_group(-1),
 	with_scripts(false), volumes_cache(NULL), phash_queue(NULL),
-	index_backup_dirs_optional(false)
+	index_backup_dirs_optional(false), bin_filelist(false), dir_digest(false)
 {
 	if(filelist_mutex==NULL)
 		filelist_mutex=Server->createMutex();
@@ -1590,6 +1590,13 @@ IndexThread::IndexErrorInfo IndexThread::indexDirs(bool full_backup, bool simult
 	{
 		std::fstream outfile(filelist_fn.c_str(), std::ios::out|std::ios::binary);
 
+		filelist_dir_offsets.clear();
+		filelist_dir_digests.reset();
+		if (bin_filelist)
+		{
+			outfile << binaryFileListHeader();
+		}
+
 #ifdef _WIN32
 		if (index_group == 0)
 		{
@@ -1887,6 +1894,11 @@ IndexThread::IndexErrorInfo IndexThread::indexDirs(bool full_backup, bool simult
 		if (outfile.is_open())
 		{
 			addBackupScripts(outfile);
+
+			if (bin_filelist)
+			{
+				outfile << binaryFileListEnd(static_cast<std::streamoff>(outfile.tellp()), filelist_dir_offsets);
+			}
 		}
 
 		std::streampos pos=outfile.tellp();
@@ -2504,8 +2516,6 @@ bool IndexThread::initialCheck(std::vector<SRecurParams>& params_stack, size_t s
 			
 			addFromLastUpto(listname, false, depth, false, outfile);
 
-			outfile << "f\"" << escapeListName((listname)) << "\" " << files[i].size << " " << static_cast<int64>(files[i].change_indicator);
-		
 			if(calculate_filehashes_on_client
 				&& !files[i].hash.empty() )
 			{
@@ -2564,14 +2574,8 @@ bool IndexThread::initialCheck(std::vector<SRecurParams>& params_stack, size_t s
 
 			extra += "&line=" + convert(file_id);
 
-			if(!extra.empty())
-			{
-				extra[0]='#';
-				outfile << extra;
-				extra.clear();
-			}
-
-			outfile << "\n";
+			writeFile(outfile, listname, files[i].size, static_cast<int64>(files[i].change_indicator), extra);
+			extra.clear();
 		}
 	}
 
@@ -2689,14 +2693,7 @@ bool IndexThread::initialCheck(std::vector<SRecurParams>& params_stack, size_t s
 	if(close_dir)
 	{
 		addFromLastLiftDepth(depth - 1, outfile);
-		if(!with_proper_symlinks)
-		{
-			outfile << "d\"..\"\n";
-		}
-		else
-		{
-			outfile << "u\n";
-		}
+		writeDirUp(outfile);
 
 		++file_id;
 	}
@@ -2711,6 +2708,10 @@ void IndexThread::initialCheckRecur1(std::vector<SRecurParams>& params_stack, SR
 {
 	params.recur_ret.pos = outfile.tellp();
 	params.recur_ret.file_id_backup = file_id;
+	if (dir_digest)
+	{
+		params.recur_ret.dir_digest_backup = filelist_dir_digests.getRestorePoint();
+	}
 
 	SLastFileList backup;
 	if (index_follow_last)
@@ -2761,14 +2762,7 @@ void IndexThread::initialCheckRecur2(std::vector<SRecurParams>& params_stack, SR
 {
 	addFromLastLiftDepth(params.depth, outfile);
 
-	if (!with_proper_symlinks)
-	{
-		outfile << "d\"..\"\n";
-	}
-	else
-	{
-		outfile << "u\n";
-	}
+	writeDirUp(outfile);
 
 	++file_id;
 
@@ -2783,6 +2777,17 @@ void IndexThread::initialCheckRecur2(std::vector<SRecurParams>& params_stack, SR
 
 			outfile.seekp(params.recur_ret.pos);
 			file_id = params.recur_ret.file_id_backup;
+
+			while (!filelist_dir_offsets.empty()
+				&& filelist_dir_offsets.back() >= static_cast<std::streamoff>(params.recur_ret.pos))
+			{
+				filelist_dir_offsets.pop_back();
+			}
+
+			if (dir_digest)
+			{
+				filelist_dir_digests.restore(params.recur_ret.dir_digest_backup);
+			}
 		}
 	}
 	else
@@ -5536,6 +5541,17 @@ void IndexThread::writeTokens()
 
 void IndexThread::writeDir(std::fstream& out, const std::string& name, bool with_change, uint64 change_identicator, const std::string& extra)
 {
+	if(bin_filelist)
+	{
+		SFile cf;
+		cf.isdir=true;
+		cf.name=name;
+		cf.last_modified=with_change ? static_cast<int64>(change_identicator) : 0;
+		writeBinaryItem(out, cf, extra);
+		++file_id;
+		return;
+	}
+
 	out << "d\"" << escapeListName((name)) << "\"";
 
 	if(with_change)
@@ -5558,6 +5574,100 @@ void IndexThread::writeDir(std::fstream& out, const std::string& name, bool with
 	++file_id;;
 }
 
+void IndexThread::writeFile(std::fstream& out, const std::string& name, int64 size, int64 change_identicator, std::string extra)
+{
+	if(bin_filelist)
+	{
+		SFile cf;
+		cf.name=name;
+		cf.size=size;
+		cf.last_modified=change_identicator;
+		writeBinaryItem(out, cf, extra);
+		return;
+	}
+
+	out << "f\"" << escapeListName(name) << "\" " << size << " " << change_identicator;
+
+	if(!extra.empty())
+	{
+		extra[0]='#';
+		out << extra;
+	}
+
+	out << "\n";
+}
+
+void IndexThread::writeDirUp(std::fstream& out)
+{
+	if(bin_filelist)
+	{
+		SFile cf;
+		cf.isdir=true;
+		cf.name="..";
+		writeBinaryItem(out, cf, std::string());
+	}
+	else if(!with_proper_symlinks)
+	{
+		out << "d\"..\"\n";
+	}
+	else
+	{
+		out << "u\n";
+	}
+}
+
+void IndexThread::writeBinaryItem(std::fstream& out, const SFile& cf, const std::string& extra)
+{
+	if(cf.isdir && cf.name!="..")
+	{
+		filelist_dir_offsets.push_back(static_cast<std::streamoff>(out.tellp()));
+	}
+
+	if(dir_digest)
+	{
+		if(cf.isdir && cf.name=="..")
+		{
+			std::string digest = filelist_dir_digests.finishDir();
+			if(!digest.empty())
+			{
+				out << binaryFileListDirUp(digest);
+				return;
+			}
+		}
+		else
+		{
+			filelist_dir_digests.addItem(cf);
+		}
+	}
+
+	out << binaryFileListItem(cf, extra);
+}
+
+void IndexThread::writeFilelistText(std::fstream& out, const std::string& text)
+{
+	if(!bin_filelist)
+	{
+		out << text;
+		return;
+	}
+
+	FileListParser parser;
+	SFile data;
+	str_map extra;
+	for(size_t i=0;i<text.size();++i)
+	{
+		if(parser.nextEntry(text[i], data, &extra))
+		{
+			std::string str_extra;
+			for (str_map::iterator it = extra.begin(); it != extra.end(); ++it)
+			{
+				str_extra += "&" + it->first + "=" + EscapeParamString(it->second);
+			}
+			writeBinaryItem(out, data, str_extra);
+		}
+	}
+}
+
 std::string IndexThread::execute_script(const std::string& cmd, const std::string& args)
 {
 	std::string output;
@@ -5588,15 +5698,14 @@ bool IndexThread::addBackupScripts(std::fstream& outfile)
 {
 	if(!scripts.empty())
 	{
-		outfile << "d\"urbackup_backup_scripts\"\n";
-		++file_id;
+		writeDir(outfile, "urbackup_backup_scripts", false, 0);
 
 		for(size_t i=0;i<scripts.size();++i)
 		{
 			int64 rndnum=Server->getRandomNumber()<<30 | Server->getRandomNumber();
-			outfile << "f\"" << escapeListName(scripts[i].outputname) << "\" " << scripts[i].size << " " << rndnum;
 			++file_id;
 
+			std::string extra;
 			if (!scripts[i].orig_path.empty())
 			{
 				std::string orig_path = scripts[i].orig_path;
@@ -5604,13 +5713,20 @@ bool IndexThread::addBackupScripts(std::fstream& outfile)
 				{
 					orig_path.erase(orig_path.size() - 1, 1);
 				}
-				outfile << "#orig_path=" << EscapeParamString(orig_path) << "&orig_sep=" << EscapeParamString(os_file_sep());
+				extra = "#orig_path=" + EscapeParamString(orig_path) + "&orig_sep=" + EscapeParamString(os_file_sep());
 			}
-			
-			outfile << "\n";
+
+			writeFile(outfile, scripts[i].outputname, scripts[i].size, rndnum, extra);
 		}
 
-		outfile << "u\n";
+		if (bin_filelist)
+		{
+			writeDirUp(outfile);
+		}
+		else
+		{
+			outfile << "u\n";
+		}
 		++file_id;
 
 		return true;
@@ -5831,15 +5947,7 @@ void IndexThread::addFileFromLast(std::fstream & outfile)
 		str_extra += "&" + it->first + "=" + EscapeParamString(it->second);
 	}
 
-	outfile << "f\"" << escapeListName(last_filelist->item.name) << "\" " << last_filelist->item.size << " " << last_filelist->item.last_modified;
-
-	if (!str_extra.empty())
-	{
-		str_extra[0] = '#';
-		outfile << str_extra;
-	}
-
-	outfile << "\n";
+	writeFile(outfile, last_filelist->item.name, last_filelist->item.size, last_filelist->item.last_modified, str_extra);
 	++file_id;
 }
 
@@ -7351,6 +7459,8 @@ void IndexThread::setFlags( unsigned int flags )
 	with_orig_path = (flags & flag_with_orig_path)>0;
 	with_sequence = (flags & flag_with_sequence)>0;
 	with_proper_symlinks = (flags & flag_with_proper_symlinks)>0;
+	bin_filelist = (flags & flag_bin_filelist)>0;
+	dir_digest = bin_filelist && (flags & flag_dir_digest)>0;
 }
 
 bool IndexThread::getAbsSymlinkTarget( const std::string& symlink, const std::string& orig_path,
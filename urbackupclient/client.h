@@ -59,6 +59,8 @@ const unsigned int flag_calc_checksums = 8;
 const unsigned int flag_with_orig_path = 16;
 const unsigned int flag_with_sequence = 32;
 const unsigned int flag_with_proper_symlinks = 64;
+const unsigned int flag_bin_filelist = 128;
+const unsigned int flag_dir_digest = 256;
 
 const uint64 change_indicator_symlink_bit = 0x4000000000000000ULL;
 const uint64 change_indicator_special_bit = 0x2000000000000000ULL;
@@ -547,6 +549,11 @@ private:
 	void setFlags(unsigned int flags);
 
 	void writeDir(std::fstream& out, const std::string& name, bool with_change, uint64 change_identicator, const std::string& extra=std::string());
+	void writeFile(std::fstream& out, const std::string& name, int64 size, int64 change_identicator, std::string extra);
+	void writeDirUp(std::fstream& out);
+	void writeBinaryItem(std::fstream& out, const SFile& cf, const std::string& extra);
+	//Writes entries in the text list format to the list
+	void writeFilelistText(std::fstream& out, const std::string& text);
 	bool addBackupScripts(std::fstream& outfile);
 
 	void monitor_disk_failures();
@@ -696,6 +703,10 @@ private:
 	bool with_orig_path;
 	bool with_sequence;
 	bool with_proper_symlinks;
+	bool bin_filelist;
+	std::vector<int64> filelist_dir_offsets;
+	bool dir_digest;
+	FileListDirDigests filelist_dir_digests;
 
 	int64 last_tmp_update_time;
 
@@ -772,6 +783,7 @@ private:
 		SLastFileList backup;
 		std::streampos pos;
 		int64 file_id_backup;
+		FileListDirDigests::SRestorePoint dir_digest_backup;
 	};
 
 	struct SFirstInfo
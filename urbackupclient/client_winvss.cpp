@@ -2029,25 +2029,24 @@ bool IndexThread::indexVssComponents(VSS_ID ssetid, bool use_db, const std::vect
 	++pretty_symlink_struct_id_add;
 
 	addFromLastUpto("windows_components", true, 0, false, outfile);
-	outfile << pretty_symlink_struct;
+	writeFilelistText(outfile, pretty_symlink_struct);
 	file_id += pretty_symlink_struct_id_add;
 
 	addFromLastUpto("windows_components_config", true, 0, false, outfile);
-	outfile << "d\"windows_components_config\" 0 "
-		<< getChangeIndicator(Server->getServerWorkingDir() + os_file_sep() + component_config_dir) 
-		<< "#orig_path=" << EscapeParamString("C:\\windows_components_config")<<"\n";
-	++file_id;
+	writeDir(outfile, "windows_components_config", true,
+		getChangeIndicator(Server->getServerWorkingDir() + os_file_sep() + component_config_dir),
+		"#orig_path=" + EscapeParamString("C:\\windows_components_config"));
 	for (size_t i = 0; i < component_config_files.size(); ++i)
 	{
-		outfile << "f\"" << component_config_files[i] << "\" " << component_config_file_size[i] << " " << randomChangeIndicator() << "#no_hash=1\n";
+		writeFile(outfile, component_config_files[i], component_config_file_size[i], randomChangeIndicator(), "#no_hash=1");
 		++file_id;
 	}
 
 	info_json.set("selected_components", selected_components_json);
 	std::string selected_components_data = info_json.stringify(false);
 
-	outfile << "f\"backupcom.xml\" 0 " << randomChangeIndicator() << "#no_hash=1\n";
-	outfile << "f\"info.json\" " << selected_components_data.size() << " " << randomChangeIndicator() << "#no_hash=1\n";
+	writeFile(outfile, "backupcom.xml", 0, randomChangeIndicator(), "#no_hash=1");
+	writeFile(outfile, "info.json", selected_components_data.size(), randomChangeIndicator(), "#no_hash=1");
 	file_id+=2;
 
 	if (!write_file_only_admin(selected_components_data, component_config_dir + os_file_sep() + "info.json"))
@@ -2056,7 +2055,14 @@ bool IndexThread::indexVssComponents(VSS_ID ssetid, bool use_db, const std::vect
 		return false;
 	}
 
-	outfile << "u\n";
+	if (bin_filelist)
+	{
+		writeDirUp(outfile);
+	}
+	else
+	{
+		outfile << "u\n";
+	}
 	++file_id;
 
 	return true;
@@ -198,6 +198,33 @@ void TreeHash::allAdlerTo64byteHash(const char * h, size_t size, size_t hashed_s
 	}
 }
 
+void TreeHash::hashBlock(const char * buf, char * byteout)
+{
+	unsigned int block_adlers[12];
+	for (size_t i = 0; i < 12; ++i)
+	{
+		block_adlers[i] = urb_adler32(0, NULL, 0);
+	}
+
+	for (_u32 i = 0; i < treehash_blocksize; i += treehash_smallblock)
+	{
+		_u32 adler_idx = (i / treehash_smallblock) % 12;
+		block_adlers[adler_idx] = urb_adler32(block_adlers[adler_idx], buf + i, treehash_smallblock);
+	}
+
+	MD5 block_md5;
+	block_md5.update(const_cast<unsigned char*>(reinterpret_cast<const unsigned char*>(buf)), treehash_blocksize);
+	block_md5.finalize();
+	memcpy(byteout, block_md5.raw_digest_int(), 16);
+
+	for (size_t j = 0; j < 12; ++j)
+	{
+		block_adlers[j] = little_endian(block_adlers[j]);
+	}
+
+	memcpy(byteout + 16, block_adlers, 12 * sizeof(_u32));
+}
+
 void TreeHash::finalize_curr()
 {
 	md5sum.finalize();
@@ -138,6 +138,9 @@ public:
 
 	static void allAdlerTo64byteHash(const char * h, size_t size, size_t hashed_size, char * byteout);
 
+	//64 byte hash of one complete block (treehash_blocksize bytes), as passed to addHash()
+	static void hashBlock(const char * buf, char * byteout);
+
 private:
 	void finalize_curr();
 	void finalize_level(size_t idx);
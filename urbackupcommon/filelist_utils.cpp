@@ -19,6 +19,39 @@
 #include "filelist_utils.h"
 #include "../Interface/Server.h"
 #include "../stringtools.h"
+#include "../common/data.h"
+#include <memory.h>
+
+namespace
+{
+	const char binary_filelist_magic[] = { 0, 'U', 'B', 'F', 'L' };
+	const char binary_filelist_index_magic[] = { 'U', 'B', 'F', 'I' };
+
+	//Keys of extra parameters which are stored as index. Only append to this
+	//with a new format version
+	const char* binary_filelist_keys[] = {
+		"line", "sym_target", "special", "orig_path", "orig_sep",
+		"sha512", "sha256", "thash", "sha256_verify", "no_hash",
+		"alt_orig_path", "share_path", "server_path", "single_item", "skip",
+		"tids", "shahash"
+	};
+
+	const size_t binary_filelist_num_keys = sizeof(binary_filelist_keys) / sizeof(binary_filelist_keys[0]);
+
+	const int64 binary_filelist_max_string = 64*1024*1024;
+
+	size_t binaryFileListKeyId(const std::string& key)
+	{
+		for (size_t i = 0; i < binary_filelist_num_keys; ++i)
+		{
+			if (key == binary_filelist_keys[i])
+			{
+				return i + 1;
+			}
+		}
+		return 0;
+	}
+}
 
 void writeFileRepeat(IFile *f, const char *buf, size_t bsize)
 {
@@ -141,14 +174,461 @@ void writeFileItem(IFile* f, SFile cf, std::string extra)
 	}
 }
 
+std::string binaryFileListHeader()
+{
+	std::string ret(binary_filelist_magic, sizeof(binary_filelist_magic));
+	ret += binary_filelist_version;
+	return ret;
+}
+
+std::string binaryFileListItem(const SFile& cf, const std::string& extra, size_t* change_identicator_off)
+{
+	CWData data;
+	if (cf.isdir && cf.name == "..")
+	{
+		data.addChar('u');
+		return std::string(data.getDataPtr(), data.getDataSize());
+	}
+
+	data.addChar(cf.isdir ? 'd' : 'f');
+	data.addString2(cf.name);
+	if (!cf.isdir)
+	{
+		data.addVarInt(cf.size);
+	}
+	data.addVarInt(cf.last_modified);
+
+	if (change_identicator_off != NULL)
+	{
+		//Last byte of the varint has the lowest bits
+		*change_identicator_off = data.getDataSize() - 1;
+	}
+
+	str_map params;
+	if (!extra.empty())
+	{
+		if (extra[0] == '&' || extra[0] == '#')
+		{
+			ParseParamStrHttp(extra.substr(1), &params);
+		}
+		else
+		{
+			ParseParamStrHttp(extra, &params);
+		}
+	}
+
+	data.addVarInt(params.size());
+	for (str_map::iterator it = params.begin(); it != params.end(); ++it)
+	{
+		size_t key_id = binaryFileListKeyId(it->first);
+		data.addVarInt(key_id);
+		if (key_id == 0)
+		{
+			data.addString2(it->first);
+		}
+		data.addString2(it->second);
+	}
+
+	return std::string(data.getDataPtr(), data.getDataSize());
+}
+
+std::string binaryFileListDirUp(const std::string& dir_digest)
+{
+	CWData data;
+	data.addChar('U');
+	data.addString2(dir_digest);
+	return std::string(data.getDataPtr(), data.getDataSize());
+}
+
+std::string binaryFileListEnd(int64 pos, const std::vector<int64>& dir_offsets)
+{
+	CWData data;
+	data.addChar('e');
+	data.addVarInt(dir_offsets.size());
+	int64 last_offset = 0;
+	for (size_t i = 0; i < dir_offsets.size(); ++i)
+	{
+		data.addVarInt(dir_offsets[i] - last_offset);
+		last_offset = dir_offsets[i];
+	}
+
+	int64 pos_le = little_endian(pos);
+	std::string ret(data.getDataPtr(), data.getDataSize());
+	ret.append(reinterpret_cast<char*>(&pos_le), sizeof(pos_le));
+	ret.append(binary_filelist_index_magic, sizeof(binary_filelist_index_magic));
+	return ret;
+}
+
+bool isBinaryFileList(IFile* f)
+{
+	char header[binary_filelist_header_size];
+	return f->Read(0, header, binary_filelist_header_size) == binary_filelist_header_size
+		&& memcmp(header, binary_filelist_magic, sizeof(binary_filelist_magic)) == 0;
+}
+
+bool readBinaryFileListIndex(IFile* f, std::vector<int64>& dir_offsets)
+{
+	int64 fsize = f->Size();
+	if (fsize < static_cast<int64>(binary_filelist_header_size + binary_filelist_trailer_size)
+		|| !isBinaryFileList(f))
+	{
+		return false;
+	}
+
+	char trailer[binary_filelist_trailer_size];
+	if (f->Read(fsize - binary_filelist_trailer_size, trailer, binary_filelist_trailer_size) != binary_filelist_trailer_size
+		|| memcmp(trailer + sizeof(int64), binary_filelist_index_magic, sizeof(binary_filelist_index_magic)) != 0)
+	{
+		return false;
+	}
+
+	int64 index_pos;
+	memcpy(&index_pos, trailer, sizeof(index_pos));
+	index_pos = little_endian(index_pos);
+
+	int64 index_end = fsize - binary_filelist_trailer_size;
+	if (index_pos < static_cast<int64>(binary_filelist_header_size)
+		|| index_pos >= index_end)
+	{
+		return false;
+	}
+
+	std::string index;
+	index.resize(static_cast<size_t>(index_end - index_pos));
+	if (f->Read(index_pos, &index[0], static_cast<_u32>(index.size())) != index.size())
+	{
+		return false;
+	}
+
+	CRData data(index.data(), index.size());
+	char type;
+	int64 num_dirs;
+	if (!data.getChar(&type)
+		|| type != 'e'
+		|| !data.getVarInt(&num_dirs))
+	{
+		return false;
+	}
+
+	dir_offsets.clear();
+	int64 offset = 0;
+	for (int64 i = 0; i < num_dirs; ++i)
+	{
+		int64 delta;
+		if (!data.getVarInt(&delta))
+		{
+			return false;
+		}
+		offset += delta;
+		dir_offsets.push_back(offset);
+	}
+
+	return true;
+}
+
+FileListDirDigests::FileListDirDigests()
+	: valid(true)
+{
+}
+
+void FileListDirDigests::addItem(const SFile& cf)
+{
+	if (cf.isdir)
+	{
+		dirs.push_back(SDir());
+		sha256_init(&dirs.back().ctx);
+		dirs.back().name = cf.name;
+		dirs.back().last_modified = cf.last_modified;
+	}
+	else if (!dirs.empty())
+	{
+		std::string item = binaryFileListItem(cf, std::string());
+		sha256_update(&dirs.back().ctx, reinterpret_cast<const unsigned char*>(item.data()), static_cast<unsigned int>(item.size()));
+	}
+}
+
+std::string FileListDirDigests::finishDir()
+{
+	if (dirs.empty())
+	{
+		return std::string();
+	}
+
+	unsigned char dig[SHA256_DIGEST_SIZE];
+	sha256_final(&dirs.back().ctx, dig);
+	std::string digest(reinterpret_cast<char*>(dig), binary_filelist_dir_digest_size);
+
+	SFile cf;
+	cf.isdir = true;
+	cf.name = dirs.back().name;
+	cf.last_modified = dirs.back().last_modified;
+	dirs.pop_back();
+
+	if (!dirs.empty())
+	{
+		std::string item = binaryFileListItem(cf, std::string()) + digest;
+		sha256_update(&dirs.back().ctx, reinterpret_cast<const unsigned char*>(item.data()), static_cast<unsigned int>(item.size()));
+	}
+
+	if (!valid)
+	{
+		return std::string();
+	}
+
+	return digest;
+}
+
+void FileListDirDigests::toggleDirChangeIndicator()
+{
+	if (!dirs.empty())
+	{
+		dirs.back().last_modified ^= 1;
+	}
+}
+
+void FileListDirDigests::reset()
+{
+	dirs.clear();
+	valid = true;
+}
+
+FileListDirDigests::SRestorePoint FileListDirDigests::getRestorePoint()
+{
+	SRestorePoint ret;
+	ret.depth = dirs.size();
+	if (!dirs.empty())
+	{
+		ret.dir = dirs.back();
+	}
+	return ret;
+}
+
+void FileListDirDigests::restore(const SRestorePoint& restore_point)
+{
+	if (restore_point.depth != dirs.size())
+	{
+		//Digests of the open directories would not match the list
+		valid = false;
+		return;
+	}
+
+	if (!dirs.empty())
+	{
+		dirs.back() = restore_point.dir;
+	}
+}
+
+FileListWriter::FileListWriter(IFile* f, bool binary, bool dir_digests)
+	: f(f), binary(binary), dir_digests(binary && dir_digests), pos(0)
+{
+	if (binary)
+	{
+		std::string header = binaryFileListHeader();
+		writeFileRepeat(f, header);
+		pos += header.size();
+	}
+}
+
+void FileListWriter::write(const SFile& cf, size_t* written, size_t* change_identicator_off)
+{
+	if (!binary)
+	{
+		size_t item_written = 0;
+		writeFileItem(f, cf, &item_written, change_identicator_off);
+		pos += item_written;
+		if (written != NULL)
+		{
+			*written += item_written;
+		}
+		return;
+	}
+
+	if (cf.isdir && cf.name != "..")
+	{
+		dir_offsets.push_back(pos);
+	}
+
+	std::string item;
+	if (dir_digests)
+	{
+		if (cf.isdir && cf.name == "..")
+		{
+			std::string digest = digests.finishDir();
+			if (!digest.empty())
+			{
+				item = binaryFileListDirUp(digest);
+			}
+		}
+		else
+		{
+			digests.addItem(cf);
+		}
+	}
+
+	if (item.empty())
+	{
+		item = binaryFileListItem(cf, std::string(), change_identicator_off);
+	}
+	writeFileRepeat(f, item);
+	pos += item.size();
+
+	if (written != NULL)
+	{
+		*written += item.size();
+	}
+}
+
+void FileListWriter::finish()
+{
+	if (binary)
+	{
+		std::string end = binaryFileListEnd(pos, dir_offsets);
+		writeFileRepeat(f, end);
+		pos += end.size();
+	}
+}
+
+bool FileListWriter::isBinary()
+{
+	return binary;
+}
+
+int64 FileListWriter::getPos()
+{
+	return pos;
+}
+
+char FileListWriter::toggleChangeIndicator(char ch)
+{
+	if (binary)
+	{
+		if (dir_digests)
+		{
+			digests.toggleDirChangeIndicator();
+		}
+		return ch ^ 1;
+	}
+
+	return ch == '0' ? '1' : '0';
+}
+
 
 bool FileListParser::nextEntry( char ch, SFile &data, std::map<std::string, std::string>* extra )
 {
 	++pos;
 	switch(state)
 	{
+	case ParseState_BinHeader:
+		if(pos<static_cast<int64>(binary_filelist_header_size))
+		{
+			if(ch!=binary_filelist_magic[pos-1])
+			{
+				return binError("Unexpected char in header at pos "+convert(pos-1));
+			}
+		}
+		else if(ch!=binary_filelist_version)
+		{
+			return binError("Unsupported format version "+convert(static_cast<int>(ch)));
+		}
+		else
+		{
+			state=ParseState_BinType;
+		}
+		break;
+	case ParseState_BinType:
+		if(extra!=NULL)
+		{
+			extra->clear();
+		}
+		if(ch=='f' || ch=='d')
+		{
+			data.isdir = ch=='d';
+			data.size=0;
+			data.last_modified=0;
+			startBinVarint(BinField_Name);
+		}
+		else if(ch=='u')
+		{
+			data.isdir=true;
+			data.name="..";
+			data.size=0;
+			data.last_modified=0;
+			return true;
+		}
+		else if(ch=='U')
+		{
+			data.isdir=true;
+			data.name="..";
+			data.size=0;
+			data.last_modified=0;
+			startBinVarint(BinField_DirDigest);
+		}
+		else if(ch=='e')
+		{
+			state=ParseState_BinEnd;
+		}
+		else
+		{
+			return binError("Unexpected entry type '"+std::string(1, ch)+"'");
+		}
+		break;
+	case ParseState_BinVarint:
+		{
+			unsigned char b = static_cast<unsigned char>(ch);
+			++bin_varint_len;
+			bool done;
+			if(bin_varint_len==9)
+			{
+				bin_val = (bin_val<<8) | b;
+				done=true;
+			}
+			else
+			{
+				bin_val = (bin_val<<7) | (b & 0x7f);
+				done = (b & 0x80)==0;
+			}
+
+			if(!done)
+			{
+				break;
+			}
+
+			if(bin_field==BinField_Name
+				|| bin_field==BinField_Key
+				|| bin_field==BinField_Value
+				|| bin_field==BinField_DirDigest)
+			{
+				if(bin_val>static_cast<uint64>(binary_filelist_max_string))
+				{
+					return binError("String too long ("+convert(bin_val)+" bytes)");
+				}
+				t_name.clear();
+				if(bin_val>0)
+				{
+					bin_bytes_left=static_cast<int64>(bin_val);
+					state=ParseState_BinBytes;
+					break;
+				}
+			}
+
+			return nextBinField(data, extra);
+		}
+	case ParseState_BinBytes:
+		t_name+=ch;
+		--bin_bytes_left;
+		if(bin_bytes_left==0)
+		{
+			return nextBinField(data, extra);
+		}
+		break;
+	case ParseState_BinEnd:
+		break;
 	case ParseState_Type:
-		if(ch=='f')
+		if(ch==binary_filelist_magic[0])
+		{
+			state=ParseState_BinHeader;
+		}
+		else if(ch=='f')
 		{
 			data.isdir=false;
 			state=ParseState_Quote;
@@ -316,6 +796,90 @@ bool FileListParser::nextEntry( char ch, SFile &data, std::map<std::string, std:
 	return false;
 }
 
+bool FileListParser::nextBinField(SFile &data, std::map<std::string, std::string>* extra)
+{
+	switch(bin_field)
+	{
+	case BinField_Name:
+		data.name=t_name;
+		t_name.clear();
+		startBinVarint(data.isdir ? BinField_ModifiedTime : BinField_Size);
+		break;
+	case BinField_Size:
+		data.size=static_cast<int64>(bin_val);
+		startBinVarint(BinField_ModifiedTime);
+		break;
+	case BinField_ModifiedTime:
+		data.last_modified=static_cast<int64>(bin_val);
+		startBinVarint(BinField_NumExtra);
+		break;
+	case BinField_NumExtra:
+		bin_n_extra=static_cast<int64>(bin_val);
+		if(bin_n_extra==0)
+		{
+			state=ParseState_BinType;
+			return true;
+		}
+		startBinVarint(BinField_KeyId);
+		break;
+	case BinField_KeyId:
+		if(bin_val==0)
+		{
+			startBinVarint(BinField_Key);
+		}
+		else if(bin_val<=binary_filelist_num_keys)
+		{
+			bin_key=binary_filelist_keys[bin_val-1];
+			startBinVarint(BinField_Value);
+		}
+		else
+		{
+			return binError("Unknown parameter key id "+convert(bin_val));
+		}
+		break;
+	case BinField_Key:
+		bin_key=t_name;
+		t_name.clear();
+		startBinVarint(BinField_Value);
+		break;
+	case BinField_Value:
+		if(extra!=NULL)
+		{
+			(*extra)[bin_key]=t_name;
+		}
+		t_name.clear();
+		--bin_n_extra;
+		if(bin_n_extra==0)
+		{
+			state=ParseState_BinType;
+			return true;
+		}
+		startBinVarint(BinField_KeyId);
+		break;
+	case BinField_DirDigest:
+		t_name.clear();
+		state=ParseState_BinType;
+		return true;
+	}
+	return false;
+}
+
+void FileListParser::startBinVarint(BinField field)
+{
+	bin_field=field;
+	bin_val=0;
+	bin_varint_len=0;
+	state=ParseState_BinVarint;
+}
+
+bool FileListParser::binError(const std::string& msg)
+{
+	Server->Log("Error parsing binary file list: "+msg, LL_ERROR);
+	t_name.clear();
+	state=ParseState_BinEnd;
+	return false;
+}
+
 void FileListParser::reset( void )
 {
 	t_name="";
@@ -324,7 +888,8 @@ void FileListParser::reset( void )
 }
 
 FileListParser::FileListParser()
-	: state(ParseState_Type), pos(0)
+	: state(ParseState_Type), pos(0), bin_field(BinField_Name),
+	bin_val(0), bin_varint_len(0), bin_bytes_left(0), bin_n_extra(0)
 {
 
 }
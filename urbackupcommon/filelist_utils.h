@@ -3,6 +3,7 @@
 #include "../Interface/File.h"
 #include "../urbackupcommon/os_functions.h"
 #include "file_metadata.h"
+#include "sha2/sha2.h"
 
 void writeFileRepeat(IFile *f, const std::string &str);
 
@@ -11,6 +12,110 @@ std::string escapeListName( const std::string& listname );
 void writeFileItem(IFile* f, SFile cf, size_t* written=NULL, size_t* change_identicator_off=NULL);
 void writeFileItem(IFile* f, SFile cf, std::string extra);
 
+//Binary file list format. The list starts with a zero byte, "UBFL" and the
+//format version. Entries are a type byte ('f', 'd' or 'u'), the length prefixed
+//name, the size (files only) and the last modified time/change indicator as varints
+//and the number of extra parameters followed by the parameters. A parameter key
+//is the index of the key in the key table of the format version plus one, or
+//zero followed by the length prefixed key. The value is length prefixed.
+//A directory up entry can be 'U' followed by the length prefixed digest of the
+//directory (see FileListDirDigests) instead of 'u'.
+//After the last entry follows 'e', the number of directory entries, the
+//(delta coded) offsets of the directory entries and a trailer with the offset
+//of the 'e' entry (64 bit little endian) and "UBFI".
+const char binary_filelist_version = 1;
+const size_t binary_filelist_header_size = 6;
+const size_t binary_filelist_trailer_size = 12;
+const size_t binary_filelist_dir_digest_size = 16;
+
+std::string binaryFileListHeader();
+
+//extra is in the format of the text list (parameters starting with '&' or '#')
+std::string binaryFileListItem(const SFile& cf, const std::string& extra, size_t* change_identicator_off=NULL);
+
+std::string binaryFileListDirUp(const std::string& dir_digest);
+
+std::string binaryFileListEnd(int64 pos, const std::vector<int64>& dir_offsets);
+
+bool isBinaryFileList(IFile* f);
+
+//Reads the offsets of the directory entries of a finished binary list
+bool readBinaryFileListIndex(IFile* f, std::vector<int64>& dir_offsets);
+
+//Merkle digests of the directories of a binary file list. The digest of a
+//directory covers type, name, size and change indicator of its entries and the
+//digests of its sub directories, so two directories with the same digest have
+//the same subtree.
+class FileListDirDigests
+{
+public:
+	FileListDirDigests();
+
+	//Adds a file or opens a directory
+	void addItem(const SFile& cf);
+
+	//Closes the innermost directory and returns its digest. Returns an empty
+	//string if no directory is open or the digests became invalid
+	std::string finishDir();
+
+	//Toggles the lowest bit of the change indicator of the innermost directory
+	void toggleDirChangeIndicator();
+
+	void reset();
+
+	struct SDir
+	{
+		sha256_ctx ctx;
+		std::string name;
+		int64 last_modified;
+	};
+
+	//State of the innermost directory, to undo entries written after
+	//getRestorePoint() (e.g. if the output is rewound)
+	struct SRestorePoint
+	{
+		size_t depth;
+		SDir dir;
+	};
+
+	SRestorePoint getRestorePoint();
+	void restore(const SRestorePoint& restore_point);
+
+private:
+	std::vector<SDir> dirs;
+	bool valid;
+};
+
+//Writes a file list to f in the text or the binary format
+class FileListWriter
+{
+public:
+	FileListWriter(IFile* f, bool binary, bool dir_digests=false);
+
+	//Same as writeFileItem()
+	void write(const SFile& cf, size_t* written=NULL, size_t* change_identicator_off=NULL);
+
+	//Writes the end of a binary list
+	void finish();
+
+	bool isBinary();
+
+	//Number of bytes written so far
+	int64 getPos();
+
+	//Changes the value of the change indicator byte at change_identicator_off
+	//of the innermost open directory (and its digest accordingly)
+	char toggleChangeIndicator(char ch);
+
+private:
+	IFile* f;
+	bool binary;
+	bool dir_digests;
+	int64 pos;
+	std::vector<int64> dir_offsets;
+	FileListDirDigests digests;
+};
+
 
 class FileListParser
 {
@@ -25,6 +130,11 @@ private:
 
 	enum ParseState
 	{
+		ParseState_BinHeader,
+		ParseState_BinType,
+		ParseState_BinVarint,
+		ParseState_BinBytes,
+		ParseState_BinEnd,
 		ParseState_Type,
 		ParseState_TypeFinish,
 		ParseState_Quote,
@@ -36,7 +146,30 @@ private:
 		ParseState_ExtraParams
 	};
 
+	enum BinField
+	{
+		BinField_Name,
+		BinField_Size,
+		BinField_ModifiedTime,
+		BinField_NumExtra,
+		BinField_KeyId,
+		BinField_Key,
+		BinField_Value,
+		BinField_DirDigest
+	};
+
+	bool nextBinField(SFile &data, std::map<std::string, std::string>* extra);
+	void startBinVarint(BinField field);
+	bool binError(const std::string& msg);
+
 	ParseState state;
 	std::string t_name;
 	int64 pos;
+
+	BinField bin_field;
+	uint64 bin_val;
+	int bin_varint_len;
+	int64 bin_bytes_left;
+	int64 bin_n_extra;
+	std::string bin_key;
 };
@@ -34,9 +34,39 @@
 #include <string.h>	/* memcpy()/memset() or bcopy()/bzero() */
 #include <assert.h>	/* assert() */
 #include "sha2.h"
+#include "sha2_impl.h"
 
 #ifdef DO_NOT_USE_CRYPTOPP_SHA
 
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SHA2_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+#if defined(__aarch64__) && (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_SHA2))
+#define SHA2_ARMV8
+#include <arm_neon.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+/* Functions compiled for instruction set extensions, which are only
+* called if the CPU supports them */
+#if defined(__GNUC__) || defined(__clang__)
+#define SHA2_TARGET(x) __attribute__((target(x)))
+#define SHA2_TRANSFORM_INLINE static inline __attribute__((always_inline))
+#define SHA2_HAS_TARGET_ATTRIBUTE
+#else
+#define SHA2_TARGET(x)
+#define SHA2_TRANSFORM_INLINE static __forceinline
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -226,8 +256,10 @@ typedef u_int64_t sha2_word64;	/* Exactly 8 bytes */
 								* only.
 								*/
 void SHA512_Last(SHA512_CTX*);
-void SHA256_Transform(SHA256_CTX*, const sha2_word32*);
-void SHA512_Transform(SHA512_CTX*, const sha2_word64*);
+SHA2_TRANSFORM_INLINE void SHA256_Transform(SHA256_CTX*, const sha2_word32*);
+SHA2_TRANSFORM_INLINE void SHA512_Transform(SHA512_CTX*, const sha2_word64*);
+static void sha256_transform_blocks(SHA256_CTX*, const sha2_byte*, size_t);
+static void sha512_transform_blocks(SHA512_CTX*, const sha2_byte*, size_t);
 
 
 /*** SHA-XYZ INITIAL HASH VALUES AND CONSTANTS ************************/
@@ -385,7 +417,7 @@ void SHA256_Init(SHA256_CTX* context) {
 	(h) = T1 + Sigma0_256(a) + Maj((a), (b), (c)); \
 	j++
 
-void SHA256_Transform(SHA256_CTX* context, const sha2_word32* data) {
+SHA2_TRANSFORM_INLINE void SHA256_Transform(SHA256_CTX* context, const sha2_word32* data) {
 	sha2_word32	a, b, c, d, e, f, g, h, s0, s1;
 	sha2_word32	T1, *W256;
 	int		j;
@@ -443,7 +475,7 @@ void SHA256_Transform(SHA256_CTX* context, const sha2_word32* data) {
 
 #else /* SHA2_UNROLL_TRANSFORM */
 
-void SHA256_Transform(SHA256_CTX* context, const sha2_word32* data) {
+SHA2_TRANSFORM_INLINE void SHA256_Transform(SHA256_CTX* context, const sha2_word32* data) {
 	sha2_word32	a, b, c, d, e, f, g, h, s0, s1;
 	sha2_word32	T1, T2, *W256;
 	int		j;
@@ -545,7 +577,7 @@ void SHA256_Update(SHA256_CTX* context, const sha2_byte *data, size_t len) {
 			context->bitcount += freespace << 3;
 			len -= freespace;
 			data += freespace;
-			SHA256_Transform(context, (sha2_word32*)context->buffer);
+			sha256_transform_blocks(context, context->buffer, 1);
 		}
 		else {
 			/* The buffer is not yet full */
@@ -556,12 +588,13 @@ void SHA256_Update(SHA256_CTX* context, const sha2_byte *data, size_t len) {
 			return;
 		}
 	}
-	while (len >= SHA256_BLOCK_LENGTH) {
+	if (len >= SHA256_BLOCK_LENGTH) {
 		/* Process as many complete blocks as we can */
-		SHA256_Transform(context, (sha2_word32*)data);
-		context->bitcount += SHA256_BLOCK_LENGTH << 3;
-		len -= SHA256_BLOCK_LENGTH;
-		data += SHA256_BLOCK_LENGTH;
+		size_t n_blocks = len / SHA256_BLOCK_LENGTH;
+		sha256_transform_blocks(context, data, n_blocks);
+		context->bitcount += (sha2_word64)(n_blocks * SHA256_BLOCK_LENGTH) << 3;
+		len -= n_blocks * SHA256_BLOCK_LENGTH;
+		data += n_blocks * SHA256_BLOCK_LENGTH;
 	}
 	if (len > 0) {
 		/* There's left-overs, so save 'em */
@@ -599,7 +632,7 @@ void SHA256_Final(sha2_byte digest[], SHA256_CTX* context) {
 					MEMSET_BZERO(&context->buffer[usedspace], SHA256_BLOCK_LENGTH - usedspace);
 				}
 				/* Do second-to-last transform: */
-				SHA256_Transform(context, (sha2_word32*)context->buffer);
+				sha256_transform_blocks(context, context->buffer, 1);
 
 				/* And set-up for the last transform: */
 				MEMSET_BZERO(context->buffer, SHA256_SHORT_BLOCK_LENGTH);
@@ -616,7 +649,7 @@ void SHA256_Final(sha2_byte digest[], SHA256_CTX* context) {
 		*(sha2_word64*)&context->buffer[SHA256_SHORT_BLOCK_LENGTH] = context->bitcount;
 
 		/* Final transform: */
-		SHA256_Transform(context, (sha2_word32*)context->buffer);
+		sha256_transform_blocks(context, context->buffer, 1);
 
 #if BYTE_ORDER == LITTLE_ENDIAN
 		{
@@ -716,7 +749,7 @@ void SHA512_Init(SHA512_CTX* context) {
 	(h) = T1 + Sigma0_512(a) + Maj((a), (b), (c)); \
 	j++
 
-void SHA512_Transform(SHA512_CTX* context, const sha2_word64* data) {
+SHA2_TRANSFORM_INLINE void SHA512_Transform(SHA512_CTX* context, const sha2_word64* data) {
 	sha2_word64	a, b, c, d, e, f, g, h, s0, s1;
 	sha2_word64	T1, *W512 = (sha2_word64*)context->buffer;
 	int		j;
@@ -771,7 +804,7 @@ void SHA512_Transform(SHA512_CTX* context, const sha2_word64* data) {
 
 #else /* SHA2_UNROLL_TRANSFORM */
 
-void SHA512_Transform(SHA512_CTX* context, const sha2_word64* data) {
+SHA2_TRANSFORM_INLINE void SHA512_Transform(SHA512_CTX* context, const sha2_word64* data) {
 	sha2_word64	a, b, c, d, e, f, g, h, s0, s1;
 	sha2_word64	T1, T2, *W512 = (sha2_word64*)context->buffer;
 	int		j;
@@ -849,6 +882,683 @@ void SHA512_Transform(SHA512_CTX* context, const sha2_word64* data) {
 
 #endif /* SHA2_UNROLL_TRANSFORM */
 
+/*** SHA-256/512 RUNTIME DISPATCH ***************************************/
+/*
+* The block functions below process consecutive 64/128 byte blocks. The
+* fastest one the CPU supports is selected on first use and checked against
+* the portable transform above before it is used.
+*/
+typedef void(*sha256_blocks_t)(SHA256_CTX*, const sha2_byte*, size_t);
+typedef void(*sha512_blocks_t)(SHA512_CTX*, const sha2_byte*, size_t);
+
+static void sha256_blocks_generic(SHA256_CTX* context, const sha2_byte* data, size_t n_blocks) {
+	size_t i;
+	for (i = 0; i < n_blocks; ++i) {
+		SHA256_Transform(context, (const sha2_word32*)(data + i*SHA256_BLOCK_LENGTH));
+	}
+}
+
+static void sha512_blocks_generic(SHA512_CTX* context, const sha2_byte* data, size_t n_blocks) {
+	size_t i;
+	for (i = 0; i < n_blocks; ++i) {
+		SHA512_Transform(context, (const sha2_word64*)(data + i*SHA512_BLOCK_LENGTH));
+	}
+}
+
+static int sha2_cpu_generic(void) {
+	return 1;
+}
+
+#if defined(SHA2_X86) && defined(SHA2_HAS_TARGET_ATTRIBUTE)
+/* Portable transforms compiled with the BMI2 rotate instructions */
+SHA2_TARGET("bmi2")
+static void sha256_blocks_bmi2(SHA256_CTX* context, const sha2_byte* data, size_t n_blocks) {
+	size_t i;
+	for (i = 0; i < n_blocks; ++i) {
+		SHA256_Transform(context, (const sha2_word32*)(data + i*SHA256_BLOCK_LENGTH));
+	}
+}
+
+SHA2_TARGET("bmi2")
+static void sha512_blocks_bmi2(SHA512_CTX* context, const sha2_byte* data, size_t n_blocks) {
+	size_t i;
+	for (i = 0; i < n_blocks; ++i) {
+		SHA512_Transform(context, (const sha2_word64*)(data + i*SHA512_BLOCK_LENGTH));
+	}
+}
+#endif
+
+#ifdef SHA2_X86
+static void sha2_cpuid(int leaf, int subleaf, unsigned int regs[4]) {
+#ifdef _MSC_VER
+	int r[4];
+	__cpuidex(r, leaf, subleaf);
+	regs[0] = r[0]; regs[1] = r[1]; regs[2] = r[2]; regs[3] = r[3];
+#else
+	__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static int sha2_cpu_leaf7_ebx(unsigned int bit) {
+	unsigned int regs[4];
+	sha2_cpuid(0, 0, regs);
+	if (regs[0] < 7) {
+		return 0;
+	}
+	sha2_cpuid(7, 0, regs);
+	return (regs[1] & (1U << bit)) != 0;
+}
+
+static int sha2_cpu_bmi2(void) {
+	return sha2_cpu_leaf7_ebx(8);
+}
+
+static int sha2_cpu_shani(void) {
+	unsigned int regs[4];
+	sha2_cpuid(1, 0, regs);
+	/* SSSE3 and SSE4.1 */
+	if ((regs[2] & (1U << 9)) == 0 || (regs[2] & (1U << 19)) == 0) {
+		return 0;
+	}
+	return sha2_cpu_leaf7_ebx(29);
+}
+
+#define SHANI_ROUNDS(k, m) \
+	tmp = _mm_add_epi32((m), _mm_loadu_si128((const __m128i*)&K256[k])); \
+	state1 = _mm_sha256rnds2_epu32(state1, state0, tmp); \
+	state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(tmp, 0x0E))
+
+#define SHANI_SCHEDULE(m0, m1, m2, m3) \
+	m0 = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32((m0), (m1)), \
+		_mm_alignr_epi8((m3), (m2), 4)), (m3))
+
+SHA2_TARGET("sha,sse4.1,ssse3")
+static void sha256_blocks_shani(SHA256_CTX* context, const sha2_byte* data, size_t n_blocks) {
+	const __m128i bswap_mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i state0, state1, tmp, m0, m1, m2, m3, abef_save, cdgh_save;
+
+	/* The SHA instructions want the state as ABEF and CDGH */
+	tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&context->state[0]), 0xB1);
+	state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&context->state[4]), 0x1B);
+	state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+	while (n_blocks-- > 0) {
+		abef_save = state0;
+		cdgh_save = state1;
+
+		m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 0)), bswap_mask);
+		SHANI_ROUNDS(0, m0);
+		m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16)), bswap_mask);
+		SHANI_ROUNDS(4, m1);
+		m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 32)), bswap_mask);
+		SHANI_ROUNDS(8, m2);
+		m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 48)), bswap_mask);
+		SHANI_ROUNDS(12, m3);
+
+		SHANI_SCHEDULE(m0, m1, m2, m3); SHANI_ROUNDS(16, m0);
+		SHANI_SCHEDULE(m1, m2, m3, m0); SHANI_ROUNDS(20, m1);
+		SHANI_SCHEDULE(m2, m3, m0, m1); SHANI_ROUNDS(24, m2);
+		SHANI_SCHEDULE(m3, m0, m1, m2); SHANI_ROUNDS(28, m3);
+		SHANI_SCHEDULE(m0, m1, m2, m3); SHANI_ROUNDS(32, m0);
+		SHANI_SCHEDULE(m1, m2, m3, m0); SHANI_ROUNDS(36, m1);
+		SHANI_SCHEDULE(m2, m3, m0, m1); SHANI_ROUNDS(40, m2);
+		SHANI_SCHEDULE(m3, m0, m1, m2); SHANI_ROUNDS(44, m3);
+		SHANI_SCHEDULE(m0, m1, m2, m3); SHANI_ROUNDS(48, m0);
+		SHANI_SCHEDULE(m1, m2, m3, m0); SHANI_ROUNDS(52, m1);
+		SHANI_SCHEDULE(m2, m3, m0, m1); SHANI_ROUNDS(56, m2);
+		SHANI_SCHEDULE(m3, m0, m1, m2); SHANI_ROUNDS(60, m3);
+
+		state0 = _mm_add_epi32(state0, abef_save);
+		state1 = _mm_add_epi32(state1, cdgh_save);
+
+		data += SHA256_BLOCK_LENGTH;
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);
+	state1 = _mm_shuffle_epi32(state1, 0xB1);
+	_mm_storeu_si128((__m128i*)&context->state[0], _mm_blend_epi16(tmp, state1, 0xF0));
+	_mm_storeu_si128((__m128i*)&context->state[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+#endif /* SHA2_X86 */
+
+#ifdef SHA2_ARMV8
+static int sha2_cpu_armv8(void) {
+#if defined(__linux__)
+	return (getauxval(AT_HWCAP) & HWCAP_SHA2) != 0;
+#elif defined(__APPLE__)
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+#define ARMV8_ROUNDS(k, m) \
+	tmp = vaddq_u32((m), vld1q_u32(&K256[k])); \
+	tmp2 = state0; \
+	state0 = vsha256hq_u32(state0, state1, tmp); \
+	state1 = vsha256h2q_u32(state1, tmp2, tmp)
+
+#define ARMV8_SCHEDULE(m0, m1, m2, m3) \
+	m0 = vsha256su1q_u32(vsha256su0q_u32((m0), (m1)), (m2), (m3))
+
+#define ARMV8_LOAD(off) \
+	vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + (off))))
+
+static void sha256_blocks_armv8(SHA256_CTX* context, const sha2_byte* data, size_t n_blocks) {
+	uint32x4_t state0, state1, tmp, tmp2, m0, m1, m2, m3, abcd_save, efgh_save;
+
+	state0 = vld1q_u32(&context->state[0]);
+	state1 = vld1q_u32(&context->state[4]);
+
+	while (n_blocks-- > 0) {
+		abcd_save = state0;
+		efgh_save = state1;
+
+		m0 = ARMV8_LOAD(0);
+		ARMV8_ROUNDS(0, m0);
+		m1 = ARMV8_LOAD(16);
+		ARMV8_ROUNDS(4, m1);
+		m2 = ARMV8_LOAD(32);
+		ARMV8_ROUNDS(8, m2);
+		m3 = ARMV8_LOAD(48);
+		ARMV8_ROUNDS(12, m3);
+
+		ARMV8_SCHEDULE(m0, m1, m2, m3); ARMV8_ROUNDS(16, m0);
+		ARMV8_SCHEDULE(m1, m2, m3, m0); ARMV8_ROUNDS(20, m1);
+		ARMV8_SCHEDULE(m2, m3, m0, m1); ARMV8_ROUNDS(24, m2);
+		ARMV8_SCHEDULE(m3, m0, m1, m2); ARMV8_ROUNDS(28, m3);
+		ARMV8_SCHEDULE(m0, m1, m2, m3); ARMV8_ROUNDS(32, m0);
+		ARMV8_SCHEDULE(m1, m2, m3, m0); ARMV8_ROUNDS(36, m1);
+		ARMV8_SCHEDULE(m2, m3, m0, m1); ARMV8_ROUNDS(40, m2);
+		ARMV8_SCHEDULE(m3, m0, m1, m2); ARMV8_ROUNDS(44, m3);
+		ARMV8_SCHEDULE(m0, m1, m2, m3); ARMV8_ROUNDS(48, m0);
+		ARMV8_SCHEDULE(m1, m2, m3, m0); ARMV8_ROUNDS(52, m1);
+		ARMV8_SCHEDULE(m2, m3, m0, m1); ARMV8_ROUNDS(56, m2);
+		ARMV8_SCHEDULE(m3, m0, m1, m2); ARMV8_ROUNDS(60, m3);
+
+		state0 = vaddq_u32(state0, abcd_save);
+		state1 = vaddq_u32(state1, efgh_save);
+
+		data += SHA256_BLOCK_LENGTH;
+	}
+
+	vst1q_u32(&context->state[0], state0);
+	vst1q_u32(&context->state[4], state1);
+}
+#endif /* SHA2_ARMV8 */
+
+typedef struct _sha256_impl {
+	const char* name;
+	sha256_blocks_t blocks;
+	int(*available)(void);
+} sha256_impl;
+
+typedef struct _sha512_impl {
+	const char* name;
+	sha512_blocks_t blocks;
+	int(*available)(void);
+} sha512_impl;
+
+/* Fastest first */
+static const sha256_impl sha256_impls[] = {
+#ifdef SHA2_X86
+	{ "shani", sha256_blocks_shani, sha2_cpu_shani },
+#ifdef SHA2_HAS_TARGET_ATTRIBUTE
+	{ "bmi2", sha256_blocks_bmi2, sha2_cpu_bmi2 },
+#endif
+#endif
+#ifdef SHA2_ARMV8
+	{ "armv8", sha256_blocks_armv8, sha2_cpu_armv8 },
+#endif
+	{ "generic", sha256_blocks_generic, sha2_cpu_generic }
+};
+
+static const sha512_impl sha512_impls[] = {
+#if defined(SHA2_X86) && defined(SHA2_HAS_TARGET_ATTRIBUTE)
+	{ "bmi2", sha512_blocks_bmi2, sha2_cpu_bmi2 },
+#endif
+	{ "generic", sha512_blocks_generic, sha2_cpu_generic }
+};
+
+#define SHA2_N_IMPLS(impls) (sizeof(impls)/sizeof(impls[0]))
+
+static const sha256_impl* volatile sha256_curr_impl = NULL;
+static const sha512_impl* volatile sha512_curr_impl = NULL;
+
+/* Compares an implementation with the portable one on unaligned input */
+static int sha256_impl_ok(const sha256_impl* impl) {
+	sha2_byte data[3 * SHA256_BLOCK_LENGTH + 1];
+	SHA256_CTX ref, test;
+	size_t i;
+
+	if (!impl->available()) {
+		return 0;
+	}
+	for (i = 0; i < sizeof(data); ++i) {
+		data[i] = (sha2_byte)(i * 131 + 7);
+	}
+	SHA256_Init(&ref);
+	SHA256_Init(&test);
+	sha256_blocks_generic(&ref, data + 1, 3);
+	impl->blocks(&test, data + 1, 3);
+	return memcmp(ref.state, test.state, sizeof(ref.state)) == 0;
+}
+
+static int sha512_impl_ok(const sha512_impl* impl) {
+	sha2_byte data[3 * SHA512_BLOCK_LENGTH + 1];
+	SHA512_CTX ref, test;
+	size_t i;
+
+	if (!impl->available()) {
+		return 0;
+	}
+	for (i = 0; i < sizeof(data); ++i) {
+		data[i] = (sha2_byte)(i * 131 + 7);
+	}
+	SHA512_Init(&ref);
+	SHA512_Init(&test);
+	sha512_blocks_generic(&ref, data + 1, 3);
+	impl->blocks(&test, data + 1, 3);
+	return memcmp(ref.state, test.state, sizeof(ref.state)) == 0;
+}
+
+static const sha256_impl* sha256_select_impl(void) {
+	size_t i;
+	for (i = 0; i + 1 < SHA2_N_IMPLS(sha256_impls); ++i) {
+		if (sha256_impl_ok(&sha256_impls[i])) {
+			return &sha256_impls[i];
+		}
+	}
+	return &sha256_impls[SHA2_N_IMPLS(sha256_impls) - 1];
+}
+
+static const sha512_impl* sha512_select_impl(void) {
+	size_t i;
+	for (i = 0; i + 1 < SHA2_N_IMPLS(sha512_impls); ++i) {
+		if (sha512_impl_ok(&sha512_impls[i])) {
+			return &sha512_impls[i];
+		}
+	}
+	return &sha512_impls[SHA2_N_IMPLS(sha512_impls) - 1];
+}
+
+static void sha256_transform_blocks(SHA256_CTX* context, const sha2_byte* data, size_t n_blocks) {
+	const sha256_impl* impl = sha256_curr_impl;
+	if (impl == NULL) {
+		impl = sha256_select_impl();
+		sha256_curr_impl = impl;
+	}
+	impl->blocks(context, data, n_blocks);
+}
+
+static void sha512_transform_blocks(SHA512_CTX* context, const sha2_byte* data, size_t n_blocks) {
+	const sha512_impl* impl = sha512_curr_impl;
+	if (impl == NULL) {
+		impl = sha512_select_impl();
+		sha512_curr_impl = impl;
+	}
+	impl->blocks(context, data, n_blocks);
+}
+
+/*** SHA-512 MULTI-BUFFER *********************************************/
+/*
+* Hashes the blocks of several independent messages at once, one message
+* per 64 bit SIMD lane. Used for many small files, where a single stream
+* can't make use of the vector units.
+*/
+#define SHA512_MB_MAX_LANES 8
+
+typedef void(*sha512_mb_blocks_t)(sha2_word64**, const sha2_byte**, size_t);
+
+static sha2_word64 sha2_load_be64(const sha2_byte* p) {
+	sha2_word64 w;
+	MEMCPY_BCOPY(&w, p, sizeof(w));
+#if BYTE_ORDER == LITTLE_ENDIAN
+	REVERSE64(w, w);
+#endif
+	return w;
+}
+
+#if defined(SHA2_X86) && defined(SHA2_HAS_TARGET_ATTRIBUTE)
+static unsigned int sha2_xgetbv0(void) {
+	unsigned int eax, edx;
+	__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return eax;
+}
+#elif defined(SHA2_X86)
+static unsigned int sha2_xgetbv0(void) {
+	return (unsigned int)_xgetbv(0);
+}
+#endif
+
+#ifdef SHA2_X86
+/* CPU and OS support for the given XCR0 state components */
+static int sha2_cpu_os_avx(unsigned int xcr0_mask) {
+	unsigned int regs[4];
+	sha2_cpuid(1, 0, regs);
+	/* OSXSAVE and AVX */
+	if ((regs[2] & (1U << 27)) == 0 || (regs[2] & (1U << 28)) == 0) {
+		return 0;
+	}
+	return (sha2_xgetbv0() & xcr0_mask) == xcr0_mask;
+}
+
+static int sha2_cpu_avx2(void) {
+	return sha2_cpu_os_avx(0x06) && sha2_cpu_leaf7_ebx(5);
+}
+
+static int sha2_cpu_avx512(void) {
+	return sha2_cpu_os_avx(0xE6) && sha2_cpu_leaf7_ebx(16);
+}
+
+#define MB256_ROR(x, n) _mm256_or_si256(_mm256_srli_epi64((x), (n)), _mm256_slli_epi64((x), 64 - (n)))
+#define MB256_XOR3(x, y, z) _mm256_xor_si256(_mm256_xor_si256((x), (y)), (z))
+#define MB256_ADD3(x, y, z) _mm256_add_epi64(_mm256_add_epi64((x), (y)), (z))
+
+SHA2_TARGET("avx2")
+static void sha512_mb_blocks_avx2(sha2_word64** states, const sha2_byte** data, size_t n_blocks) {
+	const __m256i bswap_mask = _mm256_set_epi64x(0x08090a0b0c0d0e0fULL, 0x0001020304050607ULL,
+		0x08090a0b0c0d0e0fULL, 0x0001020304050607ULL);
+	__m256i s[8], w[16], a, b, c, d, e, f, g, h, t0, t1, t2, t3;
+	const sha2_byte* p[4];
+	sha2_word64 out[4];
+	int j, l;
+
+	for (l = 0; l < 4; ++l) {
+		p[l] = data[l];
+	}
+	for (j = 0; j < 8; ++j) {
+		s[j] = _mm256_set_epi64x(states[3][j], states[2][j], states[1][j], states[0][j]);
+	}
+
+	while (n_blocks-- > 0) {
+		/* Transpose four words of each lane at a time */
+		for (j = 0; j < 16; j += 4) {
+			t0 = _mm256_loadu_si256((const __m256i*)(p[0] + j * 8));
+			t1 = _mm256_loadu_si256((const __m256i*)(p[1] + j * 8));
+			t2 = _mm256_loadu_si256((const __m256i*)(p[2] + j * 8));
+			t3 = _mm256_loadu_si256((const __m256i*)(p[3] + j * 8));
+			a = _mm256_unpacklo_epi64(t0, t1);
+			b = _mm256_unpackhi_epi64(t0, t1);
+			c = _mm256_unpacklo_epi64(t2, t3);
+			d = _mm256_unpackhi_epi64(t2, t3);
+			w[j] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(a, c, 0x20), bswap_mask);
+			w[j + 1] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(b, d, 0x20), bswap_mask);
+			w[j + 2] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(a, c, 0x31), bswap_mask);
+			w[j + 3] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(b, d, 0x31), bswap_mask);
+		}
+
+		a = s[0]; b = s[1]; c = s[2]; d = s[3];
+		e = s[4]; f = s[5]; g = s[6]; h = s[7];
+
+		for (j = 0; j < 80; ++j) {
+			if (j >= 16) {
+				t0 = w[(j - 15) & 15];
+				t1 = w[(j - 2) & 15];
+				t0 = MB256_XOR3(MB256_ROR(t0, 1), MB256_ROR(t0, 8), _mm256_srli_epi64(t0, 7));
+				t1 = MB256_XOR3(MB256_ROR(t1, 19), MB256_ROR(t1, 61), _mm256_srli_epi64(t1, 6));
+				w[j & 15] = _mm256_add_epi64(MB256_ADD3(w[j & 15], t0, t1), w[(j - 7) & 15]);
+			}
+			t1 = MB256_ADD3(h, MB256_XOR3(MB256_ROR(e, 14), MB256_ROR(e, 18), MB256_ROR(e, 41)),
+				_mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g)));
+			t1 = MB256_ADD3(t1, _mm256_set1_epi64x((long long)K512[j]), w[j & 15]);
+			t2 = _mm256_add_epi64(MB256_XOR3(MB256_ROR(a, 28), MB256_ROR(a, 34), MB256_ROR(a, 39)),
+				_mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b))));
+			h = g; g = f; f = e;
+			e = _mm256_add_epi64(d, t1);
+			d = c; c = b; b = a;
+			a = _mm256_add_epi64(t1, t2);
+		}
+
+		s[0] = _mm256_add_epi64(s[0], a); s[1] = _mm256_add_epi64(s[1], b);
+		s[2] = _mm256_add_epi64(s[2], c); s[3] = _mm256_add_epi64(s[3], d);
+		s[4] = _mm256_add_epi64(s[4], e); s[5] = _mm256_add_epi64(s[5], f);
+		s[6] = _mm256_add_epi64(s[6], g); s[7] = _mm256_add_epi64(s[7], h);
+
+		for (l = 0; l < 4; ++l) {
+			p[l] += SHA512_BLOCK_LENGTH;
+		}
+	}
+
+	for (j = 0; j < 8; ++j) {
+		_mm256_storeu_si256((__m256i*)out, s[j]);
+		for (l = 0; l < 4; ++l) {
+			states[l][j] = out[l];
+		}
+	}
+}
+
+#define MB512_XOR3(x, y, z) _mm512_ternarylogic_epi64((x), (y), (z), 0x96)
+#define MB512_ADD3(x, y, z) _mm512_add_epi64(_mm512_add_epi64((x), (y)), (z))
+
+SHA2_TARGET("avx512f")
+static void sha512_mb_blocks_avx512(sha2_word64** states, const sha2_byte** data, size_t n_blocks) {
+	__m512i s[8], w[16], a, b, c, d, e, f, g, h, t0, t1, t2;
+	const sha2_byte* p[8];
+	sha2_word64 out[8];
+	int j, l;
+
+	for (l = 0; l < 8; ++l) {
+		p[l] = data[l];
+	}
+	for (j = 0; j < 8; ++j) {
+		s[j] = _mm512_set_epi64(states[7][j], states[6][j], states[5][j], states[4][j],
+			states[3][j], states[2][j], states[1][j], states[0][j]);
+	}
+
+	while (n_blocks-- > 0) {
+		for (j = 0; j < 16; ++j) {
+			w[j] = _mm512_set_epi64(sha2_load_be64(p[7] + j * 8), sha2_load_be64(p[6] + j * 8),
+				sha2_load_be64(p[5] + j * 8), sha2_load_be64(p[4] + j * 8),
+				sha2_load_be64(p[3] + j * 8), sha2_load_be64(p[2] + j * 8),
+				sha2_load_be64(p[1] + j * 8), sha2_load_be64(p[0] + j * 8));
+		}
+
+		a = s[0]; b = s[1]; c = s[2]; d = s[3];
+		e = s[4]; f = s[5]; g = s[6]; h = s[7];
+
+		for (j = 0; j < 80; ++j) {
+			if (j >= 16) {
+				t0 = w[(j - 15) & 15];
+				t1 = w[(j - 2) & 15];
+				t0 = MB512_XOR3(_mm512_ror_epi64(t0, 1), _mm512_ror_epi64(t0, 8), _mm512_srli_epi64(t0, 7));
+				t1 = MB512_XOR3(_mm512_ror_epi64(t1, 19), _mm512_ror_epi64(t1, 61), _mm512_srli_epi64(t1, 6));
+				w[j & 15] = _mm512_add_epi64(MB512_ADD3(w[j & 15], t0, t1), w[(j - 7) & 15]);
+			}
+			/* 0xCA is Ch(e,f,g), 0xE8 is Maj(a,b,c) */
+			t1 = MB512_ADD3(h, MB512_XOR3(_mm512_ror_epi64(e, 14), _mm512_ror_epi64(e, 18), _mm512_ror_epi64(e, 41)),
+				_mm512_ternarylogic_epi64(e, f, g, 0xCA));
+			t1 = MB512_ADD3(t1, _mm512_set1_epi64((long long)K512[j]), w[j & 15]);
+			t2 = _mm512_add_epi64(MB512_XOR3(_mm512_ror_epi64(a, 28), _mm512_ror_epi64(a, 34), _mm512_ror_epi64(a, 39)),
+				_mm512_ternarylogic_epi64(a, b, c, 0xE8));
+			h = g; g = f; f = e;
+			e = _mm512_add_epi64(d, t1);
+			d = c; c = b; b = a;
+			a = _mm512_add_epi64(t1, t2);
+		}
+
+		s[0] = _mm512_add_epi64(s[0], a); s[1] = _mm512_add_epi64(s[1], b);
+		s[2] = _mm512_add_epi64(s[2], c); s[3] = _mm512_add_epi64(s[3], d);
+		s[4] = _mm512_add_epi64(s[4], e); s[5] = _mm512_add_epi64(s[5], f);
+		s[6] = _mm512_add_epi64(s[6], g); s[7] = _mm512_add_epi64(s[7], h);
+
+		for (l = 0; l < 8; ++l) {
+			p[l] += SHA512_BLOCK_LENGTH;
+		}
+	}
+
+	for (j = 0; j < 8; ++j) {
+		_mm512_storeu_si512((void*)out, s[j]);
+		for (l = 0; l < 8; ++l) {
+			states[l][j] = out[l];
+		}
+	}
+}
+#endif /* SHA2_X86 */
+
+typedef struct _sha512_mb_impl {
+	const char* name;
+	size_t lanes;
+	sha512_mb_blocks_t blocks;
+	int(*available)(void);
+} sha512_mb_impl;
+
+/* Widest first. "scalar" hashes each message with the single-buffer functions */
+static const sha512_mb_impl sha512_mb_impls[] = {
+#ifdef SHA2_X86
+	{ "avx512", 8, sha512_mb_blocks_avx512, sha2_cpu_avx512 },
+	{ "avx2", 4, sha512_mb_blocks_avx2, sha2_cpu_avx2 },
+#endif
+	{ "scalar", 1, NULL, sha2_cpu_generic }
+};
+
+static const sha512_mb_impl* volatile sha512_mb_curr_impl = NULL;
+
+static int sha512_mb_impl_ok(const sha512_mb_impl* impl) {
+	sha2_byte data[SHA512_MB_MAX_LANES * 3 * SHA512_BLOCK_LENGTH + 1];
+	sha2_word64 ref[SHA512_MB_MAX_LANES][8];
+	sha2_word64 test[SHA512_MB_MAX_LANES][8];
+	sha2_word64* states[SHA512_MB_MAX_LANES];
+	const sha2_byte* lane_data[SHA512_MB_MAX_LANES];
+	SHA512_CTX ctx;
+	size_t i;
+
+	if (!impl->available()) {
+		return 0;
+	}
+	if (impl->blocks == NULL) {
+		return 1;
+	}
+	for (i = 0; i < sizeof(data); ++i) {
+		data[i] = (sha2_byte)(i * 131 + 7);
+	}
+	for (i = 0; i < impl->lanes; ++i) {
+		SHA512_Init(&ctx);
+		sha512_blocks_generic(&ctx, data + 1 + i * 3 * SHA512_BLOCK_LENGTH, 3);
+		MEMCPY_BCOPY(ref[i], ctx.state, sizeof(ref[i]));
+		MEMCPY_BCOPY(test[i], sha512_initial_hash_value, sizeof(test[i]));
+		states[i] = test[i];
+		lane_data[i] = data + 1 + i * 3 * SHA512_BLOCK_LENGTH;
+	}
+	impl->blocks(states, lane_data, 3);
+	return memcmp(ref, test, impl->lanes * sizeof(ref[0])) == 0;
+}
+
+static const sha512_mb_impl* sha512_mb_select_impl(void) {
+	size_t i;
+	for (i = 0; i + 1 < SHA2_N_IMPLS(sha512_mb_impls); ++i) {
+		if (sha512_mb_impl_ok(&sha512_mb_impls[i])) {
+			return &sha512_mb_impls[i];
+		}
+	}
+	return &sha512_mb_impls[SHA2_N_IMPLS(sha512_mb_impls) - 1];
+}
+
+static const sha512_mb_impl* sha512_mb_get_curr_impl(void) {
+	const sha512_mb_impl* impl = sha512_mb_curr_impl;
+	if (impl == NULL) {
+		impl = sha512_mb_select_impl();
+		sha512_mb_curr_impl = impl;
+	}
+	return impl;
+}
+
+/*
+* Processes n_blocks[i] blocks of data[i] for each context. Lanes are
+* filled with the contexts that still have blocks left, as long as at least
+* two of them do. The rest is hashed one context at a time.
+*/
+static void sha512_mb_transform_blocks(SHA512_CTX** contexts, const sha2_byte** data, size_t* n_blocks, size_t n) {
+	const sha512_mb_impl* impl = sha512_mb_get_curr_impl();
+	sha2_word64 dummy_state[8];
+	sha2_word64* states[SHA512_MB_MAX_LANES];
+	const sha2_byte* lane_data[SHA512_MB_MAX_LANES];
+	size_t lane_idx[SHA512_MB_MAX_LANES];
+	size_t i, n_used, min_blocks;
+
+	while (impl->blocks != NULL) {
+		n_used = 0;
+		min_blocks = 0;
+		for (i = 0; i < n && n_used < impl->lanes; ++i) {
+			if (n_blocks[i] > 0) {
+				if (n_used == 0 || n_blocks[i] < min_blocks) {
+					min_blocks = n_blocks[i];
+				}
+				lane_idx[n_used++] = i;
+			}
+		}
+
+		if (n_used < 2) {
+			break;
+		}
+
+		for (i = 0; i < impl->lanes; ++i) {
+			if (i < n_used) {
+				states[i] = contexts[lane_idx[i]]->state;
+				lane_data[i] = data[lane_idx[i]];
+			}
+			else {
+				states[i] = dummy_state;
+				lane_data[i] = data[lane_idx[0]];
+			}
+		}
+
+		impl->blocks(states, lane_data, min_blocks);
+
+		for (i = 0; i < n_used; ++i) {
+			data[lane_idx[i]] += min_blocks * SHA512_BLOCK_LENGTH;
+			n_blocks[lane_idx[i]] -= min_blocks;
+		}
+	}
+
+	for (i = 0; i < n; ++i) {
+		if (n_blocks[i] > 0) {
+			sha512_transform_blocks(contexts[i], data[i], n_blocks[i]);
+			data[i] += n_blocks[i] * SHA512_BLOCK_LENGTH;
+			n_blocks[i] = 0;
+		}
+	}
+}
+
+static void sha512_mb_update(SHA512_CTX** contexts, const sha2_byte** data, const size_t* len, size_t n) {
+	const sha2_byte* lane_data[SHA512_MB_MAX_LANES];
+	size_t n_blocks[SHA512_MB_MAX_LANES];
+	size_t i, j, k, usedspace, freespace, remaining;
+
+	for (i = 0; i < n; i += SHA512_MB_MAX_LANES) {
+		k = n - i < SHA512_MB_MAX_LANES ? n - i : SHA512_MB_MAX_LANES;
+
+		for (j = 0; j < k; ++j) {
+			lane_data[j] = data[i + j];
+			remaining = len[i + j];
+
+			/* Complete a partially filled buffer first */
+			usedspace = (contexts[i + j]->bitcount[0] >> 3) % SHA512_BLOCK_LENGTH;
+			if (usedspace > 0) {
+				freespace = SHA512_BLOCK_LENGTH - usedspace;
+				if (freespace > remaining) {
+					freespace = remaining;
+				}
+				SHA512_Update(contexts[i + j], lane_data[j], freespace);
+				lane_data[j] += freespace;
+				remaining -= freespace;
+			}
+
+			n_blocks[j] = remaining / SHA512_BLOCK_LENGTH;
+			ADDINC128(contexts[i + j]->bitcount, (sha2_word64)(n_blocks[j] * SHA512_BLOCK_LENGTH) << 3);
+		}
+
+		sha512_mb_transform_blocks(contexts + i, lane_data, n_blocks, k);
+
+		/* Buffer the left-overs */
+		for (j = 0; j < k; ++j) {
+			remaining = data[i + j] + len[i + j] - lane_data[j];
+			SHA512_Update(contexts[i + j], lane_data[j], remaining);
+		}
+	}
+}
+
 void SHA512_Update(SHA512_CTX* context, const sha2_byte *data, size_t len) {
 	unsigned int	freespace, usedspace;
 
@@ -871,7 +1581,7 @@ void SHA512_Update(SHA512_CTX* context, const sha2_byte *data, size_t len) {
 			ADDINC128(context->bitcount, freespace << 3);
 			len -= freespace;
 			data += freespace;
-			SHA512_Transform(context, (sha2_word64*)context->buffer);
+			sha512_transform_blocks(context, context->buffer, 1);
 		}
 		else {
 			/* The buffer is not yet full */
@@ -882,12 +1592,13 @@ void SHA512_Update(SHA512_CTX* context, const sha2_byte *data, size_t len) {
 			return;
 		}
 	}
-	while (len >= SHA512_BLOCK_LENGTH) {
+	if (len >= SHA512_BLOCK_LENGTH) {
 		/* Process as many complete blocks as we can */
-		SHA512_Transform(context, (sha2_word64*)data);
-		ADDINC128(context->bitcount, SHA512_BLOCK_LENGTH << 3);
-		len -= SHA512_BLOCK_LENGTH;
-		data += SHA512_BLOCK_LENGTH;
+		size_t n_blocks = len / SHA512_BLOCK_LENGTH;
+		sha512_transform_blocks(context, data, n_blocks);
+		ADDINC128(context->bitcount, (sha2_word64)(n_blocks * SHA512_BLOCK_LENGTH) << 3);
+		len -= n_blocks * SHA512_BLOCK_LENGTH;
+		data += n_blocks * SHA512_BLOCK_LENGTH;
 	}
 	if (len > 0) {
 		/* There's left-overs, so save 'em */
@@ -920,7 +1631,7 @@ void SHA512_Last(SHA512_CTX* context) {
 				MEMSET_BZERO(&context->buffer[usedspace], SHA512_BLOCK_LENGTH - usedspace);
 			}
 			/* Do second-to-last transform: */
-			SHA512_Transform(context, (sha2_word64*)context->buffer);
+			sha512_transform_blocks(context, context->buffer, 1);
 
 			/* And set-up for the last transform: */
 			MEMSET_BZERO(context->buffer, SHA512_BLOCK_LENGTH - 2);
@@ -938,7 +1649,7 @@ void SHA512_Last(SHA512_CTX* context) {
 	*(sha2_word64*)&context->buffer[SHA512_SHORT_BLOCK_LENGTH + 8] = context->bitcount[0];
 
 	/* Final transform: */
-	SHA512_Transform(context, (sha2_word64*)context->buffer);
+	sha512_transform_blocks(context, context->buffer, 1);
 }
 
 void SHA512_Final(sha2_byte digest[], SHA512_CTX* context) {
@@ -1101,7 +1812,10 @@ void sha256_final(sha256_ctx *ctx, unsigned char *digest)
 void sha256(const unsigned char *message, unsigned int len,
 	unsigned char *digest)
 {
-	SHA256_Data(message, len, reinterpret_cast<char*>(digest));
+	SHA256_CTX ctx;
+	SHA256_Init(&ctx);
+	SHA256_Update(&ctx, message, len);
+	SHA256_Final(digest, &ctx);
 }
 
 void sha512_init(sha512_ctx *ctx)
@@ -1123,7 +1837,139 @@ void sha512_final(sha512_ctx *ctx, unsigned char *digest)
 void sha512(const unsigned char *message, unsigned int len,
 	unsigned char *digest)
 {
-	SHA512_Data(message, len, reinterpret_cast<char*>(digest));
+	SHA512_CTX ctx;
+	SHA512_Init(&ctx);
+	SHA512_Update(&ctx, message, len);
+	SHA512_Final(digest, &ctx);
+}
+
+void sha512_update_multi(sha512_ctx** ctxs, const unsigned char** messages,
+	const size_t* lens, size_t n)
+{
+	sha512_mb_update(ctxs, messages, lens, n);
+}
+
+std::vector<std::string> sha256_get_impls()
+{
+	std::vector<std::string> ret;
+	for (size_t i = 0; i < SHA2_N_IMPLS(sha256_impls); ++i)
+	{
+		if (sha256_impls[i].available())
+		{
+			ret.push_back(sha256_impls[i].name);
+		}
+	}
+	return ret;
+}
+
+std::vector<std::string> sha512_get_impls()
+{
+	std::vector<std::string> ret;
+	for (size_t i = 0; i < SHA2_N_IMPLS(sha512_impls); ++i)
+	{
+		if (sha512_impls[i].available())
+		{
+			ret.push_back(sha512_impls[i].name);
+		}
+	}
+	return ret;
+}
+
+std::string sha256_get_impl()
+{
+	if (sha256_curr_impl == NULL)
+	{
+		sha256_curr_impl = sha256_select_impl();
+	}
+	return sha256_curr_impl->name;
+}
+
+std::string sha512_get_impl()
+{
+	if (sha512_curr_impl == NULL)
+	{
+		sha512_curr_impl = sha512_select_impl();
+	}
+	return sha512_curr_impl->name;
+}
+
+bool sha256_set_impl(const std::string& name)
+{
+	for (size_t i = 0; i < SHA2_N_IMPLS(sha256_impls); ++i)
+	{
+		if (sha256_impls[i].name == name
+			&& sha256_impl_ok(&sha256_impls[i]))
+		{
+			sha256_curr_impl = &sha256_impls[i];
+			return true;
+		}
+	}
+	return false;
+}
+
+bool sha512_set_impl(const std::string& name)
+{
+	for (size_t i = 0; i < SHA2_N_IMPLS(sha512_impls); ++i)
+	{
+		if (sha512_impls[i].name == name
+			&& sha512_impl_ok(&sha512_impls[i]))
+		{
+			sha512_curr_impl = &sha512_impls[i];
+			return true;
+		}
+	}
+	return false;
+}
+
+std::vector<std::string> sha512_mb_get_impls()
+{
+	std::vector<std::string> ret;
+	for (size_t i = 0; i < SHA2_N_IMPLS(sha512_mb_impls); ++i)
+	{
+		if (sha512_mb_impls[i].available())
+		{
+			ret.push_back(sha512_mb_impls[i].name);
+		}
+	}
+	return ret;
+}
+
+std::string sha512_mb_get_impl()
+{
+	return sha512_mb_get_curr_impl()->name;
+}
+
+size_t sha512_mb_lanes()
+{
+	return sha512_mb_get_curr_impl()->lanes;
+}
+
+bool sha512_mb_set_impl(const std::string& name)
+{
+	for (size_t i = 0; i < SHA2_N_IMPLS(sha512_mb_impls); ++i)
+	{
+		if (sha512_mb_impls[i].name == name
+			&& sha512_mb_impl_ok(&sha512_mb_impls[i]))
+		{
+			sha512_mb_curr_impl = &sha512_mb_impls[i];
+			return true;
+		}
+	}
+	return false;
+}
+
+namespace
+{
+	//Select before other threads hash
+	struct SSha2SelectImpl
+	{
+		SSha2SelectImpl()
+		{
+			sha256_get_impl();
+			sha512_get_impl();
+			sha512_mb_get_impl();
+		}
+	} sha2_select_impl;
 }
 
 #else //!DO_NOT_USE_CRYPTOPP_SHA
@@ -1179,4 +2025,35 @@ void sha256(const unsigned char *message, unsigned int len, unsigned char *diges
 	sha256_final(&ctx, digest);
 }
 
+//Crypto++ selects its SHA-NI/ARMv8 code itself
+std::vector<std::string> sha256_get_impls()
+{
+	return std::vector<std::string>(1, "cryptopp");
+}
+
+std::vector<std::string> sha512_get_impls()
+{
+	return std::vector<std::string>(1, "cryptopp");
+}
+
+std::string sha256_get_impl()
+{
+	return "cryptopp";
+}
+
+std::string sha512_get_impl()
+{
+	return "cryptopp";
+}
+
+bool sha256_set_impl(const std::string& name)
+{
+	return name == "cryptopp";
+}
+
+bool sha512_set_impl(const std::string& name)
+{
+	return name == "cryptopp";
+}
+
 #endif //DO_NOT_USE_CRYPTOPP_SHA
\ No newline at end of file
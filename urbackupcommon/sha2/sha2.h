@@ -241,6 +241,13 @@ void sha512_final(sha512_ctx *ctx, unsigned char *digest);
 void sha512(const unsigned char *message, unsigned int len,
 	unsigned char *digest);
 
+#ifdef DO_NOT_USE_CRYPTOPP_SHA
+//Updates n independent contexts with one message each. Blocks of
+//different contexts are hashed together in SIMD lanes if the CPU can.
+void sha512_update_multi(sha512_ctx** ctxs, const unsigned char** messages,
+	const size_t* lens, size_t n);
+#endif
+
 
 typedef sha512_ctx sha_def_ctx;
 
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+//SHA-2 block function implementations usable on this CPU, fastest first.
+//The first one is selected automatically on first use.
+std::vector<std::string> sha256_get_impls();
+std::vector<std::string> sha512_get_impls();
+
+std::string sha256_get_impl();
+std::string sha512_get_impl();
+
+//Switches the implementation, e.g. for benchmarks. Not thread-safe.
+bool sha256_set_impl(const std::string& name);
+bool sha512_set_impl(const std::string& name);
+
+#ifdef DO_NOT_USE_CRYPTOPP_SHA
+//Multi-buffer SHA-512 implementations (see sha512_update_multi)
+std::vector<std::string> sha512_mb_get_impls();
+std::string sha512_mb_get_impl();
+bool sha512_mb_set_impl(const std::string& name);
+
+//Number of messages hashed at once by the current implementation
+size_t sha512_mb_lanes();
+#endif
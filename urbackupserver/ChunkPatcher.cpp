@@ -17,11 +17,13 @@
 **************************************************************************/
 
 #include "ChunkPatcher.h"
+#include "FilePrefetcher.h"
 #include "../stringtools.h"
 #include <assert.h>
 #include "../urbackupcommon/ExtentIterator.h"
 #include <memory.h>
 #include <limits.h>
+#include <memory>
 
 #define VLOG(x)
 
@@ -54,9 +56,10 @@ namespace
 
 
 const int64 sparse_blocksize = 512*1024;
+const size_t prefetch_blocksize = 2*1024*1024;
 
 ChunkPatcher::ChunkPatcher(void)
-	: cb(NULL), require_unchanged(true), with_sparse(false),
+	: cb(NULL), require_unchanged(true), with_sparse(false), prefetch_size(0),
 	unchanged_align(0), unchanged_align_start(-1), unchanged_align_end(-1), unchanged_align_end_next(-1), last_unchanged(false)
 {
 }
@@ -98,6 +101,14 @@ bool ChunkPatcher::ApplyPatch(IFile *file, IFile *patch, ExtentIterator* extent_
 		sparse_buf.resize(sparse_blocksize);
 	}
 
+	std::auto_ptr<FilePrefetcher> prefetcher;
+	if (prefetch_size > 0
+		&& require_unchanged
+		&& file->Size() > buffer_size)
+	{
+		prefetcher.reset(new FilePrefetcher(file, prefetch_blocksize, prefetch_size / prefetch_blocksize));
+	}
+
 	IFsFile::SSparseExtent curr_sparse_extent;
 	if (extent_iterator != NULL)
 	{
@@ -306,7 +317,16 @@ bool ChunkPatcher::ApplyPatch(IFile *file, IFile *patch, ExtentIterator* extent_
 				if(curr_require_unchaged)
 				{
 					bool has_read_error = false;
-					_u32 r=file->Read(buf.data(), tr, &has_read_error);
+					const char* data = buf.data();
+					_u32 r;
+					if (prefetcher.get() != NULL)
+					{
+						data = prefetcher->get(file_pos, tr, r, has_read_error);
+					}
+					else
+					{
+						r = file->Read(buf.data(), tr, &has_read_error);
+					}
 
 					if (has_read_error)
 					{
@@ -318,12 +338,12 @@ bool ChunkPatcher::ApplyPatch(IFile *file, IFile *patch, ExtentIterator* extent_
 					
 					if (with_sparse)
 					{
-						nextChunkPatcherBytes(file_pos, buf.data(), r, false, false);
+						nextChunkPatcherBytes(file_pos, data, r, false, false);
 					}
 					else
 					{
 						assert(cb->chunk_patcher_pos() < 0 || cb->chunk_patcher_pos() == file_pos);
-						cb->next_chunk_patcher_bytes(buf.data(), r, false);
+						cb->next_chunk_patcher_bytes(data, r, false);
 					}
 					
 					file_pos += r;
@@ -586,3 +606,19 @@ void ChunkPatcher::setWithSparse(bool b)
 {
 	with_sparse = b;
 }
+
+void ChunkPatcher::setPrefetchSize(size_t s)
+{
+	prefetch_size = s;
+}
+
+size_t ChunkPatcher::get_default_prefetch_size()
+{
+	std::string size = Server->getServerParameter("patch_prefetch_size");
+	if (!size.empty())
+	{
+		return static_cast<size_t>(watoi64(size));
+	}
+
+	return 16*1024*1024;
+}
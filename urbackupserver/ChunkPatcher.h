@@ -28,9 +28,13 @@ public:
 	void setRequireUnchanged(bool b);
 	void setUnchangedAlign(int64 a);
 	void setWithSparse(bool b);
+	//Read the unchanged data of the original file ahead with this many bytes of buffers (0 to disable)
+	void setPrefetchSize(size_t s);
 	bool ApplyPatch(IFile *file, IFile *patch, ExtentIterator* extent_iterator);
 	_i64 getFilesize(void);
 
+	static size_t get_default_prefetch_size();
+
 private:
 	bool readNextValidPatch(IFile *patchf, _i64 &patchf_pos, SPatchHeader *patch_header, bool& has_read_error);
 	void nextChunkPatcherBytes(int64 pos, const char *buf, size_t bsize, bool changed, bool sparse);
@@ -41,6 +45,7 @@ private:
 	IChunkPatcherCallback *cb;
 	bool require_unchanged;
 	bool with_sparse;
+	size_t prefetch_size;
 
 	int64 last_sparse_start;
 	bool curr_only_zeros;
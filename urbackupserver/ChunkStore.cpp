@@ -0,0 +1,969 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "ChunkStore.h"
+#include "ExtentCopy.h"
+#include "../Interface/Server.h"
+#include "../Interface/File.h"
+#include "../Interface/Mutex.h"
+#include "../stringtools.h"
+#include "../urbackupcommon/os_functions.h"
+#include "../urbackupcommon/sha2/sha2.h"
+#include "../fileservplugin/chunk_settings.h"
+#ifdef NO_EMBEDDED_LMDB
+#include <lmdb.h>
+#else
+#include "lmdb/lmdb.h"
+#endif
+#include <memory>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <string.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <errno.h>
+#endif
+
+namespace
+{
+	const char* c_chunk_db_fn = "urbackup/fileindex/backup_server_chunks.lmdb";
+	const char* c_container_dir = "urbackup_chunks";
+	const size_t c_initial_chunk_map_size = 64 * 1024 * 1024;
+	const int64 c_default_min_filesize = 64 * 1024 * 1024;
+	const int64 c_container_size = 1024 * 1024 * 1024;
+
+	//Chunks are between 64KB and 1MB, on average ~320KB
+	const int64 c_chunk_min_blocks = 16;
+	const int64 c_chunk_max_blocks = 256;
+	const unsigned int c_chunk_avg_bits = 6;
+
+	const char c_container_pos_key = 'c';
+
+	const size_t c_file_key_size = sizeof(_u32) + SHA256_DIGEST_SIZE;
+
+#pragma pack(1)
+	struct SChunkPos
+	{
+		int64 container;
+		int64 offset;
+		int64 size;
+		int64 refcount;
+	};
+
+	struct SContainerPos
+	{
+		int64 container;
+		int64 offset;
+	};
+#pragma pack()
+
+	struct SChunk
+	{
+		unsigned char hash[SHA256_DIGEST_SIZE];
+		int64 offset;
+		int64 size;
+	};
+
+	IMutex* mutex = NULL;
+	MDB_env* env = NULL;
+	MDB_dbi chunks_dbi;
+	MDB_dbi files_dbi;
+	size_t map_size = c_initial_chunk_map_size;
+	bool env_error = false;
+	bool range_sharing_unsupported = false;
+
+#ifdef __linux__
+	struct SDedupeRangeHeader
+	{
+		uint64 src_offset;
+		uint64 src_length;
+		_u16 dest_count;
+		_u16 reserved1;
+		_u32 reserved2;
+	};
+
+	struct SDedupeRangeInfo
+	{
+		int64 dest_fd;
+		uint64 dest_offset;
+		uint64 bytes_deduped;
+		int status;
+		_u32 reserved;
+	};
+
+	struct SDedupeRange
+	{
+		SDedupeRangeHeader header;
+		SDedupeRangeInfo info;
+	};
+
+#define CHUNK_IOC_DEDUPE_RANGE _IOWR(0x94, 54, SDedupeRangeHeader)
+#endif
+
+	//Makes the range of dst reference the data of the range of src if both have the same content
+	bool dedupe_range(IFsFile* src, int64 src_offset, IFsFile* dst, int64 dst_offset, int64 size)
+	{
+#ifdef __linux__
+		SDedupeRange args;
+		memset(&args, 0, sizeof(args));
+		args.header.src_offset = src_offset;
+		args.header.src_length = size;
+		args.header.dest_count = 1;
+		args.info.dest_fd = dst->getOsHandle();
+		args.info.dest_offset = dst_offset;
+
+		if (ioctl(src->getOsHandle(), CHUNK_IOC_DEDUPE_RANGE, &args) != 0)
+		{
+			Server->Log("Deduplicating range of \"" + src->getFilename() + "\" to \"" + dst->getFilename() + "\" failed. errno=" + convert(errno), LL_DEBUG);
+			return false;
+		}
+
+		//Status is zero if the ranges were the same
+		return args.info.status == 0
+			&& static_cast<int64>(args.info.bytes_deduped) == size;
+#else
+		return false;
+#endif
+	}
+
+	void sha256_digest(const char* data, size_t size, unsigned char* digest)
+	{
+		sha256_ctx ctx;
+		sha256_init(&ctx);
+		sha256_update(&ctx, reinterpret_cast<const unsigned char*>(data), static_cast<unsigned int>(size));
+		sha256_final(&ctx, digest);
+	}
+
+	std::string container_fn(const std::string& backupfolder, int64 container)
+	{
+		return backupfolder + os_file_sep() + c_container_dir + os_file_sep() + convert(container) + ".chunks";
+	}
+
+	std::string file_key(int backupid, const std::string& fn)
+	{
+		std::string ret;
+		ret.resize(c_file_key_size);
+		_u32 bbackupid = big_endian(static_cast<_u32>(backupid));
+		memcpy(&ret[0], &bbackupid, sizeof(bbackupid));
+		sha256_digest(fn.data(), fn.size(), reinterpret_cast<unsigned char*>(&ret[sizeof(bbackupid)]));
+		return ret;
+	}
+
+	bool open_env()
+	{
+		if (env != NULL)
+		{
+			return true;
+		}
+
+		if (env_error)
+		{
+			return false;
+		}
+
+		env_error = true;
+
+		int rc = mdb_env_create(&env);
+		if (rc)
+		{
+			Server->Log("LMDB: Failed to create chunk store env (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+			env = NULL;
+			return false;
+		}
+
+		{
+			std::auto_ptr<IFile> lmdb_f(Server->openFile(c_chunk_db_fn, MODE_READ));
+			if (lmdb_f.get() != NULL)
+			{
+				while (lmdb_f->Size() > static_cast<_i64>(map_size))
+				{
+					map_size *= 2;
+				}
+			}
+		}
+
+		mdb_env_set_maxdbs(env, 2);
+
+		rc = mdb_env_set_mapsize(env, map_size);
+		if (rc)
+		{
+			Server->Log("LMDB: Failed to set chunk store map size (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+			mdb_env_close(env);
+			env = NULL;
+			return false;
+		}
+
+		os_create_dir("urbackup/fileindex");
+
+		rc = mdb_env_open(env, c_chunk_db_fn, MDB_NOSUBDIR | MDB_NOMETASYNC, 0664);
+		if (rc)
+		{
+			Server->Log("LMDB: Failed to open chunk store database file (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+			mdb_env_close(env);
+			env = NULL;
+			return false;
+		}
+
+		MDB_txn* txn;
+		rc = mdb_txn_begin(env, NULL, 0, &txn);
+		if (rc)
+		{
+			Server->Log("LMDB: Failed to open transaction for chunk store dbi open (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+			mdb_env_close(env);
+			env = NULL;
+			return false;
+		}
+
+		rc = mdb_dbi_open(txn, "chunks", MDB_CREATE, &chunks_dbi);
+		if (!rc)
+		{
+			rc = mdb_dbi_open(txn, "files", MDB_CREATE, &files_dbi);
+		}
+
+		if (!rc)
+		{
+			rc = mdb_txn_commit(txn);
+		}
+		else
+		{
+			mdb_txn_abort(txn);
+		}
+
+		if (rc)
+		{
+			Server->Log("LMDB: Failed to open chunk store databases (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+			mdb_env_close(env);
+			env = NULL;
+			return false;
+		}
+
+		env_error = false;
+		return true;
+	}
+
+	//Grows the map before a write transaction, so it does not need to be repeated
+	//after the chunks were already cloned into the containers
+	bool ensure_map_size(size_t write_size)
+	{
+		MDB_envinfo info;
+		MDB_stat stat;
+		int rc = mdb_env_info(env, &info);
+		if (!rc)
+		{
+			rc = mdb_env_stat(env, &stat);
+		}
+
+		if (rc)
+		{
+			Server->Log("LMDB: Failed to get chunk store info (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+			return false;
+		}
+
+		size_t used = (info.me_last_pgno + 1)*stat.ms_psize;
+		size_t new_map_size = map_size;
+		while (used + 4 * write_size + 1024 * 1024 > new_map_size / 2)
+		{
+			new_map_size *= 2;
+		}
+
+		if (new_map_size != map_size)
+		{
+			rc = mdb_env_set_mapsize(env, new_map_size);
+			if (rc)
+			{
+				Server->Log("LMDB: Failed to increase chunk store map size (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+				return false;
+			}
+
+			map_size = new_map_size;
+			Server->Log("Increased chunk store database size to " + PrettyPrintBytes(map_size), LL_DEBUG);
+		}
+
+		return true;
+	}
+
+	//Cuts the file after a block whose small hash matches, within the chunk size limits.
+	//The last chunk is skipped if it is not block aligned, because it cannot be shared.
+	bool get_chunks(IFile* f, IFile* hash_f, int64 filesize, std::vector<SChunk>& chunks)
+	{
+		int64 hashfilesize;
+		if (hash_f->Read(0, reinterpret_cast<char*>(&hashfilesize), sizeof(hashfilesize)) != sizeof(hashfilesize)
+			|| little_endian(hashfilesize) != filesize)
+		{
+			return false;
+		}
+
+		std::vector<char> buf(static_cast<size_t>(c_chunk_max_blocks*c_small_hash_dist));
+		std::vector<char> hash_data(chunkhash_single_size);
+
+		int64 n_blocks = (filesize + c_small_hash_dist - 1) / c_small_hash_dist;
+		int64 chunk_blocks = 0;
+		int64 chunk_start = 0;
+		int64 loaded_checkpoint = -1;
+		for (int64 block = 0; block < n_blocks; ++block)
+		{
+			int64 checkpoint = block*c_small_hash_dist / c_checkpoint_dist;
+			if (checkpoint != loaded_checkpoint)
+			{
+				int64 checkpoint_size = (std::min)(c_checkpoint_dist, filesize - checkpoint*c_checkpoint_dist);
+				_u32 hash_size = static_cast<_u32>(big_hash_size
+					+ small_hash_size*((checkpoint_size + c_small_hash_dist - 1) / c_small_hash_dist));
+				if (hash_f->Read(chunkhash_file_off + checkpoint*chunkhash_single_size, hash_data.data(),
+					hash_size) != hash_size)
+				{
+					return false;
+				}
+				loaded_checkpoint = checkpoint;
+			}
+
+			_u32 small_hash;
+			memcpy(&small_hash, &hash_data[big_hash_size + (block % (c_checkpoint_dist / c_small_hash_dist))*small_hash_size], sizeof(small_hash));
+			small_hash = little_endian(small_hash);
+
+			++chunk_blocks;
+
+			if (chunk_blocks < c_chunk_max_blocks
+				&& block + 1 < n_blocks
+				&& (chunk_blocks < c_chunk_min_blocks
+					|| ((small_hash * 0x9E3779B1U) >> (32 - c_chunk_avg_bits)) != 0))
+			{
+				continue;
+			}
+
+			SChunk chunk;
+			chunk.offset = chunk_start;
+			chunk.size = (std::min)(chunk_blocks*c_small_hash_dist, filesize - chunk_start);
+			chunk_start += chunk.size;
+			chunk_blocks = 0;
+
+			if (chunk.size%c_small_hash_dist != 0)
+			{
+				continue;
+			}
+
+			_u32 size = static_cast<_u32>(chunk.size);
+			bool has_read_error = false;
+			if (f->Read(chunk.offset, buf.data(), size, &has_read_error) != size
+				|| has_read_error)
+			{
+				return false;
+			}
+
+			sha256_digest(buf.data(), size, chunk.hash);
+			chunks.push_back(chunk);
+		}
+
+		return true;
+	}
+
+	bool get_container_pos(MDB_txn* txn, SContainerPos& pos)
+	{
+		MDB_val key;
+		key.mv_data = const_cast<char*>(&c_container_pos_key);
+		key.mv_size = sizeof(c_container_pos_key);
+
+		MDB_val value;
+		int rc = mdb_get(txn, chunks_dbi, &key, &value);
+		if (rc == MDB_NOTFOUND)
+		{
+			pos.container = 0;
+			pos.offset = 0;
+			return true;
+		}
+		else if (rc || value.mv_size != sizeof(SContainerPos))
+		{
+			Server->Log("LMDB: Failed to read chunk container position", LL_ERROR);
+			return false;
+		}
+
+		memcpy(&pos, value.mv_data, sizeof(pos));
+		return true;
+	}
+
+	//Decrements the reference count of the chunks in the chunk list and removes
+	//unreferenced chunks. Their container ranges are returned in to_punch.
+	bool unref_chunks(MDB_txn* txn, const MDB_val& chunk_list, std::vector<SChunkPos>& to_punch)
+	{
+		for (size_t i = 0; i + SHA256_DIGEST_SIZE <= chunk_list.mv_size; i += SHA256_DIGEST_SIZE)
+		{
+			MDB_val key;
+			key.mv_data = static_cast<char*>(chunk_list.mv_data) + i;
+			key.mv_size = SHA256_DIGEST_SIZE;
+
+			MDB_val value;
+			int rc = mdb_get(txn, chunks_dbi, &key, &value);
+			if (rc == MDB_NOTFOUND)
+			{
+				continue;
+			}
+			else if (rc || value.mv_size != sizeof(SChunkPos))
+			{
+				Server->Log("LMDB: Failed to read chunk (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+				return false;
+			}
+
+			SChunkPos chunk_pos;
+			memcpy(&chunk_pos, value.mv_data, sizeof(chunk_pos));
+
+			--chunk_pos.refcount;
+
+			if (chunk_pos.refcount <= 0)
+			{
+				rc = mdb_del(txn, chunks_dbi, &key, NULL);
+				to_punch.push_back(chunk_pos);
+			}
+			else
+			{
+				value.mv_data = &chunk_pos;
+				value.mv_size = sizeof(chunk_pos);
+				rc = mdb_put(txn, chunks_dbi, &key, &value, 0);
+			}
+
+			if (rc)
+			{
+				Server->Log("LMDB: Failed to update chunk (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	void punch_chunks(const std::string& backupfolder, std::vector<SChunkPos>& to_punch)
+	{
+		std::map<int64, IFsFile*> containers;
+		for (size_t i = 0; i < to_punch.size(); ++i)
+		{
+			IFsFile*& container = containers[to_punch[i].container];
+			if (container == NULL)
+			{
+				container = Server->openFile(os_file_prefix(container_fn(backupfolder, to_punch[i].container)), MODE_RW);
+			}
+
+			if (container == NULL
+				|| !container->PunchHole(to_punch[i].offset, to_punch[i].size))
+			{
+				Server->Log("Error freeing chunk in container " + convert(to_punch[i].container) + " at offset " + convert(to_punch[i].offset), LL_WARNING);
+			}
+		}
+
+		for (std::map<int64, IFsFile*>::iterator it = containers.begin(); it != containers.end(); ++it)
+		{
+			Server->destroy(it->second);
+		}
+	}
+}
+
+void ChunkStore::init_mutex()
+{
+	mutex = Server->createMutex();
+}
+
+bool ChunkStore::is_enabled()
+{
+	return Server->getServerParameter("chunk_store") == "true";
+}
+
+int64 ChunkStore::get_min_filesize()
+{
+	std::string min_filesize = Server->getServerParameter("chunk_store_min_size");
+	if (min_filesize.empty())
+	{
+		return c_default_min_filesize;
+	}
+	return watoi64(min_filesize);
+}
+
+bool ChunkStore::dedup_file(const std::string& backupfolder, int backupid, const std::string& fn,
+	const std::string& hash_fn, int64 filesize, int64& shared_bytes)
+{
+	shared_bytes = 0;
+
+	if (range_sharing_unsupported)
+	{
+		return false;
+	}
+
+	std::auto_ptr<IFsFile> f(Server->openFile(os_file_prefix(fn), MODE_RW));
+	std::auto_ptr<IFile> hash_f(Server->openFile(os_file_prefix(hash_fn), MODE_READ));
+	if (f.get() == NULL || hash_f.get() == NULL)
+	{
+		Server->Log("Error opening \"" + fn + "\" or its hash file for chunk store", LL_ERROR);
+		return false;
+	}
+
+	std::vector<SChunk> chunks;
+	if (!get_chunks(f.get(), hash_f.get(), filesize, chunks))
+	{
+		Server->Log("Hash file \"" + hash_fn + "\" has no chunk hashes. Not adding file to chunk store.", LL_DEBUG);
+		return false;
+	}
+
+	if (chunks.empty())
+	{
+		return true;
+	}
+
+	std::string file_key_data = file_key(backupid, fn);
+
+	std::vector<SChunkPos> positions(chunks.size());
+	std::vector<size_t> new_chunks;
+	std::vector<size_t> existing_chunks;
+	std::vector<SChunkPos> to_punch;
+
+	//Reserves container ranges for the chunks which are not in the index. Only the
+	//container position is committed. The chunks are added to the index after they
+	//were copied to the containers, so the lock is not held while copying
+	{
+		IScopedLock lock(mutex);
+
+		if (!open_env()
+			|| !ensure_map_size(sizeof(SContainerPos)))
+		{
+			return false;
+		}
+
+		MDB_txn* txn;
+		int rc = mdb_txn_begin(env, NULL, 0, &txn);
+		if (rc)
+		{
+			Server->Log("LMDB: Failed to begin chunk store transaction (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+			return false;
+		}
+
+		SContainerPos pos;
+		bool ok = get_container_pos(txn, pos);
+
+		std::set<std::string> reserved_hashes;
+		for (size_t i = 0; ok && i < chunks.size(); ++i)
+		{
+			MDB_val key;
+			key.mv_data = chunks[i].hash;
+			key.mv_size = SHA256_DIGEST_SIZE;
+
+			MDB_val value;
+			rc = mdb_get(txn, chunks_dbi, &key, &value);
+			if (rc == MDB_NOTFOUND)
+			{
+				//Same chunk occurs multiple times in the file
+				if (!reserved_hashes.insert(std::string(reinterpret_cast<char*>(chunks[i].hash), SHA256_DIGEST_SIZE)).second)
+				{
+					continue;
+				}
+
+				if (pos.offset + chunks[i].size > c_container_size)
+				{
+					++pos.container;
+					pos.offset = 0;
+				}
+
+				positions[i].container = pos.container;
+				positions[i].offset = pos.offset;
+				positions[i].size = chunks[i].size;
+				positions[i].refcount = 1;
+				pos.offset += chunks[i].size;
+				new_chunks.push_back(i);
+			}
+			else if (rc)
+			{
+				Server->Log("LMDB: Failed to read chunk (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+				ok = false;
+			}
+		}
+
+		if (ok && !new_chunks.empty())
+		{
+			MDB_val key;
+			key.mv_data = const_cast<char*>(&c_container_pos_key);
+			key.mv_size = sizeof(c_container_pos_key);
+			MDB_val value;
+			value.mv_data = &pos;
+			value.mv_size = sizeof(pos);
+			rc = mdb_put(txn, chunks_dbi, &key, &value, 0);
+			if (rc)
+			{
+				Server->Log("LMDB: Failed to put chunk container position (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+				ok = false;
+			}
+		}
+
+		if (!ok || new_chunks.empty())
+		{
+			mdb_txn_abort(txn);
+		}
+		else
+		{
+			rc = mdb_txn_commit(txn);
+			if (rc)
+			{
+				Server->Log("LMDB: Failed to commit chunk store transaction (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+				ok = false;
+			}
+		}
+
+		if (!ok)
+		{
+			return false;
+		}
+	}
+
+	std::vector<SChunkPos> reserved;
+	for (size_t i = 0; i < new_chunks.size(); ++i)
+	{
+		reserved.push_back(positions[new_chunks[i]]);
+	}
+
+	//New chunks have to be in the containers before they are visible in the index
+	bool ok = true;
+	{
+		std::map<int64, IFsFile*> containers;
+		if (!new_chunks.empty())
+		{
+			os_create_dir(os_file_prefix(backupfolder + os_file_sep() + c_container_dir));
+		}
+
+		for (size_t i = 0; ok && i < new_chunks.size(); ++i)
+		{
+			const SChunk& chunk = chunks[new_chunks[i]];
+			const SChunkPos& chunk_pos = positions[new_chunks[i]];
+
+			IFsFile*& container = containers[chunk_pos.container];
+			if (container == NULL)
+			{
+				container = Server->openFile(os_file_prefix(container_fn(backupfolder, chunk_pos.container)), MODE_RW_CREATE);
+				if (container == NULL)
+				{
+					Server->Log("Error opening chunk container \"" + container_fn(backupfolder, chunk_pos.container) + "\". " + os_last_error_str(), LL_ERROR);
+					ok = false;
+					break;
+				}
+			}
+
+			bool unsupported;
+			if (!ExtentCopy::clone_range(f.get(), chunk.offset, container, chunk_pos.offset, chunk.size, unsupported))
+			{
+				if (unsupported)
+				{
+					Server->Log("File system of backup folder does not support sharing file ranges. Disabling chunk store.", LL_WARNING);
+					range_sharing_unsupported = true;
+				}
+				else
+				{
+					Server->Log("Error adding chunk to container \"" + container->getFilename() + "\"", LL_ERROR);
+				}
+				ok = false;
+			}
+		}
+
+		for (std::map<int64, IFsFile*>::iterator it = containers.begin(); it != containers.end(); ++it)
+		{
+			if (it->second == NULL)
+			{
+				continue;
+			}
+			if (ok && !it->second->Sync())
+			{
+				Server->Log("Error syncing chunk container \"" + it->second->getFilename() + "\"", LL_ERROR);
+				ok = false;
+			}
+			Server->destroy(it->second);
+		}
+	}
+
+	if (!ok)
+	{
+		punch_chunks(backupfolder, reserved);
+		return false;
+	}
+
+	//Adds the chunks to the index. Another file may have added the same new chunks
+	//in the meantime, or chunks which were in the index may have been removed
+	std::string chunk_list;
+	{
+		IScopedLock lock(mutex);
+
+		if (!open_env()
+			|| !ensure_map_size(chunks.size()*(SHA256_DIGEST_SIZE + sizeof(SChunkPos))))
+		{
+			ok = false;
+		}
+
+		MDB_txn* txn = NULL;
+		int rc = 0;
+		if (ok)
+		{
+			rc = mdb_txn_begin(env, NULL, 0, &txn);
+			if (rc)
+			{
+				Server->Log("LMDB: Failed to begin chunk store transaction (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+				ok = false;
+			}
+		}
+
+		if (!ok)
+		{
+			lock.relock(NULL);
+			punch_chunks(backupfolder, reserved);
+			return false;
+		}
+
+		MDB_val file_key_val;
+		file_key_val.mv_data = &file_key_data[0];
+		file_key_val.mv_size = file_key_data.size();
+
+		//The same file was added to the backup before
+		MDB_val old_chunk_list;
+		rc = mdb_get(txn, files_dbi, &file_key_val, &old_chunk_list);
+		ok = (rc == 0 || rc == MDB_NOTFOUND);
+		if (rc == 0)
+		{
+			ok = unref_chunks(txn, old_chunk_list, to_punch);
+		}
+
+		std::vector<SChunkPos> unused;
+		size_t next_new = 0;
+		for (size_t i = 0; ok && i < chunks.size(); ++i)
+		{
+			bool is_new = next_new < new_chunks.size() && new_chunks[next_new] == i;
+			if (is_new)
+			{
+				++next_new;
+			}
+
+			MDB_val key;
+			key.mv_data = chunks[i].hash;
+			key.mv_size = SHA256_DIGEST_SIZE;
+
+			MDB_val value;
+			rc = mdb_get(txn, chunks_dbi, &key, &value);
+			if (rc == 0 && value.mv_size == sizeof(SChunkPos))
+			{
+				if (is_new)
+				{
+					unused.push_back(positions[i]);
+				}
+				memcpy(&positions[i], value.mv_data, sizeof(SChunkPos));
+				++positions[i].refcount;
+				existing_chunks.push_back(i);
+			}
+			else if (rc == MDB_NOTFOUND)
+			{
+				if (!is_new)
+				{
+					//Was removed in the meantime. Not in the containers
+					continue;
+				}
+			}
+			else
+			{
+				Server->Log("LMDB: Failed to read chunk (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+				ok = false;
+				break;
+			}
+
+			value.mv_data = &positions[i];
+			value.mv_size = sizeof(SChunkPos);
+			rc = mdb_put(txn, chunks_dbi, &key, &value, 0);
+			if (rc)
+			{
+				Server->Log("LMDB: Failed to put chunk (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+				ok = false;
+			}
+
+			chunk_list.append(reinterpret_cast<char*>(chunks[i].hash), SHA256_DIGEST_SIZE);
+		}
+
+		if (ok)
+		{
+			if (!chunk_list.empty())
+			{
+				MDB_val value;
+				value.mv_data = &chunk_list[0];
+				value.mv_size = chunk_list.size();
+				rc = mdb_put(txn, files_dbi, &file_key_val, &value, 0);
+			}
+			else
+			{
+				rc = mdb_del(txn, files_dbi, &file_key_val, NULL);
+				if (rc == MDB_NOTFOUND)
+				{
+					rc = 0;
+				}
+			}
+
+			if (rc)
+			{
+				Server->Log("LMDB: Failed to put chunk list (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+				ok = false;
+			}
+		}
+
+		if (ok)
+		{
+			rc = mdb_txn_commit(txn);
+			if (rc)
+			{
+				Server->Log("LMDB: Failed to commit chunk store transaction (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+				ok = false;
+			}
+		}
+		else
+		{
+			mdb_txn_abort(txn);
+		}
+
+		if (!ok)
+		{
+			lock.relock(NULL);
+			punch_chunks(backupfolder, reserved);
+			return false;
+		}
+
+		to_punch.insert(to_punch.end(), unused.begin(), unused.end());
+	}
+
+	//Only shares ranges with the same content, so a chunk which was freed in the meantime is skipped
+	std::map<int64, IFsFile*> containers;
+	for (size_t i = 0; i < existing_chunks.size(); ++i)
+	{
+		const SChunk& chunk = chunks[existing_chunks[i]];
+		const SChunkPos& chunk_pos = positions[existing_chunks[i]];
+
+		IFsFile*& container = containers[chunk_pos.container];
+		if (container == NULL)
+		{
+			container = Server->openFile(os_file_prefix(container_fn(backupfolder, chunk_pos.container)), MODE_READ);
+			if (container == NULL)
+			{
+				continue;
+			}
+		}
+
+		if (dedupe_range(container, chunk_pos.offset, f.get(), chunk.offset, chunk.size))
+		{
+			shared_bytes += chunk.size;
+		}
+	}
+
+	for (std::map<int64, IFsFile*>::iterator it = containers.begin(); it != containers.end(); ++it)
+	{
+		Server->destroy(it->second);
+	}
+
+	punch_chunks(backupfolder, to_punch);
+
+	return true;
+}
+
+bool ChunkStore::remove_backup(const std::string& backupfolder, int backupid)
+{
+	if (!is_enabled()
+		&& !FileExists(c_chunk_db_fn))
+	{
+		return true;
+	}
+
+	std::vector<SChunkPos> to_punch;
+
+	{
+		IScopedLock lock(mutex);
+
+		if (!open_env()
+			|| !ensure_map_size(0))
+		{
+			return false;
+		}
+
+		MDB_txn* txn;
+		int rc = mdb_txn_begin(env, NULL, 0, &txn);
+		if (rc)
+		{
+			Server->Log("LMDB: Failed to begin chunk store transaction (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+			return false;
+		}
+
+		MDB_cursor* cursor;
+		rc = mdb_cursor_open(txn, files_dbi, &cursor);
+		if (rc)
+		{
+			Server->Log("LMDB: Failed to open chunk store cursor (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+			mdb_txn_abort(txn);
+			return false;
+		}
+
+		_u32 bbackupid = big_endian(static_cast<_u32>(backupid));
+
+		MDB_val key;
+		key.mv_data = &bbackupid;
+		key.mv_size = sizeof(bbackupid);
+		MDB_val value;
+
+		bool ok = true;
+		rc = mdb_cursor_get(cursor, &key, &value, MDB_SET_RANGE);
+		while (rc == 0
+			&& key.mv_size == c_file_key_size
+			&& memcmp(key.mv_data, &bbackupid, sizeof(bbackupid)) == 0)
+		{
+			if (!unref_chunks(txn, value, to_punch))
+			{
+				ok = false;
+				break;
+			}
+
+			rc = mdb_cursor_del(cursor, 0);
+			if (rc)
+			{
+				break;
+			}
+
+			rc = mdb_cursor_get(cursor, &key, &value, MDB_NEXT);
+		}
+
+		if (rc && rc != MDB_NOTFOUND)
+		{
+			Server->Log("LMDB: Failed to remove chunk lists of backup (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+			ok = false;
+		}
+
+		mdb_cursor_close(cursor);
+
+		if (!ok)
+		{
+			mdb_txn_abort(txn);
+			return false;
+		}
+
+		rc = mdb_txn_commit(txn);
+		if (rc)
+		{
+			Server->Log("LMDB: Failed to commit chunk store transaction (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+			return false;
+		}
+	}
+
+	if (!to_punch.empty())
+	{
+		Server->Log("Freeing " + convert(to_punch.size()) + " unreferenced chunks of backup " + convert(backupid), LL_DEBUG);
+	}
+
+	punch_chunks(backupfolder, to_punch);
+
+	return true;
+}
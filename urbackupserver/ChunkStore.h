@@ -0,0 +1,29 @@
+#pragma once
+
+#include "../Interface/Types.h"
+#include <string>
+
+//Optional store for the chunks of large files, shared between all clients.
+//Files are split at content-defined boundaries, which are derived from the
+//small block hashes in their hash file. Each unique chunk is kept once in a
+//packed container file in the backup folder and indexed by its SHA256 in a
+//separate LMDB database next to the file entry index.
+//Backup files share the extents of the chunks with the containers via the
+//file system (range reflinks), so they can still be read as normal files.
+class ChunkStore
+{
+public:
+	static void init_mutex();
+
+	static bool is_enabled();
+
+	static int64 get_min_filesize();
+
+	//Shares the chunks of the stored backup file fn with the chunk store.
+	//shared_bytes is set to the number of bytes which were already stored.
+	static bool dedup_file(const std::string& backupfolder, int backupid, const std::string& fn,
+		const std::string& hash_fn, int64 filesize, int64& shared_bytes);
+
+	//Releases the chunks of all files of a file backup
+	static bool remove_backup(const std::string& backupfolder, int backupid);
+};
@@ -1631,6 +1631,11 @@ bool ClientMain::updateCapabilities(bool* needs_restart)
 		{
 			protocol_versions.async_index_version = watoi(it->second);
 		}
+		it = params.find("BIN_FILELIST");
+		if (it != params.end())
+		{
+			protocol_versions.bin_filelist_version = watoi(it->second);
+		}
 		it = params.find("SYMBIT");
 		if (it != params.end())
 		{
@@ -49,7 +49,7 @@ struct SProtocolVersions
 				symbit_version(0), phash_version(0),
 				wtokens_version(0), update_vols(0),
 				update_capa_interval(0), require_previous_cbitmap(0),
-				async_index_version(0)
+				async_index_version(0), bin_filelist_version(0)
 			{
 
 			}
@@ -68,6 +68,7 @@ struct SProtocolVersions
 	int cmd_version;
 	int require_previous_cbitmap;
 	int async_index_version;
+	int bin_filelist_version;
 	int symbit_version;
 	int phash_version;
 	int wtokens_version;
@@ -0,0 +1,864 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "CompactFileIndex.h"
+#include "../Interface/Server.h"
+#include "../stringtools.h"
+#include "../urbackupcommon/os_functions.h"
+#include "create_files_index.h"
+#include <string.h>
+#include <algorithm>
+
+ISharedMutex* CompactFileIndex::mutex = NULL;
+IMutex* CompactFileIndex::journal_mutex = NULL;
+bool CompactFileIndex::loaded = false;
+bool CompactFileIndex::journal_error = false;
+std::vector<CompactFileIndex::SBucket> CompactFileIndex::buckets;
+unsigned int CompactFileIndex::bucket_bits = 0;
+std::vector<CompactFileIndex::SEntry*> CompactFileIndex::entry_blocks;
+_u32 CompactFileIndex::n_allocated = 0;
+std::vector<_u32> CompactFileIndex::free_entries;
+int64 CompactFileIndex::n_entries = 0;
+IFsFile* CompactFileIndex::journal_file = NULL;
+MemoryMappedFile* CompactFileIndex::journal_map = NULL;
+CompactFileIndex* CompactFileIndex::fileindex = NULL;
+THREADPOOL_TICKET CompactFileIndex::fileindex_ticket = ILLEGAL_THREADPOOL_TICKET;
+
+const char* c_journal_fn = "urbackup/fileindex/backup_server_files_index.journal";
+
+namespace
+{
+	const char journal_magic[] = "UBFIDXJ1";
+	const _u32 journal_version = 1;
+	const unsigned int initial_bucket_bits = 16;
+	const size_t entries_per_block = 65536;
+	const double max_load_factor = 0.8;
+	const int64 min_journal_size = 16 * 1024 * 1024;
+	const int64 min_compact_records = 1000000;
+	const size_t compact_write_entries = 100000;
+
+	struct SEntryKeyLess
+	{
+		template<typename T>
+		bool operator()(const T& a, const T& b) const
+		{
+			return a.key < b.key;
+		}
+	};
+}
+
+bool CompactFileIndex::initFileIndex()
+{
+	fileindex = new CompactFileIndex;
+
+	if (fileindex->has_error())
+	{
+		return false;
+	}
+
+	Server->Log("File entry index contains " + convert(n_entries) + " entries using "
+		+ PrettyPrintBytes(get_memory_usage()) + " of memory", LL_INFO);
+
+	if (!fileindex->replay_after_checkpoint())
+	{
+		Server->Log("Replaying file entries after file entry index checkpoint failed", LL_ERROR);
+		return false;
+	}
+
+	fileindex_ticket = Server->getThreadPool()->execute(fileindex, "fileindex writer");
+
+	return !fileindex->has_error();
+}
+
+void CompactFileIndex::shutdownFileIndex()
+{
+	fileindex->shutdown();
+	Server->getThreadPool()->waitFor(fileindex_ticket);
+}
+
+CompactFileIndex::CompactFileIndex(bool no_sync)
+	: _has_error(false), no_sync(no_sync), it_bucket(0), it_bits(0), it_pos(0)
+{
+	if (!load())
+	{
+		_has_error = true;
+	}
+}
+
+CompactFileIndex::~CompactFileIndex(void)
+{
+}
+
+bool CompactFileIndex::load()
+{
+	if (loaded)
+	{
+		return !journal_error;
+	}
+
+	mutex = Server->createSharedMutex();
+	journal_mutex = Server->createMutex();
+	journal_map = new MemoryMappedFile;
+
+	bucket_bits = initial_bucket_bits;
+	buckets.resize(static_cast<size_t>(1) << bucket_bits);
+
+	loaded = true;
+
+	if (!open_journal()
+		|| !replay_journal())
+	{
+		journal_error = true;
+		return false;
+	}
+
+	return true;
+}
+
+bool CompactFileIndex::open_journal()
+{
+	os_create_dir("urbackup/fileindex");
+
+	bool is_new = !FileExists(c_journal_fn);
+
+	journal_file = Server->openFile(c_journal_fn, is_new ? MODE_RW_CREATE : MODE_RW);
+	if (journal_file == NULL)
+	{
+		Server->Log("Error opening file entry index journal \"" + std::string(c_journal_fn) + "\". " + os_last_error_str(), LL_ERROR);
+		return false;
+	}
+
+	int64 fsize = journal_file->Size();
+
+	if (is_new || fsize == 0)
+	{
+		if (!journal_file->Resize(min_journal_size, false)
+			|| !map_journal(min_journal_size))
+		{
+			Server->Log("Error creating file entry index journal. " + os_last_error_str(), LL_ERROR);
+			return false;
+		}
+
+		SJournalHeader* header = reinterpret_cast<SJournalHeader*>(journal_map->data());
+		memcpy(header->magic, journal_magic, sizeof(header->magic));
+		header->version = journal_version;
+		header->record_size = sizeof(SEntry);
+		header->committed_size = 0;
+		header->checkpoint = -1;
+		header->n_entries = 0;
+
+		if (!journal_map->sync())
+		{
+			Server->Log("Error syncing file entry index journal. " + os_last_error_str(), LL_ERROR);
+			return false;
+		}
+
+		return true;
+	}
+
+	if (fsize < static_cast<int64>(sizeof(SJournalHeader))
+		|| !map_journal(fsize))
+	{
+		Server->Log("Error mapping file entry index journal. " + os_last_error_str(), LL_ERROR);
+		return false;
+	}
+
+	SJournalHeader* header = reinterpret_cast<SJournalHeader*>(journal_map->data());
+	if (memcmp(header->magic, journal_magic, sizeof(header->magic)) != 0
+		|| header->version != journal_version
+		|| header->record_size != sizeof(SEntry)
+		|| header->committed_size < 0
+		|| header->committed_size % sizeof(SEntry) != 0
+		|| static_cast<int64>(sizeof(SJournalHeader)) + header->committed_size > fsize)
+	{
+		Server->Log("File entry index journal \"" + std::string(c_journal_fn) + "\" is not valid. Delete it to rebuild the file entry index.", LL_ERROR);
+		return false;
+	}
+
+	return true;
+}
+
+bool CompactFileIndex::map_journal(int64 size)
+{
+	return journal_map->map(journal_file, size);
+}
+
+bool CompactFileIndex::replay_journal()
+{
+	SJournalHeader* header = reinterpret_cast<SJournalHeader*>(journal_map->data());
+	const char* records = journal_map->data() + sizeof(SJournalHeader);
+	int64 n_records = header->committed_size / sizeof(SEntry);
+
+	IScopedWriteLock lock(mutex);
+
+	for (int64 i = 0; i < n_records; ++i)
+	{
+		SEntry record;
+		memcpy(&record, records + i*sizeof(SEntry), sizeof(SEntry));
+
+		if (record.value != 0)
+		{
+			put_table(record.key, record.value);
+		}
+		else
+		{
+			del_table(record.key);
+		}
+
+		if ((i + 1) % 10000000 == 0)
+		{
+			Server->Log("Loading file entry index: " + convert(i + 1) + " of " + convert(n_records) + " journal records", LL_INFO);
+		}
+	}
+
+	return true;
+}
+
+size_t CompactFileIndex::home_bucket(const SIndexKey& key)
+{
+	uint64 prefix;
+	memcpy(&prefix, key.getHash(), sizeof(prefix));
+	return static_cast<size_t>(big_endian(prefix) >> (64 - bucket_bits));
+}
+
+_u32 CompactFileIndex::key_tag(const SIndexKey& key)
+{
+	//Does not depend on the clientid, so all clients of a file have the same tag
+	_u32 tag;
+	memcpy(&tag, key.getHash() + sizeof(uint64), sizeof(tag));
+	uint64 filesize = static_cast<uint64>(key.getFilesize());
+	return tag ^ static_cast<_u32>((filesize ^ (filesize >> 32)) * 0x9E3779B1U);
+}
+
+CompactFileIndex::SEntry& CompactFileIndex::entry(_u32 idx)
+{
+	return entry_blocks[idx / entries_per_block][idx % entries_per_block];
+}
+
+void CompactFileIndex::lookup(const SIndexKey& key, const SEntry*& ge, const SEntry*& lt)
+{
+	ge = NULL;
+	lt = NULL;
+
+	size_t mask = buckets.size() - 1;
+	size_t b = home_bucket(key);
+	_u32 tag = key_tag(key);
+
+	for (size_t n = 0; n < buckets.size(); ++n)
+	{
+		const SBucket& bucket = buckets[b];
+		for (size_t i = 0; i < bucket.n_used; ++i)
+		{
+			if (bucket.tags[i] != tag)
+			{
+				continue;
+			}
+
+			const SEntry& curr = entry(bucket.entries[i]);
+			if (!curr.key.isEqualWithoutClientid(key))
+			{
+				continue;
+			}
+
+			if (curr.key < key)
+			{
+				if (lt == NULL || lt->key < curr.key)
+				{
+					lt = &curr;
+				}
+			}
+			else if (ge == NULL || curr.key < ge->key)
+			{
+				ge = &curr;
+			}
+		}
+
+		if (bucket.n_overflow == 0)
+		{
+			break;
+		}
+
+		b = (b + 1) & mask;
+	}
+}
+
+_u32 CompactFileIndex::alloc_entry()
+{
+	if (!free_entries.empty())
+	{
+		_u32 ret = free_entries.back();
+		free_entries.pop_back();
+		return ret;
+	}
+
+	if (n_allocated == entry_blocks.size()*entries_per_block)
+	{
+		//Not constructed, so only pages which are used become resident
+		entry_blocks.push_back(reinterpret_cast<SEntry*>(new char[entries_per_block*sizeof(SEntry)]));
+	}
+
+	return n_allocated++;
+}
+
+void CompactFileIndex::insert_idx(std::vector<SBucket>& table, size_t mask, _u32 idx)
+{
+	const SIndexKey& key = entry(idx).key;
+	size_t b = home_bucket(key);
+
+	while (table[b].n_used == bucket_slots)
+	{
+		++table[b].n_overflow;
+		b = (b + 1) & mask;
+	}
+
+	SBucket& bucket = table[b];
+	bucket.tags[bucket.n_used] = key_tag(key);
+	bucket.entries[bucket.n_used] = idx;
+	++bucket.n_used;
+}
+
+void CompactFileIndex::grow_table()
+{
+	std::vector<SBucket> new_buckets(buckets.size() * 2);
+
+	++bucket_bits;
+
+	for (size_t i = 0; i < buckets.size(); ++i)
+	{
+		for (size_t j = 0; j < buckets[i].n_used; ++j)
+		{
+			insert_idx(new_buckets, new_buckets.size() - 1, buckets[i].entries[j]);
+		}
+	}
+
+	buckets.swap(new_buckets);
+
+	Server->Log("Increased file entry index hash table size to " + PrettyPrintBytes(buckets.size()*sizeof(SBucket)), LL_DEBUG);
+}
+
+void CompactFileIndex::put_table(const SIndexKey& key, int64 value)
+{
+	const SEntry* ge;
+	const SEntry* lt;
+	lookup(key, ge, lt);
+
+	if (ge != NULL && ge->key == key)
+	{
+		const_cast<SEntry*>(ge)->value = value;
+		return;
+	}
+
+	if (n_entries + 1 > static_cast<int64>(buckets.size()*bucket_slots*max_load_factor))
+	{
+		grow_table();
+	}
+
+	_u32 idx = alloc_entry();
+	SEntry& new_entry = entry(idx);
+	memcpy(&new_entry.key, &key, sizeof(SIndexKey));
+	new_entry.value = value;
+
+	insert_idx(buckets, buckets.size() - 1, idx);
+	++n_entries;
+}
+
+void CompactFileIndex::del_table(const SIndexKey& key)
+{
+	size_t mask = buckets.size() - 1;
+	size_t b = home_bucket(key);
+	_u32 tag = key_tag(key);
+
+	for (size_t n = 0; n < buckets.size(); ++n)
+	{
+		SBucket& bucket = buckets[b];
+		for (size_t i = 0; i < bucket.n_used; ++i)
+		{
+			if (bucket.tags[i] == tag
+				&& entry(bucket.entries[i]).key == key)
+			{
+				free_entries.push_back(bucket.entries[i]);
+
+				--bucket.n_used;
+				bucket.tags[i] = bucket.tags[bucket.n_used];
+				bucket.entries[i] = bucket.entries[bucket.n_used];
+				--n_entries;
+
+				//The entry was moved past the buckets before it on insert
+				for (size_t ob = home_bucket(key); ob != b; ob = (ob + 1) & mask)
+				{
+					--buckets[ob].n_overflow;
+				}
+				return;
+			}
+		}
+
+		if (bucket.n_overflow == 0)
+		{
+			break;
+		}
+
+		b = (b + 1) & mask;
+	}
+
+	FILEENTRY_DEBUG(Server->Log("Compact file index: Entry to delete not found", LL_DEBUG));
+}
+
+void CompactFileIndex::collect_home_bucket(size_t home, std::vector<SEntry>& res)
+{
+	size_t mask = buckets.size() - 1;
+	size_t b = home;
+
+	for (size_t n = 0; n < buckets.size(); ++n)
+	{
+		const SBucket& bucket = buckets[b];
+		for (size_t i = 0; i < bucket.n_used; ++i)
+		{
+			const SEntry& curr = entry(bucket.entries[i]);
+			if (home_bucket(curr.key) == home)
+			{
+				res.push_back(curr);
+			}
+		}
+
+		if (bucket.n_overflow == 0)
+		{
+			break;
+		}
+
+		b = (b + 1) & mask;
+	}
+}
+
+bool CompactFileIndex::has_error(void)
+{
+	return _has_error;
+}
+
+int64 CompactFileIndex::get(const SIndexKey& key)
+{
+	IScopedReadLock lock(mutex);
+
+	const SEntry* ge;
+	const SEntry* lt;
+	lookup(key, ge, lt);
+
+	if (ge != NULL && ge->key == key)
+	{
+		return ge->value;
+	}
+	return 0;
+}
+
+int64 CompactFileIndex::get_any_client(const SIndexKey& key)
+{
+	IScopedReadLock lock(mutex);
+
+	const SEntry* ge;
+	const SEntry* lt;
+	lookup(key, ge, lt);
+
+	if (ge != NULL)
+	{
+		return ge->value;
+	}
+	return 0;
+}
+
+int64 CompactFileIndex::get_prefer_client(const SIndexKey& key)
+{
+	IScopedReadLock lock(mutex);
+
+	const SEntry* ge;
+	const SEntry* lt;
+	lookup(key, ge, lt);
+
+	if (ge != NULL)
+	{
+		return ge->value;
+	}
+	else if (lt != NULL)
+	{
+		return lt->value;
+	}
+	return 0;
+}
+
+std::map<int, int64> CompactFileIndex::get_all_clients(const SIndexKey& key)
+{
+	std::map<int, int64> ret;
+
+	IScopedReadLock lock(mutex);
+
+	size_t mask = buckets.size() - 1;
+	size_t b = home_bucket(key);
+	_u32 tag = key_tag(key);
+
+	for (size_t n = 0; n < buckets.size(); ++n)
+	{
+		const SBucket& bucket = buckets[b];
+		for (size_t i = 0; i < bucket.n_used; ++i)
+		{
+			if (bucket.tags[i] != tag)
+			{
+				continue;
+			}
+
+			const SEntry& curr = entry(bucket.entries[i]);
+			if (curr.key.isEqualWithoutClientid(key))
+			{
+				ret[curr.key.getClientid()] = curr.value;
+			}
+		}
+
+		if (bucket.n_overflow == 0)
+		{
+			break;
+		}
+
+		b = (b + 1) & mask;
+	}
+
+	return ret;
+}
+
+std::vector<int64> CompactFileIndex::get_batch(const std::vector<SIndexKey>& keys)
+{
+	std::vector<int64> ret(keys.size(), 0);
+
+	IScopedReadLock lock(mutex);
+
+	for (size_t i = 0; i < keys.size(); ++i)
+	{
+		const SEntry* ge;
+		const SEntry* lt;
+		lookup(keys[i], ge, lt);
+
+		if (ge != NULL)
+		{
+			ret[i] = ge->value;
+		}
+		else if (lt != NULL)
+		{
+			ret[i] = lt->value;
+		}
+	}
+
+	return ret;
+}
+
+void CompactFileIndex::start_transaction(void)
+{
+	pending.clear();
+}
+
+void CompactFileIndex::put(const SIndexKey& key, int64 value)
+{
+	{
+		IScopedWriteLock lock(mutex);
+		put_table(key, value);
+	}
+
+	SEntry record;
+	memcpy(&record.key, &key, sizeof(SIndexKey));
+	record.value = value;
+	pending.push_back(record);
+}
+
+void CompactFileIndex::del(const SIndexKey& key)
+{
+	{
+		IScopedWriteLock lock(mutex);
+		del_table(key);
+	}
+
+	SEntry record;
+	memcpy(&record.key, &key, sizeof(SIndexKey));
+	record.value = 0;
+	pending.push_back(record);
+}
+
+void CompactFileIndex::commit_transaction(void)
+{
+	IScopedLock lock(journal_mutex);
+
+	if (!write_journal())
+	{
+		_has_error = true;
+		return;
+	}
+
+	SJournalHeader* header = reinterpret_cast<SJournalHeader*>(journal_map->data());
+	int64 n_records = header->committed_size / sizeof(SEntry);
+	if (n_records > min_compact_records
+		&& n_records > 2 * header->n_entries)
+	{
+		if (!compact_journal())
+		{
+			Server->Log("Compacting file entry index journal failed", LL_ERROR);
+			_has_error = true;
+		}
+	}
+}
+
+bool CompactFileIndex::write_journal()
+{
+	if (pending.empty())
+	{
+		return true;
+	}
+
+	SJournalHeader* header = reinterpret_cast<SJournalHeader*>(journal_map->data());
+	int64 offset = sizeof(SJournalHeader) + header->committed_size;
+	int64 len = pending.size()*sizeof(SEntry);
+
+	if (offset + len > journal_map->size())
+	{
+		int64 new_size = (std::max)(journal_map->size() * 2, offset + len);
+
+		journal_map->unmap();
+
+		if (!journal_file->Resize(new_size, false)
+			|| !map_journal(new_size))
+		{
+			Server->Log("Error increasing file entry index journal size to " + PrettyPrintBytes(new_size) + ". " + os_last_error_str(), LL_ERROR);
+			return false;
+		}
+
+		header = reinterpret_cast<SJournalHeader*>(journal_map->data());
+	}
+
+	memcpy(journal_map->data() + offset, &pending[0], static_cast<size_t>(len));
+
+	//Records have to be on disk before the header references them
+	if (!no_sync
+		&& !journal_map->sync(offset, len))
+	{
+		Server->Log("Error syncing file entry index journal. " + os_last_error_str(), LL_ERROR);
+		return false;
+	}
+
+	header->committed_size += len;
+
+	{
+		IScopedReadLock lock(mutex);
+		header->n_entries = n_entries;
+	}
+
+	if (!no_sync
+		&& !journal_map->sync(0, sizeof(SJournalHeader)))
+	{
+		Server->Log("Error syncing file entry index journal header. " + os_last_error_str(), LL_ERROR);
+		return false;
+	}
+
+	pending.clear();
+
+	return true;
+}
+
+bool CompactFileIndex::compact_journal()
+{
+	std::string tmp_fn = std::string(c_journal_fn) + ".new";
+
+	Server->Log("Compacting file entry index journal...", LL_INFO);
+
+	std::auto_ptr<IFsFile> new_journal(Server->openFile(tmp_fn, MODE_WRITE));
+	if (new_journal.get() == NULL)
+	{
+		Server->Log("Error creating file entry index journal \"" + tmp_fn + "\". " + os_last_error_str(), LL_ERROR);
+		return false;
+	}
+
+	SJournalHeader header = *reinterpret_cast<SJournalHeader*>(journal_map->data());
+	header.committed_size = 0;
+
+	int64 pos = sizeof(SJournalHeader);
+	std::vector<SEntry> buf;
+	buf.reserve(compact_write_entries);
+
+	{
+		IScopedReadLock lock(mutex);
+
+		for (size_t i = 0; i < buckets.size(); ++i)
+		{
+			for (size_t j = 0; j < buckets[i].n_used; ++j)
+			{
+				buf.push_back(entry(buckets[i].entries[j]));
+
+				if (buf.size() >= compact_write_entries
+					&& !write_compact_records(new_journal.get(), pos, buf))
+				{
+					return false;
+				}
+			}
+		}
+
+		if (!buf.empty()
+			&& !write_compact_records(new_journal.get(), pos, buf))
+		{
+			return false;
+		}
+
+		header.n_entries = n_entries;
+	}
+
+	header.committed_size = pos - sizeof(SJournalHeader);
+
+	if (new_journal->Write(0, reinterpret_cast<char*>(&header), sizeof(header)) != sizeof(header)
+		|| !new_journal->Sync())
+	{
+		Server->Log("Error writing file entry index journal \"" + tmp_fn + "\". " + os_last_error_str(), LL_ERROR);
+		return false;
+	}
+
+	new_journal.reset();
+
+	journal_map->unmap();
+	Server->destroy(journal_file);
+	journal_file = NULL;
+
+	bool renamed = os_rename_file(tmp_fn, c_journal_fn);
+	if (!renamed)
+	{
+		Server->Log("Error renaming compacted file entry index journal. " + os_last_error_str(), LL_ERROR);
+	}
+
+	//Old journal is still valid if renaming failed
+	if (!open_journal())
+	{
+		journal_error = true;
+		return false;
+	}
+
+	if (renamed)
+	{
+		Server->Log("Compacted file entry index journal to " + PrettyPrintBytes(pos), LL_INFO);
+	}
+
+	return true;
+}
+
+bool CompactFileIndex::write_compact_records(IFsFile* f, int64& pos, std::vector<SEntry>& buf)
+{
+	_u32 len = static_cast<_u32>(buf.size()*sizeof(SEntry));
+	if (f->Write(pos, reinterpret_cast<char*>(&buf[0]), len) != len)
+	{
+		Server->Log("Error writing file entry index journal \"" + f->getFilename() + "\". " + os_last_error_str(), LL_ERROR);
+		return false;
+	}
+	pos += len;
+	buf.clear();
+	return true;
+}
+
+void CompactFileIndex::start_iteration()
+{
+	IScopedReadLock lock(mutex);
+	it_bucket = 0;
+	it_bits = bucket_bits;
+	it_entries.clear();
+	it_pos = 0;
+}
+
+std::map<int, int64> CompactFileIndex::get_next_entries_iteration(bool& has_next)
+{
+	while (it_pos >= it_entries.size())
+	{
+		it_entries.clear();
+		it_pos = 0;
+
+		IScopedReadLock lock(mutex);
+
+		//Table only grows. Each home bucket is split into consecutive ones
+		if (bucket_bits != it_bits)
+		{
+			it_bucket <<= bucket_bits - it_bits;
+			it_bits = bucket_bits;
+		}
+
+		if (it_bucket >= buckets.size())
+		{
+			has_next = false;
+			return std::map<int, int64>();
+		}
+
+		collect_home_bucket(it_bucket, it_entries);
+		++it_bucket;
+
+		std::sort(it_entries.begin(), it_entries.end(), SEntryKeyLess());
+	}
+
+	std::map<int, int64> ret;
+	SIndexKey start_key = it_entries[it_pos].key;
+
+	while (it_pos < it_entries.size()
+		&& it_entries[it_pos].key.isEqualWithoutClientid(start_key))
+	{
+		ret[it_entries[it_pos].key.getClientid()] = it_entries[it_pos].value;
+		++it_pos;
+	}
+
+	return ret;
+}
+
+void CompactFileIndex::stop_iteration()
+{
+	it_entries.clear();
+	it_pos = 0;
+}
+
+void CompactFileIndex::set_checkpoint(int64 files_id)
+{
+	IScopedLock lock(journal_mutex);
+
+	SJournalHeader* header = reinterpret_cast<SJournalHeader*>(journal_map->data());
+	header->checkpoint = files_id;
+
+	if (!no_sync
+		&& !journal_map->sync(0, sizeof(SJournalHeader)))
+	{
+		Server->Log("Error syncing file entry index journal header. " + os_last_error_str(), LL_WARNING);
+	}
+}
+
+int64 CompactFileIndex::get_checkpoint()
+{
+	IScopedLock lock(journal_mutex);
+
+	SJournalHeader* header = reinterpret_cast<SJournalHeader*>(journal_map->data());
+	return header->checkpoint;
+}
+
+void CompactFileIndex::create_finished()
+{
+	IScopedLock lock(journal_mutex);
+
+	if (!journal_map->sync())
+	{
+		Server->Log("Error syncing file entry index journal. " + os_last_error_str(), LL_ERROR);
+		_has_error = true;
+	}
+}
+
+int64 CompactFileIndex::get_memory_usage()
+{
+	IScopedReadLock lock(mutex);
+	return static_cast<int64>(buckets.size()*sizeof(SBucket)
+		+ entry_blocks.size()*entries_per_block*sizeof(SEntry)
+		+ free_entries.capacity()*sizeof(_u32));
+}
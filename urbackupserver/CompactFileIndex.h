@@ -0,0 +1,145 @@
+#pragma once
+
+#include "../Interface/Types.h"
+#include "../Interface/File.h"
+#include "../Interface/SharedMutex.h"
+#include "../Interface/ThreadPool.h"
+#include "FileIndex.h"
+#include "MemoryMappedFile.h"
+#include <memory>
+#include <vector>
+
+//File entry index kept completely in memory. Smaller than the LMDB index
+//for servers with up to some ten million file entries.
+//Entries are stored in a hash table with cache line sized buckets. The home
+//bucket of an entry are the leading bits of its hash, so the buckets are
+//ordered like the keys and all clients of a hash and filesize share a bucket
+//chain. Changes are appended to a memory-mapped journal, which is replayed
+//on startup and compacted once it contains mostly stale records.
+class CompactFileIndex : public FileIndex
+{
+public:
+	static bool initFileIndex();
+	static void shutdownFileIndex();
+
+	CompactFileIndex(bool no_sync=false);
+
+	~CompactFileIndex(void);
+
+	virtual bool has_error(void);
+
+	virtual int64 get(const SIndexKey& key);
+
+	virtual int64 get_any_client(const SIndexKey& key);
+
+	virtual int64 get_prefer_client(const SIndexKey& key);
+
+	virtual std::map<int, int64> get_all_clients(const SIndexKey& key);
+
+	virtual std::vector<int64> get_batch(const std::vector<SIndexKey>& keys);
+
+	virtual void start_transaction(void);
+
+	virtual void put(const SIndexKey& key, int64 value);
+
+	virtual void del(const SIndexKey& key);
+
+	virtual void commit_transaction(void);
+
+	virtual void start_iteration();
+
+	virtual std::map<int, int64> get_next_entries_iteration(bool& has_next);
+
+	virtual void stop_iteration();
+
+	virtual void set_checkpoint(int64 files_id);
+
+	virtual int64 get_checkpoint();
+
+	//Memory used by the hash table and the entries
+	static int64 get_memory_usage();
+
+protected:
+	virtual void create_finished();
+
+private:
+#pragma pack(1)
+	struct SEntry
+	{
+		SIndexKey key;
+		int64 value;
+	};
+#pragma pack()
+
+	static const size_t bucket_slots = 7;
+
+	struct SBucket
+	{
+		_u32 tags[bucket_slots];
+		_u32 entries[bucket_slots];
+		_u16 n_used;
+		_u16 reserved;
+		//Number of entries which were moved past this bucket because it was full.
+		//Lookups continue with the next bucket as long as it is not zero
+		_u32 n_overflow;
+	};
+
+	struct SJournalHeader
+	{
+		char magic[8];
+		_u32 version;
+		_u32 record_size;
+		int64 committed_size;
+		int64 checkpoint;
+		int64 n_entries;
+		char reserved[24];
+	};
+
+	static bool load();
+	static bool open_journal();
+	static bool map_journal(int64 size);
+	static bool replay_journal();
+
+	static size_t home_bucket(const SIndexKey& key);
+	static _u32 key_tag(const SIndexKey& key);
+	static SEntry& entry(_u32 idx);
+
+	static void lookup(const SIndexKey& key, const SEntry*& ge, const SEntry*& lt);
+	static void put_table(const SIndexKey& key, int64 value);
+	static void del_table(const SIndexKey& key);
+	static _u32 alloc_entry();
+	static void insert_idx(std::vector<SBucket>& table, size_t mask, _u32 idx);
+	static void grow_table();
+	static void collect_home_bucket(size_t home, std::vector<SEntry>& res);
+
+	bool write_journal();
+	bool compact_journal();
+	static bool write_compact_records(IFsFile* f, int64& pos, std::vector<SEntry>& buf);
+
+	bool _has_error;
+	bool no_sync;
+	std::vector<SEntry> pending;
+
+	size_t it_bucket;
+	unsigned int it_bits;
+	std::vector<SEntry> it_entries;
+	size_t it_pos;
+
+	static ISharedMutex* mutex;
+	static IMutex* journal_mutex;
+	static bool loaded;
+	static bool journal_error;
+
+	static std::vector<SBucket> buckets;
+	static unsigned int bucket_bits;
+	static std::vector<SEntry*> entry_blocks;
+	static _u32 n_allocated;
+	static std::vector<_u32> free_entries;
+	static int64 n_entries;
+
+	static IFsFile* journal_file;
+	static MemoryMappedFile* journal_map;
+
+	static CompactFileIndex* fileindex;
+	static THREADPOOL_TICKET fileindex_ticket;
+};
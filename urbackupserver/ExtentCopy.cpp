@@ -0,0 +1,132 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "ExtentCopy.h"
+#include "../Interface/Server.h"
+#include "../stringtools.h"
+#include <algorithm>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+namespace
+{
+#ifdef __linux__
+	struct SCloneRange
+	{
+		int64 src_fd;
+		uint64 src_offset;
+		uint64 src_length;
+		uint64 dest_offset;
+	};
+
+#define EXTENT_IOC_CLONE_RANGE _IOW(0x94, 13, SCloneRange)
+#endif
+
+	//Reflinks can only be created for ranges aligned to the file system block size
+	const int64 c_clone_alignment = 4096;
+	const int64 c_max_copy_size = 1024 * 1024 * 1024;
+}
+
+bool ExtentCopy::clone_range(IFsFile* src, int64 src_offset, IFsFile* dst, int64 dst_offset, int64 size, bool& unsupported)
+{
+	unsupported = false;
+#ifdef __linux__
+	SCloneRange args;
+	args.src_fd = src->getOsHandle();
+	args.src_offset = src_offset;
+	args.src_length = size;
+	args.dest_offset = dst_offset;
+
+	if (ioctl(dst->getOsHandle(), EXTENT_IOC_CLONE_RANGE, &args) != 0)
+	{
+		int err = errno;
+		unsupported = (err == EOPNOTSUPP || err == ENOTTY || err == EXDEV);
+		Server->Log("Cloning range of \"" + src->getFilename() + "\" to \"" + dst->getFilename() + "\" failed. errno=" + convert(err), LL_DEBUG);
+		return false;
+	}
+	return true;
+#else
+	unsupported = true;
+	return false;
+#endif
+}
+
+int64 ExtentCopy::copy_range(IFsFile* src, int64 src_offset, IFsFile* dst, int64 dst_offset, int64 size,
+	bool with_clone, bool& unsupported)
+{
+	unsupported = false;
+
+	if (size <= 0)
+	{
+		return 0;
+	}
+
+#ifdef __linux__
+	if (with_clone
+		&& src_offset%c_clone_alignment == 0
+		&& dst_offset%c_clone_alignment == 0
+		&& (size%c_clone_alignment == 0 || src_offset + size == src->Size()))
+	{
+		bool clone_unsupported;
+		if (clone_range(src, src_offset, dst, dst_offset, size, clone_unsupported))
+		{
+			return size;
+		}
+	}
+
+#ifdef __NR_copy_file_range
+	int64 copied = 0;
+	while (copied < size)
+	{
+		loff_t off_in = src_offset + copied;
+		loff_t off_out = dst_offset + copied;
+		long rc = syscall(__NR_copy_file_range, src->getOsHandle(), &off_in, dst->getOsHandle(), &off_out,
+			static_cast<size_t>((std::min)(size - copied, c_max_copy_size)), 0);
+
+		if (rc < 0)
+		{
+			int err = errno;
+			unsupported = (err == ENOSYS || err == EXDEV || err == EOPNOTSUPP || err == EINVAL || err == EBADF);
+			if (!unsupported)
+			{
+				Server->Log("Copying range of \"" + src->getFilename() + "\" to \"" + dst->getFilename() + "\" failed. errno=" + convert(err), LL_DEBUG);
+			}
+			break;
+		}
+		else if (rc == 0)
+		{
+			break;
+		}
+
+		copied += rc;
+	}
+
+	return copied;
+#else
+	unsupported = true;
+	return 0;
+#endif
+#else
+	unsupported = true;
+	return 0;
+#endif
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "../Interface/Types.h"
+#include "../Interface/File.h"
+
+//Copies ranges between files without passing the data through user space.
+//The range is shared via a reflink (FICLONERANGE) if the file system supports
+//it, otherwise it is copied by the kernel with copy_file_range.
+class ExtentCopy
+{
+public:
+	//Makes the range of dst reference the data of the range of src
+	static bool clone_range(IFsFile* src, int64 src_offset, IFsFile* dst, int64 dst_offset, int64 size, bool& unsupported);
+
+	//Returns the number of bytes copied, which is less than size on error or at the
+	//end of src. unsupported is set if the files cannot be copied in the kernel
+	static int64 copy_range(IFsFile* src, int64 src_offset, IFsFile* dst, int64 dst_offset, int64 size,
+		bool with_clone, bool& unsupported);
+};
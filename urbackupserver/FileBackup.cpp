@@ -40,12 +40,17 @@
 #include "../urbackupcommon/TreeHash.h"
 #include "../common/data.h"
 #include "PhashLoad.h"
+#include "FileManifest.h"
+#include "FileEntryBatch.h"
 
 #ifndef NAME_MAX
 #define NAME_MAX _POSIX_NAME_MAX
 #endif
 
 const unsigned int full_backup_construct_timeout=4*60*60*1000;
+//Files waiting in front of the hash and link stages before the download waits.
+//Each of them keeps its temporary file open.
+const size_t hash_queue_capacity=1000;
 extern std::string server_identity;
 
 FileBackup::FileBackup( ClientMain* client_main, int clientid, std::string clientname, std::string clientsubname, LogAction log_action,
@@ -54,8 +59,7 @@ FileBackup::FileBackup( ClientMain* client_main, int clientid, std::string clien
 	:  Backup(client_main, clientid, clientname, clientsubname, log_action, true, is_incremental, server_token, details, scheduled),
 	group(group), use_tmpfiles(use_tmpfiles), tmpfile_path(tmpfile_path), use_reflink(use_reflink), use_snapshots(use_snapshots),
 	disk_error(false), with_hashes(false),
-	backupid(-1), hashpipe(NULL), hashpipe_prepare(NULL), bsh(NULL), bsh_prepare(NULL),
-	bsh_ticket(ILLEGAL_THREADPOOL_TICKET), bsh_prepare_ticket(ILLEGAL_THREADPOOL_TICKET), pingthread(NULL),
+	backupid(-1), hashpipe(NULL), hashpipe_prepare(NULL), hash_queue(NULL), prepare_hash_queue(NULL), pingthread(NULL),
 	pingthread_ticket(ILLEGAL_THREADPOOL_TICKET), cdp_path(false), metadata_download_thread_ticket(ILLEGAL_THREADPOOL_TICKET),
 	last_speed_received_bytes(0), speed_set_time(0)
 {
@@ -198,6 +202,17 @@ bool FileBackup::request_filelist_construct(bool full, bool resume, int group,
 		start_backup_cmd += "&async=1";
 	}
 
+	if (client_main->getProtocolVersions().bin_filelist_version > 0
+		&& useBinaryFilelists())
+	{
+		start_backup_cmd += "&bin_filelist=1";
+
+		if (client_main->getProtocolVersions().bin_filelist_version > 1)
+		{
+			start_backup_cmd += "&dir_digest=1";
+		}
+	}
+
 	if(with_token)
 	{
 		start_backup_cmd+="#token="+server_token;
@@ -574,6 +589,11 @@ bool FileBackup::getTokenFile(FileClient &fc, bool hashed_transfer, bool request
 	return has_token_file;
 }
 
+bool FileBackup::useBinaryFilelists()
+{
+	return Server->getServerParameter("binary_filelists") == "true";
+}
+
 std::string FileBackup::clientlistName(int ref_backupid)
 {
 	return "urbackup/clientlist_b_" + convert(ref_backupid) + ".ub";
@@ -581,16 +601,31 @@ std::string FileBackup::clientlistName(int ref_backupid)
 
 void FileBackup::createHashThreads(bool use_reflink, bool ignore_hash_mismatches)
 {
-	assert(bsh==NULL);
-	assert(bsh_prepare==NULL);
+	assert(bsh.empty());
+	assert(bsh_prepare.empty());
+
+	hashpipe=new HashWorkQueue(hash_queue_capacity);
+	hashpipe_prepare=new HashWorkQueue(hash_queue_capacity);
+
+	size_t n_workers = HashStageQueue::get_default_workers();
+
+	size_t entry_batch_size = FileEntryBatch::get_default_max_entries();
+	if (entry_batch_size > 1)
+	{
+		file_entry_batch.reset(new FileEntryBatch(entry_batch_size));
+	}
 
-	hashpipe=Server->createMemoryPipe();
-	hashpipe_prepare=Server->createMemoryPipe();
+	hash_queue=new HashStageQueue(hashpipe, NULL, n_workers, BackupServerHash::getStageKey);
+	prepare_hash_queue=new HashStageQueue(hashpipe_prepare, hashpipe, n_workers);
 
-	bsh=new BackupServerHash(hashpipe, clientid, use_snapshots, use_reflink, use_tmpfiles, logid, use_snapshots, max_file_id);
-	bsh_prepare=new BackupServerPrepareHash(hashpipe_prepare, hashpipe, clientid, logid, ignore_hash_mismatches);
-	bsh_ticket = Server->getThreadPool()->execute(bsh, "fbackup write");
-	bsh_prepare_ticket = Server->getThreadPool()->execute(bsh_prepare, "fbackup hash");
+	for (size_t i = 0; i < n_workers; ++i)
+	{
+		bsh.push_back(new BackupServerHash(hash_queue, clientid, use_snapshots, use_reflink, use_tmpfiles, logid, use_snapshots, max_file_id));
+		bsh[i]->setFileEntryBatch(file_entry_batch.get());
+		bsh_prepare.push_back(new BackupServerPrepareHash(prepare_hash_queue, clientid, logid, ignore_hash_mismatches));
+		bsh_tickets.push_back(Server->getThreadPool()->execute(bsh[i], "fbackup write"));
+		bsh_prepare_tickets.push_back(Server->getThreadPool()->execute(bsh_prepare[i], "fbackup hash"));
+	}
 }
 
 
@@ -598,19 +633,74 @@ void FileBackup::destroyHashThreads()
 {
 	if (hashpipe_prepare != NULL)
 	{
-		assert(bsh_ticket != ILLEGAL_THREADPOOL_TICKET);
-		assert(bsh_prepare_ticket != ILLEGAL_THREADPOOL_TICKET);
-		hashpipe_prepare->Write("exit");
-		Server->getThreadPool()->waitFor(bsh_ticket);
-		Server->getThreadPool()->waitFor(bsh_prepare_ticket);
+		assert(!bsh_tickets.empty());
+		assert(!bsh_prepare_tickets.empty());
+		hashpipe_prepare->pushControl(SHashWorkItem::EType_Exit);
+		Server->getThreadPool()->waitFor(bsh_tickets);
+		Server->getThreadPool()->waitFor(bsh_prepare_tickets);
+
+		delete hash_queue;
+		delete prepare_hash_queue;
 	}
 
-	bsh_ticket=ILLEGAL_THREADPOOL_TICKET;
-	bsh_prepare_ticket=ILLEGAL_THREADPOOL_TICKET;
+	bsh_tickets.clear();
+	bsh_prepare_tickets.clear();
+	hash_queue=NULL;
+	prepare_hash_queue=NULL;
 	hashpipe=NULL;
 	hashpipe_prepare=NULL;
-	bsh=NULL;
-	bsh_prepare=NULL;
+	bsh.clear();
+	bsh_prepare.clear();
+}
+
+void FileBackup::openFileManifest()
+{
+	if (FileManifest::is_enabled())
+	{
+		file_manifest.reset(new FileManifest(backupid, clientid));
+	}
+}
+
+void FileBackup::finishFileManifest()
+{
+	if (file_manifest.get() == NULL)
+	{
+		return;
+	}
+
+	std::vector<ServerFilesDao::SNewFileEntry> unwritten;
+	if (!file_manifest->finish(unwritten))
+	{
+		ServerLogger::Log(logid, "Error syncing file manifest of backup. Entries of small files may be missing after a crash.", LL_ERROR);
+		disk_error = true;
+	}
+
+	if (!unwritten.empty())
+	{
+		ServerLogger::Log(logid, "Error writing file manifest of backup. Adding " + convert(unwritten.size()) + " entries to the file entries instead.", LL_WARNING);
+
+		std::vector<FileEntryBatch::SEntry> entries(unwritten.size());
+		for (size_t i = 0; i < unwritten.size(); ++i)
+		{
+			entries[i].file = unwritten[i];
+		}
+
+		ServerFilesDao filesdao(Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER_FILES));
+		FileEntryBatch::write(filesdao, *fileindex, entries, true);
+	}
+}
+
+bool FileBackup::hashThreadsHaveError()
+{
+	for (size_t i = 0; i < bsh.size(); ++i)
+	{
+		if (bsh[i]->hasError()
+			|| bsh_prepare[i]->hasError())
+		{
+			return true;
+		}
+	}
+	return false;
 }
 
 _i64 FileBackup::getIncrementalSize(IFile *f, const std::vector<size_t> &diffs, bool& backup_with_components, bool all)
@@ -830,6 +920,8 @@ bool FileBackup::doBackup()
 
 	bool backup_result = doFileBackup();
 
+	finishFileManifest();
+
 	if(pingthread!=NULL)
 	{
 		pingthread->setStop(true);
@@ -1206,22 +1298,29 @@ void FileBackup::notifyClientBackupFailed()
 void FileBackup::waitForFileThreads(void)
 {
 	SStatus status=ServerStatus::getStatus(clientname);
-	hashpipe->Write("flush");
-	hashpipe_prepare->Write("flush");
-	_u32 hashqueuesize=(_u32)hashpipe->getNumElements()+(bsh->isWorking()?1:0);
-	_u32 prepare_hashqueuesize=(_u32)hashpipe_prepare->getNumElements()+(bsh_prepare->isWorking()?1:0);
+	hashpipe->pushControl(SHashWorkItem::EType_Flush);
+	hashpipe_prepare->pushControl(SHashWorkItem::EType_Flush);
+	_u32 hashqueuesize=(_u32)(hashpipe->getNumElements()+hash_queue->in_progress());
+	_u32 prepare_hashqueuesize=(_u32)(hashpipe_prepare->getNumElements()+prepare_hash_queue->in_progress());
 	while(hashqueuesize>0 || prepare_hashqueuesize>0)
 	{
 		ServerStatus::setProcessQueuesize(clientname, status_id, prepare_hashqueuesize, hashqueuesize);
 		Server->wait(1000);
-		hashqueuesize=(_u32)hashpipe->getNumElements()+(bsh->isWorking()?1:0);
-		prepare_hashqueuesize=(_u32)hashpipe_prepare->getNumElements()+(bsh_prepare->isWorking()?1:0);
+		hashqueuesize=(_u32)(hashpipe->getNumElements()+hash_queue->in_progress());
+		prepare_hashqueuesize=(_u32)(hashpipe_prepare->getNumElements()+prepare_hash_queue->in_progress());
 	}
 	{
 		Server->wait(10);
-		while(bsh->isWorking()) Server->wait(1000);
+		while(hash_queue->in_progress()>0) Server->wait(1000);
 	}	
 
+	//Remaining file entries are written by the workers after the flush delay
+	while(file_entry_batch.get()!=NULL
+		&& file_entry_batch->get_num_pending()>0)
+	{
+		Server->wait(100);
+	}
+
 	ServerStatus::setProcessQueuesize(clientname, status_id, 0, 0);
 }
 
@@ -15,6 +15,10 @@
 class ClientMain;
 class BackupServerHash;
 class BackupServerPrepareHash;
+class HashStageQueue;
+class HashWorkQueue;
+class FileEntryBatch;
+class FileManifest;
 class ServerPingThread;
 class FileIndex;
 class PhashLoad;
@@ -203,6 +207,9 @@ public:
 
 	static bool create_hardlink(const std::string &linkname, const std::string &fname, bool use_ioref, bool* too_many_links, bool* copy);
 
+	//Client and server file lists in the binary format (binary_filelists=true)
+	static bool useBinaryFilelists();
+
 protected:
 	virtual bool doBackup();
 
@@ -218,6 +225,10 @@ protected:
 	std::string clientlistName(int ref_backupid);
 	void createHashThreads(bool use_reflink, bool ignore_hash_mismatches);
 	void destroyHashThreads();
+
+	void openFileManifest();
+	void finishFileManifest();
+	bool hashThreadsHaveError();
 	_i64 getIncrementalSize(IFile *f, const std::vector<size_t> &diffs, bool& backup_with_components, bool all=false);
 	void calculateDownloadSpeed(int64 ctime, FileClient &fc, FileClientChunked* fc_chunked);
 	void calculateEtaFileBackup( int64 &last_eta_update, int64& eta_set_time, int64 ctime, FileClient &fc, FileClientChunked* fc_chunked,
@@ -264,14 +275,18 @@ protected:
 	std::string backuppath_hashes;
 	std::string backuppath_single;
 
-	IPipe *hashpipe;
-	IPipe *hashpipe_prepare;
-	BackupServerHash *bsh;
-	THREADPOOL_TICKET bsh_ticket;
-	BackupServerPrepareHash *bsh_prepare;
-	THREADPOOL_TICKET bsh_prepare_ticket;
+	HashWorkQueue *hashpipe;
+	HashWorkQueue *hashpipe_prepare;
+	HashStageQueue* hash_queue;
+	HashStageQueue* prepare_hash_queue;
+	std::vector<BackupServerHash*> bsh;
+	std::vector<THREADPOOL_TICKET> bsh_tickets;
+	std::vector<BackupServerPrepareHash*> bsh_prepare;
+	std::vector<THREADPOOL_TICKET> bsh_prepare_tickets;
 	std::auto_ptr<BackupServerHash> local_hash;
 	std::auto_ptr<BackupServerHash> local_hash2;
+	std::auto_ptr<FileEntryBatch> file_entry_batch;
+	std::auto_ptr<FileManifest> file_manifest;
 
 	std::string filelist_async_id;
 
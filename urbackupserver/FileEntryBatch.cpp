@@ -0,0 +1,279 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "FileEntryBatch.h"
+#include "FileIndex.h"
+#include "FileManifest.h"
+#include "create_files_index.h"
+#include "../Interface/Server.h"
+#include "../stringtools.h"
+#include <algorithm>
+
+namespace
+{
+	//Maximum time in ms an entry stays pending
+	const int64 max_delay=1000;
+
+	std::pair<std::string, int64> entry_key(const FileEntryBatch::SEntry& entry)
+	{
+		return std::make_pair(entry.file.shahash, entry.file.filesize);
+	}
+}
+
+IMutex* FileEntryBatch::batches_mutex = NULL;
+std::set<FileEntryBatch*> FileEntryBatch::batches;
+
+FileEntryBatch::FileEntryBatch(size_t max_entries)
+	: mutex(Server->createMutex()), flush_mutex(Server->createMutex()),
+	max_entries(max_entries), first_pending_time(0)
+{
+	pending.reserve(max_entries);
+
+	IScopedLock lock(batches_mutex);
+	batches.insert(this);
+}
+
+FileEntryBatch::~FileEntryBatch()
+{
+	{
+		IScopedLock lock(batches_mutex);
+		batches.erase(this);
+	}
+
+	if (!pending.empty())
+	{
+		Server->Log("File entry batch destroyed with " + convert(pending.size()) + " entries which were not written", LL_ERROR);
+	}
+
+	Server->destroy(mutex);
+	Server->destroy(flush_mutex);
+}
+
+void FileEntryBatch::init_mutex()
+{
+	batches_mutex = Server->createMutex();
+}
+
+size_t FileEntryBatch::get_default_max_entries()
+{
+	std::string batch_size = Server->getServerParameter("file_entry_batch_size");
+	if (!batch_size.empty())
+	{
+		return (std::max)(1, watoi(batch_size));
+	}
+	return 128;
+}
+
+void FileEntryBatch::add(ServerFilesDao& filesdao, FileIndex& fileindex, const SEntry& entry)
+{
+	bool do_flush;
+	{
+		IScopedLock lock(mutex);
+		if (pending.empty())
+		{
+			first_pending_time = Server->getTimeMS();
+		}
+		pending.push_back(entry);
+		pending_keys.insert(entry_key(entry));
+		do_flush = pending.size() >= max_entries;
+	}
+
+	if (do_flush)
+	{
+		flush(filesdao, fileindex);
+	}
+}
+
+int FileEntryBatch::flush_due(ServerFilesDao& filesdao, FileIndex& fileindex)
+{
+	int64 passed;
+	{
+		IScopedLock lock(mutex);
+		if (pending.empty())
+		{
+			return -1;
+		}
+		passed = Server->getTimeMS() - first_pending_time;
+	}
+
+	if (passed < max_delay)
+	{
+		return static_cast<int>(max_delay - passed);
+	}
+
+	flush(filesdao, fileindex);
+	return flush_due(filesdao, fileindex);
+}
+
+void FileEntryBatch::flush(ServerFilesDao& filesdao, FileIndex& fileindex)
+{
+	IScopedLock flush_lock(flush_mutex);
+
+	std::vector<SEntry> entries;
+	{
+		IScopedLock lock(mutex);
+		entries.swap(pending);
+		pending.reserve(max_entries);
+	}
+
+	if (entries.empty())
+	{
+		return;
+	}
+
+	write(filesdao, fileindex, entries, true);
+
+	IScopedLock lock(mutex);
+	for (size_t i = 0; i < entries.size(); ++i)
+	{
+		pending_keys.erase(pending_keys.find(entry_key(entries[i])));
+	}
+}
+
+size_t FileEntryBatch::get_num_pending()
+{
+	IScopedLock lock(mutex);
+	return pending_keys.size();
+}
+
+bool FileEntryBatch::has_pending(const std::pair<std::string, int64>& key)
+{
+	IScopedLock lock(mutex);
+	return pending_keys.find(key) != pending_keys.end();
+}
+
+void FileEntryBatch::flush_pending(ServerFilesDao& filesdao, FileIndex& fileindex, const std::string& shahash, int64 filesize)
+{
+	std::pair<std::string, int64> key(shahash, filesize);
+
+	IScopedLock lock(batches_mutex);
+	for (std::set<FileEntryBatch*>::iterator it = batches.begin(); it != batches.end(); ++it)
+	{
+		if ((*it)->has_pending(key))
+		{
+			(*it)->flush(filesdao, fileindex);
+		}
+	}
+}
+
+void FileEntryBatch::flush_all(ServerFilesDao& filesdao, FileIndex& fileindex)
+{
+	IScopedLock lock(batches_mutex);
+	for (std::set<FileEntryBatch*>::iterator it = batches.begin(); it != batches.end(); ++it)
+	{
+		(*it)->flush(filesdao, fileindex);
+	}
+}
+
+void FileEntryBatch::write(ServerFilesDao& filesdao, FileIndex& fileindex, const std::vector<SEntry>& entries, bool with_transaction)
+{
+	bool with_index = false;
+	std::vector<const ServerFilesDao::SNewFileEntry*> files;
+	std::vector<size_t> file_entries;
+	std::vector<ServerFilesDao::SNewFileEntry> manifest_unwritten;
+	files.reserve(entries.size());
+	file_entries.reserve(entries.size());
+	for (size_t i = 0; i < entries.size(); ++i)
+	{
+		if (entries[i].manifest
+			&& FileManifest::is_enabled()
+			&& FileManifest::add_entry(entries[i].file, manifest_unwritten))
+		{
+			continue;
+		}
+
+		files.push_back(&entries[i].file);
+		file_entries.push_back(i);
+		if (entries[i].put_index)
+		{
+			with_index = true;
+		}
+	}
+
+	//Entries of a manifest block which could not be written (not in the file entry index)
+	for (size_t i = 0; i < manifest_unwritten.size(); ++i)
+	{
+		files.push_back(&manifest_unwritten[i]);
+	}
+
+	if (with_index)
+	{
+		FileIndex::start_add_entry();
+	}
+
+	if (with_transaction)
+	{
+		filesdao.BeginWriteTransaction();
+	}
+
+	for (size_t i = 0; i < entries.size(); ++i)
+	{
+		const SEntry& entry = entries[i];
+		if (entry.add_incoming)
+		{
+			filesdao.addIncomingFile(entry.file.filesize, entry.file.clientid, entry.file.backupid, entry.incoming_clients,
+				ServerFilesDao::c_direction_incoming, entry.file.incremental);
+		}
+		if (entry.clear_pointed_to != 0)
+		{
+			filesdao.setPointedTo(0, entry.clear_pointed_to);
+		}
+	}
+
+	std::vector<int64> ids = filesdao.addFileEntriesExternal(files);
+
+	//Only entries after the checkpoint are put into the index when replaying after an
+	//unclean shutdown. Entries with ids of deleted entries need an index journal entry
+	for (size_t i = 0; i < file_entries.size(); ++i)
+	{
+		const SEntry& entry = entries[file_entries[i]];
+		if (entry.put_index
+			&& FileIndex::may_be_checkpointed(ids[i]))
+		{
+			filesdao.addIndexJournalEntry(entry.file.shahash.substr(0, bytes_in_index), entry.file.filesize, entry.file.clientid, ids[i]);
+			FileIndex::added_journal_entry(filesdao.getLastId());
+		}
+	}
+
+	if (with_transaction)
+	{
+		filesdao.endTransaction();
+	}
+
+	if (!ids.empty())
+	{
+		FileIndex::added_file_entries(*std::max_element(ids.begin(), ids.end()));
+	}
+
+	for (size_t i = 0; i < file_entries.size(); ++i)
+	{
+		const SEntry& entry = entries[file_entries[i]];
+		if (entry.put_index)
+		{
+			FILEENTRY_DEBUG(Server->Log("New fileindex entry for \"" + entry.file.fullpath + "\""
+				" id=" + convert(ids[i])
+				+ " hash=" + base64_encode(reinterpret_cast<const unsigned char*>(entry.file.shahash.c_str()), bytes_in_index), LL_DEBUG));
+			fileindex.put_delayed(FileIndex::SIndexKey(entry.file.shahash.c_str(), entry.file.filesize, entry.file.clientid), ids[i]);
+		}
+	}
+
+	if (with_index)
+	{
+		FileIndex::end_add_entry();
+	}
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "../Interface/Types.h"
+#include "../Interface/Mutex.h"
+#include "dao/ServerFilesDao.h"
+#include <string>
+#include <vector>
+#include <set>
+#include <utility>
+
+class FileIndex;
+
+//Group commit of the file entries added while linking the files of a file
+//backup. The reads for an entry (its place in the hash chain, which clients
+//have the file) are done when it is added. The writes are collected and done
+//for all pending entries in one write transaction, with multi-row inserts,
+//after max_entries entries or after a delay.
+//Pending entries never have the same hash and file size, so their chains are
+//disjoint and the chain updates of the batch can be computed up front. Every
+//reader or writer of the chain of a hash calls flush_pending() first.
+class FileEntryBatch
+{
+public:
+	struct SEntry
+	{
+		SEntry()
+			: add_incoming(false), clear_pointed_to(0), put_index(false), manifest(false)
+		{
+		}
+
+		ServerFilesDao::SNewFileEntry file;
+		//Add an incoming statistics entry with these other clients
+		bool add_incoming;
+		std::string incoming_clients;
+		//The new entry takes over the file entry index entry of this entry
+		int64 clear_pointed_to;
+		bool put_index;
+		//Not used for deduplication. Goes into the manifest of the backup if it has one
+		bool manifest;
+	};
+
+	FileEntryBatch(size_t max_entries);
+	~FileEntryBatch();
+
+	static void init_mutex();
+
+	//Returns 1 if entries should be written immediately
+	static size_t get_default_max_entries();
+
+	void add(ServerFilesDao& filesdao, FileIndex& fileindex, const SEntry& entry);
+
+	//Flushes if the oldest pending entry waited for the maximum delay. Returns the time in ms
+	//until the next flush is due or -1 if nothing is pending
+	int flush_due(ServerFilesDao& filesdao, FileIndex& fileindex);
+
+	void flush(ServerFilesDao& filesdao, FileIndex& fileindex);
+
+	//Number of entries which are not written yet
+	size_t get_num_pending();
+
+	//Flushes the batches with a pending entry with this hash and file size.
+	//Must not be called inside a write transaction
+	static void flush_pending(ServerFilesDao& filesdao, FileIndex& fileindex, const std::string& shahash, int64 filesize);
+
+	static void flush_all(ServerFilesDao& filesdao, FileIndex& fileindex);
+
+	//Writes the entries (in one write transaction if with_transaction is set)
+	static void write(ServerFilesDao& filesdao, FileIndex& fileindex, const std::vector<SEntry>& entries, bool with_transaction);
+
+private:
+	bool has_pending(const std::pair<std::string, int64>& key);
+
+	IMutex* mutex;
+	//Held while writing, so the keys stay pending until the entries are written
+	IMutex* flush_mutex;
+	size_t max_entries;
+	std::vector<SEntry> pending;
+	std::multiset<std::pair<std::string, int64> > pending_keys;
+	int64 first_pending_time;
+
+	static IMutex* batches_mutex;
+	static std::set<FileEntryBatch*> batches;
+};
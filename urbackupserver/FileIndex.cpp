@@ -17,8 +17,15 @@
 **************************************************************************/
 
 #include "FileIndex.h"
+#include "FileIndexCache.h"
 #include "../Interface/Server.h"
 #include "create_files_index.h"
+#include "database.h"
+#include "dao/ServerFilesDao.h"
+#include "../Interface/DatabaseCursor.h"
+#include "../Interface/Query.h"
+#include "../common/data.h"
+#include <algorithm>
 
 const size_t max_buffer_size=100000;
 #ifdef _DEBUG
@@ -27,114 +34,256 @@ const unsigned int max_wait_time=1000;
 const unsigned int max_wait_time=30000;
 #endif
 const size_t min_size_no_wait=10000;
+const size_t c_create_commit_n = 10000;
 
-std::map<FileIndex::SIndexKey, int64> FileIndex::cache_buffer_1;
-std::map<FileIndex::SIndexKey, int64> FileIndex::cache_buffer_2;
-std::map<FileIndex::SIndexKey, int64>* FileIndex::active_cache_buffer=&cache_buffer_1;
-std::map<FileIndex::SIndexKey, int64>* FileIndex::other_cache_buffer=&cache_buffer_2;
+namespace
+{
+	struct SDataCallbackData
+	{
+		FileIndex::get_data_callback_t get_data_callback;
+		void* userdata;
+		size_t n_rows;
+	};
+
+	void data_entries_callback(size_t n_done, std::vector<FileIndex::SCreateEntry>& entries, void *userdata)
+	{
+		SDataCallbackData* data = reinterpret_cast<SDataCallbackData*>(userdata);
+
+		db_results res = data->get_data_callback(n_done, data->n_rows, data->userdata);
+
+		++data->n_rows;
+
+		for (size_t i = 0; i < res.size(); ++i)
+		{
+			const std::string& shahash = res[i]["shahash"];
+			FileIndex::SCreateEntry entry = {
+				FileIndex::SIndexKey(reinterpret_cast<const char*>(shahash.c_str()), watoi64(res[i]["filesize"]), watoi(res[i]["clientid"])),
+				watoi64(res[i]["id"]),
+				watoi64(res[i]["next_entry"]),
+				watoi64(res[i]["prev_entry"]),
+				watoi(res[i]["pointed_to"]) != 0 };
+			entries.push_back(entry);
+		}
+	}
 
+	void update_max(std::atomic<int64>& max_val, int64 val)
+	{
+		int64 curr = max_val.load();
+		while (val > curr
+			&& !max_val.compare_exchange_weak(curr, val))
+		{
+		}
+	}
 
+	//The index entry of a key points to the file entry with this key and pointed_to=1
+	bool is_index_target(ServerFilesDao& filesdao, const FileIndex::SIndexKey& key, int64 id)
+	{
+		ServerFilesDao::SFindFileEntry entry = filesdao.getFileEntry(id);
+		return entry.exists
+			&& entry.pointed_to != 0
+			&& entry.shahash.size() >= bytes_in_index
+			&& FileIndex::SIndexKey(entry.shahash.c_str(), entry.filesize, entry.clientid) == key;
+	}
+}
 
+FileIndexCache* FileIndex::cache=NULL;
+std::atomic<size_t> FileIndex::flush_generation(0);
+std::atomic<size_t> FileIndex::n_adding(0);
+std::atomic<int64> FileIndex::max_file_id(0);
+std::atomic<int64> FileIndex::max_journal_id(0);
+std::atomic<int64> FileIndex::flushed_journal_id(0);
 IMutex *FileIndex::mutex=NULL;
 ICondition *FileIndex::cond=NULL;
+ICondition *FileIndex::cond_space=NULL;
+std::atomic<size_t> FileIndex::n_cleared(0);
 bool FileIndex::do_shutdown=false;
 bool FileIndex::do_flush=false;
-bool FileIndex::do_accept = true;
+std::atomic<bool> FileIndex::do_accept(true);
 
 
-void FileIndex::operator()(void)
+void FileIndex::init_mutex()
 {
 	mutex=Server->createMutex();
 	cond=Server->createCondition();
+	cond_space=Server->createCondition();
+	cache=new FileIndexCache(max_buffer_size);
+}
+
+void FileIndex::operator()(void)
+{
+	FileIndexCache::entry_list_t entries;
+	int64 last_checkpoint_id=0;
 
 	while(true)
 	{
-		std::map<FileIndex::SIndexKey, int64>* local_buf;
-
 		{
 			IScopedLock lock(mutex);
 
 			if(do_shutdown &&
-				cache_buffer_1.empty() &&
-				cache_buffer_2.empty() )
+				cache->empty() )
 			{
 				break;
 			}
 
-			while(active_cache_buffer->empty() && !do_shutdown)
+			while(cache->get_num_pending()==0 && !do_shutdown)
 			{
 				do_flush=false;
 				int64 starttime=Server->getTimeMS();
 
-				while(active_cache_buffer->size()<min_size_no_wait
+				while(cache->get_num_pending()<min_size_no_wait
 					&& Server->getTimeMS()-starttime<max_wait_time
 					&& !do_shutdown && !do_flush)
 				{
 					cond->wait(&lock, max_wait_time);
 				}
-			}			
-
-			local_buf=active_cache_buffer;
-			
-			if(active_cache_buffer==&cache_buffer_1)
-			{
-				active_cache_buffer=&cache_buffer_2;
-				other_cache_buffer=&cache_buffer_1;
-			}
-			else
-			{
-				active_cache_buffer=&cache_buffer_1;
-				other_cache_buffer=&cache_buffer_2;
 			}
 		}
 
+		int64 checkpoint_id = max_file_id.load();
+		int64 journal_id = max_journal_id.load();
+
+		//A change with a smaller id may not have been put yet.
+		//Checked after reading the ids, so changes added before are put already.
+		if(n_adding.load()!=0)
+		{
+			checkpoint_id = 0;
+			journal_id = 0;
+		}
+
 		start_transaction();
 
-		for(std::map<FileIndex::SIndexKey, int64>::iterator it=local_buf->begin();
-			it!=local_buf->end();++it)
+		//Shards are ordered by hash prefix, so this writes in key order
+		for(size_t shard=0;shard<FileIndexCache::n_shards;++shard)
 		{
-			if(it->second!=0)
-			{
-				FILEENTRY_DEBUG(Server->Log("LMDB: PUT clientid=" + convert(it->first.getClientid()) 
-					+ " filesize=" + convert(it->first.getFilesize())
-					+ " hash=" + base64_encode(reinterpret_cast<const unsigned char*>(it->first.getHash()), bytes_in_index)
-					+ " target=" + convert(it->second), LL_DEBUG));
-				put(it->first, it->second);
-			}
-			else
+			entries.clear();
+			cache->swap_shard(shard, entries);
+
+			for(size_t i=0;i<entries.size();++i)
 			{
-				FILEENTRY_DEBUG(Server->Log("LMDB: DEL clientid=" + convert(it->first.getClientid()) 
-					+ " filesize=" + convert(it->first.getFilesize())
-					+ " hash="+base64_encode(reinterpret_cast<const unsigned char*>(it->first.getHash()), bytes_in_index), LL_DEBUG));
-				del(it->first);
+				const SIndexKey& key = entries[i].first;
+				if(entries[i].second!=0)
+				{
+					FILEENTRY_DEBUG(Server->Log("LMDB: PUT clientid=" + convert(key.getClientid()) 
+						+ " filesize=" + convert(key.getFilesize())
+						+ " hash=" + base64_encode(reinterpret_cast<const unsigned char*>(key.getHash()), bytes_in_index)
+						+ " target=" + convert(entries[i].second), LL_DEBUG));
+					put(key, entries[i].second);
+				}
+				else
+				{
+					FILEENTRY_DEBUG(Server->Log("LMDB: DEL clientid=" + convert(key.getClientid()) 
+						+ " filesize=" + convert(key.getFilesize())
+						+ " hash="+base64_encode(reinterpret_cast<const unsigned char*>(key.getHash()), bytes_in_index), LL_DEBUG));
+					del(key);
+				}
 			}
 		}
 
+		int64 commit_starttime = FileIndexStats::get_time_us();
 		commit_transaction();
+		FileIndexStats::add_latency(FileIndexStats::EHistogram_IndexCommit, FileIndexStats::get_time_us() - commit_starttime);
+
+		//Entries are in the index now, but prefetched lookups may not have seen them
+		++flush_generation;
+
+		if(checkpoint_id>last_checkpoint_id
+			&& !has_error())
+		{
+			set_checkpoint(checkpoint_id);
+			last_checkpoint_id=checkpoint_id;
+		}
+
+		if(journal_id>flushed_journal_id.load()
+			&& !has_error())
+		{
+			flushed_journal_id.store(journal_id);
+		}
+
+		for(size_t shard=0;shard<FileIndexCache::n_shards;++shard)
+		{
+			cache->clear_flushed_shard(shard);
+		}
+
+		FileIndexStats::set_flush_queue_depth(cache->get_num_pending());
 
 		{
 			IScopedLock lock(mutex);
-			local_buf->clear();
 			do_flush=false;
+			++n_cleared;
+			cond_space->notify_all();
 		}
 	}
 
+	Server->destroyDatabases(Server->getThreadID());
+
 	delete this;
 }
 
-void FileIndex::put_delayed(const SIndexKey& key, int64 value)
+void FileIndex::start_add_entry()
 {
-	IScopedLock lock(mutex);
+	++n_adding;
+}
+
+void FileIndex::end_add_entry()
+{
+	--n_adding;
+}
+
+void FileIndex::added_file_entries(int64 max_id)
+{
+	update_max(max_file_id, max_id);
+}
+
+bool FileIndex::may_be_checkpointed(int64 id)
+{
+	return id<=max_file_id.load();
+}
+
+void FileIndex::added_journal_entry(int64 journal_id)
+{
+	update_max(max_journal_id, journal_id);
+}
 
-	while(active_cache_buffer->size()>=max_buffer_size || !do_accept)
+int64 FileIndex::get_flushed_journal_id()
+{
+	return flushed_journal_id.load();
+}
+
+void FileIndex::put_delayed(const SIndexKey& key, int64 value)
+{
+	size_t n_pending;
+	while(true)
 	{
-		lock.relock(NULL);
-		Server->wait(10);
-		lock.relock(mutex);
+		//Read before the put, so a flush finishing in between is not missed
+		size_t curr_cleared=n_cleared.load();
+
+		if(do_accept
+			&& cache->put(key, value, n_pending))
+		{
+			break;
+		}
+
+		IScopedLock lock(mutex);
+		if(do_accept)
+		{
+			//Shard is full. Flush now instead of waiting for more entries
+			do_flush=true;
+			cond->notify_all();
+		}
+
+		while(n_cleared.load()==curr_cleared)
+		{
+			cond_space->wait(&lock);
+		}
 	}
 
-	(*active_cache_buffer)[key]=value;
-	cond->notify_all();
+	FileIndexStats::set_flush_queue_depth(n_pending);
+
+	if(n_pending==min_size_no_wait)
+	{
+		IScopedLock lock(mutex);
+		cond->notify_all();
+	}
 }
 
 void FileIndex::del_delayed(const SIndexKey& key)
@@ -144,58 +293,128 @@ void FileIndex::del_delayed(const SIndexKey& key)
 
 int64 FileIndex::get_with_cache(const FileIndex::SIndexKey& key)
 {
+	int64 ret;
+	if(cache!=NULL && cache->get(key, ret))
 	{
-		IScopedLock lock(mutex);
-
-		int64 ret;
-		if(get_from_cache(key, *active_cache_buffer, ret))
+		FileIndexStats::count(NULL, FileIndexStats::ECounter_CacheHit);
+		if(ret!=0)
 		{
 			return ret;
 		}
+		return get_after_cached_del(key, NULL);
+	}
+
+	int64 starttime = FileIndexStats::get_time_us();
+	ret = get_any_client(key);
+	count_index_read(starttime, ret!=0, NULL);
+	return ret;
+}
 
-		if(get_from_cache(key, *other_cache_buffer, ret))
+int64 FileIndex::get_with_cache_prefer_client(const SIndexKey& key)
+{
+	int64 ret;
+	if(cache!=NULL && cache->get_prefer_client(key, ret))
+	{
+		FileIndexStats::count(NULL, FileIndexStats::ECounter_CacheHit);
+		if(ret!=0)
 		{
 			return ret;
 		}
-
+		return get_after_cached_del(key, NULL);
 	}
 
-	return get_any_client(key);
+	int64 starttime = FileIndexStats::get_time_us();
+	ret = get_prefer_client(key);
+	count_index_read(starttime, ret!=0, NULL);
+	return ret;
 }
 
-int64 FileIndex::get_with_cache_prefer_client(const SIndexKey& key)
+void FileIndex::count_index_read(int64 starttime, bool found, FileIndexStats::SCounters* client_counters)
 {
+	FileIndexStats::add_latency(FileIndexStats::EHistogram_IndexRead, FileIndexStats::get_time_us() - starttime);
+	FileIndexStats::count(client_counters, found ? FileIndexStats::ECounter_IndexHit : FileIndexStats::ECounter_IndexMiss);
+}
+
+void FileIndex::prefetch_batch(const std::vector<SIndexKey>& keys, SBatchPrefetch& prefetch)
+{
+	//Has to be read before the index, so a flush during the lookup invalidates the results
+	prefetch.flush_generation = flush_generation.load();
+
+	int64 starttime = FileIndexStats::get_time_us();
+	std::vector<int64> res = get_batch(keys);
+	FileIndexStats::add_latency(FileIndexStats::EHistogram_IndexBatchRead, FileIndexStats::get_time_us() - starttime);
+
+	prefetch.entries.clear();
+	for(size_t i=0;i<keys.size();++i)
 	{
-		IScopedLock lock(mutex);
+		prefetch.entries[keys[i]] = res[i];
+	}
+}
 
-		int64 ret;
-		if(get_from_cache_prefer_client(key, *active_cache_buffer, ret))
+int64 FileIndex::get_with_cache_prefer_client(const SIndexKey& key, const SBatchPrefetch& prefetch, FileIndexStats::SCounters* client_counters)
+{
+	int64 ret;
+	if(cache!=NULL && cache->get_prefer_client(key, ret))
+	{
+		FileIndexStats::count(client_counters, FileIndexStats::ECounter_CacheHit);
+		if(ret!=0)
 		{
 			return ret;
 		}
+		return get_after_cached_del(key, client_counters);
+	}
 
-		if(get_from_cache_prefer_client(key, *other_cache_buffer, ret))
+	//Anything flushed since the prefetch is no longer in the cache
+	if(prefetch.flush_generation==flush_generation.load())
+	{
+		std::map<SIndexKey, int64>::const_iterator it = prefetch.entries.find(key);
+		if(it!=prefetch.entries.end())
 		{
-			return ret;
+			FileIndexStats::count(client_counters, FileIndexStats::ECounter_PrefetchHit);
+			return it->second;
 		}
 	}
 
-	return get_prefer_client(key);
+	int64 starttime = FileIndexStats::get_time_us();
+	ret = get_prefer_client(key);
+	count_index_read(starttime, ret!=0, client_counters);
+	return ret;
 }
 
-std::map<int, int64> FileIndex::get_all_clients_with_cache( const SIndexKey& key, bool with_del)
+int64 FileIndex::get_after_cached_del(const SIndexKey& key, FileIndexStats::SCounters* client_counters)
 {
-	std::map<int, int64> ret_cache;
+	//The cache only knows that one client does not have the file anymore. Other clients may have it
+	std::map<int, int64> all_clients = get_all_clients_with_cache(key, false, client_counters);
+	if(all_clients.empty())
+	{
+		return 0;
+	}
 
+	std::map<int, int64>::iterator it = all_clients.lower_bound(key.getClientid());
+	if(it==all_clients.end())
 	{
-		IScopedLock lock(mutex);
+		--it;
+	}
+	return it->second;
+}
 
-		get_from_cache_all_clients(key, *other_cache_buffer, ret_cache);
+std::map<int, int64> FileIndex::get_all_clients_with_cache( const SIndexKey& key, bool with_del, FileIndexStats::SCounters* client_counters)
+{
+	std::map<int, int64> ret_cache;
+
+	if(cache!=NULL)
+	{
+		cache->get_all_clients(key, ret_cache);
 
-		get_from_cache_all_clients(key, *active_cache_buffer, ret_cache);
+		if(!ret_cache.empty())
+		{
+			FileIndexStats::count(client_counters, FileIndexStats::ECounter_CacheHit);
+		}
 	}
 
+	int64 starttime = FileIndexStats::get_time_us();
 	std::map<int, int64> ret = get_all_clients(key);
+	count_index_read(starttime, !ret.empty(), client_counters);
 
 	for (std::map<int, int64>::iterator it = ret_cache.begin(); it != ret_cache.end();++it)
 	{
@@ -222,24 +441,19 @@ std::map<int, int64> FileIndex::get_all_clients_with_cache( const SIndexKey& key
 	return ret;
 }
 
-int64 FileIndex::get_with_cache_exact( const SIndexKey& key )
+int64 FileIndex::get_with_cache_exact( const SIndexKey& key, FileIndexStats::SCounters* client_counters)
 {
+	int64 ret;
+	if(cache!=NULL && cache->get_exact(key, ret))
 	{
-		IScopedLock lock(mutex);
-
-		int64 ret;
-		if(get_from_cache_exact(key, *active_cache_buffer, ret))
-		{
-			return ret;
-		}
-
-		if(get_from_cache_exact(key, *other_cache_buffer, ret))
-		{
-			return ret;
-		}
+		FileIndexStats::count(client_counters, FileIndexStats::ECounter_CacheHit);
+		return ret;
 	}
 
-	return get(key);
+	int64 starttime = FileIndexStats::get_time_us();
+	ret = get(key);
+	count_index_read(starttime, ret!=0, client_counters);
+	return ret;
 }
 
 void FileIndex::shutdown()
@@ -250,87 +464,343 @@ void FileIndex::shutdown()
 	cond->notify_all();
 }
 
-bool FileIndex::get_from_cache( const FileIndex::SIndexKey &key, const std::map<SIndexKey, int64>& cache, int64& res )
+void FileIndex::flush()
 {
-	std::map<FileIndex::SIndexKey, int64>::const_iterator it=cache.lower_bound(key);
+	IScopedLock lock(mutex);
+
+	do_flush=true;
 
-	if(it!=cache.end() &&
-		it->first.isEqualWithoutClientid(key))
+	while(do_flush)
 	{
-		res = it->second;
-		return true;
+		cond->notify_all();
+		lock.relock(NULL);
+		Server->wait(100);
+		lock.relock(mutex);
 	}
+}
+
+void FileIndex::stop_accept()
+{
+	IScopedLock lock(mutex);
+	do_accept = false;
+}
+
+void FileIndex::create(get_data_callback_t get_data_callback, void *userdata)
+{
+	SDataCallbackData data;
+	data.get_data_callback = get_data_callback;
+	data.userdata = userdata;
+	data.n_rows = 0;
 
-	return false;
+	create_sorted(data_entries_callback, &data);
 }
 
-bool FileIndex::get_from_cache_prefer_client( const SIndexKey &key, const std::map<SIndexKey, int64>& cache, int64& res)
+void FileIndex::create_sorted(get_entries_callback_t get_entries_callback, void *userdata)
 {
-	std::map<FileIndex::SIndexKey, int64>::const_iterator start_it=cache.lower_bound(key);
+	start_transaction();
 
-	if(start_it!=cache.end()
-		&& start_it->first.isEqualWithoutClientid(key) )
-	{
-		res=start_it->second;
-		return true;
-	}
+	IDatabase *db=Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER_FILES_NEW);
+
+	ServerFilesDao filesdao(db);
 
-	if(start_it!=cache.end() &&
-		start_it!=cache.begin())
+	size_t n_done=0;
+	int64 max_id=0;
+
+	SIndexKey last;
+	int64 last_prev_entry;
+	int64 last_id;
+	std::vector<SCreateEntry> entries;
+	do
 	{
-		--start_it;
+		entries.clear();
+		get_entries_callback(n_done, entries, userdata);
 
-		if( start_it->first.isEqualWithoutClientid(key) )
+		for(size_t i=0;i<entries.size();++i)
 		{
-			res=start_it->second;
-			return true;
-		}
+			const SIndexKey& key = entries[i].key;
+			int64 id = entries[i].id;
+			int64 next_entry = entries[i].next_entry;
+			int64 prev_entry = entries[i].prev_entry;
+			bool pointed_to = entries[i].pointed_to;
+
+			max_id = (std::max)(max_id, id);
+
+			assert(memcmp(&last, &key, sizeof(SIndexKey))!=1);
+
+			if(key==last)
+			{
+				if(last_prev_entry==0)
+				{
+					filesdao.setPrevEntry(id, last_id);
+				}
+
+				if(next_entry==0
+					&& (last_prev_entry==0 || last_prev_entry==id) )
+				{
+					filesdao.setNextEntry(last_id, id);
+				}
+
+				if(pointed_to)
+				{
+					filesdao.setPointedTo(0, id);
+				}
+
+				last=key;
+				last_id=id;
+				last_prev_entry=prev_entry;
+
+				continue;
+			}
+			else
+			{
+				if(!pointed_to)
+				{
+					filesdao.setPointedTo(1, id);
+				}
+			}
+			
+			put_sorted(key, id);
+
+			if(has_error())
+			{
+				Server->Log("File entry index error after putting element. Error state interrupting..", LL_ERROR);
+				return;
+			}
+
+			if(n_done % 1000 == 0 && n_done>0)
+			{
+				if ((Server->getFailBits() & IServer::FAIL_DATABASE_CORRUPTED) ||
+					(Server->getFailBits() & IServer::FAIL_DATABASE_IOERR) ||
+					(Server->getFailBits() & IServer::FAIL_DATABASE_FULL))
+				{
+					Server->Log("Database error. Stopping.", LL_ERROR);
+					return;
+				}
+				Server->Log("File entry index contains "+convert(n_done)+" entries now.", LL_INFO);
+			}
+
+			if(n_done % c_create_commit_n == 0 && n_done>0)
+			{
+				commit_transaction();
+				start_transaction();
+			}
+
+			++n_done;
+
+			last=key;
+			last_id=id;
+			last_prev_entry=prev_entry;
+		}		
 	}
+	while(!entries.empty());
+
+	commit_transaction();
 
-	return false;
+	if (!has_error())
+	{
+		set_checkpoint(max_id);
+		added_file_entries(max_id);
+	}
+
+	create_finished();
 }
 
-void FileIndex::get_from_cache_all_clients( const SIndexKey &key, const std::map<SIndexKey, int64>& cache, std::map<int, int64> &ret )
+void FileIndex::put_sorted(const SIndexKey& key, int64 value)
 {
-	std::map<FileIndex::SIndexKey, int64>::const_iterator it=cache.lower_bound(key);
+	put(key, value);
+}
 
-	for(;it!=cache.end()
-		&& it->first.isEqualWithoutClientid(key); ++it)
-	{
-		ret[it->first.getClientid()]=it->second;
-	}
+void FileIndex::create_finished()
+{
 }
 
-bool FileIndex::get_from_cache_exact( const SIndexKey& key, const std::map<SIndexKey, int64>& cache, int64& res )
+bool FileIndex::replay_after_checkpoint()
 {
-	std::map<FileIndex::SIndexKey, int64>::const_iterator it=cache.find(key);
+	IDatabase* db = Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER_FILES);
+	if (db == NULL)
+	{
+		return false;
+	}
+
+	ServerFilesDao filesdao(db);
+
+	ServerFilesDao::CondInt64 max_file = filesdao.getMaxFileId();
+	int64 max_id = max_file.exists ? max_file.value : 0;
+	added_file_entries(max_id);
 
-	if(it!=cache.end())
+	int64 checkpoint = get_checkpoint();
+	if (checkpoint < 0)
 	{
-		res=it->second;
-		return true;
+		Server->Log("File entry index has no checkpoint. Entries not written to it before an unclean shutdown cannot be recovered.", LL_INFO);
+		return replay_journal(filesdao);
 	}
 
-	return false;
-}
+	if (max_id < checkpoint)
+	{
+		//File entries were rolled back. Their ids are used again
+		set_checkpoint(max_id);
+	}
 
-void FileIndex::flush()
-{
-	IScopedLock lock(mutex);
+	if (max_id <= checkpoint)
+	{
+		return replay_journal(filesdao);
+	}
 
-	do_flush=true;
+	Server->Log("Replaying file entries added after file entry index checkpoint (ids " + convert(checkpoint + 1) + " to " + convert(max_id) + ")...", LL_INFO);
 
-	while(do_flush)
+	//Index entries point to the file entry with pointed_to=1
+	IQuery* q_replay = db->Prepare("SELECT id, shahash, filesize, clientid FROM files WHERE id>? AND id<=? AND pointed_to=1 ORDER BY id ASC", false);
+	q_replay->Bind(checkpoint);
+	q_replay->Bind(max_id);
+
+	size_t n_replayed = 0;
+	bool read_error;
 	{
-		cond->notify_all();
-		lock.relock(NULL);
-		Server->wait(100);
-		lock.relock(mutex);
+		ScopedDatabaseCursor cur(q_replay->Cursor());
+
+		start_transaction();
+
+		db_single_result row;
+		while (!has_error() && cur.next(row))
+		{
+			const std::string& shahash = row["shahash"];
+			if (shahash.size() < bytes_in_index)
+			{
+				continue;
+			}
+
+			put(SIndexKey(shahash.c_str(), watoi64(row["filesize"]), watoi(row["clientid"])), watoi64(row["id"]));
+
+			++n_replayed;
+
+			if (n_replayed % c_create_commit_n == 0)
+			{
+				commit_transaction();
+				start_transaction();
+			}
+		}
+
+		commit_transaction();
+
+		read_error = cur.has_error();
 	}
+
+	db->destroyQuery(q_replay);
+
+	if (has_error() || read_error)
+	{
+		return false;
+	}
+
+	set_checkpoint(max_id);
+
+	Server->Log("Replayed " + convert(n_replayed) + " file entry index entries", LL_INFO);
+
+	return replay_journal(filesdao);
 }
 
-void FileIndex::stop_accept()
+bool FileIndex::replay_journal(ServerFilesDao& filesdao)
 {
-	IScopedLock lock(mutex);
-	do_accept = false;
+	int64 next_id = 0;
+	int64 last_id = 0;
+	size_t n_journal = 0;
+	size_t n_changed = 0;
+
+	while (true)
+	{
+		std::vector<ServerFilesDao::SIndexJournalEntry> journal = filesdao.getIndexJournalEntries(next_id, c_create_commit_n);
+		if (journal.empty())
+		{
+			break;
+		}
+
+		if (n_journal == 0)
+		{
+			Server->Log("Redoing file entry index changes in index journal...", LL_INFO);
+		}
+
+		n_journal += journal.size();
+		last_id = journal.back().id;
+		next_id = last_id + 1;
+
+		//The changes may be partially in the index and may be in a different order than the
+		//file entry changes. The index entry is set to the file entry the files table says it
+		//should point to, which is one of the change targets or the current index entry
+		std::map<SIndexKey, std::vector<int64> > key_targets;
+		for (size_t i = 0; i < journal.size(); ++i)
+		{
+			const ServerFilesDao::SIndexJournalEntry& entry = journal[i];
+			if (entry.shahash.size() < bytes_in_index)
+			{
+				continue;
+			}
+
+			std::vector<int64>& targets = key_targets[SIndexKey(entry.shahash.c_str(), entry.filesize, entry.clientid)];
+			if (entry.target != 0)
+			{
+				targets.push_back(entry.target);
+			}
+		}
+
+		std::vector<std::pair<SIndexKey, int64> > changes;
+		for (std::map<SIndexKey, std::vector<int64> >::iterator it = key_targets.begin(); it != key_targets.end(); ++it)
+		{
+			int64 curr = get(it->first);
+
+			std::vector<int64>& targets = it->second;
+			if (curr != 0)
+			{
+				targets.push_back(curr);
+			}
+
+			int64 new_target = 0;
+			for (size_t i = 0; i < targets.size(); ++i)
+			{
+				if (targets[i] > new_target
+					&& is_index_target(filesdao, it->first, targets[i]))
+				{
+					new_target = targets[i];
+				}
+			}
+
+			if (new_target != curr)
+			{
+				changes.push_back(std::make_pair(it->first, new_target));
+			}
+		}
+
+		start_transaction();
+
+		for (size_t i = 0; i < changes.size(); ++i)
+		{
+			if (changes[i].second != 0)
+			{
+				put(changes[i].first, changes[i].second);
+			}
+			else
+			{
+				del(changes[i].first);
+			}
+		}
+
+		commit_transaction();
+
+		if (has_error())
+		{
+			return false;
+		}
+
+		n_changed += changes.size();
+	}
+
+	if (n_journal == 0)
+	{
+		return true;
+	}
+
+	filesdao.delIndexJournalEntriesUpTo(last_id);
+
+	Server->Log("Redid " + convert(n_journal) + " file entry index journal entries. Changed " + convert(n_changed) + " index entries", LL_INFO);
+
+	return true;
 }
@@ -7,9 +7,15 @@
 #include "../Interface/Thread.h"
 #include <memory.h>
 #include "../stringtools.h"
+#include "FileIndexStats.h"
 #include <assert.h>
+#include <atomic>
+#include <vector>
 
 const size_t bytes_in_index = 16;
+
+class FileIndexCache;
+class ServerFilesDao;
 
 class FileIndex : public IThread
 {
@@ -92,11 +98,27 @@ public:
 	};
 #pragma pack()
 
+	struct SCreateEntry
+	{
+		SIndexKey key;
+		int64 id;
+		int64 next_entry;
+		int64 prev_entry;
+		bool pointed_to;
+	};
+
+	//Appends the next entries (sorted by key, newest first) to entries. No more entries if it appends nothing.
+	typedef void(*get_entries_callback_t)(size_t n_done, std::vector<SCreateEntry>& entries, void *userdata);
+
 	virtual ~FileIndex(void) {};
 
 	virtual bool has_error(void)=0;
 
-	virtual void create(get_data_callback_t get_data_callback, void *userdata)=0;
+	//Index creation and replay_after_checkpoint() are shared by the backends. They only use
+	//the transaction, put/del and checkpoint functions below and the protected hooks
+	virtual void create(get_data_callback_t get_data_callback, void *userdata);
+
+	virtual void create_sorted(get_entries_callback_t get_entries_callback, void *userdata);
 
 	virtual int64 get(const SIndexKey& key)=0;
 
@@ -106,6 +128,9 @@ public:
 
 	virtual std::map<int, int64> get_all_clients(const SIndexKey& key) = 0;
 
+	//get_prefer_client() for multiple keys. Returns the results in the order of keys
+	virtual std::vector<int64> get_batch(const std::vector<SIndexKey>& keys) = 0;
+
 	virtual void start_transaction(void)=0;
 
 	virtual void put(const SIndexKey& key, int64 value)=0;
@@ -114,16 +139,59 @@ public:
 
 	virtual int64 get_with_cache(const SIndexKey& key);
 
-	virtual int64 get_with_cache_exact(const SIndexKey& key);
+	virtual int64 get_with_cache_exact(const SIndexKey& key, FileIndexStats::SCounters* client_counters=NULL);
 
-	virtual std::map<int, int64> get_all_clients_with_cache(const SIndexKey& key, bool with_del);
+	virtual std::map<int, int64> get_all_clients_with_cache(const SIndexKey& key, bool with_del, FileIndexStats::SCounters* client_counters=NULL);
 
 	virtual int64 get_with_cache_prefer_client(const SIndexKey& key);
 
+	struct SBatchPrefetch
+	{
+		SBatchPrefetch()
+			: flush_generation(0) {}
+
+		std::map<SIndexKey, int64> entries;
+		size_t flush_generation;
+	};
+
+	//Looks up keys with get_batch(). The results are only used by
+	//get_with_cache_prefer_client() until the next flush of the cache
+	void prefetch_batch(const std::vector<SIndexKey>& keys, SBatchPrefetch& prefetch);
+
+	int64 get_with_cache_prefer_client(const SIndexKey& key, const SBatchPrefetch& prefetch, FileIndexStats::SCounters* client_counters=NULL);
+
 	virtual void del(const SIndexKey& key)=0;
 
 	static void del_delayed(const SIndexKey& key);
 
+	//Has to bracket adding a file entry whose index entry is added with put_delayed() and adding
+	//an index journal entry, so the writer knows when all changes up to an id are in the index
+	static void start_add_entry();
+	static void end_add_entry();
+
+	//Records the highest id of committed file entries (before end_add_entry())
+	static void added_file_entries(int64 max_id);
+
+	//True if a checkpoint may include the file entry id. SQLite uses the ids of the
+	//file entries with the highest ids again after they are deleted
+	static bool may_be_checkpointed(int64 id);
+
+	//Records the id of an index journal entry (before end_add_entry())
+	static void added_journal_entry(int64 journal_id);
+
+	//Index journal entries up to this id are in the index and can be deleted
+	static int64 get_flushed_journal_id();
+
+	//Records that the index contains the entries of all file entries up to files_id
+	virtual void set_checkpoint(int64 files_id)=0;
+
+	//Returns -1 if the index has no checkpoint
+	virtual int64 get_checkpoint()=0;
+
+	//Puts the file entries added after the checkpoint into the index and redoes the
+	//changes in the index journal
+	bool replay_after_checkpoint();
+
 	virtual void commit_transaction(void)=0;
 
 	virtual void start_iteration()=0;
@@ -132,6 +200,9 @@ public:
 
 	virtual void stop_iteration()=0;
 
+	//Creates the write-behind cache, so entries can be put before the writer runs
+	static void init_mutex();
+
 	void operator()(void);
 
 	static void shutdown();
@@ -140,25 +211,36 @@ public:
 
 	static void stop_accept();
 
-private:
+protected:
+	//Called by create_sorted() with keys in ascending order. Defaults to put()
+	virtual void put_sorted(const SIndexKey& key, int64 value);
+
+	//Called after create() or create_sorted() committed all entries and set the checkpoint
+	virtual void create_finished();
 
-	bool get_from_cache( const FileIndex::SIndexKey &key, const std::map<SIndexKey, int64>& cache, int64& res );
+private:
 
-	bool get_from_cache_prefer_client( const SIndexKey &key, const std::map<SIndexKey, int64>& cache, int64& res);
+	bool replay_journal(ServerFilesDao& filesdao);
 
-	bool get_from_cache_exact( const SIndexKey& key, const std::map<SIndexKey, int64>& cache, int64& res );
+	//Lookup preferring the client of key after the cache returned a deleted entry
+	int64 get_after_cached_del(const SIndexKey& key, FileIndexStats::SCounters* client_counters);
 
-	void get_from_cache_all_clients( const SIndexKey &key, const std::map<SIndexKey, int64>& cache, std::map<int, int64> &ret );
+	static void count_index_read(int64 starttime, bool found, FileIndexStats::SCounters* client_counters);
 
-	static std::map<SIndexKey, int64> cache_buffer_1;
-	static std::map<SIndexKey, int64> cache_buffer_2;
-	static std::map<SIndexKey, int64>* active_cache_buffer;
-	static std::map<SIndexKey, int64>* other_cache_buffer;
-	static std::map<SIndexKey, bool> del_buffer;
+	static FileIndexCache* cache;
+	static std::atomic<size_t> flush_generation;
+	static std::atomic<size_t> n_adding;
+	static std::atomic<int64> max_file_id;
+	static std::atomic<int64> max_journal_id;
+	static std::atomic<int64> flushed_journal_id;
+	//Number of flushes which freed the flushed entries of the cache (changed with mutex)
+	static std::atomic<size_t> n_cleared;
 	static IMutex *mutex;
 	static ICondition *cond;
+	//Signaled after a flush freed space in the cache
+	static ICondition *cond_space;
 	static bool do_shutdown;
 
 	static bool do_flush;
-	static bool do_accept;
+	static std::atomic<bool> do_accept;
 };
\ No newline at end of file
@@ -0,0 +1,319 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "FileIndexCache.h"
+#include "../Interface/Server.h"
+#include <algorithm>
+
+FileIndexCache::FileIndexCache(size_t max_entries)
+	: num_pending(0)
+{
+	//Hashes are uniformly distributed, so allow some slack per shard
+	shard_max_entries = (std::max)(max_entries / n_shards + max_entries / n_shards / 4, static_cast<size_t>(16));
+
+	//Keep load factor below 0.5 so linear probing stays short
+	shard_capacity = 1;
+	while (shard_capacity < shard_max_entries * 2)
+	{
+		shard_capacity *= 2;
+	}
+
+	for (size_t i = 0; i < n_shards; ++i)
+	{
+		SShard& shard = shards[i];
+		shard.mutex = Server->createSharedMutex();
+		shard.active = 0;
+		for (size_t j = 0; j < 2; ++j)
+		{
+			STable& table = shard.tables[j];
+			table.keys = new SIndexKey[shard_capacity];
+			table.values = new int64[shard_capacity];
+			table.used = new char[shard_capacity];
+			memset(table.used, 0, shard_capacity);
+			table.n_used = 0;
+		}
+	}
+}
+
+FileIndexCache::~FileIndexCache()
+{
+	for (size_t i = 0; i < n_shards; ++i)
+	{
+		SShard& shard = shards[i];
+		Server->destroy(shard.mutex);
+		for (size_t j = 0; j < 2; ++j)
+		{
+			delete[] shard.tables[j].keys;
+			delete[] shard.tables[j].values;
+			delete[] shard.tables[j].used;
+		}
+	}
+}
+
+size_t FileIndexCache::get_shard(const SIndexKey& key)
+{
+	return static_cast<unsigned char>(key.getHash()[0]) >> (8 - shard_bits);
+}
+
+size_t FileIndexCache::slot_start(const SIndexKey& key)
+{
+	//Do not include the clientid, so that all entries of a file are in one probe sequence
+	uint64 h;
+	memcpy(&h, key.getHash() + 1, sizeof(h));
+	h ^= static_cast<uint64>(key.getFilesize())*0x9E3779B97F4A7C15ULL;
+	h ^= h >> 29;
+	return static_cast<size_t>(h) & (shard_capacity - 1);
+}
+
+bool FileIndexCache::put(const SIndexKey& key, int64 value, size_t& n_pending)
+{
+	SShard& shard = shards[get_shard(key)];
+
+	IScopedWriteLock lock(shard.mutex);
+
+	STable& table = shard.tables[shard.active];
+
+	size_t mask = shard_capacity - 1;
+	size_t idx = slot_start(key);
+	while (table.used[idx])
+	{
+		if (table.keys[idx] == key)
+		{
+			table.values[idx] = value;
+			n_pending = num_pending.load();
+			return true;
+		}
+		idx = (idx + 1) & mask;
+	}
+
+	if (table.n_used >= shard_max_entries)
+	{
+		n_pending = num_pending.load();
+		return false;
+	}
+
+	table.keys[idx] = key;
+	table.values[idx] = value;
+	table.used[idx] = 1;
+	++table.n_used;
+
+	n_pending = ++num_pending;
+
+	return true;
+}
+
+void FileIndexCache::collect_matches(const STable& table, const SIndexKey& key, std::vector<SMatch>& matches)
+{
+	size_t mask = shard_capacity - 1;
+	size_t idx = slot_start(key);
+	for (size_t i = 0; i < shard_capacity && table.used[idx]; ++i)
+	{
+		if (table.keys[idx].isEqualWithoutClientid(key))
+		{
+			SMatch match = { table.keys[idx].getClientid(), table.values[idx] };
+			matches.push_back(match);
+		}
+		idx = (idx + 1) & mask;
+	}
+}
+
+void FileIndexCache::read_matches(const SIndexKey& key, std::vector<SMatch>& active_matches, std::vector<SMatch>& flushing_matches)
+{
+	const SShard& shard = shards[get_shard(key)];
+
+	IScopedReadLock lock(shard.mutex);
+
+	collect_matches(shard.tables[shard.active], key, active_matches);
+	collect_matches(shard.tables[1 - shard.active], key, flushing_matches);
+}
+
+bool FileIndexCache::find_lower_bound(const std::vector<SMatch>& matches, int clientid, int64& res)
+{
+	bool found = false;
+	int found_clientid = 0;
+	for (size_t i = 0; i < matches.size(); ++i)
+	{
+		if (matches[i].clientid >= clientid
+			&& (!found || matches[i].clientid < found_clientid))
+		{
+			found = true;
+			found_clientid = matches[i].clientid;
+			res = matches[i].value;
+		}
+	}
+	return found;
+}
+
+bool FileIndexCache::find_before(const std::vector<SMatch>& matches, int clientid, int64& res)
+{
+	bool found = false;
+	int found_clientid = 0;
+	for (size_t i = 0; i < matches.size(); ++i)
+	{
+		if (matches[i].clientid < clientid
+			&& (!found || matches[i].clientid > found_clientid))
+		{
+			found = true;
+			found_clientid = matches[i].clientid;
+			res = matches[i].value;
+		}
+	}
+	return found;
+}
+
+bool FileIndexCache::get(const SIndexKey& key, int64& res)
+{
+	std::vector<SMatch> active_matches;
+	std::vector<SMatch> flushing_matches;
+	read_matches(key, active_matches, flushing_matches);
+
+	return find_lower_bound(active_matches, key.getClientid(), res)
+		|| find_lower_bound(flushing_matches, key.getClientid(), res);
+}
+
+bool FileIndexCache::get_prefer_client(const SIndexKey& key, int64& res)
+{
+	std::vector<SMatch> active_matches;
+	std::vector<SMatch> flushing_matches;
+	read_matches(key, active_matches, flushing_matches);
+
+	return find_lower_bound(active_matches, key.getClientid(), res)
+		|| find_before(active_matches, key.getClientid(), res)
+		|| find_lower_bound(flushing_matches, key.getClientid(), res)
+		|| find_before(flushing_matches, key.getClientid(), res);
+}
+
+bool FileIndexCache::get_exact(const SIndexKey& key, int64& res)
+{
+	std::vector<SMatch> active_matches;
+	std::vector<SMatch> flushing_matches;
+	read_matches(key, active_matches, flushing_matches);
+
+	int clientid = key.getClientid();
+
+	for (size_t i = 0; i < active_matches.size(); ++i)
+	{
+		if (active_matches[i].clientid == clientid)
+		{
+			res = active_matches[i].value;
+			return true;
+		}
+	}
+
+	for (size_t i = 0; i < flushing_matches.size(); ++i)
+	{
+		if (flushing_matches[i].clientid == clientid)
+		{
+			res = flushing_matches[i].value;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void FileIndexCache::get_all_clients(const SIndexKey& key, std::map<int, int64>& ret)
+{
+	std::vector<SMatch> active_matches;
+	std::vector<SMatch> flushing_matches;
+	read_matches(key, active_matches, flushing_matches);
+
+	for (size_t i = 0; i < flushing_matches.size(); ++i)
+	{
+		ret[flushing_matches[i].clientid] = flushing_matches[i].value;
+	}
+
+	for (size_t i = 0; i < active_matches.size(); ++i)
+	{
+		ret[active_matches[i].clientid] = active_matches[i].value;
+	}
+}
+
+size_t FileIndexCache::get_num_pending()
+{
+	return num_pending.load();
+}
+
+bool FileIndexCache::empty()
+{
+	if (num_pending.load() != 0)
+	{
+		return false;
+	}
+
+	for (size_t i = 0; i < n_shards; ++i)
+	{
+		IScopedReadLock lock(shards[i].mutex);
+		if (shards[i].tables[1 - shards[i].active].n_used != 0)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void FileIndexCache::swap_shard(size_t shard_idx, entry_list_t& entries)
+{
+	SShard& shard = shards[shard_idx];
+
+	size_t flushing;
+	{
+		IScopedWriteLock lock(shard.mutex);
+
+		size_t active = shard.active;
+		assert(shard.tables[1 - active].n_used == 0);
+
+		shard.active = 1 - active;
+
+		num_pending -= shard.tables[active].n_used;
+
+		flushing = active;
+	}
+
+	//Only put() modifies the active table and only the flusher modifies this one,
+	//so it can be read without lock
+	const STable& table = shard.tables[flushing];
+	size_t start = entries.size();
+	for (size_t i = 0; i < shard_capacity; ++i)
+	{
+		if (table.used[i])
+		{
+			entries.push_back(std::make_pair(table.keys[i], table.values[i]));
+		}
+	}
+
+	std::sort(entries.begin() + start, entries.end());
+}
+
+void FileIndexCache::clear_flushed_shard(size_t shard_idx)
+{
+	SShard& shard = shards[shard_idx];
+
+	IScopedWriteLock lock(shard.mutex);
+
+	STable& table = shard.tables[1 - shard.active];
+
+	if (table.n_used == 0)
+	{
+		return;
+	}
+
+	memset(table.used, 0, shard_capacity);
+	table.n_used = 0;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "FileIndex.h"
+#include "../Interface/SharedMutex.h"
+#include <atomic>
+#include <vector>
+#include <map>
+
+//Write-behind cache for the file entry index. Entries are partitioned into
+//shards by the leading bits of the hash, so iterating the shards in order
+//and sorting each one yields the keys in LMDB key order.
+//Each shard has its own shared lock. Lookups take it shared, so they only
+//wait for puts to the same shard and not for each other.
+class FileIndexCache
+{
+public:
+	typedef FileIndex::SIndexKey SIndexKey;
+	typedef std::vector<std::pair<SIndexKey, int64> > entry_list_t;
+
+	static const size_t shard_bits = 6;
+	static const size_t n_shards = 1 << shard_bits;
+
+	FileIndexCache(size_t max_entries);
+	~FileIndexCache();
+
+	//Returns false if the shard of key is full. Value 0 marks a deletion.
+	//n_pending is set to the number of pending entries after the put.
+	bool put(const SIndexKey& key, int64 value, size_t& n_pending);
+
+	//Entry with the same hash/filesize and smallest clientid >= key's clientid
+	bool get(const SIndexKey& key, int64& res);
+
+	//Like get(), but falls back to the entry with the largest clientid < key's clientid
+	bool get_prefer_client(const SIndexKey& key, int64& res);
+
+	bool get_exact(const SIndexKey& key, int64& res);
+
+	void get_all_clients(const SIndexKey& key, std::map<int, int64>& ret);
+
+	//Number of entries not yet handed to the flusher
+	size_t get_num_pending();
+
+	bool empty();
+
+	//Makes the pending entries of the shard the ones being flushed
+	//and appends them to entries in key order. Until clear_flushed_shard()
+	//is called they are still visible to readers.
+	void swap_shard(size_t shard, entry_list_t& entries);
+
+	void clear_flushed_shard(size_t shard);
+
+	static size_t get_shard(const SIndexKey& key);
+
+private:
+	struct STable
+	{
+		SIndexKey* keys;
+		int64* values;
+		char* used;
+		size_t n_used;
+	};
+
+	struct SMatch
+	{
+		int clientid;
+		int64 value;
+	};
+
+	struct SShard
+	{
+		ISharedMutex* mutex;
+		size_t active;
+		STable tables[2];
+	};
+
+	size_t slot_start(const SIndexKey& key);
+
+	void read_matches(const SIndexKey& key, std::vector<SMatch>& active_matches, std::vector<SMatch>& flushing_matches);
+
+	void collect_matches(const STable& table, const SIndexKey& key, std::vector<SMatch>& matches);
+
+	static bool find_lower_bound(const std::vector<SMatch>& matches, int clientid, int64& res);
+	static bool find_before(const std::vector<SMatch>& matches, int clientid, int64& res);
+
+	SShard shards[n_shards];
+	size_t shard_capacity;
+	size_t shard_max_entries;
+	std::atomic<size_t> num_pending;
+};
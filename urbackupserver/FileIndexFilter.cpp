@@ -0,0 +1,291 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "FileIndexFilter.h"
+#include "../Interface/Server.h"
+#include "../stringtools.h"
+#include "../urbackupcommon/os_functions.h"
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace
+{
+	const char filter_magic[] = "UBFIDXF1";
+	const _u32 filter_version = 1;
+	//One block is a cache line
+	const size_t block_bytes = 64;
+	const _u32 block_bits = block_bytes * 8;
+	const int64 min_capacity = 1000000;
+	const _u32 max_bits_set = 16;
+
+	uint64 rotl64(uint64 x, int r)
+	{
+		return (x << r) | (x >> (64 - r));
+	}
+
+	//The writer sets bits while readers test them
+	void or_bits(unsigned char* p, unsigned char mask)
+	{
+#ifdef _MSC_VER
+		_InterlockedOr8(reinterpret_cast<volatile char*>(p), static_cast<char>(mask));
+#else
+		__sync_fetch_and_or(p, mask);
+#endif
+	}
+
+	unsigned char load_bits(const unsigned char* p)
+	{
+#ifdef _MSC_VER
+		return *reinterpret_cast<const volatile unsigned char*>(p);
+#else
+		return __atomic_load_n(p, __ATOMIC_RELAXED);
+#endif
+	}
+}
+
+FileIndexFilter::FileIndexFilter()
+	: header(NULL), blocks(NULL),
+	n_negative(0), n_positive(0), n_false_positive(0)
+{
+}
+
+FileIndexFilter::~FileIndexFilter()
+{
+	close_file();
+}
+
+bool FileIndexFilter::map_file(int64 size)
+{
+	if (!view.map(file.get(), size))
+	{
+		return false;
+	}
+	header = reinterpret_cast<SHeader*>(view.data());
+	blocks = reinterpret_cast<unsigned char*>(view.data() + sizeof(SHeader));
+	return true;
+}
+
+void FileIndexFilter::close_file()
+{
+	view.unmap();
+	header = NULL;
+	blocks = NULL;
+	file.reset();
+}
+
+bool FileIndexFilter::open(const std::string& fn)
+{
+	close_file();
+
+	file.reset(Server->openFile(fn, MODE_RW));
+	if (file.get() == NULL)
+	{
+		return false;
+	}
+
+	int64 fsize = file->Size();
+	if (fsize < static_cast<int64>(sizeof(SHeader)))
+	{
+		Server->Log("File index filter \"" + fn + "\" is too small", LL_WARNING);
+		close_file();
+		return false;
+	}
+
+	if (!map_file(fsize))
+	{
+		Server->Log("Error mapping file index filter \"" + fn + "\". " + os_last_error_str(), LL_ERROR);
+		close_file();
+		return false;
+	}
+
+	if (memcmp(header->magic, filter_magic, sizeof(header->magic)) != 0
+		|| header->version != filter_version
+		|| header->n_bits_set == 0 || header->n_bits_set > max_bits_set
+		|| header->n_blocks <= 0
+		|| static_cast<int64>(sizeof(SHeader)) + header->n_blocks*static_cast<int64>(block_bytes) != fsize)
+	{
+		Server->Log("File index filter \"" + fn + "\" is not valid", LL_WARNING);
+		close_file();
+		return false;
+	}
+
+	return true;
+}
+
+bool FileIndexFilter::create(const std::string& fn, int64 capacity, double fp_rate)
+{
+	close_file();
+
+	capacity = (std::max)(capacity, min_capacity);
+
+	//Blocked Bloom filters need about 10% more bits than standard ones for the same rate
+	double bits_per_entry = -log(fp_rate) / (log(2.0)*log(2.0)) * 1.1;
+	_u32 n_bits_set = static_cast<_u32>(bits_per_entry*log(2.0) + 0.5);
+	n_bits_set = (std::min)((std::max)(n_bits_set, static_cast<_u32>(1)), max_bits_set);
+
+	int64 n_blocks = static_cast<int64>(capacity*bits_per_entry / block_bits) + 1;
+	int64 fsize = static_cast<int64>(sizeof(SHeader)) + n_blocks*static_cast<int64>(block_bytes);
+
+	Server->deleteFile(fn);
+
+	file.reset(Server->openFile(fn, MODE_RW_CREATE));
+	if (file.get() == NULL)
+	{
+		Server->Log("Error creating file index filter \"" + fn + "\". " + os_last_error_str(), LL_ERROR);
+		return false;
+	}
+
+	if (!file->Resize(fsize, false))
+	{
+		Server->Log("Error resizing file index filter \"" + fn + "\" to " + PrettyPrintBytes(fsize) + ". " + os_last_error_str(), LL_ERROR);
+		close_file();
+		return false;
+	}
+
+	if (!map_file(fsize))
+	{
+		Server->Log("Error mapping file index filter \"" + fn + "\". " + os_last_error_str(), LL_ERROR);
+		close_file();
+		return false;
+	}
+
+	//New file is zero filled already
+	memset(header, 0, sizeof(SHeader));
+	memcpy(header->magic, filter_magic, sizeof(header->magic));
+	header->version = filter_version;
+	header->n_bits_set = n_bits_set;
+	header->n_blocks = n_blocks;
+	header->n_entries = 0;
+	header->capacity = capacity;
+	header->fp_rate = fp_rate;
+
+	Server->Log("Created file index filter with capacity " + convert(capacity) + " ("
+		+ PrettyPrintBytes(fsize) + ", " + convert(n_bits_set) + " bits per entry set)", LL_INFO);
+
+	return true;
+}
+
+void FileIndexFilter::get_bits(const char* hash, int64 filesize, size_t& block, _u32 bits[16])
+{
+	//Hash is already a cryptographic hash, so its bits can be used directly
+	uint64 h1;
+	uint64 h2;
+	memcpy(&h1, hash, sizeof(h1));
+	memcpy(&h2, hash + sizeof(h1), sizeof(h2));
+
+	h1 ^= static_cast<uint64>(filesize)*0x9E3779B97F4A7C15ULL;
+	h2 ^= rotl64(static_cast<uint64>(filesize), 32)*0xC2B2AE3D27D4EB4FULL;
+
+	block = static_cast<size_t>(h1 % static_cast<uint64>(header->n_blocks));
+
+	_u32 a = static_cast<_u32>(h2);
+	_u32 b = static_cast<_u32>(h2 >> 32) | 1;
+	for (_u32 i = 0; i < header->n_bits_set; ++i)
+	{
+		bits[i] = (a + i*b) % block_bits;
+	}
+}
+
+bool FileIndexFilter::may_contain(const char* hash, int64 filesize)
+{
+	size_t block;
+	_u32 bits[max_bits_set];
+	get_bits(hash, filesize, block, bits);
+
+	const unsigned char* bdata = blocks + block*block_bytes;
+	for (_u32 i = 0; i < header->n_bits_set; ++i)
+	{
+		if ((load_bits(bdata + bits[i] / 8) & (1 << (bits[i] % 8))) == 0)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+void FileIndexFilter::add(const char* hash, int64 filesize)
+{
+	size_t block;
+	_u32 bits[max_bits_set];
+	get_bits(hash, filesize, block, bits);
+
+	unsigned char* bdata = blocks + block*block_bytes;
+	bool is_new = false;
+	for (_u32 i = 0; i < header->n_bits_set; ++i)
+	{
+		unsigned char mask = static_cast<unsigned char>(1 << (bits[i] % 8));
+		if ((load_bits(bdata + bits[i] / 8) & mask) == 0)
+		{
+			or_bits(bdata + bits[i] / 8, mask);
+			is_new = true;
+		}
+	}
+
+	if (is_new)
+	{
+		++header->n_entries;
+	}
+}
+
+bool FileIndexFilter::sync()
+{
+	return view.sync();
+}
+
+bool FileIndexFilter::is_overfull()
+{
+	return header->n_entries > header->capacity;
+}
+
+double FileIndexFilter::get_fp_rate()
+{
+	return header->fp_rate;
+}
+
+void FileIndexFilter::count_lookup(bool negative)
+{
+	if (negative)
+	{
+		++n_negative;
+	}
+	else
+	{
+		++n_positive;
+	}
+}
+
+void FileIndexFilter::count_false_positives(int64 n)
+{
+	n_false_positive += n;
+}
+
+FileIndexFilter::SStats FileIndexFilter::get_stats()
+{
+	SStats ret;
+	ret.n_entries = header->n_entries;
+	ret.capacity = header->capacity;
+	ret.fp_rate = header->fp_rate;
+	ret.n_negative = n_negative.load();
+	ret.n_positive = n_positive.load();
+	ret.n_false_positive = n_false_positive.load();
+	return ret;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "../Interface/Types.h"
+#include "../Interface/File.h"
+#include "MemoryMappedFile.h"
+#include <atomic>
+#include <memory>
+
+//Memory-mapped blocked Bloom filter over (hash, filesize) of the file entry
+//index. A negative answer means the file is definitely not in the index.
+//Entries cannot be removed, so deletions only increase the false positive
+//rate until the filter is rebuilt.
+class FileIndexFilter
+{
+public:
+	struct SStats
+	{
+		int64 n_entries;
+		int64 capacity;
+		double fp_rate;
+		int64 n_negative;
+		int64 n_positive;
+		int64 n_false_positive;
+	};
+
+	FileIndexFilter();
+	~FileIndexFilter();
+
+	//Opens an existing filter. Fails if it does not exist or is not valid
+	bool open(const std::string& fn);
+
+	//Creates a new empty filter for capacity entries, replacing any existing one
+	bool create(const std::string& fn, int64 capacity, double fp_rate);
+
+	bool may_contain(const char* hash, int64 filesize);
+
+	//Only one thread may add entries. It can run concurrently with may_contain()
+	void add(const char* hash, int64 filesize);
+
+	//Writes the filter to disk. Has to be called before the entries added
+	//to it are committed to the index.
+	bool sync();
+
+	bool is_overfull();
+
+	double get_fp_rate();
+
+	void count_lookup(bool negative);
+	void count_false_positives(int64 n);
+
+	SStats get_stats();
+
+private:
+	struct SHeader
+	{
+		char magic[8];
+		_u32 version;
+		_u32 n_bits_set;
+		int64 n_blocks;
+		int64 n_entries;
+		int64 capacity;
+		double fp_rate;
+		char reserved[16];
+	};
+
+	bool map_file(int64 size);
+	void close_file();
+
+	void get_bits(const char* hash, int64 filesize, size_t& block, _u32 bits[16]);
+
+	std::auto_ptr<IFsFile> file;
+	MemoryMappedFile view;
+	SHeader* header;
+	unsigned char* blocks;
+
+	std::atomic<int64> n_negative;
+	std::atomic<int64> n_positive;
+	std::atomic<int64> n_false_positive;
+};
@@ -0,0 +1,421 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "FileIndexRebuild.h"
+#include "../Interface/Server.h"
+#include "../Interface/Database.h"
+#include "../Interface/DatabaseCursor.h"
+#include "../Interface/Query.h"
+#include "../Interface/File.h"
+#include "../Interface/Thread.h"
+#include "../Interface/ThreadPool.h"
+#include "../stringtools.h"
+#include "../urbackupcommon/os_functions.h"
+#include "serverinterface/helper.h"
+#include "database.h"
+#include <algorithm>
+#include <memory.h>
+#include <memory>
+
+namespace
+{
+	const char* c_run_prefix = "urbackup/fileindex/rebuild_run_";
+	const size_t c_sort_memory = 512 * 1024 * 1024;
+	const size_t c_merge_memory = 64 * 1024 * 1024;
+	const size_t c_partitions_per_thread = 8;
+	const size_t c_read_report_n = 10000;
+	const size_t c_io_chunk_size = 16 * 1024 * 1024;
+	const size_t c_merge_batch_size = 1000;
+}
+
+class FileIndexRebuild::SortWorker : public IThread
+{
+public:
+	SortWorker(FileIndexRebuild& rebuild)
+		: rebuild(rebuild)
+	{
+	}
+
+	void operator()()
+	{
+		IDatabase* db = Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER_FILES);
+		if (db == NULL)
+		{
+			Server->Log("Error opening files database for index rebuild", LL_ERROR);
+			rebuild.error = true;
+			return;
+		}
+
+		IQuery* q_read = db->Prepare("SELECT id, shahash, filesize, clientid, next_entry, prev_entry, pointed_to, created FROM files WHERE id>=? AND id<?", false);
+
+		std::vector<SEntry> entries;
+		entries.reserve(rebuild.run_entries);
+
+		int64 start;
+		int64 end;
+		while (!rebuild.error
+			&& rebuild.get_next_partition(start, end))
+		{
+			q_read->Bind(start);
+			q_read->Bind(end);
+
+			IDatabaseCursor* cur = q_read->Cursor();
+
+			size_t n_curr = 0;
+			db_single_result res;
+			while (cur->next(res))
+			{
+				const std::string& shahash = res["shahash"];
+				char hash[bytes_in_index] = {};
+				memcpy(hash, shahash.data(), (std::min)(shahash.size(), bytes_in_index));
+
+				SEntry entry;
+				entry.key = FileIndex::SIndexKey(hash, watoi64(res["filesize"]), watoi(res["clientid"]));
+				entry.created = watoi64(res["created"]);
+				entry.id = watoi64(res["id"]);
+				entry.next_entry = watoi64(res["next_entry"]);
+				entry.prev_entry = watoi64(res["prev_entry"]);
+				entry.pointed_to = watoi(res["pointed_to"]) != 0 ? 1 : 0;
+				entries.push_back(entry);
+
+				++n_curr;
+				if (n_curr%c_read_report_n == 0)
+				{
+					rebuild.add_read(c_read_report_n);
+				}
+
+				if (entries.size() >= rebuild.run_entries)
+				{
+					if (!rebuild.write_run(entries))
+					{
+						rebuild.error = true;
+					}
+					entries.clear();
+				}
+			}
+
+			if (cur->has_error())
+			{
+				Server->Log("Error reading files table for index rebuild", LL_ERROR);
+				rebuild.error = true;
+			}
+
+			q_read->Reset();
+
+			rebuild.add_read(n_curr%c_read_report_n);
+		}
+
+		if (!entries.empty()
+			&& !rebuild.error)
+		{
+			if (!rebuild.write_run(entries))
+			{
+				rebuild.error = true;
+			}
+		}
+
+		db->destroyQuery(q_read);
+		Server->destroyDatabases(Server->getThreadID());
+	}
+
+private:
+	FileIndexRebuild& rebuild;
+};
+
+FileIndexRebuild::FileIndexRebuild(SStartupStatus& status, int64 n_files)
+	: status(status), n_files(n_files), min_id(0), partition_size(1),
+	n_partitions(0), next_partition(0), run_entries(0), n_read(0), n_merged(0),
+	error(false), mutex(Server->createMutex()), merge_buf_entries(0)
+{
+}
+
+FileIndexRebuild::~FileIndexRebuild()
+{
+	for (size_t i = 0; i < readers.size(); ++i)
+	{
+		if (readers[i].file != NULL)
+		{
+			Server->destroy(readers[i].file);
+		}
+	}
+
+	for (size_t i = 0; i < run_fns.size(); ++i)
+	{
+		Server->deleteFile(run_fns[i]);
+	}
+
+	Server->destroy(mutex);
+}
+
+size_t FileIndexRebuild::get_num_threads()
+{
+	std::string threads = Server->getServerParameter("fileindex_rebuild_threads");
+	if (!threads.empty())
+	{
+		return static_cast<size_t>(watoi(threads));
+	}
+
+	return (std::max)(os_get_num_cpus(), static_cast<size_t>(1));
+}
+
+bool FileIndexRebuild::sort_runs(size_t n_threads)
+{
+	IDatabase* db = Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER_FILES);
+
+	db_results res = db->Read("SELECT MIN(id) AS min_id, MAX(id) AS max_id FROM files");
+	if (res.empty() || res[0]["min_id"].empty())
+	{
+		Server->Log("Files table is empty", LL_INFO);
+		return start_merge();
+	}
+
+	min_id = watoi64(res[0]["min_id"]);
+	int64 max_id = watoi64(res[0]["max_id"]);
+
+	//More partitions than threads, so threads finishing early take over remaining work
+	n_partitions = n_threads*c_partitions_per_thread;
+	partition_size = (std::max)((max_id - min_id) / static_cast<int64>(n_partitions) + 1, static_cast<int64>(1));
+	next_partition = 0;
+
+	run_entries = (std::max)(c_sort_memory / n_threads / sizeof(SEntry), static_cast<size_t>(1000));
+
+	Server->Log("Sorting file entries with " + convert(n_threads) + " threads...", LL_INFO);
+
+	std::vector<SortWorker*> workers;
+	std::vector<THREADPOOL_TICKET> tickets;
+	for (size_t i = 0; i < n_threads; ++i)
+	{
+		workers.push_back(new SortWorker(*this));
+		tickets.push_back(Server->getThreadPool()->execute(workers[i], "fileindex sort"));
+	}
+
+	while (!Server->getThreadPool()->waitFor(tickets, 1000))
+	{
+		if (n_files > 0)
+		{
+			update_progress(static_cast<double>(n_read.load()) / n_files / 2);
+		}
+	}
+
+	for (size_t i = 0; i < workers.size(); ++i)
+	{
+		delete workers[i];
+	}
+
+	if (error)
+	{
+		return false;
+	}
+
+	Server->Log("Sorted " + convert(n_read.load()) + " file entries into " + convert(run_fns.size()) + " runs", LL_INFO);
+
+	return start_merge();
+}
+
+bool FileIndexRebuild::has_error()
+{
+	return error;
+}
+
+bool FileIndexRebuild::get_next_partition(int64& start, int64& end)
+{
+	size_t partition = next_partition++;
+	if (partition >= n_partitions)
+	{
+		return false;
+	}
+
+	start = min_id + partition*partition_size;
+	end = start + partition_size;
+	return true;
+}
+
+bool FileIndexRebuild::write_run(std::vector<SEntry>& entries)
+{
+	std::sort(entries.begin(), entries.end());
+
+	std::string fn;
+	{
+		IScopedLock lock(mutex);
+		fn = c_run_prefix + convert(run_fns.size()) + ".tmp";
+		run_fns.push_back(fn);
+	}
+
+	std::auto_ptr<IFile> f(Server->openFile(fn, MODE_WRITE));
+	if (f.get() == NULL)
+	{
+		Server->Log("Error creating file index rebuild run \"" + fn + "\". " + os_last_error_str(), LL_ERROR);
+		return false;
+	}
+
+	const char* data = reinterpret_cast<const char*>(entries.data());
+	size_t size = entries.size()*sizeof(SEntry);
+	for (size_t pos = 0; pos < size;)
+	{
+		_u32 tw = static_cast<_u32>((std::min)(size - pos, c_io_chunk_size));
+		if (f->Write(data + pos, tw) != tw)
+		{
+			Server->Log("Error writing file index rebuild run \"" + fn + "\". " + os_last_error_str(), LL_ERROR);
+			return false;
+		}
+		pos += tw;
+	}
+
+	return true;
+}
+
+void FileIndexRebuild::add_read(size_t n)
+{
+	n_read += n;
+}
+
+bool FileIndexRebuild::start_merge()
+{
+	merge_buf_entries = (std::max)(c_merge_memory / (std::max)(run_fns.size(), static_cast<size_t>(1)) / sizeof(SEntry),
+		static_cast<size_t>(1000));
+
+	readers.resize(run_fns.size());
+	for (size_t i = 0; i < run_fns.size(); ++i)
+	{
+		readers[i].file = NULL;
+	}
+
+	for (size_t i = 0; i < run_fns.size(); ++i)
+	{
+		readers[i].file = Server->openFile(run_fns[i], MODE_READ_SEQUENTIAL);
+		if (readers[i].file == NULL)
+		{
+			Server->Log("Error opening file index rebuild run \"" + run_fns[i] + "\". " + os_last_error_str(), LL_ERROR);
+			error = true;
+			return false;
+		}
+
+		if (!fill_reader(i))
+		{
+			return false;
+		}
+
+		if (!readers[i].buf.empty())
+		{
+			SHeapItem item = { readers[i].buf[0], i };
+			heap.push(item);
+		}
+	}
+
+	return true;
+}
+
+bool FileIndexRebuild::fill_reader(size_t idx)
+{
+	SRunReader& reader = readers[idx];
+
+	reader.buf.resize(merge_buf_entries);
+	reader.pos = 0;
+
+	char* data = reinterpret_cast<char*>(reader.buf.data());
+	size_t size = merge_buf_entries*sizeof(SEntry);
+	size_t read = 0;
+	while (read < size)
+	{
+		bool has_read_error = false;
+		_u32 tr = static_cast<_u32>((std::min)(size - read, c_io_chunk_size));
+		_u32 r = reader.file->Read(data + read, tr, &has_read_error);
+		if (has_read_error)
+		{
+			Server->Log("Error reading file index rebuild run \"" + reader.file->getFilename() + "\". " + os_last_error_str(), LL_ERROR);
+			error = true;
+			return false;
+		}
+		read += r;
+		if (r < tr)
+		{
+			break;
+		}
+	}
+
+	if (read%sizeof(SEntry) != 0)
+	{
+		Server->Log("File index rebuild run \"" + reader.file->getFilename() + "\" is truncated", LL_ERROR);
+		error = true;
+		return false;
+	}
+
+	reader.buf.resize(read / sizeof(SEntry));
+
+	return true;
+}
+
+void FileIndexRebuild::get_entries_callback(size_t n_done, std::vector<FileIndex::SCreateEntry>& entries, void *userdata)
+{
+	FileIndexRebuild* rebuild = reinterpret_cast<FileIndexRebuild*>(userdata);
+	rebuild->get_entries(n_done, entries);
+}
+
+void FileIndexRebuild::get_entries(size_t n_done, std::vector<FileIndex::SCreateEntry>& entries)
+{
+	status.processed_file_entries = n_done;
+
+	while (entries.size() < c_merge_batch_size
+		&& !heap.empty()
+		&& !error)
+	{
+		SHeapItem item = heap.top();
+		heap.pop();
+
+		FileIndex::SCreateEntry create_entry = { item.entry.key, item.entry.id,
+			item.entry.next_entry, item.entry.prev_entry, item.entry.pointed_to != 0 };
+		entries.push_back(create_entry);
+
+		SRunReader& reader = readers[item.reader];
+		++reader.pos;
+		if (reader.pos >= reader.buf.size())
+		{
+			if (!fill_reader(item.reader))
+			{
+				break;
+			}
+		}
+
+		if (reader.pos < reader.buf.size())
+		{
+			item.entry = reader.buf[reader.pos];
+			heap.push(item);
+		}
+	}
+
+	n_merged += entries.size();
+
+	if (n_files > 0)
+	{
+		update_progress(0.5 + static_cast<double>(n_merged) / n_files / 2);
+	}
+}
+
+void FileIndexRebuild::update_progress(double pc_done)
+{
+	int last_pc = static_cast<int>(status.pc_done * 1000 + 0.5);
+
+	status.pc_done = (std::min)(pc_done, 1.0);
+
+	int curr_pc = static_cast<int>(status.pc_done * 1000 + 0.5);
+
+	if (curr_pc != last_pc)
+	{
+		Server->Log("Creating files index: " + convert((double)curr_pc / 10) + "% finished", LL_INFO);
+	}
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "FileIndex.h"
+#include "../Interface/Mutex.h"
+#include <atomic>
+#include <vector>
+#include <string>
+#include <queue>
+
+struct SStartupStatus;
+class IFile;
+
+//Rebuilds the file entry index from the files table in two phases.
+//First worker threads read id ranges of the files table and write them
+//as runs sorted by index key. Then the runs are merged and handed to
+//FileIndex::create_sorted(), which appends them to the index in key order.
+class FileIndexRebuild
+{
+public:
+#pragma pack(1)
+	struct SEntry
+	{
+		FileIndex::SIndexKey key;
+		int64 created;
+		int64 id;
+		int64 next_entry;
+		int64 prev_entry;
+		char pointed_to;
+
+		//Same order as the entries were previously read from the database
+		bool operator<(const SEntry& other) const
+		{
+			if (key != other.key)
+			{
+				return key < other.key;
+			}
+			if (created != other.created)
+			{
+				return created > other.created;
+			}
+			return id > other.id;
+		}
+	};
+#pragma pack()
+
+	FileIndexRebuild(SStartupStatus& status, int64 n_files);
+	~FileIndexRebuild();
+
+	bool sort_runs(size_t n_threads);
+
+	static void get_entries_callback(size_t n_done, std::vector<FileIndex::SCreateEntry>& entries, void *userdata);
+
+	bool has_error();
+
+	static size_t get_num_threads();
+
+private:
+	class SortWorker;
+
+	struct SRunReader
+	{
+		IFile* file;
+		std::vector<SEntry> buf;
+		size_t pos;
+	};
+
+	struct SHeapItem
+	{
+		SEntry entry;
+		size_t reader;
+
+		//Smallest entry on top of the priority queue
+		bool operator<(const SHeapItem& other) const
+		{
+			return other.entry < entry;
+		}
+	};
+
+	bool get_next_partition(int64& start, int64& end);
+	bool write_run(std::vector<SEntry>& entries);
+	void add_read(size_t n);
+
+	bool start_merge();
+	bool fill_reader(size_t idx);
+	void get_entries(size_t n_done, std::vector<FileIndex::SCreateEntry>& entries);
+
+	void update_progress(double pc_done);
+
+	SStartupStatus& status;
+	int64 n_files;
+
+	int64 min_id;
+	int64 partition_size;
+	size_t n_partitions;
+	std::atomic<size_t> next_partition;
+	size_t run_entries;
+
+	std::atomic<int64> n_read;
+	int64 n_merged;
+	std::atomic<bool> error;
+
+	IMutex* mutex;
+	std::vector<std::string> run_fns;
+
+	size_t merge_buf_entries;
+	std::vector<SRunReader> readers;
+	std::priority_queue<SHeapItem> heap;
+};
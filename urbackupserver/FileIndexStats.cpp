@@ -0,0 +1,177 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "FileIndexStats.h"
+#include "../Interface/Server.h"
+#include <chrono>
+
+FileIndexStats::SCounters FileIndexStats::global_counters;
+FileIndexStats::SAtomicHistogram FileIndexStats::histograms[FileIndexStats::EHistogram_Max];
+std::atomic<int64> FileIndexStats::flush_queue_depth(0);
+std::atomic<int64> FileIndexStats::max_flush_queue_depth(0);
+IMutex* FileIndexStats::mutex = NULL;
+std::map<int, FileIndexStats::SCounters*> FileIndexStats::clients;
+
+FileIndexStats::SCounters::SCounters()
+{
+	for (size_t i = 0; i < ECounter_Max; ++i)
+	{
+		counters[i] = 0;
+	}
+}
+
+FileIndexStats::SAtomicHistogram::SAtomicHistogram()
+	: count(0), sum_us(0), max_us(0)
+{
+	for (size_t i = 0; i < histogram_buckets; ++i)
+	{
+		buckets[i] = 0;
+	}
+}
+
+void FileIndexStats::init_mutex()
+{
+	mutex = Server->createMutex();
+}
+
+FileIndexStats::SCounters* FileIndexStats::get_client_counters(int clientid)
+{
+	IScopedLock lock(mutex);
+
+	std::map<int, SCounters*>::iterator it = clients.find(clientid);
+	if (it != clients.end())
+	{
+		return it->second;
+	}
+
+	SCounters* ret = new SCounters;
+	clients[clientid] = ret;
+	return ret;
+}
+
+void FileIndexStats::count(SCounters* client_counters, ECounter counter)
+{
+	global_counters.counters[counter].fetch_add(1, std::memory_order_relaxed);
+
+	if (client_counters != NULL)
+	{
+		client_counters->counters[counter].fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+void FileIndexStats::add_latency(EHistogram histogram, int64 time_us)
+{
+	SAtomicHistogram& hist = histograms[histogram];
+
+	size_t bucket = 0;
+	while (bucket + 1 < histogram_buckets
+		&& time_us >= (static_cast<int64>(1) << bucket))
+	{
+		++bucket;
+	}
+
+	hist.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+	hist.count.fetch_add(1, std::memory_order_relaxed);
+	hist.sum_us.fetch_add(time_us, std::memory_order_relaxed);
+	update_max(hist.max_us, time_us);
+}
+
+void FileIndexStats::set_flush_queue_depth(size_t n)
+{
+	flush_queue_depth.store(static_cast<int64>(n), std::memory_order_relaxed);
+	update_max(max_flush_queue_depth, static_cast<int64>(n));
+}
+
+void FileIndexStats::update_max(std::atomic<int64>& max_val, int64 val)
+{
+	int64 curr = max_val.load(std::memory_order_relaxed);
+	while (val > curr
+		&& !max_val.compare_exchange_weak(curr, val, std::memory_order_relaxed))
+	{
+	}
+}
+
+FileIndexStats::SStats FileIndexStats::get_stats()
+{
+	SStats ret;
+
+	for (size_t i = 0; i < ECounter_Max; ++i)
+	{
+		ret.global[i] = global_counters.counters[i].load(std::memory_order_relaxed);
+	}
+
+	{
+		IScopedLock lock(mutex);
+		for (std::map<int, SCounters*>::iterator it = clients.begin(); it != clients.end(); ++it)
+		{
+			std::vector<int64>& client = ret.clients[it->first];
+			client.resize(ECounter_Max);
+			for (size_t i = 0; i < ECounter_Max; ++i)
+			{
+				client[i] = it->second->counters[i].load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	for (size_t i = 0; i < EHistogram_Max; ++i)
+	{
+		ret.histograms[i].count = histograms[i].count.load(std::memory_order_relaxed);
+		ret.histograms[i].sum_us = histograms[i].sum_us.load(std::memory_order_relaxed);
+		ret.histograms[i].max_us = histograms[i].max_us.load(std::memory_order_relaxed);
+		for (size_t j = 0; j < histogram_buckets; ++j)
+		{
+			ret.histograms[i].buckets[j] = histograms[i].buckets[j].load(std::memory_order_relaxed);
+		}
+	}
+
+	ret.flush_queue_depth = flush_queue_depth.load(std::memory_order_relaxed);
+	ret.max_flush_queue_depth = max_flush_queue_depth.load(std::memory_order_relaxed);
+
+	return ret;
+}
+
+int64 FileIndexStats::get_time_us()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+const char* FileIndexStats::get_counter_name(ECounter counter)
+{
+	switch (counter)
+	{
+	case ECounter_CacheHit: return "cache_hit";
+	case ECounter_PrefetchHit: return "prefetch_hit";
+	case ECounter_IndexHit: return "index_hit";
+	case ECounter_IndexMiss: return "index_miss";
+	case ECounter_DbHit: return "db_hit";
+	case ECounter_DbMiss: return "db_miss";
+	default: return "unknown";
+	}
+}
+
+const char* FileIndexStats::get_histogram_name(EHistogram histogram)
+{
+	switch (histogram)
+	{
+	case EHistogram_IndexRead: return "index_read";
+	case EHistogram_IndexBatchRead: return "index_batch_read";
+	case EHistogram_IndexCommit: return "index_commit";
+	default: return "unknown";
+	}
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "../Interface/Types.h"
+#include "../Interface/Mutex.h"
+#include <atomic>
+#include <map>
+#include <vector>
+
+//Counts how file entry lookups are answered (write-behind cache, prefetch,
+//index or files database) globally and per client, and keeps latency
+//histograms of index reads and commits
+class FileIndexStats
+{
+public:
+	enum ECounter
+	{
+		ECounter_CacheHit = 0,
+		ECounter_PrefetchHit,
+		ECounter_IndexHit,
+		ECounter_IndexMiss,
+		ECounter_DbHit,
+		ECounter_DbMiss,
+		ECounter_Max
+	};
+
+	enum EHistogram
+	{
+		EHistogram_IndexRead = 0,
+		EHistogram_IndexBatchRead,
+		EHistogram_IndexCommit,
+		EHistogram_Max
+	};
+
+	//Bucket i counts latencies below 2^i microseconds
+	static const size_t histogram_buckets = 32;
+
+	struct SCounters
+	{
+		SCounters();
+
+		std::atomic<int64> counters[ECounter_Max];
+	};
+
+	struct SHistogram
+	{
+		int64 count;
+		int64 sum_us;
+		int64 max_us;
+		int64 buckets[histogram_buckets];
+	};
+
+	struct SStats
+	{
+		int64 global[ECounter_Max];
+		std::map<int, std::vector<int64> > clients;
+		SHistogram histograms[EHistogram_Max];
+		int64 flush_queue_depth;
+		int64 max_flush_queue_depth;
+	};
+
+	static void init_mutex();
+
+	//Counters of a client. Stay valid for the lifetime of the server
+	static SCounters* get_client_counters(int clientid);
+
+	static void count(SCounters* client_counters, ECounter counter);
+
+	static void add_latency(EHistogram histogram, int64 time_us);
+
+	static void set_flush_queue_depth(size_t n);
+
+	static SStats get_stats();
+
+	static int64 get_time_us();
+
+	static const char* get_counter_name(ECounter counter);
+	static const char* get_histogram_name(EHistogram histogram);
+
+private:
+	struct SAtomicHistogram
+	{
+		SAtomicHistogram();
+
+		std::atomic<int64> count;
+		std::atomic<int64> sum_us;
+		std::atomic<int64> max_us;
+		std::atomic<int64> buckets[histogram_buckets];
+	};
+
+	static void update_max(std::atomic<int64>& max_val, int64 val);
+
+	static SCounters global_counters;
+	static SAtomicHistogram histograms[EHistogram_Max];
+	static std::atomic<int64> flush_queue_depth;
+	static std::atomic<int64> max_flush_queue_depth;
+
+	static IMutex* mutex;
+	static std::map<int, SCounters*> clients;
+};
@@ -0,0 +1,360 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "FileListStream.h"
+#include "../Interface/Server.h"
+#include "../Interface/Thread.h"
+#include "../Interface/ThreadPool.h"
+#include "../urbackupcommon/fileclient/FileClient.h"
+#include "../stringtools.h"
+#include "../fileservplugin/chunk_settings.h"
+#include <algorithm>
+#include <memory.h>
+
+namespace
+{
+	//Maximum list data queued for the consumer
+	const size_t c_max_queued = 32 * 1024 * 1024;
+}
+
+class FileListStream::DownloadWorker : public IThread
+{
+public:
+	DownloadWorker(FileListStream& stream)
+		: stream(stream)
+	{
+	}
+
+	void operator()()
+	{
+		stream.download();
+	}
+
+private:
+	FileListStream& stream;
+};
+
+FileListStream::FileListStream(IFsFile* file)
+	: file(file), pos(0), mutex(Server->createMutex()), cond(Server->createCondition()),
+	queue_front_off(0), queue_bytes(0), released_end(0), done(false), stop_queueing(false), stream_error(false), rc(ERR_ERROR),
+	fc(NULL), hashed_transfer(false), verify_checkpoints(false), worker(NULL), ticket(ILLEGAL_THREADPOOL_TICKET)
+{
+}
+
+FileListStream::~FileListStream()
+{
+	if (worker != NULL)
+	{
+		abortDownload();
+	}
+
+	Server->destroy(mutex);
+	Server->destroy(cond);
+}
+
+void FileListStream::startDownload(FileClient& p_fc, const std::string& p_remotefn, bool p_hashed_transfer, int filesrv_protocol_version)
+{
+	fc = &p_fc;
+	remotefn = p_remotefn;
+	hashed_transfer = p_hashed_transfer;
+	//FileClient checks a hash at every checkpoint (c_checkpoint_dist) with protocol version>1
+	verify_checkpoints = hashed_transfer && filesrv_protocol_version > 1;
+	worker = new DownloadWorker(*this);
+	ticket = Server->getThreadPool()->execute(worker, "filelist download");
+}
+
+void FileListStream::download()
+{
+	_u32 download_rc = fc->GetFile(remotefn, this, hashed_transfer, false, 0, false, 0);
+
+	IScopedLock lock(mutex);
+	if (download_rc == ERR_SUCCESS
+		&& !stream_error
+		&& !stop_queueing)
+	{
+		releaseData(released_end + static_cast<int64>(unverified.size()));
+	}
+	rc = download_rc;
+	done = true;
+	cond->notify_all();
+}
+
+_u32 FileListStream::read(char* buffer, _u32 bsize)
+{
+	IScopedLock lock(mutex);
+
+	_u32 copied = 0;
+	while (copied < bsize)
+	{
+		if (stream_error)
+		{
+			return 0;
+		}
+		else if (!queue.empty())
+		{
+			std::string& front = queue.front();
+			size_t tc = (std::min)(static_cast<size_t>(bsize - copied), front.size() - queue_front_off);
+			memcpy(buffer + copied, front.data() + queue_front_off, tc);
+			copied += static_cast<_u32>(tc);
+			queue_front_off += tc;
+			queue_bytes -= tc;
+
+			if (queue_front_off == front.size())
+			{
+				queue.pop_front();
+				queue_front_off = 0;
+			}
+
+			cond->notify_all();
+		}
+		else if (done)
+		{
+			break;
+		}
+		else
+		{
+			cond->wait(&lock);
+		}
+	}
+
+	return copied;
+}
+
+_u32 FileListStream::waitDownload()
+{
+	if (worker != NULL)
+	{
+		{
+			IScopedLock lock(mutex);
+			stop_queueing = true;
+			queue.clear();
+			queue_front_off = 0;
+			queue_bytes = 0;
+			unverified.clear();
+			cond->notify_all();
+		}
+
+		Server->getThreadPool()->waitFor(ticket);
+		delete worker;
+		worker = NULL;
+	}
+
+	if (rc == ERR_SUCCESS
+		&& stream_error)
+	{
+		return ERR_ERROR;
+	}
+
+	return rc;
+}
+
+_u32 FileListStream::abortDownload()
+{
+	if (worker != NULL)
+	{
+		{
+			IScopedLock lock(mutex);
+			stop_queueing = true;
+			cond->notify_all();
+		}
+
+		fc->Shutdown();
+	}
+
+	return waitDownload();
+}
+
+void FileListStream::queueData(int64 spos, const char* buffer, _u32 bsize)
+{
+	IScopedLock lock(mutex);
+
+	while (queue_bytes >= c_max_queued
+		&& !stop_queueing)
+	{
+		cond->wait(&lock);
+	}
+
+	if (stop_queueing
+		|| stream_error)
+	{
+		return;
+	}
+
+	int64 queued_end = released_end + static_cast<int64>(unverified.size());
+
+	if (spos + bsize <= released_end)
+	{
+		return;
+	}
+
+	if (spos > queued_end)
+	{
+		Server->Log("File list data at " + convert(spos) + " not written sequentially (end " + convert(queued_end) + ")", LL_ERROR);
+		stream_error = true;
+		cond->notify_all();
+		return;
+	}
+
+	//After a reconnect data is written again from the last checkpoint. Released
+	//data is verified and stays, the unverified data is replaced
+	size_t skip = 0;
+	if (spos < released_end)
+	{
+		skip = static_cast<size_t>(released_end - spos);
+		unverified.clear();
+	}
+	else
+	{
+		unverified.resize(static_cast<size_t>(spos - released_end));
+	}
+
+	unverified.append(buffer + skip, bsize - skip);
+
+	if (!verify_checkpoints)
+	{
+		releaseData(released_end + static_cast<int64>(unverified.size()));
+	}
+	else
+	{
+		//Writes do not span checkpoints and the hash of the previous checkpoints
+		//was checked before data after them is written
+		releaseData((spos / c_checkpoint_dist) * c_checkpoint_dist);
+	}
+}
+
+void FileListStream::releaseData(int64 end)
+{
+	if (end <= released_end)
+	{
+		return;
+	}
+
+	size_t n = static_cast<size_t>(end - released_end);
+	queue.push_back(unverified.substr(0, n));
+	unverified.erase(0, n);
+	queue_bytes += n;
+	released_end = end;
+	cond->notify_all();
+}
+
+std::string FileListStream::Read(_u32 tr, bool* has_error)
+{
+	std::string ret = file->Read(pos, tr, has_error);
+	pos += ret.size();
+	return ret;
+}
+
+std::string FileListStream::Read(int64 spos, _u32 tr, bool* has_error)
+{
+	return file->Read(spos, tr, has_error);
+}
+
+_u32 FileListStream::Read(char* buffer, _u32 bsize, bool* has_error)
+{
+	_u32 r = file->Read(pos, buffer, bsize, has_error);
+	pos += r;
+	return r;
+}
+
+_u32 FileListStream::Read(int64 spos, char* buffer, _u32 bsize, bool* has_error)
+{
+	return file->Read(spos, buffer, bsize, has_error);
+}
+
+_u32 FileListStream::Write(const std::string& tw, bool* has_error)
+{
+	return Write(tw.data(), static_cast<_u32>(tw.size()), has_error);
+}
+
+_u32 FileListStream::Write(int64 spos, const std::string& tw, bool* has_error)
+{
+	return Write(spos, tw.data(), static_cast<_u32>(tw.size()), has_error);
+}
+
+_u32 FileListStream::Write(const char* buffer, _u32 bsiz, bool* has_error)
+{
+	_u32 w = Write(pos, buffer, bsiz, has_error);
+	pos += w;
+	return w;
+}
+
+_u32 FileListStream::Write(int64 spos, const char* buffer, _u32 bsiz, bool* has_error)
+{
+	_u32 w = file->Write(spos, buffer, bsiz, has_error);
+	if (w > 0)
+	{
+		queueData(spos, buffer, w);
+	}
+	return w;
+}
+
+bool FileListStream::Seek(_i64 spos)
+{
+	pos = spos;
+	return true;
+}
+
+_i64 FileListStream::Size(void)
+{
+	return file->Size();
+}
+
+_i64 FileListStream::RealSize()
+{
+	return file->RealSize();
+}
+
+bool FileListStream::PunchHole(_i64 spos, _i64 size)
+{
+	return file->PunchHole(spos, size);
+}
+
+bool FileListStream::Sync()
+{
+	return file->Sync();
+}
+
+std::string FileListStream::getFilename(void)
+{
+	return file->getFilename();
+}
+
+void FileListStream::resetSparseExtentIter()
+{
+	file->resetSparseExtentIter();
+}
+
+IFsFile::SSparseExtent FileListStream::nextSparseExtent()
+{
+	return file->nextSparseExtent();
+}
+
+bool FileListStream::Resize(int64 new_size, bool set_sparse)
+{
+	return file->Resize(new_size, set_sparse);
+}
+
+std::vector<IFsFile::SFileExtent> FileListStream::getFileExtents(int64 starting_offset, int64 block_size, bool& more_data)
+{
+	return file->getFileExtents(starting_offset, block_size, more_data);
+}
+
+IFsFile::os_file_handle FileListStream::getOsHandle(bool release_handle)
+{
+	return file->getOsHandle(release_handle);
+}
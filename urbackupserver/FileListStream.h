@@ -0,0 +1,91 @@
+#pragma once
+
+#include "../Interface/Types.h"
+#include "../Interface/File.h"
+#include "../Interface/Mutex.h"
+#include "../Interface/Condition.h"
+#include <deque>
+#include <string>
+
+class FileClient;
+
+//Downloads a file list into a file in a thread pool thread, while the list is
+//read in list order by a consumer. Data written to the file is also queued
+//for the consumer (up to a limit, then the download waits). Data which is
+//written again after a reconnect is only written to the file.
+//With hashed transfers the consumer only gets data which is verified, i.e. up
+//to the last checkpoint whose hash was checked by the FileClient (the rest
+//after the download succeeded). Unverified data is replaced if the FileClient
+//writes it again after a reconnect.
+class FileListStream : public IFsFile
+{
+public:
+	FileListStream(IFsFile* file);
+	//Aborts the download if it is still running
+	~FileListStream();
+
+	void startDownload(FileClient& fc, const std::string& remotefn, bool hashed_transfer, int filesrv_protocol_version);
+
+	//Waits until bsize bytes of the list are available or the download is finished.
+	//Returns less than bsize bytes only at the end of the list or on error
+	_u32 read(char* buffer, _u32 bsize);
+
+	//Waits for the download to finish and returns the FileClient error code
+	//(ERR_ERROR if the data could not be passed to the consumer).
+	//Data which is not read yet is dropped
+	_u32 waitDownload();
+
+	//Stops the download (shuts down the connection) and waits for it
+	_u32 abortDownload();
+
+	virtual std::string Read(_u32 tr, bool* has_error = NULL);
+	virtual std::string Read(int64 spos, _u32 tr, bool* has_error = NULL);
+	virtual _u32 Read(char* buffer, _u32 bsize, bool* has_error = NULL);
+	virtual _u32 Read(int64 spos, char* buffer, _u32 bsize, bool* has_error = NULL);
+	virtual _u32 Write(const std::string& tw, bool* has_error = NULL);
+	virtual _u32 Write(int64 spos, const std::string& tw, bool* has_error = NULL);
+	virtual _u32 Write(const char* buffer, _u32 bsiz, bool* has_error = NULL);
+	virtual _u32 Write(int64 spos, const char* buffer, _u32 bsiz, bool* has_error = NULL);
+	virtual bool Seek(_i64 spos);
+	virtual _i64 Size(void);
+	virtual _i64 RealSize();
+	virtual bool PunchHole(_i64 spos, _i64 size);
+	virtual bool Sync();
+	virtual std::string getFilename(void);
+	virtual void resetSparseExtentIter();
+	virtual SSparseExtent nextSparseExtent();
+	virtual bool Resize(int64 new_size, bool set_sparse = true);
+	virtual std::vector<SFileExtent> getFileExtents(int64 starting_offset, int64 block_size, bool& more_data);
+	virtual IFsFile::os_file_handle getOsHandle(bool release_handle = false);
+
+private:
+	class DownloadWorker;
+
+	void download();
+	void queueData(int64 spos, const char* buffer, _u32 bsize);
+	void releaseData(int64 end);
+
+	IFsFile* file;
+	int64 pos;
+
+	IMutex* mutex;
+	ICondition* cond;
+	std::deque<std::string> queue;
+	size_t queue_front_off;
+	size_t queue_bytes;
+	//Data after released_end which is not verified yet
+	std::string unverified;
+	//End of the data passed to the queue
+	int64 released_end;
+	bool done;
+	bool stop_queueing;
+	bool stream_error;
+	_u32 rc;
+
+	FileClient* fc;
+	std::string remotefn;
+	bool hashed_transfer;
+	bool verify_checkpoints;
+	DownloadWorker* worker;
+	THREADPOOL_TICKET ticket;
+};
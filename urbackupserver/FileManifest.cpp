@@ -0,0 +1,545 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "FileManifest.h"
+#include "../Interface/Server.h"
+#include "../Interface/Mutex.h"
+#include "../stringtools.h"
+#include "../common/data.h"
+#include "../urbackupcommon/os_functions.h"
+#include <algorithm>
+#include <memory>
+#include <memory.h>
+
+#define MINIZ_NO_ZLIB_COMPATIBLE_NAMES
+#include "../common/miniz.h"
+
+namespace
+{
+	const char* manifest_dir = "urbackup/file_manifests";
+	const char manifest_magic[] = "URBFMAN1";
+	const size_t manifest_magic_size = 8;
+	const size_t manifest_header_size = manifest_magic_size + 2 * sizeof(_u32);
+	const size_t block_header_size = 3 * sizeof(_u32);
+	const size_t block_entries = 4096;
+	//Upper limit for the uncompressed size of a block
+	const size_t max_block_size = 256 * 1024 * 1024;
+
+	std::string manifest_fn(int backupid)
+	{
+		return std::string(manifest_dir) + os_file_sep() + convert(backupid) + ".manifest";
+	}
+
+	bool entry_less(const FileManifest::SEntry& a, const FileManifest::SEntry& b)
+	{
+		return a.fullpath < b.fullpath;
+	}
+
+	void add_prefixed(CWData& data, const std::string& prev, const std::string& curr)
+	{
+		size_t shared = 0;
+		size_t max_shared = (std::min)(prev.size(), curr.size());
+		while (shared < max_shared && prev[shared] == curr[shared])
+		{
+			++shared;
+		}
+		data.addVarInt(shared);
+		data.addString2(curr.substr(shared));
+	}
+
+	bool get_prefixed(CRData& data, const std::string& prev, std::string& curr)
+	{
+		int64 shared;
+		std::string suffix;
+		if (!data.getVarInt(&shared)
+			|| shared<0 || static_cast<size_t>(shared)>prev.size()
+			|| !data.getStr2(&suffix))
+		{
+			return false;
+		}
+		curr = prev.substr(0, static_cast<size_t>(shared)) + suffix;
+		return true;
+	}
+
+	void add_column(CWData& block_data, CWData& column)
+	{
+		block_data.addString2(std::string(column.getDataPtr(), column.getDataSize()));
+	}
+
+	void write_u32(char* buf, size_t idx, _u32 val)
+	{
+		val = little_endian(val);
+		memcpy(buf + idx*sizeof(_u32), &val, sizeof(val));
+	}
+
+	_u32 read_u32(const char* buf, size_t idx)
+	{
+		_u32 val;
+		memcpy(&val, buf + idx*sizeof(_u32), sizeof(val));
+		return little_endian(val);
+	}
+}
+
+IMutex* FileManifest::mutex = NULL;
+std::map<int, FileManifest*> FileManifest::open_manifests;
+
+void FileManifest::init_mutex()
+{
+	mutex = Server->createMutex();
+}
+
+bool FileManifest::is_enabled()
+{
+	return Server->getServerParameter("file_manifests") == "true";
+}
+
+FileManifest::FileManifest(int backupid, int clientid)
+	: backupid(backupid), clientid(clientid), file(NULL), written_size(manifest_header_size), error(false), sync_error(false), finished(false)
+{
+	if (!os_directory_exists(manifest_dir)
+		&& !os_create_dir_recursive(manifest_dir))
+	{
+		Server->Log("Error creating file manifest directory \"" + std::string(manifest_dir) + "\". " + os_last_error_str(), LL_ERROR);
+	}
+
+	file = Server->openFile(manifest_fn(backupid), MODE_WRITE);
+
+	char header[manifest_header_size];
+	memcpy(header, manifest_magic, manifest_magic_size);
+	write_u32(header + manifest_magic_size, 0, static_cast<_u32>(clientid));
+	write_u32(header + manifest_magic_size, 1, static_cast<_u32>(backupid));
+
+	if (file == NULL
+		|| file->Write(header, manifest_header_size) != manifest_header_size)
+	{
+		Server->Log("Error creating file manifest \"" + manifest_fn(backupid) + "\". " + os_last_error_str(), LL_ERROR);
+		error = true;
+		finished = true;
+		return;
+	}
+
+	block.reserve(block_entries);
+
+	IScopedLock lock(mutex);
+	open_manifests[backupid] = this;
+}
+
+FileManifest::~FileManifest()
+{
+	std::vector<ServerFilesDao::SNewFileEntry> unwritten;
+	finish(unwritten);
+	if (!unwritten.empty())
+	{
+		Server->Log("Lost " + convert(unwritten.size()) + " entries of file manifest "" + manifest_fn(backupid) + """, LL_ERROR);
+	}
+	Server->destroy(file);
+}
+
+bool FileManifest::has_error()
+{
+	IScopedLock lock(mutex);
+	return error;
+}
+
+bool FileManifest::finish(std::vector<ServerFilesDao::SNewFileEntry>& unwritten)
+{
+	IScopedLock lock(mutex);
+
+	if (finished)
+	{
+		return !sync_error;
+	}
+
+	finished = true;
+	open_manifests.erase(backupid);
+
+	if (!block.empty()
+		&& !write_block())
+	{
+		take_block(unwritten);
+	}
+
+	//Blocks written before an error are valid
+	if (!file->Sync())
+	{
+		Server->Log("Error syncing file manifest \"" + manifest_fn(backupid) + "\". " + os_last_error_str(), LL_ERROR);
+		error = true;
+		sync_error = true;
+	}
+
+	return !sync_error;
+}
+
+bool FileManifest::add_entry(const ServerFilesDao::SNewFileEntry& entry, std::vector<ServerFilesDao::SNewFileEntry>& unwritten)
+{
+	IScopedLock lock(mutex);
+
+	std::map<int, FileManifest*>::iterator it = open_manifests.find(entry.backupid);
+	if (it == open_manifests.end()
+		|| it->second->error)
+	{
+		return false;
+	}
+
+	SEntry manifest_entry;
+	manifest_entry.fullpath = entry.fullpath;
+	manifest_entry.hashpath = entry.hashpath;
+	manifest_entry.shahash = entry.shahash;
+	manifest_entry.filesize = entry.filesize;
+	manifest_entry.rsize = entry.rsize;
+	manifest_entry.incremental = entry.incremental;
+
+	it->second->add(manifest_entry, unwritten);
+	return true;
+}
+
+void FileManifest::add(const SEntry& entry, std::vector<ServerFilesDao::SNewFileEntry>& unwritten)
+{
+	block.push_back(entry);
+
+	if (block.size() >= block_entries
+		&& !write_block())
+	{
+		//Entries added after an error go to the files table
+		take_block(unwritten);
+	}
+}
+
+void FileManifest::take_block(std::vector<ServerFilesDao::SNewFileEntry>& unwritten)
+{
+	for (size_t i = 0; i < block.size(); ++i)
+	{
+		const SEntry& entry = block[i];
+		ServerFilesDao::SNewFileEntry file_entry;
+		file_entry.backupid = backupid;
+		file_entry.fullpath = entry.fullpath;
+		file_entry.hashpath = entry.hashpath;
+		file_entry.shahash = entry.shahash;
+		file_entry.filesize = entry.filesize;
+		file_entry.rsize = entry.rsize;
+		file_entry.clientid = clientid;
+		file_entry.incremental = entry.incremental;
+		file_entry.next_entry = 0;
+		file_entry.prev_entry = 0;
+		file_entry.pointed_to = 0;
+		unwritten.push_back(file_entry);
+	}
+	block.clear();
+}
+
+bool FileManifest::write_block()
+{
+	std::sort(block.begin(), block.end(), entry_less);
+
+	std::map<std::string, size_t> hash_dict;
+	std::vector<const std::string*> dict_hashes;
+
+	CWData paths;
+	CWData hashpaths;
+	CWData hash_refs;
+	CWData sizes;
+	std::string prev_path;
+	std::string prev_hashpath;
+	for (size_t i = 0; i < block.size(); ++i)
+	{
+		const SEntry& entry = block[i];
+		add_prefixed(paths, prev_path, entry.fullpath);
+		add_prefixed(hashpaths, prev_hashpath, entry.hashpath);
+		prev_path = entry.fullpath;
+		prev_hashpath = entry.hashpath;
+
+		std::map<std::string, size_t>::iterator it = hash_dict.find(entry.shahash);
+		if (it == hash_dict.end())
+		{
+			it = hash_dict.insert(std::make_pair(entry.shahash, dict_hashes.size())).first;
+			dict_hashes.push_back(&it->first);
+		}
+		hash_refs.addVarInt(it->second);
+
+		sizes.addVarInt(entry.filesize);
+		sizes.addVarInt(entry.rsize);
+		sizes.addVarInt(entry.incremental);
+	}
+
+	CWData dict;
+	dict.addVarInt(dict_hashes.size());
+	for (size_t i = 0; i < dict_hashes.size(); ++i)
+	{
+		dict.addString2(*dict_hashes[i]);
+	}
+
+	CWData block_data;
+	add_column(block_data, dict);
+	add_column(block_data, paths);
+	add_column(block_data, hashpaths);
+	add_column(block_data, hash_refs);
+	add_column(block_data, sizes);
+
+	mz_ulong comp_size = mz_compressBound(block_data.getDataSize());
+	std::vector<char> comp_buf(block_header_size + comp_size);
+	int rc = mz_compress2(reinterpret_cast<unsigned char*>(&comp_buf[block_header_size]), &comp_size,
+		reinterpret_cast<const unsigned char*>(block_data.getDataPtr()), block_data.getDataSize(), MZ_DEFAULT_COMPRESSION);
+
+	size_t n_entries = block.size();
+
+	if (rc != MZ_OK)
+	{
+		Server->Log("Error compressing block of file manifest \"" + manifest_fn(backupid) + "\" rc=" + convert(rc), LL_ERROR);
+		error = true;
+		return false;
+	}
+
+	write_u32(&comp_buf[0], 0, static_cast<_u32>(n_entries));
+	write_u32(&comp_buf[0], 1, static_cast<_u32>(block_data.getDataSize()));
+	write_u32(&comp_buf[0], 2, static_cast<_u32>(comp_size));
+
+	_u32 towrite = static_cast<_u32>(block_header_size + comp_size);
+	if (file->Write(written_size, &comp_buf[0], towrite) != towrite)
+	{
+		Server->Log("Error writing to file manifest \"" + manifest_fn(backupid) + "\". " + os_last_error_str(), LL_ERROR);
+		error = true;
+
+		//Readers stop at a partially written block
+		if (!file->Resize(written_size))
+		{
+			Server->Log("Error removing partially written block of file manifest \"" + manifest_fn(backupid) + "\". " + os_last_error_str(), LL_ERROR);
+		}
+		return false;
+	}
+
+	written_size += towrite;
+	block.clear();
+	return true;
+}
+
+bool FileManifest::remove(int backupid)
+{
+	std::string fn = manifest_fn(backupid);
+	if (!FileExists(fn))
+	{
+		return true;
+	}
+
+	if (!Server->deleteFile(fn))
+	{
+		Server->Log("Error deleting file manifest \"" + fn + "\". " + os_last_error_str(), LL_ERROR);
+		return false;
+	}
+	return true;
+}
+
+void FileManifest::remove_dangling(const std::set<int>& backupids)
+{
+	std::vector<int> manifest_backupids = get_backupids();
+	for (size_t i = 0; i < manifest_backupids.size(); ++i)
+	{
+		if (backupids.find(manifest_backupids[i]) == backupids.end())
+		{
+			Server->Log("Deleting file manifest of deleted backup with id " + convert(manifest_backupids[i]), LL_INFO);
+			remove(manifest_backupids[i]);
+		}
+	}
+}
+
+std::vector<int> FileManifest::get_backupids()
+{
+	std::vector<int> ret;
+	std::vector<SFile> files = getFiles(manifest_dir);
+	for (size_t i = 0; i < files.size(); ++i)
+	{
+		if (!files[i].isdir
+			&& findextension(files[i].name) == "manifest")
+		{
+			ret.push_back(watoi(getuntil(".", files[i].name)));
+		}
+	}
+	return ret;
+}
+
+FileManifest::Reader::Reader(int backupid)
+	: file(NULL), clientid(0), block_pos(0), error(false)
+{
+	std::string fn = manifest_fn(backupid);
+	if (!FileExists(fn))
+	{
+		return;
+	}
+
+	file = Server->openFile(fn, MODE_READ);
+
+	char header[manifest_header_size];
+	if (file == NULL
+		|| file->Read(header, manifest_header_size) != manifest_header_size
+		|| memcmp(header, manifest_magic, manifest_magic_size) != 0
+		|| static_cast<int>(read_u32(header + manifest_magic_size, 1)) != backupid)
+	{
+		Server->Log("Error reading header of file manifest \"" + fn + "\"", LL_ERROR);
+		error = true;
+		return;
+	}
+
+	clientid = static_cast<int>(read_u32(header + manifest_magic_size, 0));
+}
+
+FileManifest::Reader::~Reader()
+{
+	Server->destroy(file);
+}
+
+bool FileManifest::Reader::exists()
+{
+	return file != NULL;
+}
+
+int FileManifest::Reader::get_clientid()
+{
+	return clientid;
+}
+
+bool FileManifest::Reader::has_error()
+{
+	return error;
+}
+
+bool FileManifest::Reader::next(SEntry& entry)
+{
+	while (block_pos >= block.size())
+	{
+		if (error || file == NULL
+			|| !read_block())
+		{
+			return false;
+		}
+	}
+
+	entry = block[block_pos];
+	++block_pos;
+	return true;
+}
+
+bool FileManifest::Reader::read_block()
+{
+	block.clear();
+	block_pos = 0;
+
+	char header[block_header_size];
+	_u32 read = file->Read(header, block_header_size);
+	if (read == 0)
+	{
+		return false;
+	}
+
+	_u32 n_entries = read_u32(header, 0);
+	_u32 raw_size = read_u32(header, 1);
+	_u32 comp_size = read_u32(header, 2);
+
+	if (read != block_header_size
+		|| n_entries == 0 || n_entries > max_block_size
+		|| raw_size == 0 || raw_size > max_block_size
+		|| comp_size == 0 || comp_size > max_block_size)
+	{
+		Server->Log("Invalid block header in file manifest \"" + file->getFilename() + "\"", LL_ERROR);
+		error = true;
+		return false;
+	}
+
+	std::vector<char> comp_buf(comp_size);
+	std::vector<char> raw_buf(raw_size);
+	mz_ulong raw_len = raw_size;
+	if (file->Read(&comp_buf[0], comp_size) != comp_size
+		|| mz_uncompress(reinterpret_cast<unsigned char*>(&raw_buf[0]), &raw_len,
+			reinterpret_cast<const unsigned char*>(&comp_buf[0]), comp_size) != MZ_OK
+		|| raw_len != raw_size)
+	{
+		Server->Log("Error reading block of file manifest \"" + file->getFilename() + "\"", LL_ERROR);
+		error = true;
+		return false;
+	}
+
+	CRData block_data(&raw_buf[0], raw_buf.size());
+	std::string dict_col;
+	std::string paths_col;
+	std::string hashpaths_col;
+	std::string hash_refs_col;
+	std::string sizes_col;
+	if (!block_data.getStr2(&dict_col)
+		|| !block_data.getStr2(&paths_col)
+		|| !block_data.getStr2(&hashpaths_col)
+		|| !block_data.getStr2(&hash_refs_col)
+		|| !block_data.getStr2(&sizes_col))
+	{
+		Server->Log("Missing columns in block of file manifest \"" + file->getFilename() + "\"", LL_ERROR);
+		error = true;
+		return false;
+	}
+
+	CRData dict(&dict_col);
+	int64 n_dict;
+	std::vector<std::string> hashes;
+	if (!dict.getVarInt(&n_dict)
+		|| n_dict<0 || n_dict>n_entries)
+	{
+		error = true;
+	}
+	else
+	{
+		hashes.resize(static_cast<size_t>(n_dict));
+		for (size_t i = 0; i < hashes.size() && !error; ++i)
+		{
+			error = !dict.getStr2(&hashes[i]);
+		}
+	}
+
+	CRData paths(&paths_col);
+	CRData hashpaths(&hashpaths_col);
+	CRData hash_refs(&hash_refs_col);
+	CRData sizes(&sizes_col);
+	block.resize(n_entries);
+	std::string prev_path;
+	std::string prev_hashpath;
+	for (size_t i = 0; i < block.size() && !error; ++i)
+	{
+		SEntry& entry = block[i];
+		int64 hash_ref;
+		int64 incremental;
+		if (!get_prefixed(paths, prev_path, entry.fullpath)
+			|| !get_prefixed(hashpaths, prev_hashpath, entry.hashpath)
+			|| !hash_refs.getVarInt(&hash_ref)
+			|| hash_ref<0 || hash_ref>=n_dict
+			|| !sizes.getVarInt(&entry.filesize)
+			|| !sizes.getVarInt(&entry.rsize)
+			|| !sizes.getVarInt(&incremental))
+		{
+			error = true;
+			break;
+		}
+		entry.shahash = hashes[static_cast<size_t>(hash_ref)];
+		entry.incremental = static_cast<int>(incremental);
+		prev_path = entry.fullpath;
+		prev_hashpath = entry.hashpath;
+	}
+
+	if (error)
+	{
+		Server->Log("Error decoding block of file manifest \"" + file->getFilename() + "\"", LL_ERROR);
+		block.clear();
+		return false;
+	}
+
+	return true;
+}
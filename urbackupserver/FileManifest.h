@@ -0,0 +1,103 @@
+#pragma once
+
+#include "../Interface/Types.h"
+#include "../Interface/File.h"
+#include "dao/ServerFilesDao.h"
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+
+//Optional compact storage of the file entries of a file backup which are not
+//used for deduplication (files too small to be linked). Instead of one row per
+//file in the files table they are written to one manifest file per backup.
+//The manifest consists of compressed blocks. Each block is sorted by path on its
+//own (the manifest as a whole is not sorted) and stored column by column, with
+//the paths prefix compressed against the previous path and the hashes as
+//references into a per-block dictionary.
+//Entries stay in memory until their block is written. If writing a block fails
+//its entries are returned to the caller, which adds them to the files table.
+class FileManifest
+{
+public:
+	struct SEntry
+	{
+		std::string fullpath;
+		std::string hashpath;
+		std::string shahash;
+		int64 filesize;
+		int64 rsize;
+		int incremental;
+	};
+
+	static void init_mutex();
+
+	static bool is_enabled();
+
+	//Creates the manifest of a file backup. Until it is finished add_entry()
+	//puts the entries of the backup into it
+	FileManifest(int backupid, int clientid);
+	~FileManifest();
+
+	bool has_error();
+
+	//Writes the last block. Entries added afterwards go to the files table.
+	//Returns the entries which could not be written in unwritten. Returns false
+	//if the written blocks could not be synced
+	bool finish(std::vector<ServerFilesDao::SNewFileEntry>& unwritten);
+
+	//Returns false if the backup has no open manifest. If writing a block fails,
+	//its entries (including this one) are returned in unwritten
+	static bool add_entry(const ServerFilesDao::SNewFileEntry& entry, std::vector<ServerFilesDao::SNewFileEntry>& unwritten);
+
+	static bool remove(int backupid);
+
+	//Removes the manifests of backups which are not in backupids
+	static void remove_dangling(const std::set<int>& backupids);
+
+	static std::vector<int> get_backupids();
+
+	class Reader
+	{
+	public:
+		Reader(int backupid);
+		~Reader();
+
+		//False if the backup does not have a manifest
+		bool exists();
+
+		int get_clientid();
+
+		//Returns false at the end of the manifest or on error
+		bool next(SEntry& entry);
+
+		bool has_error();
+
+	private:
+		bool read_block();
+
+		IFile* file;
+		int clientid;
+		std::vector<SEntry> block;
+		size_t block_pos;
+		bool error;
+	};
+
+private:
+	void add(const SEntry& entry, std::vector<ServerFilesDao::SNewFileEntry>& unwritten);
+	bool write_block();
+	void take_block(std::vector<ServerFilesDao::SNewFileEntry>& unwritten);
+
+	int backupid;
+	int clientid;
+	IFsFile* file;
+	//Size of the manifest up to the last completely written block
+	int64 written_size;
+	std::vector<SEntry> block;
+	bool error;
+	bool sync_error;
+	bool finished;
+
+	static IMutex* mutex;
+	static std::map<int, FileManifest*> open_manifests;
+};
@@ -0,0 +1,201 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "FilePrefetcher.h"
+#include "../Interface/Server.h"
+#include "../Interface/Thread.h"
+#include "../Interface/ThreadPool.h"
+#include "../stringtools.h"
+#include <algorithm>
+
+class FilePrefetcher::ReadWorker : public IThread
+{
+public:
+	ReadWorker(FilePrefetcher& prefetcher)
+		: prefetcher(prefetcher)
+	{
+	}
+
+	void operator()()
+	{
+		prefetcher.read_blocks();
+	}
+
+private:
+	FilePrefetcher& prefetcher;
+};
+
+FilePrefetcher::FilePrefetcher(IFile* file, size_t block_size, size_t n_blocks)
+	: file(file), file_size(file->Size()), block_size(block_size),
+	mutex(Server->createMutex()), cond_reader(Server->createCondition()), cond_consumer(Server->createCondition()),
+	do_exit(false), reading(false), head(0), n_queued(0), next_pos(0), worker(NULL), ticket(ILLEGAL_THREADPOOL_TICKET)
+{
+	blocks.resize((std::max)(n_blocks, static_cast<size_t>(2)));
+}
+
+FilePrefetcher::~FilePrefetcher()
+{
+	if (worker != NULL)
+	{
+		{
+			IScopedLock lock(mutex);
+			do_exit = true;
+			cond_reader->notify_all();
+		}
+
+		Server->getThreadPool()->waitFor(ticket);
+		delete worker;
+	}
+
+	Server->destroy(mutex);
+	Server->destroy(cond_reader);
+	Server->destroy(cond_consumer);
+}
+
+const char* FilePrefetcher::get(int64 pos, _u32 max_size, _u32& size, bool& has_read_error)
+{
+	size = 0;
+
+	if (pos < 0 || pos >= file_size)
+	{
+		has_read_error = true;
+		return NULL;
+	}
+
+	IScopedLock lock(mutex);
+
+	if (worker == NULL)
+	{
+		next_pos = pos;
+		worker = new ReadWorker(*this);
+		ticket = Server->getThreadPool()->execute(worker, "patch prefetch");
+	}
+
+	while (true)
+	{
+		if (n_queued == 0)
+		{
+			if (pos < next_pos
+				|| pos >= next_pos + static_cast<int64>(block_size))
+			{
+				restart(lock, pos);
+			}
+
+			cond_consumer->wait(&lock);
+			continue;
+		}
+
+		SBlock& front = blocks[head];
+
+		if (pos < front.pos
+			|| pos >= next_pos + static_cast<int64>(block_size))
+		{
+			restart(lock, pos);
+			continue;
+		}
+
+		if (!front.full)
+		{
+			cond_consumer->wait(&lock);
+			continue;
+		}
+
+		if (front.read_error
+			&& pos < front.pos + static_cast<int64>(block_size))
+		{
+			has_read_error = true;
+			return NULL;
+		}
+
+		if (pos >= front.pos + front.size)
+		{
+			head = (head + 1) % blocks.size();
+			--n_queued;
+			cond_reader->notify_one();
+			continue;
+		}
+
+		size_t off = static_cast<size_t>(pos - front.pos);
+		size = static_cast<_u32>((std::min)(static_cast<size_t>(max_size), front.size - off));
+		return front.data.data() + off;
+	}
+}
+
+void FilePrefetcher::restart(IScopedLock& lock, int64 pos)
+{
+	//Wait for the block being read, so it is not put into the restarted queue
+	while (reading)
+	{
+		cond_consumer->wait(&lock);
+	}
+
+	head = 0;
+	n_queued = 0;
+	next_pos = pos;
+	cond_reader->notify_one();
+}
+
+void FilePrefetcher::read_blocks()
+{
+	IScopedLock lock(mutex);
+	while (true)
+	{
+		while (!do_exit
+			&& (n_queued == blocks.size()
+				|| next_pos >= file_size))
+		{
+			cond_reader->wait(&lock);
+		}
+
+		if (do_exit)
+		{
+			return;
+		}
+
+		SBlock& block = blocks[(head + n_queued) % blocks.size()];
+		block.pos = next_pos;
+		block.size = static_cast<_u32>((std::min)(static_cast<int64>(block_size), file_size - next_pos));
+		block.full = false;
+		block.read_error = false;
+		if (block.data.size() < block_size)
+		{
+			block.data.resize(block_size);
+		}
+		++n_queued;
+		next_pos += block.size;
+		reading = true;
+
+		lock.relock(NULL);
+
+		bool has_read_error = false;
+		_u32 r = file->Read(block.pos, block.data.data(), block.size, &has_read_error);
+
+		lock.relock(mutex);
+
+		if (has_read_error
+			|| r != block.size)
+		{
+			Server->Log("Error reading from \"" + file->getFilename() + "\" at offset " + convert(block.pos) + " while prefetching", LL_ERROR);
+			block.read_error = true;
+		}
+
+		block.full = true;
+		reading = false;
+		cond_consumer->notify_all();
+	}
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "../Interface/Types.h"
+#include "../Interface/File.h"
+#include "../Interface/Mutex.h"
+#include "../Interface/Condition.h"
+#include <vector>
+
+//Reads a file sequentially ahead of its consumer in a thread pool thread, so
+//reading overlaps with processing the data. The file is read in large blocks
+//into a fixed number of buffers. Skipping forward a bit drops the buffered
+//blocks before the new position, going backwards or far ahead restarts
+//reading at the new position.
+class FilePrefetcher
+{
+public:
+	FilePrefetcher(IFile* file, size_t block_size, size_t n_blocks);
+	~FilePrefetcher();
+
+	//Returns the data at pos and sets size to the number of bytes returned
+	//(at most max_size). The data stays valid until the next call.
+	//Returns NULL on read error or if pos is not in the file
+	const char* get(int64 pos, _u32 max_size, _u32& size, bool& has_read_error);
+
+private:
+	class ReadWorker;
+
+	struct SBlock
+	{
+		std::vector<char> data;
+		int64 pos;
+		_u32 size;
+		bool full;
+		bool read_error;
+	};
+
+	void restart(IScopedLock& lock, int64 pos);
+	void read_blocks();
+
+	IFile* file;
+	int64 file_size;
+	size_t block_size;
+
+	IMutex* mutex;
+	ICondition* cond_reader;
+	ICondition* cond_consumer;
+	bool do_exit;
+	bool reading;
+
+	std::vector<SBlock> blocks;
+	size_t head;
+	size_t n_queued;
+	int64 next_pos;
+
+	ReadWorker* worker;
+	THREADPOOL_TICKET ticket;
+};
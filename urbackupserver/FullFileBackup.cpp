@@ -167,6 +167,8 @@ bool FullFileBackup::doFileBackup()
 
 	backupid = static_cast<int>(db->getLastInsertID());
 
+	openFileManifest();
+
 	tmp_filelist->Seek(0);
 
 	FileListParser list_parser;
@@ -712,7 +714,7 @@ bool FullFileBackup::doFileBackup()
 	tmp_filelist->Seek(0);
 	line = 0;
 	list_parser.reset();
-	size_t output_offset=0;
+	FileListWriter clientlist_writer(clientlist, useBinaryFilelists(), true);
 	std::stack<size_t> last_modified_offsets;
 	script_dir=false;
 	has_read_error = false;
@@ -735,8 +737,8 @@ bool FullFileBackup::doFileBackup()
 						if (line < max_line)
 						{
 							size_t curr_last_modified_offset = 0;
-							size_t curr_output_offset = output_offset;
-							writeFileItem(clientlist, cf, &output_offset, &curr_last_modified_offset);
+							size_t curr_output_offset = static_cast<size_t>(clientlist_writer.getPos());
+							clientlist_writer.write(cf, NULL, &curr_last_modified_offset);
 
 							last_modified_offsets.push(curr_output_offset + curr_last_modified_offset);
 						}
@@ -769,7 +771,7 @@ bool FullFileBackup::doFileBackup()
 								char ch;
 								if(clientlist->Read(&ch, 1)==1)
 								{
-									ch = (ch=='0' ? '1' : '0');
+									ch = clientlist_writer.toggleChangeIndicator(ch);
 									if(!clientlist->Seek(last_modified_offsets.top())
 										|| clientlist->Write(&ch, 1)!=1)
 									{
@@ -794,7 +796,7 @@ bool FullFileBackup::doFileBackup()
 
 						if (line < max_line)
 						{
-							writeFileItem(clientlist, cf, &output_offset);
+							clientlist_writer.write(cf);
 						}
 
 						script_dir=false;
@@ -824,7 +826,7 @@ bool FullFileBackup::doFileBackup()
 						}
 						cf.last_modified *= Server->getRandomNumber();
 					}
-					writeFileItem(clientlist, cf, &output_offset);
+					clientlist_writer.write(cf);
 				}				
 				++line;
 			}
@@ -837,6 +839,8 @@ bool FullFileBackup::doFileBackup()
 		disk_error = true;
 	}
 
+	clientlist_writer.finish();
+
 	if(has_all_metadata)
 	{
 		ServerLogger::Log(logid, "All metadata was present", LL_INFO);
@@ -865,7 +869,7 @@ bool FullFileBackup::doFileBackup()
 		}
 	}
 
-	if( bsh->hasError() || bsh_prepare->hasError() )
+	if( hashThreadsHaveError() )
 	{
 		disk_error=true;
 	}
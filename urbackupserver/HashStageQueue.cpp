@@ -0,0 +1,226 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "HashStageQueue.h"
+#include "../Interface/Server.h"
+#include "../stringtools.h"
+
+HashStageQueue::HashStageQueue(HashWorkQueue* input, HashWorkQueue* output, size_t n_workers, key_func_t key_func)
+	: input(input), output(output), n_workers(n_workers), key_func(key_func),
+	mutex(Server->createMutex()), cond(Server->createCondition()), output_mutex(Server->createMutex()),
+	next_seq(0), next_output(0), next_done(0), n_done(0), n_exit_seen(0), n_exited(0)
+{
+}
+
+HashStageQueue::~HashStageQueue()
+{
+	for (std::map<int64, SHashWorkItem*>::iterator it = results.begin(); it != results.end(); ++it)
+	{
+		delete it->second;
+	}
+	delete input;
+	Server->destroy(mutex);
+	Server->destroy(cond);
+	Server->destroy(output_mutex);
+}
+
+size_t HashStageQueue::get_default_workers()
+{
+	std::string workers = Server->getServerParameter("file_hash_workers");
+	if (!workers.empty())
+	{
+		return (std::max)(1, watoi(workers));
+	}
+	return 1;
+}
+
+SHashWorkItem* HashStageQueue::next(int timeoutms)
+{
+	while (true)
+	{
+		if (!input->isReadable(timeoutms))
+		{
+			if (timeoutms < 0)
+			{
+				continue;
+			}
+			return NULL;
+		}
+
+		//Taking the item and numbering have to be atomic, so wait for readability without the lock
+		IScopedLock lock(mutex);
+
+		SHashWorkItem* item = input->pop(0);
+		if (item == NULL)
+		{
+			if (timeoutms == 0)
+			{
+				return NULL;
+			}
+			continue;
+		}
+
+		if (item->type == SHashWorkItem::EType_Exit)
+		{
+			//Every worker has to get one
+			++n_exit_seen;
+			if (n_exit_seen < n_workers)
+			{
+				input->pushControl(SHashWorkItem::EType_Exit);
+			}
+			item->seq = -1;
+			return item;
+		}
+		else if (item->type == SHashWorkItem::EType_Flush)
+		{
+			item->seq = -1;
+			return item;
+		}
+
+		item->seq = next_seq++;
+
+		if (key_func != NULL)
+		{
+			std::string key = key_func(*item);
+			if (!key.empty())
+			{
+				item_keys[item->seq] = key;
+				key_seqs[key].insert(item->seq);
+			}
+		}
+
+		return item;
+	}
+}
+
+void HashStageQueue::put(int64 seq, SHashWorkItem* result)
+{
+	//The output blocks while it is full, so write to it without the lock, but
+	//one worker after another to keep the order. The file counts as done only
+	//after its result was written, so in_progress() does not miss it.
+	IScopedLock output_lock(output_mutex);
+
+	std::vector<SHashWorkItem*> ready;
+	{
+		IScopedLock lock(mutex);
+
+		results[seq] = result;
+
+		std::map<int64, SHashWorkItem*>::iterator it;
+		while (!results.empty()
+			&& (it = results.begin())->first == next_output)
+		{
+			if (it->second != NULL)
+			{
+				ready.push_back(it->second);
+			}
+			results.erase(it);
+			++next_output;
+		}
+	}
+
+	for (size_t i = 0; i < ready.size(); ++i)
+	{
+		output->push(ready[i]);
+	}
+
+	done(seq);
+}
+
+void HashStageQueue::done(int64 seq)
+{
+	IScopedLock lock(mutex);
+	done_locked(seq);
+}
+
+void HashStageQueue::done_locked(int64 seq)
+{
+	++n_done;
+
+	done_seqs.insert(seq);
+	while (!done_seqs.empty()
+		&& *done_seqs.begin() == next_done)
+	{
+		done_seqs.erase(done_seqs.begin());
+		++next_done;
+	}
+
+	std::map<int64, std::string>::iterator it = item_keys.find(seq);
+	if (it != item_keys.end())
+	{
+		std::map<std::string, std::set<int64> >::iterator it_key = key_seqs.find(it->second);
+		it_key->second.erase(seq);
+		if (it_key->second.empty())
+		{
+			key_seqs.erase(it_key);
+		}
+		item_keys.erase(it);
+	}
+
+	cond->notify_all();
+}
+
+void HashStageQueue::wait_turn(int64 seq)
+{
+	IScopedLock lock(mutex);
+	while (next_done < seq)
+	{
+		cond->wait(&lock);
+	}
+}
+
+void HashStageQueue::wait_key(int64 seq)
+{
+	IScopedLock lock(mutex);
+
+	std::map<int64, std::string>::iterator it = item_keys.find(seq);
+	if (it == item_keys.end())
+	{
+		return;
+	}
+
+	std::set<int64>& seqs = key_seqs[it->second];
+	while (*seqs.begin() != seq)
+	{
+		cond->wait(&lock);
+	}
+}
+
+size_t HashStageQueue::in_progress()
+{
+	IScopedLock lock(mutex);
+	return static_cast<size_t>(next_seq - n_done);
+}
+
+size_t HashStageQueue::get_n_workers()
+{
+	return n_workers;
+}
+
+void HashStageQueue::put_output(SHashWorkItem::EType type)
+{
+	IScopedLock output_lock(output_mutex);
+	output->pushControl(type);
+}
+
+bool HashStageQueue::worker_exit()
+{
+	IScopedLock lock(mutex);
+	++n_exited;
+	return n_exited == n_workers;
+}
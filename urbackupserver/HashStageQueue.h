@@ -0,0 +1,80 @@
+#pragma once
+
+#include "../Interface/Types.h"
+#include "HashWorkQueue.h"
+#include "../Interface/Mutex.h"
+#include "../Interface/Condition.h"
+#include <string>
+#include <map>
+#include <set>
+#include <vector>
+
+//Input of one stage of the file backup pipeline (hash preparation or
+//linking), shared by the worker threads of that stage. Files get sequence
+//numbers in input order. Workers pass results on through a reorder buffer or
+//wait for their turn before writing to the database, so the next stage and
+//the file entries see the files in input order no matter which worker
+//finishes first.
+class HashStageQueue
+{
+public:
+	typedef std::string(*key_func_t)(const SHashWorkItem& item);
+
+	//Files with the same (non-empty) key returned by key_func are processed
+	//one after another in input order
+	HashStageQueue(HashWorkQueue* input, HashWorkQueue* output, size_t n_workers, key_func_t key_func=NULL);
+	~HashStageQueue();
+
+	static size_t get_default_workers();
+
+	//Gets the next item. Files get the next sequence number, control
+	//items (flush, exit) get -1. Returns NULL on timeout.
+	SHashWorkItem* next(int timeoutms=-1);
+
+	//Marks file seq as done and passes its result on to the output once all
+	//files before it are done. Files without result pass NULL.
+	void put(int64 seq, SHashWorkItem* result);
+
+	void done(int64 seq);
+
+	//Blocks until all files before seq are done
+	void wait_turn(int64 seq);
+
+	//Blocks until all files before seq with the same key are done
+	void wait_key(int64 seq);
+
+	//Files taken from the input, which are not done yet
+	size_t in_progress();
+
+	size_t get_n_workers();
+
+	//Writes a control item to the output
+	void put_output(SHashWorkItem::EType type);
+
+	//Called by each worker after it got exit. Returns true for the last one.
+	bool worker_exit();
+
+private:
+	void done_locked(int64 seq);
+
+	HashWorkQueue* input;
+	HashWorkQueue* output;
+	size_t n_workers;
+	key_func_t key_func;
+
+	IMutex* mutex;
+	ICondition* cond;
+	IMutex* output_mutex;
+
+	int64 next_seq;
+	int64 next_output;
+	int64 next_done;
+	int64 n_done;
+	std::set<int64> done_seqs;
+	std::map<int64, SHashWorkItem*> results;
+	std::map<int64, std::string> item_keys;
+	std::map<std::string, std::set<int64> > key_seqs;
+
+	size_t n_exit_seen;
+	size_t n_exited;
+};
@@ -0,0 +1,187 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "HashWorkQueue.h"
+#include "../Interface/Server.h"
+#include "../urbackupcommon/os_functions.h"
+#include <algorithm>
+
+SHashWorkItem::SHashWorkItem(EType type)
+	: type(type), seq(-1), fileid(0), tf(NULL), backupid(0), incremental(0),
+	with_hashes(false), old_file(NULL), t_filesize(0), hash_func(0), has_snapshot(false)
+{
+}
+
+SHashWorkItem::~SHashWorkItem()
+{
+	if (tf != NULL)
+	{
+		Server->destroy(tf);
+	}
+	if (old_file != NULL)
+	{
+		Server->destroy(old_file);
+	}
+}
+
+IFile* SHashWorkItem::releaseTempFile(int mode)
+{
+	IFile* ret = tf;
+	tf = NULL;
+	if (ret == NULL)
+	{
+		ret = Server->openFile(os_file_prefix(temp_fn), mode);
+	}
+	else
+	{
+		ret->Seek(0);
+	}
+	return ret;
+}
+
+HashWorkQueue::HashWorkQueue(size_t capacity)
+	: ring((std::max)(capacity, static_cast<size_t>(1))), head(0), n_items(0),
+	capacity((std::max)(capacity, static_cast<size_t>(1))), n_waiting_readers(0), n_waiting_writers(0),
+	mutex(Server->createMutex()), cond_readable(Server->createCondition()),
+	cond_writable(Server->createCondition())
+{
+}
+
+HashWorkQueue::~HashWorkQueue()
+{
+	for (size_t i = 0; i < n_items; ++i)
+	{
+		delete ring[(head + i) % ring.size()];
+	}
+	Server->destroy(mutex);
+	Server->destroy(cond_readable);
+	Server->destroy(cond_writable);
+}
+
+void HashWorkQueue::push(SHashWorkItem* item)
+{
+	IScopedLock lock(mutex);
+
+	if (item->isControl())
+	{
+		if (n_items == ring.size())
+		{
+			grow();
+		}
+	}
+	else
+	{
+		while (n_items >= capacity)
+		{
+			++n_waiting_writers;
+			cond_writable->wait(&lock);
+			--n_waiting_writers;
+		}
+	}
+
+	ring[(head + n_items) % ring.size()] = item;
+	++n_items;
+
+	if (n_waiting_readers > 0)
+	{
+		cond_readable->notify_one();
+	}
+}
+
+void HashWorkQueue::pushControl(SHashWorkItem::EType type)
+{
+	push(new SHashWorkItem(type));
+}
+
+SHashWorkItem* HashWorkQueue::pop(int timeoutms)
+{
+	IScopedLock lock(mutex);
+
+	if (n_items == 0)
+	{
+		++n_waiting_readers;
+		if (timeoutms < 0)
+		{
+			while (n_items == 0)
+			{
+				cond_readable->wait(&lock);
+			}
+		}
+		else if (timeoutms > 0)
+		{
+			cond_readable->wait(&lock, timeoutms);
+		}
+		--n_waiting_readers;
+
+		if (n_items == 0)
+		{
+			return NULL;
+		}
+	}
+
+	SHashWorkItem* ret = ring[head];
+	ring[head] = NULL;
+	head = (head + 1) % ring.size();
+	--n_items;
+
+	if (n_waiting_writers > 0)
+	{
+		cond_writable->notify_one();
+	}
+
+	return ret;
+}
+
+bool HashWorkQueue::isReadable(int timeoutms)
+{
+	IScopedLock lock(mutex);
+
+	if (n_items > 0)
+		return true;
+
+	++n_waiting_readers;
+	if (timeoutms > 0)
+		cond_readable->wait(&lock, timeoutms);
+	else if (timeoutms < 0)
+		cond_readable->wait(&lock);
+	--n_waiting_readers;
+
+	return n_items > 0;
+}
+
+size_t HashWorkQueue::getNumElements()
+{
+	IScopedLock lock(mutex);
+	return n_items;
+}
+
+size_t HashWorkQueue::getCapacity()
+{
+	return capacity;
+}
+
+void HashWorkQueue::grow()
+{
+	std::vector<SHashWorkItem*> new_ring(ring.size() * 2);
+	for (size_t i = 0; i < n_items; ++i)
+	{
+		new_ring[i] = ring[(head + i) % ring.size()];
+	}
+	ring.swap(new_ring);
+	head = 0;
+}
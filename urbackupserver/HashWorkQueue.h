@@ -0,0 +1,104 @@
+#pragma once
+
+#include "../Interface/Types.h"
+#include "../Interface/File.h"
+#include "../Interface/Mutex.h"
+#include "../Interface/Condition.h"
+#include "../urbackupcommon/file_metadata.h"
+#include <string>
+#include <vector>
+
+//One file passing through the hash preparation and linking stages of a
+//file backup. Items are allocated once by the producer and handed on by
+//pointer, so the stages do not serialize or copy them. The current owner
+//deletes the item, which closes the file handles it still holds.
+struct SHashWorkItem
+{
+	enum EType
+	{
+		//Downloaded file which has to be hashed (input of the preparation stage)
+		EType_Prepare,
+		//Hashed file which has to be linked or copied into the backup
+		EType_LinkOrCopy,
+		//Copy temp_fn to tfn and hashpath to hashoutput_fn
+		EType_Copy,
+		EType_Flush,
+		EType_Exit
+	};
+
+	SHashWorkItem(EType type=EType_Prepare);
+	~SHashWorkItem();
+
+	bool isControl() const
+	{
+		return type==EType_Flush || type==EType_Exit;
+	}
+
+	//Takes the temporary file handle (opens temp_fn if there is none)
+	IFile* releaseTempFile(int mode);
+
+	EType type;
+	int64 seq;
+
+	int64 fileid;
+	std::string temp_fn;
+	IFile* tf;
+	int backupid;
+	int incremental;
+	bool with_hashes;
+	std::string tfn;
+	std::string hashpath;
+	std::string hashoutput_fn;
+	std::string old_file_fn;
+	IFile* old_file;
+	int64 t_filesize;
+	std::string client_sha_dig;
+	std::string sparse_extents_fn;
+	char hash_func;
+	bool has_snapshot;
+	std::string sha2;
+	FileMetadata metadata;
+
+private:
+	SHashWorkItem(const SHashWorkItem& other);
+	SHashWorkItem& operator=(const SHashWorkItem& other);
+};
+
+//Bounded ring of work items between two stages. Producers block while it is
+//full, so downloaded files cannot pile up unboundedly in front of a slow
+//hashing or linking stage. Control items (flush, exit) are always accepted.
+class HashWorkQueue
+{
+public:
+	HashWorkQueue(size_t capacity);
+	~HashWorkQueue();
+
+	//Takes ownership of item
+	void push(SHashWorkItem* item);
+
+	void pushControl(SHashWorkItem::EType type);
+
+	//Returns NULL on timeout
+	SHashWorkItem* pop(int timeoutms=-1);
+
+	bool isReadable(int timeoutms=0);
+
+	size_t getNumElements();
+
+	size_t getCapacity();
+
+private:
+	void grow();
+
+	std::vector<SHashWorkItem*> ring;
+	size_t head;
+	size_t n_items;
+	size_t capacity;
+	//Only wake up threads if there are any waiting
+	size_t n_waiting_readers;
+	size_t n_waiting_writers;
+
+	IMutex* mutex;
+	ICondition* cond_readable;
+	ICondition* cond_writable;
+};
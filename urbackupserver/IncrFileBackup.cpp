@@ -21,6 +21,8 @@
 #include "../urbackupcommon/os_functions.h"
 #include "ClientMain.h"
 #include "treediff/TreeDiff.h"
+#include "treediff/StreamingTreeDiff.h"
+#include "FileListStream.h"
 #include "../urbackupcommon/filelist_utils.h"
 #include "server_dir_links.h"
 #include "server_running.h"
@@ -37,6 +39,8 @@
 #include "database.h"
 #include <algorithm>
 #include "PhashLoad.h"
+#include "HashWorkQueue.h"
+#include "FileManifest.h"
 
 extern std::string server_identity;
 
@@ -216,12 +220,62 @@ bool IncrFileBackup::doFileBackup()
 	int64 incr_backup_starttime=Server->getTimeMS();
 	int64 incr_backup_stoptime=0;
 
-	rc=fc.GetFile(group>0?("urbackup/filelist_"+convert(group)+".ub"):"urbackup/filelist.ub", tmp_filelist, hashed_transfer, false, 0, false, 0);
-	if(rc!=ERR_SUCCESS)
+	std::string clientlist_name = clientlistName(last.backupid);
+	if(!Server->fileExists(clientlist_name))
 	{
-		ServerLogger::Log(logid, "Error getting filelist of "+clientname+". Errorcode: "+fc.getErrorString(rc)+" ("+convert(rc)+")", LL_ERROR);
-		has_early_error=true;
-		return false;
+		clientlist_name="urbackup/clientlist_"+convert(clientid)+".ub";
+	}
+
+	bool has_symbit = client_main->getProtocolVersions().symbit_version > 0;
+	std::string os_simple = client_main->getProtocolVersions().os_simple;
+	bool is_windows = (os_simple == "windows" || os_simple.empty());
+
+	std::vector<size_t> diffs;
+	std::vector<size_t> modified_inplace_ids;
+	std::vector<size_t> dir_diffs;
+
+	//Backups of Windows clients may need to fail on snapshot errors (backup with components),
+	//which is only known after the whole list is loaded
+	std::auto_ptr<StreamingTreeDiff> streaming_diff;
+	if(!use_snapshots && !is_windows && useStreamingFilelist())
+	{
+		streaming_diff.reset(new StreamingTreeDiff(diffs, dir_diffs, &modified_inplace_ids));
+		if(!streaming_diff->readTree(clientlist_name))
+		{
+			ServerLogger::Log(logid, "Error reading last file list. Loading file list completely before backup.", LL_WARNING);
+			streaming_diff.reset();
+		}
+	}
+
+	std::string filelist_fn = group>0?("urbackup/filelist_"+convert(group)+".ub"):"urbackup/filelist.ub";
+	std::auto_ptr<FileClient> fc_list;
+	std::auto_ptr<FileListStream> filelist_stream;
+	if(streaming_diff.get()!=NULL)
+	{
+		fc_list.reset(new FileClient(false, identity, client_main->getProtocolVersions().filesrv_protocol_version, client_main->isOnInternetConnection(), client_main, use_tmpfiles?NULL:this));
+		rc=client_main->getClientFilesrvConnection(fc_list.get(), server_settings.get(), 60000);
+		if(rc!=ERR_CONNECTED)
+		{
+			ServerLogger::Log(logid, "Incremental Backup of "+clientname+" failed - CONNECT error -4", LL_ERROR);
+			has_early_error=true;
+			log_backup=false;
+			return false;
+		}
+
+		//Only verified parts of the list are processed with hashed transfers. Returning
+		//before the list is processed aborts the download
+		filelist_stream.reset(new FileListStream(tmp_filelist));
+		filelist_stream->startDownload(*fc_list, filelist_fn, hashed_transfer, client_main->getProtocolVersions().filesrv_protocol_version);
+	}
+	else
+	{
+		rc=fc.GetFile(filelist_fn, tmp_filelist, hashed_transfer, false, 0, false, 0);
+		if(rc!=ERR_SUCCESS)
+		{
+			ServerLogger::Log(logid, "Error getting filelist of "+clientname+". Errorcode: "+fc.getErrorString(rc)+" ("+convert(rc)+")", LL_ERROR);
+			has_early_error=true;
+			return false;
+		}
 	}
 
 	ServerLogger::Log(logid, clientname+" Starting incremental backup...", LL_DEBUG);
@@ -235,16 +289,21 @@ bool IncrFileBackup::doFileBackup()
 	}
 	backupid=static_cast<int>(db->getLastInsertID());
 
+	openFileManifest();
+
 	std::string backupfolder=server_settings->getSettings()->backupfolder;
 	std::string last_backuppath=backupfolder+os_file_sep()+clientname+os_file_sep()+last.path;
 	std::string last_backuppath_hashes=backupfolder+os_file_sep()+clientname+os_file_sep()+last.path+os_file_sep()+".hashes";
 	std::string last_backuppath_complete=backupfolder+os_file_sep()+clientname+os_file_sep()+last.complete;
 
 	std::string tmpfilename=tmp_filelist->getFilename();
-	tmp_filelist_delete.release();
-	Server->destroy(tmp_filelist);
+	if(filelist_stream.get()==NULL)
+	{
+		tmp_filelist_delete.release();
+		Server->destroy(tmp_filelist);
 
-	ServerLogger::Log(logid, clientname+": Calculating file tree differences...", LL_INFO);
+		ServerLogger::Log(logid, clientname+": Calculating file tree differences...", LL_INFO);
+	}
 
 	bool reflink_files = !intra_file_diffs;
 
@@ -255,23 +314,12 @@ bool IncrFileBackup::doFileBackup()
 	std::vector<size_t> large_unchanged_subtrees;
 	std::vector<size_t> *large_unchanged_subtrees_ref=NULL;
 	if(use_directory_links) large_unchanged_subtrees_ref=&large_unchanged_subtrees;
-	std::vector<size_t> modified_inplace_ids;
 	std::vector<size_t> deleted_inplace_ids;
 	std::vector<size_t>* deleted_inplace_ids_ref = NULL;
 	if (!reflink_files) deleted_inplace_ids_ref = &deleted_inplace_ids;
-	std::vector<size_t> dir_diffs;
-
-	std::string clientlist_name = clientlistName(last.backupid);
-	if(!Server->fileExists(clientlist_name))
-	{
-		clientlist_name="urbackup/clientlist_"+convert(clientid)+".ub";
-	}
 
-	std::vector<size_t> diffs;
+	if(filelist_stream.get()==NULL)
 	{
-		bool has_symbit = client_main->getProtocolVersions().symbit_version > 0;
-		std::string os_simple = client_main->getProtocolVersions().os_simple;
-		bool is_windows = (os_simple == "windows" || os_simple.empty());
 		diffs = TreeDiff::diffTrees(clientlist_name, tmpfilename,
 			error, deleted_ids_ref, large_unchanged_subtrees_ref, &modified_inplace_ids,
 			dir_diffs, deleted_inplace_ids_ref, has_symbit, is_windows);
@@ -481,6 +529,7 @@ bool IncrFileBackup::doFileBackup()
 		ServerLogger::Log(logid, clientname + ": Indexing file entries from last backup...", LL_INFO);
 		copy_last_file_entries = copy_last_file_entries && filesdao->createTemporaryLastFilesTable();
 		copy_last_file_entries = copy_last_file_entries && filesdao->copyToTemporaryLastFilesTable(last.backupid);
+		copy_last_file_entries = copy_last_file_entries && copyManifestToTemporaryLastFilesTable(last.backupid);
 		filesdao->createTemporaryLastFilesTableIndex();
 	}
 
@@ -489,17 +538,24 @@ bool IncrFileBackup::doFileBackup()
 		readd_file_entries_sparse=false;
 	}
 
-	tmp_filelist = Server->openFile(tmpfilename, MODE_READ);
-	tmp_filelist_delete.reset(tmp_filelist);
+	if(filelist_stream.get()==NULL)
+	{
+		tmp_filelist = Server->openFile(tmpfilename, MODE_READ);
+		tmp_filelist_delete.reset(tmp_filelist);
+	}
 
 	ServerRunningUpdater *running_updater=new ServerRunningUpdater(backupid, false);
 	Server->getThreadPool()->execute(running_updater, "backup active updater");
 
 	bool with_sparse_hashing = client_main->getProtocolVersions().select_sha_version > 0;
 
-	ServerLogger::Log(logid, clientname + ": Calculating tree difference size...", LL_INFO);
-	bool backup_with_components;
-	_i64 files_size = getIncrementalSize(tmp_filelist, diffs, backup_with_components);
+	bool backup_with_components = false;
+	_i64 files_size = 0;
+	if(filelist_stream.get()==NULL)
+	{
+		ServerLogger::Log(logid, clientname + ": Calculating tree difference size...", LL_INFO);
+		files_size = getIncrementalSize(tmp_filelist, diffs, backup_with_components);
+	}
 
 	std::auto_ptr<ServerDownloadThread> server_download(new ServerDownloadThread(fc, fc_chunked.get(), backuppath,
 		backuppath_hashes, last_backuppath, last_backuppath_complete,
@@ -568,7 +624,7 @@ bool IncrFileBackup::doFileBackup()
 	bool phash_load_offline = false;
 
 	bool has_read_error = false;
-	while( (read=tmp_filelist->Read(buffer, 4096, &has_read_error))>0 )
+	while( (read=(filelist_stream.get()!=NULL ? filelist_stream->read(buffer, 4096) : tmp_filelist->Read(buffer, 4096, &has_read_error)))>0 )
 	{
 		if (has_read_error)
 		{
@@ -583,6 +639,11 @@ bool IncrFileBackup::doFileBackup()
 			bool b=list_parser.nextEntry(buffer[i], cf, &extra_params);
 			if(b)
 			{
+				if(streaming_diff.get()!=NULL)
+				{
+					streaming_diff->nextEntry(cf);
+				}
+
 				std::string osspecific_name;
 
 				if(!cf.isdir || cf.name!="..")
@@ -668,6 +729,11 @@ bool IncrFileBackup::doFileBackup()
 						}
 
 						laststatsupdate = ctime;
+						if (filelist_stream.get() != NULL)
+						{
+							ServerStatus::setProcessTotalBytes(clientname, status_id, files_size);
+						}
+
 						if (files_size == 0)
 						{
 							ServerStatus::setProcessPcDone(clientname, status_id, 100);
@@ -1159,6 +1225,11 @@ bool IncrFileBackup::doFileBackup()
 					}
 					else if(indirchange || file_changed) //is changed
 					{
+						if(filelist_stream.get()!=NULL)
+						{
+							files_size+=cf.size;
+						}
+
 						bool f_ok=false;
 						if(!curr_sha2.empty() && cf.size>= link_file_min_size)
 						{
@@ -1342,6 +1413,30 @@ bool IncrFileBackup::doFileBackup()
 		disk_error = true;
 	}
 
+	if (filelist_stream.get() != NULL)
+	{
+		if (c_has_error || has_read_error)
+		{
+			rc = filelist_stream->abortDownload();
+		}
+		else
+		{
+			rc = filelist_stream->waitDownload();
+		}
+		if (rc != ERR_SUCCESS)
+		{
+			ServerLogger::Log(logid, "Error getting filelist of " + clientname + ". Errorcode: " + fc_list->getErrorString(rc) + " (" + convert(rc) + ")", LL_ERROR);
+			r_offline = true;
+		}
+
+		ServerStatus::setProcessTotalBytes(clientname, status_id, files_size);
+
+		tmp_filelist_delete.release();
+		Server->destroy(tmp_filelist);
+		tmp_filelist = Server->openFile(tmpfilename, MODE_READ);
+		tmp_filelist_delete.reset(tmp_filelist);
+	}
+
 	stopPhashDownloadThread(filelist_async_id);
 
 	server_download->queueStop();
@@ -1409,7 +1504,7 @@ bool IncrFileBackup::doFileBackup()
 
 	waitForFileThreads();
 
-	if( bsh->hasError() || bsh_prepare->hasError() )
+	if( hashThreadsHaveError() )
 	{
 		disk_error=true;
 	}
@@ -1451,8 +1546,7 @@ bool IncrFileBackup::doFileBackup()
 
 		tmp_filelist->Seek(0);
 		line = 0;
-		size_t output_offset=0;
-		std::stack<size_t> last_modified_offsets;
+		FileListWriter clientlist_writer(clientlist, useBinaryFilelists(), true);
 		list_parser.reset();
 		script_dir=false;
 		indirchange=false;
@@ -1520,7 +1614,7 @@ bool IncrFileBackup::doFileBackup()
 						}
 
 
-						writeFileItem(clientlist, cf);
+						clientlist_writer.write(cf);
 					}
 					else if( (extra_params.find("special") != extra_params.end()
 								|| extra_params.find("sym_target") != extra_params.end() )
@@ -1552,7 +1646,7 @@ bool IncrFileBackup::doFileBackup()
 							cf.last_modified *= Server->getRandomNumber();
 						}
 
-						writeFileItem(clientlist, cf);
+						clientlist_writer.write(cf);
 					}
 					++line;
 				}
@@ -1565,6 +1659,8 @@ bool IncrFileBackup::doFileBackup()
 			disk_error = true;
 		}
 
+		clientlist_writer.finish();
+
 		if(has_all_metadata)
 		{
 			ServerLogger::Log(logid, "All metadata was present", LL_INFO);
@@ -1825,7 +1921,10 @@ bool IncrFileBackup::doFileBackup()
 	return !r_offline;
 }
 
-
+bool IncrFileBackup::useStreamingFilelist()
+{
+	return Server->getServerParameter("streaming_filelist") == "true";
+}
 
 SBackup IncrFileBackup::getLastIncremental( int group )
 {
@@ -2031,6 +2130,26 @@ bool IncrFileBackup::deleteFilesInSnapshot(const std::string clientlist_fn, cons
 	return true;
 }
 
+bool IncrFileBackup::copyManifestToTemporaryLastFilesTable(int last_backupid)
+{
+	FileManifest::Reader manifest(last_backupid);
+	if (!manifest.exists())
+	{
+		return !manifest.has_error();
+	}
+
+	FileManifest::SEntry entry;
+	while (manifest.next(entry))
+	{
+		if (!filesdao->addToTemporaryLastFilesTable(entry.fullpath, entry.hashpath, entry.shahash, entry.filesize))
+		{
+			return false;
+		}
+	}
+
+	return !manifest.has_error();
+}
+
 void IncrFileBackup::addFileEntrySQLWithExisting( const std::string &fp, const std::string &hash_path, const std::string &shahash, _i64 filesize, _i64 rsize, int incremental)
 {
 	bool update_fileindex = false;
@@ -2040,6 +2159,8 @@ void IncrFileBackup::addFileEntrySQLWithExisting( const std::string &fp, const s
 	
 	if (filesize >= link_file_min_size)
 	{
+		FileEntryBatch::flush_pending(*filesdao, *fileindex.get(), shahash, filesize);
+
 		entryid = fileindex->get_with_cache_exact(FileIndex::SIndexKey(shahash.c_str(), filesize, clientid));
 
 		if (entryid == 0)
@@ -2128,16 +2249,15 @@ void IncrFileBackup::copyFile(size_t fileid, const std::string& source, const st
 {
 	max_file_id.setMinDownloaded(fileid);
 
-	CWData data;
-	data.addInt(BackupServerHash::EAction_Copy);
-	data.addVarInt(fileid);
-	data.addString((source));
-	data.addString((dest));
-	data.addString((hash_src));
-	data.addString((hash_dest));
-	metadata.serialize(data);
+	SHashWorkItem* item = new SHashWorkItem(SHashWorkItem::EType_Copy);
+	item->fileid = fileid;
+	item->temp_fn = source;
+	item->tfn = dest;
+	item->hashpath = hash_src;
+	item->hashoutput_fn = hash_dest;
+	item->metadata = metadata;
 
-	hashpipe->Write(data.getDataPtr(), data.getDataSize());
+	hashpipe->push(item);
 }
 
 bool IncrFileBackup::doFullBackup()
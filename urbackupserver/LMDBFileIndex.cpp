@@ -30,23 +30,116 @@
 #include <memory>
 #include "../Interface/Server.h"
 #include "create_files_index.h"
+#include <math.h>
+#include <algorithm>
 
 MDB_env *LMDBFileIndex::env=NULL;
 MDB_dbi LMDBFileIndex::dbi;
 ISharedMutex* LMDBFileIndex::mutex=NULL;
 LMDBFileIndex* LMDBFileIndex::fileindex=NULL;
 THREADPOOL_TICKET LMDBFileIndex::fileindex_ticket = ILLEGAL_THREADPOOL_TICKET;
+FileIndexFilter* LMDBFileIndex::filter = NULL;
+ISharedMutex* LMDBFileIndex::filter_mutex = NULL;
+std::atomic<bool> LMDBFileIndex::filter_rebuilding(false);
+std::vector<LMDBFileIndex::SIndexKey> LMDBFileIndex::filter_rebuild_keys;
+std::atomic<bool> LMDBFileIndex::filter_rebuild_stop(false);
+THREADPOOL_TICKET LMDBFileIndex::filter_rebuild_ticket = ILLEGAL_THREADPOOL_TICKET;
 
 
 const size_t c_initial_map_size=1*1024*1024;
-const size_t c_create_commit_n = 10000;
+const char* c_filter_fn = "urbackup/fileindex/backup_server_files_index.filter";
+const char* c_filter_new_fn = "urbackup/fileindex/backup_server_files_index.filter.new";
+const char* c_checkpoint_fn = "urbackup/fileindex/backup_server_files_index.checkpoint";
+const double c_default_filter_fp_rate = 0.01;
+//Entries read per read transaction while building the filter. Keeps the
+//resize lock from being held for the whole scan
+const int64 c_filter_rebuild_chunk = 10000;
+
+namespace
+{
+	double get_filter_fp_rate()
+	{
+		std::string fp_rate = Server->getServerParameter("fileindex_filter_fp_rate");
+		if (fp_rate.empty())
+		{
+			return c_default_filter_fp_rate;
+		}
+		double ret = atof(fp_rate.c_str());
+		if (ret >= 1)
+		{
+			return 0;
+		}
+		return ret;
+	}
 
+	class FilterRebuildThread : public IThread
+	{
+	public:
+		FilterRebuildThread(double fp_rate)
+			: fp_rate(fp_rate)
+		{
+		}
+
+		void operator()()
+		{
+			{
+				LMDBFileIndex fileindex;
+				if (!fileindex.has_error()
+					&& !fileindex.rebuild_filter(fp_rate))
+				{
+					Server->Log("Rebuilding file entry index filter failed. Continuing without filter.", LL_WARNING);
+					Server->deleteFile(c_filter_fn);
+				}
+			}
+			delete this;
+		}
+
+	private:
+		double fp_rate;
+	};
+}
 
 bool LMDBFileIndex::initFileIndex()
 {
 	mutex = Server->createSharedMutex();
+	filter_mutex = Server->createSharedMutex();
 
 	fileindex=new LMDBFileIndex;
+
+	double fp_rate = get_filter_fp_rate();
+	if (fp_rate > 0 && filter == NULL)
+	{
+		std::auto_ptr<FileIndexFilter> existing_filter(new FileIndexFilter);
+		if (existing_filter->open(c_filter_fn)
+			&& !existing_filter->is_overfull()
+			&& fabs(existing_filter->get_fp_rate() - fp_rate) <= fp_rate / 100)
+		{
+			filter = existing_filter.release();
+		}
+		else
+		{
+			existing_filter.reset();
+
+			Server->Log("Rebuilding file entry index filter...", LL_INFO);
+			if (!fileindex->rebuild_filter(fp_rate))
+			{
+				Server->Log("Rebuilding file entry index filter failed. Continuing without filter.", LL_WARNING);
+				Server->deleteFile(c_filter_fn);
+			}
+		}
+	}
+	else if (fp_rate <= 0 && filter != NULL)
+	{
+		delete filter;
+		filter = NULL;
+	}
+
+	if (!fileindex->replay_after_checkpoint())
+	{
+		Server->Log("Replaying file entries after file entry index checkpoint failed", LL_ERROR);
+		return false;
+	}
+
 	fileindex_ticket = Server->getThreadPool()->execute(fileindex, "fileindex writer");
 
 	return !fileindex->has_error();
@@ -57,6 +150,32 @@ void LMDBFileIndex::shutdownFileIndex()
 {
 	fileindex->shutdown();
 	Server->getThreadPool()->waitFor(fileindex_ticket);
+
+	if (filter_rebuild_ticket != ILLEGAL_THREADPOOL_TICKET)
+	{
+		filter_rebuild_stop = true;
+		Server->getThreadPool()->waitFor(filter_rebuild_ticket);
+	}
+
+	FileIndexFilter::SStats stats;
+	if (getFilterStats(stats))
+	{
+		Server->Log("File entry index filter: " + convert(stats.n_negative) + " lookups answered by filter, "
+			+ convert(stats.n_positive) + " passed to index (" + convert(stats.n_false_positive) + " false positives)", LL_INFO);
+	}
+}
+
+bool LMDBFileIndex::getFilterStats(FileIndexFilter::SStats& stats)
+{
+	IScopedReadLock lock(filter_mutex);
+
+	if (filter == NULL)
+	{
+		return false;
+	}
+
+	stats = filter->get_stats();
+	return true;
 }
 
 
@@ -102,111 +221,13 @@ void LMDBFileIndex::begin_txn(unsigned int flags)
 	}
 }
 
-void LMDBFileIndex::create(get_data_callback_t get_data_callback, void *userdata)
+int64 LMDBFileIndex::get(const LMDBFileIndex::SIndexKey& key)
 {
-	begin_txn(0);
-
-	IDatabase *db=Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER_FILES_NEW);
-
-	ServerFilesDao filesdao(db);
-
-	size_t n_done=0;
-	size_t n_rows=0;
-
-	SIndexKey last;
-	int64 last_prev_entry;
-	int64 last_id;
-	db_results res;
-	do
+	if (filter_excludes(key))
 	{
-		res=get_data_callback(n_done, n_rows, userdata);
-
-		++n_rows;
-
-		for(size_t i=0;i<res.size();++i)
-		{
-			const std::string& shahash=res[i]["shahash"];
-			int64 id = watoi64(res[i]["id"]);
-			SIndexKey key(reinterpret_cast<const char*>(shahash.c_str()), watoi64(res[i]["filesize"]), watoi(res[i]["clientid"]));
-
-			int64 next_entry = watoi64(res[i]["next_entry"]);
-			int64 prev_entry = watoi64(res[i]["prev_entry"]);
-			int pointed_to = watoi(res[i]["pointed_to"]);
-
-			assert(memcmp(&last, &key, sizeof(SIndexKey))!=1);
-
-			if(key==last)
-			{
-				if(last_prev_entry==0)
-				{
-					filesdao.setPrevEntry(id, last_id);
-				}
-
-				if(next_entry==0
-					&& (last_prev_entry==0 || last_prev_entry==id) )
-				{
-					filesdao.setNextEntry(last_id, id);
-				}
-
-				if(pointed_to)
-				{
-					filesdao.setPointedTo(0, id);
-				}
-
-				last=key;
-				last_id=id;
-				last_prev_entry=prev_entry;
-
-				continue;
-			}
-			else
-			{
-				if(!pointed_to)
-				{
-					filesdao.setPointedTo(1, id);
-				}
-			}
-			
-			put(key, id, MDB_APPEND);
-
-			if(_has_error)
-			{
-				Server->Log("LMDB error after putting element. Error state interrupting..", LL_ERROR);
-				return;
-			}
-
-			if(n_done % 1000 == 0 && n_done>0)
-			{
-				if ((Server->getFailBits() & IServer::FAIL_DATABASE_CORRUPTED) ||
-					(Server->getFailBits() & IServer::FAIL_DATABASE_IOERR) ||
-					(Server->getFailBits() & IServer::FAIL_DATABASE_FULL))
-				{
-					Server->Log("Database error. Stopping.", LL_ERROR);
-					return;
-				}
-				Server->Log("File entry index contains "+convert(n_done)+" entries now.", LL_INFO);
-			}
-
-			if(n_done % c_create_commit_n == 0 && n_done>0)
-			{
-				commit_transaction();
-				begin_txn(0);
-			}
-
-			++n_done;
-
-			last=key;
-			last_id=id;
-			last_prev_entry=prev_entry;
-		}		
+		return 0;
 	}
-	while(!res.empty());
 
-	commit_transaction();
-}
-
-int64 LMDBFileIndex::get(const LMDBFileIndex::SIndexKey& key)
-{
 	begin_txn(MDB_RDONLY);
 
 	MDB_val mdb_tkey;
@@ -259,6 +280,19 @@ void LMDBFileIndex::put_internal(const SIndexKey& key, int64 value, int flags, b
 
 	int rc = mdb_put(txn, dbi, &mdb_tkey, &mdb_tvalue, flags);
 
+	if (rc == 0)
+	{
+		IScopedReadLock lock(filter_mutex);
+		if (filter != NULL)
+		{
+			filter->add(key.getHash(), key.getFilesize());
+		}
+		if (filter_rebuilding)
+		{
+			filter_rebuild_keys.push_back(key);
+		}
+	}
+
 	if(rc==MDB_MAP_FULL && handle_enosp)
 	{
 		mdb_txn_abort(txn);
@@ -420,10 +454,49 @@ void LMDBFileIndex::del_internal(const SIndexKey& key, bool log, bool handle_eno
 void LMDBFileIndex::commit_transaction(void)
 {
 	commit_transaction_internal(true);
+
+	if (_has_error)
+	{
+		return;
+	}
+
+	//Rebuild with the current number of entries, otherwise the false positive rate keeps increasing
+	double fp_rate;
+	{
+		IScopedReadLock lock(filter_mutex);
+		if (filter == NULL
+			|| filter_rebuilding
+			|| !filter->is_overfull())
+		{
+			return;
+		}
+		fp_rate = filter->get_fp_rate();
+	}
+
+	//Set here, so keys put before the rebuild thread runs are recorded as well
+	filter_rebuilding = true;
+
+	if (filter_rebuild_ticket != ILLEGAL_THREADPOOL_TICKET)
+	{
+		Server->getThreadPool()->waitFor(filter_rebuild_ticket);
+	}
+
+	Server->Log("File entry index filter is full. Rebuilding in background...", LL_INFO);
+	filter_rebuild_ticket = Server->getThreadPool()->execute(new FilterRebuildThread(fp_rate), "fileindex filter");
 }
 
 void LMDBFileIndex::commit_transaction_internal(bool handle_enosp)
 {
+	//Filter has to contain everything that is in the index before the index is committed
+	{
+		IScopedReadLock lock(filter_mutex);
+		if (filter != NULL && !filter->sync())
+		{
+			Server->Log("Syncing file entry index filter failed. " + os_last_error_str(), LL_ERROR);
+			_has_error = true;
+		}
+	}
+
 	int rc = mdb_txn_commit(txn);
 	
 	
@@ -588,6 +661,11 @@ size_t LMDBFileIndex::get_map_size()
 
 int64 LMDBFileIndex::get_any_client( const SIndexKey& key )
 {
+	if (filter_excludes(key))
+	{
+		return 0;
+	}
+
 	begin_txn(MDB_RDONLY);
 
 	MDB_cursor* cursor;
@@ -628,6 +706,11 @@ int64 LMDBFileIndex::get_any_client( const SIndexKey& key )
 
 	abort_transaction();
 
+	if (ret == 0)
+	{
+		count_filter_false_positives(1);
+	}
+
 	return ret;
 }
 
@@ -641,6 +724,11 @@ void LMDBFileIndex::abort_transaction()
 
 std::map<int, int64> LMDBFileIndex::get_all_clients( const SIndexKey& key )
 {
+	if (filter_excludes(key))
+	{
+		return std::map<int, int64>();
+	}
+
 	begin_txn(MDB_RDONLY);
 
 	MDB_cursor* cursor;
@@ -685,17 +773,115 @@ std::map<int, int64> LMDBFileIndex::get_all_clients( const SIndexKey& key )
 
 	abort_transaction();
 
+	if (ret.empty())
+	{
+		count_filter_false_positives(1);
+	}
+
 	return ret;
 }
 
 int64 LMDBFileIndex::get_prefer_client( const SIndexKey& key )
 {
+	if (filter_excludes(key))
+	{
+		return 0;
+	}
+
 	begin_txn(MDB_RDONLY);
 
 	MDB_cursor* cursor;
 
 	mdb_cursor_open(txn, dbi, &cursor);
 
+	int64 ret = get_prefer_client_cursor(cursor, key);
+
+	mdb_cursor_close(cursor);
+
+	abort_transaction();
+
+	if (ret == 0)
+	{
+		count_filter_false_positives(1);
+	}
+
+	return ret;
+}
+
+namespace
+{
+	struct SKeyIdxLess
+	{
+		SKeyIdxLess(const std::vector<FileIndex::SIndexKey>& keys)
+			: keys(keys) {}
+
+		bool operator()(size_t a, size_t b) const
+		{
+			return keys[a] < keys[b];
+		}
+
+		const std::vector<FileIndex::SIndexKey>& keys;
+	};
+}
+
+std::vector<int64> LMDBFileIndex::get_batch(const std::vector<SIndexKey>& keys)
+{
+	std::vector<int64> ret(keys.size(), 0);
+
+	std::vector<size_t> lookup;
+	lookup.reserve(keys.size());
+	for (size_t i = 0; i < keys.size(); ++i)
+	{
+		if (!filter_excludes(keys[i]))
+		{
+			lookup.push_back(i);
+		}
+	}
+
+	if (lookup.empty())
+	{
+		return ret;
+	}
+
+	//Walk the keys in index order, so consecutive lookups touch pages which were just read
+	std::sort(lookup.begin(), lookup.end(), SKeyIdxLess(keys));
+
+	begin_txn(MDB_RDONLY);
+
+	MDB_cursor* cursor;
+
+	mdb_cursor_open(txn, dbi, &cursor);
+
+	int64 n_false_positives = 0;
+	for (size_t i = 0; i < lookup.size() && !_has_error; ++i)
+	{
+		size_t idx = lookup[i];
+
+		if (i > 0 && keys[lookup[i - 1]] == keys[idx])
+		{
+			ret[idx] = ret[lookup[i - 1]];
+			continue;
+		}
+
+		ret[idx] = get_prefer_client_cursor(cursor, keys[idx]);
+
+		if (ret[idx] == 0)
+		{
+			++n_false_positives;
+		}
+	}
+
+	mdb_cursor_close(cursor);
+
+	abort_transaction();
+
+	count_filter_false_positives(n_false_positives);
+
+	return ret;
+}
+
+int64 LMDBFileIndex::get_prefer_client_cursor(MDB_cursor* cursor, const SIndexKey& key)
+{
 	SIndexKey orig_key = key;
 
 	MDB_val mdb_tkey;
@@ -734,10 +920,6 @@ int64 LMDBFileIndex::get_prefer_client( const SIndexKey& key )
 		}
 	}
 
-	mdb_cursor_close(cursor);
-
-	abort_transaction();
-
 	return ret;
 }
 
@@ -860,4 +1042,283 @@ void LMDBFileIndex::stop_iteration()
 void LMDBFileIndex::del( const SIndexKey& key )
 {
 	del_internal(key, true, true);
+}
+
+bool LMDBFileIndex::filter_excludes(const SIndexKey& key)
+{
+	IScopedReadLock lock(filter_mutex);
+
+	if (filter == NULL)
+	{
+		return false;
+	}
+
+	bool negative = !filter->may_contain(key.getHash(), key.getFilesize());
+	filter->count_lookup(negative);
+	return negative;
+}
+
+void LMDBFileIndex::count_filter_false_positives(int64 n)
+{
+	if (n == 0)
+	{
+		return;
+	}
+
+	IScopedReadLock lock(filter_mutex);
+
+	if (filter != NULL)
+	{
+		filter->count_false_positives(n);
+	}
+}
+
+void LMDBFileIndex::set_checkpoint(int64 files_id)
+{
+	std::string tmp_fn = std::string(c_checkpoint_fn) + ".new";
+
+	std::auto_ptr<IFile> f(Server->openFile(tmp_fn, MODE_WRITE));
+	if (f.get() == NULL)
+	{
+		Server->Log("Error creating file entry index checkpoint \"" + tmp_fn + "\". " + os_last_error_str(), LL_WARNING);
+		return;
+	}
+
+	std::string data = convert(files_id);
+	if (f->Write(data) != data.size()
+		|| !f->Sync())
+	{
+		Server->Log("Error writing file entry index checkpoint \"" + tmp_fn + "\". " + os_last_error_str(), LL_WARNING);
+		return;
+	}
+
+	f.reset();
+
+	if (!os_rename_file(tmp_fn, c_checkpoint_fn))
+	{
+		Server->Log("Error renaming file entry index checkpoint. " + os_last_error_str(), LL_WARNING);
+	}
 }
+
+void LMDBFileIndex::put_sorted(const SIndexKey& key, int64 value)
+{
+	put(key, value, MDB_APPEND);
+}
+
+void LMDBFileIndex::create_finished()
+{
+	double fp_rate = get_filter_fp_rate();
+	if (fp_rate > 0)
+	{
+		Server->Log("Creating file entry index filter...", LL_INFO);
+		if (!rebuild_filter(fp_rate))
+		{
+			Server->Log("Creating file entry index filter failed", LL_WARNING);
+		}
+	}
+}
+
+int64 LMDBFileIndex::get_checkpoint()
+{
+	std::string checkpoint_str = trim(getFile(c_checkpoint_fn));
+	if (checkpoint_str.empty())
+	{
+		return -1;
+	}
+	return watoi64(checkpoint_str);
+}
+
+bool LMDBFileIndex::rebuild_filter(double fp_rate)
+{
+	{
+		//Keys put from now on are added to the new filter after the scan
+		IScopedWriteLock lock(filter_mutex);
+		filter_rebuilding = true;
+	}
+
+	Server->deleteFile(c_filter_new_fn);
+
+	std::auto_ptr<FileIndexFilter> new_filter(new FileIndexFilter);
+	bool ok = fill_filter(*new_filter, fp_rate);
+
+	if (ok)
+	{
+		//Add most keys put during the scan without blocking lookups
+		std::vector<SIndexKey> put_keys;
+		{
+			IScopedWriteLock lock(filter_mutex);
+			put_keys.swap(filter_rebuild_keys);
+		}
+
+		for (size_t i = 0; i < put_keys.size(); ++i)
+		{
+			new_filter->add(put_keys[i].getHash(), put_keys[i].getFilesize());
+		}
+
+		if (!new_filter->sync())
+		{
+			Server->Log("Syncing file entry index filter failed. " + os_last_error_str(), LL_ERROR);
+			ok = false;
+		}
+	}
+
+	return replace_filter(new_filter, ok);
+}
+
+bool LMDBFileIndex::fill_filter(FileIndexFilter& new_filter, double fp_rate)
+{
+	SIndexKey last_key;
+	bool has_last_key = false;
+	int64 n_done = 0;
+	int64 n_entries = 0;
+
+	while (true)
+	{
+		if (filter_rebuild_stop)
+		{
+			Server->Log("Stopped building file entry index filter", LL_INFO);
+			return false;
+		}
+
+		begin_txn(MDB_RDONLY);
+
+		if (_has_error)
+		{
+			read_transaction_lock.reset();
+			return false;
+		}
+
+		int rc;
+		if (!has_last_key)
+		{
+			MDB_stat stat;
+			rc = mdb_stat(txn, dbi, &stat);
+			if (rc)
+			{
+				Server->Log("LMDB: Failed to get stats (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+				abort_transaction();
+				return false;
+			}
+
+			n_entries = static_cast<int64>(stat.ms_entries);
+
+			//Leave room for the index to grow before the filter has to be rebuilt
+			if (!new_filter.create(c_filter_new_fn, n_entries * 2, fp_rate))
+			{
+				abort_transaction();
+				return false;
+			}
+		}
+
+		MDB_cursor* cursor;
+		mdb_cursor_open(txn, dbi, &cursor);
+
+		MDB_val mdb_tkey;
+		MDB_val mdb_tvalue;
+
+		if (!has_last_key)
+		{
+			rc = mdb_cursor_get(cursor, &mdb_tkey, &mdb_tvalue, MDB_FIRST);
+		}
+		else
+		{
+			//Continue after the last key of the previous read transaction
+			mdb_tkey.mv_data = &last_key;
+			mdb_tkey.mv_size = sizeof(SIndexKey);
+			rc = mdb_cursor_get(cursor, &mdb_tkey, &mdb_tvalue, MDB_SET_RANGE);
+			if (rc == 0
+				&& mdb_tkey.mv_size == sizeof(SIndexKey)
+				&& memcmp(mdb_tkey.mv_data, &last_key, sizeof(SIndexKey)) == 0)
+			{
+				rc = mdb_cursor_get(cursor, &mdb_tkey, &mdb_tvalue, MDB_NEXT);
+			}
+		}
+
+		int64 n_chunk = 0;
+		while (rc == 0)
+		{
+			SIndexKey* curr_key = reinterpret_cast<SIndexKey*>(mdb_tkey.mv_data);
+			new_filter.add(curr_key->getHash(), curr_key->getFilesize());
+
+			++n_done;
+			if (n_done % 1000000 == 0)
+			{
+				Server->Log("File entry index filter contains " + convert(n_done) + " of " + convert(n_entries) + " entries", LL_INFO);
+			}
+
+			if (++n_chunk >= c_filter_rebuild_chunk)
+			{
+				last_key = *curr_key;
+				has_last_key = true;
+				break;
+			}
+
+			rc = mdb_cursor_get(cursor, &mdb_tkey, &mdb_tvalue, MDB_NEXT);
+		}
+
+		mdb_cursor_close(cursor);
+
+		abort_transaction();
+
+		if (rc == MDB_NOTFOUND)
+		{
+			return true;
+		}
+		else if (rc != 0)
+		{
+			Server->Log("LMDB: Failed to read (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+			return false;
+		}
+	}
+}
+
+bool LMDBFileIndex::replace_filter(std::auto_ptr<FileIndexFilter>& new_filter, bool ok)
+{
+	IScopedWriteLock lock(filter_mutex);
+
+	if (ok)
+	{
+		//Keys put after the last batch was taken
+		for (size_t i = 0; i < filter_rebuild_keys.size(); ++i)
+		{
+			new_filter->add(filter_rebuild_keys[i].getHash(), filter_rebuild_keys[i].getFilesize());
+		}
+
+		if (!filter_rebuild_keys.empty()
+			&& !new_filter->sync())
+		{
+			Server->Log("Syncing file entry index filter failed. " + os_last_error_str(), LL_ERROR);
+			ok = false;
+		}
+	}
+
+	filter_rebuild_keys.clear();
+	filter_rebuilding = false;
+
+	//Replaces the file of the current filter, which has to be closed for that on Windows
+	delete filter;
+	filter = NULL;
+	new_filter.reset();
+
+	if (!ok)
+	{
+		Server->deleteFile(c_filter_new_fn);
+		return false;
+	}
+
+	if (!os_rename_file(c_filter_new_fn, c_filter_fn))
+	{
+		Server->Log("Error renaming file entry index filter. " + os_last_error_str(), LL_ERROR);
+		Server->deleteFile(c_filter_new_fn);
+		return false;
+	}
+
+	std::auto_ptr<FileIndexFilter> renamed_filter(new FileIndexFilter);
+	if (!renamed_filter->open(c_filter_fn))
+	{
+		return false;
+	}
+
+	filter = renamed_filter.release();
+	return true;
+}
\ No newline at end of file
@@ -6,6 +6,7 @@
 #include "lmdb/lmdb.h"
 #endif
 #include "FileIndex.h"
+#include "FileIndexFilter.h"
 #include "../Interface/SharedMutex.h"
 #include <memory>
 
@@ -15,6 +16,8 @@ public:
 	static bool initFileIndex();
 	static void shutdownFileIndex();
 
+	static bool getFilterStats(FileIndexFilter::SStats& stats);
+
 	LMDBFileIndex(bool no_sync=false);
 
 	bool create_env();
@@ -25,8 +28,6 @@ public:
 
 	virtual bool has_error(void);
 
-	virtual void create(get_data_callback_t get_data_callback, void *userdata);
-
 	virtual int64 get(const SIndexKey& key);
 
 	virtual int64 get_any_client(const SIndexKey& key);
@@ -35,6 +36,8 @@ public:
 
 	virtual std::map<int, int64> get_all_clients(const SIndexKey& key);
 
+	virtual std::vector<int64> get_batch(const std::vector<SIndexKey>& keys);
+
 	virtual void start_transaction(void);
 
 	virtual void put(const SIndexKey& key, int64 value);
@@ -54,6 +57,20 @@ public:
 	void abort_transaction();
 
 	size_t get_map_size();
+
+	//Builds a new filter from the index. The current filter is used until
+	//the new one replaces it
+	bool rebuild_filter(double fp_rate);
+
+	virtual void set_checkpoint(int64 files_id);
+
+	virtual int64 get_checkpoint();
+
+protected:
+	virtual void put_sorted(const SIndexKey& key, int64 value);
+
+	virtual void create_finished();
+
 private:
 
 	void begin_txn(unsigned int flags);
@@ -71,6 +88,16 @@ private:
 	void replay_transaction_log();
 	
 	void commit_transaction_internal(bool handle_enosp);
+
+	bool filter_excludes(const SIndexKey& key);
+
+	void count_filter_false_positives(int64 n);
+
+	bool fill_filter(FileIndexFilter& new_filter, double fp_rate);
+
+	bool replace_filter(std::auto_ptr<FileIndexFilter>& new_filter, bool ok);
+
+	int64 get_prefer_client_cursor(MDB_cursor* cursor, const SIndexKey& key);
 
 
 	MDB_txn *txn;
@@ -89,6 +116,16 @@ private:
 	static ISharedMutex* mutex;
 	static LMDBFileIndex* fileindex;
 	static THREADPOOL_TICKET fileindex_ticket;
+	static FileIndexFilter* filter;
+	//Protects the filter against being replaced while it is used
+	static ISharedMutex* filter_mutex;
+	//Set while a new filter is built (changed with filter_mutex)
+	static std::atomic<bool> filter_rebuilding;
+	//Keys put while the new filter is built. Only the writer adds keys (with
+	//read lock on filter_mutex)
+	static std::vector<SIndexKey> filter_rebuild_keys;
+	static std::atomic<bool> filter_rebuild_stop;
+	static THREADPOOL_TICKET filter_rebuild_ticket;
 
 	bool no_sync;
 };
\ No newline at end of file
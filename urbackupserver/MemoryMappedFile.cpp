@@ -0,0 +1,145 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "MemoryMappedFile.h"
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+	int64 get_page_size()
+	{
+#ifdef _WIN32
+		SYSTEM_INFO si;
+		GetSystemInfo(&si);
+		return si.dwAllocationGranularity;
+#else
+		return sysconf(_SC_PAGESIZE);
+#endif
+	}
+}
+
+MemoryMappedFile::MemoryMappedFile()
+	: file(NULL), view(NULL), view_size(0)
+#ifdef _WIN32
+	, map_handle(NULL)
+#endif
+{
+}
+
+MemoryMappedFile::~MemoryMappedFile()
+{
+	unmap();
+}
+
+bool MemoryMappedFile::map(IFsFile* pfile, int64 size, bool read_only)
+{
+	unmap();
+
+	IFsFile::os_file_handle h = pfile->getOsHandle();
+#ifdef _WIN32
+	LARGE_INTEGER li;
+	li.QuadPart = size;
+	map_handle = CreateFileMappingW(h, NULL, read_only ? PAGE_READONLY : PAGE_READWRITE, li.HighPart, li.LowPart, NULL);
+	if (map_handle == NULL)
+	{
+		return false;
+	}
+	view = reinterpret_cast<char*>(MapViewOfFile(map_handle, read_only ? FILE_MAP_READ : FILE_MAP_ALL_ACCESS, 0, 0, 0));
+	if (view == NULL)
+	{
+		CloseHandle(map_handle);
+		map_handle = NULL;
+		return false;
+	}
+#else
+	void* addr = mmap(NULL, static_cast<size_t>(size), read_only ? PROT_READ : (PROT_READ | PROT_WRITE), MAP_SHARED, h, 0);
+	if (addr == MAP_FAILED)
+	{
+		return false;
+	}
+	view = reinterpret_cast<char*>(addr);
+#endif
+	file = pfile;
+	view_size = size;
+	return true;
+}
+
+void MemoryMappedFile::unmap()
+{
+	if (view != NULL)
+	{
+#ifdef _WIN32
+		UnmapViewOfFile(view);
+		CloseHandle(map_handle);
+		map_handle = NULL;
+#else
+		munmap(view, static_cast<size_t>(view_size));
+#endif
+		view = NULL;
+		view_size = 0;
+		file = NULL;
+	}
+}
+
+char* MemoryMappedFile::data()
+{
+	return view;
+}
+
+int64 MemoryMappedFile::size()
+{
+	return view_size;
+}
+
+bool MemoryMappedFile::sync(int64 offset, int64 len)
+{
+	if (view == NULL)
+	{
+		return false;
+	}
+
+	if (len <= 0)
+	{
+		return true;
+	}
+
+	//Start of the range has to be page aligned
+	int64 page_size = get_page_size();
+	int64 aligned_offset = (offset / page_size)*page_size;
+	len += offset - aligned_offset;
+
+#ifdef _WIN32
+	if (!FlushViewOfFile(view + aligned_offset, static_cast<SIZE_T>(len)))
+	{
+		return false;
+	}
+	return file->Sync();
+#else
+	return msync(view + aligned_offset, static_cast<size_t>(len), MS_SYNC) == 0;
+#endif
+}
+
+bool MemoryMappedFile::sync()
+{
+	return sync(0, view_size);
+}
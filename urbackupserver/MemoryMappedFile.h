@@ -0,0 +1,34 @@
+#pragma once
+
+#include "../Interface/Types.h"
+#include "../Interface/File.h"
+
+//Shared read/write memory mapping of a whole file
+class MemoryMappedFile
+{
+public:
+	MemoryMappedFile();
+	~MemoryMappedFile();
+
+	//Maps the first size bytes of file. The file has to stay open while it is mapped
+	bool map(IFsFile* file, int64 size, bool read_only=false);
+
+	void unmap();
+
+	char* data();
+
+	int64 size();
+
+	//Writes the mapped range to disk
+	bool sync(int64 offset, int64 len);
+
+	bool sync();
+
+private:
+	IFsFile* file;
+	char* view;
+	int64 view_size;
+#ifdef _WIN32
+	void* map_handle;
+#endif
+};
@@ -0,0 +1,372 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "ParallelDirRemover.h"
+#include "../Interface/Server.h"
+#include "../Interface/Thread.h"
+#include "../Interface/ThreadPool.h"
+#include "../stringtools.h"
+#include "../urbackupcommon/os_functions.h"
+#include "server_dir_links.h"
+#include "database.h"
+#include "dao/ServerLinkDao.h"
+#include <memory>
+#include <algorithm>
+#include <string.h>
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+#endif
+
+namespace
+{
+	//Split the tree until there are this many subtrees per thread
+	const size_t c_subtrees_per_thread = 8;
+	const size_t c_max_split_depth = 4;
+
+#ifdef _WIN32
+	struct SLinkCallbackData
+	{
+		ParallelDirRemover* remover;
+		ServerLinkDao* link_dao;
+	};
+#endif
+}
+
+class ParallelDirRemover::RemoveWorker : public IThread
+{
+public:
+	RemoveWorker(ParallelDirRemover& remover)
+		: remover(remover)
+	{
+	}
+
+	void operator()()
+	{
+		{
+			ServerLinkDao link_dao(Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER_LINKS));
+
+			std::string path;
+			while (remover.get_next_subtree(path))
+			{
+				if (!remover.remove_subtree(path, link_dao))
+				{
+					IScopedLock lock(remover.mutex);
+					remover.error = true;
+				}
+			}
+		}
+
+		Server->destroyDatabases(Server->getThreadID());
+	}
+
+private:
+	ParallelDirRemover& remover;
+};
+
+ParallelDirRemover::ParallelDirRemover(int clientid, size_t n_threads)
+	: clientid(clientid), n_threads(n_threads), mutex(Server->createMutex()),
+	link_mutex(Server->createMutex()), next_subtree(0), error(false)
+{
+}
+
+ParallelDirRemover::~ParallelDirRemover()
+{
+	Server->destroy(mutex);
+	Server->destroy(link_mutex);
+}
+
+size_t ParallelDirRemover::get_num_threads()
+{
+	std::string threads = Server->getServerParameter("file_delete_threads");
+	if (!threads.empty())
+	{
+		return (std::max)(static_cast<size_t>(watoi(threads)), static_cast<size_t>(1));
+	}
+
+	return 4;
+}
+
+bool ParallelDirRemover::remove(const std::string& path, bool delete_root)
+{
+	if (n_threads <= 1
+		|| os_is_symlink(os_file_prefix(path)))
+	{
+		ServerLinkDao link_dao(Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER_LINKS));
+		return remove_directory_link_dir(path, link_dao, clientid, delete_root);
+	}
+
+	//Other threads must not add or remove links of the client while the tree
+	//is removed, same as in remove_directory_link_dir()
+	IScopedLock client_lock(NULL);
+	dir_link_lock_client_mutex(clientid, client_lock);
+
+	subtrees.clear();
+	next_subtree = 0;
+	error = false;
+
+	std::vector<std::string> split_dirs;
+	if (!split(path, split_dirs))
+	{
+		return false;
+	}
+
+	std::vector<RemoveWorker*> workers;
+	std::vector<THREADPOOL_TICKET> tickets;
+	for (size_t i = 0; i < (std::min)(n_threads, subtrees.size()); ++i)
+	{
+		workers.push_back(new RemoveWorker(*this));
+		tickets.push_back(Server->getThreadPool()->execute(workers[i], "backup delete"));
+	}
+
+	Server->getThreadPool()->waitFor(tickets);
+
+	for (size_t i = 0; i < workers.size(); ++i)
+	{
+		delete workers[i];
+	}
+
+	//Split directories are ordered parents first
+	for (size_t i = split_dirs.size(); i-- > 0;)
+	{
+		if (i == 0 && !delete_root)
+		{
+			continue;
+		}
+
+		if (!os_remove_dir(os_file_prefix(split_dirs[i])))
+		{
+			Server->Log("Error deleting directory \"" + split_dirs[i] + "\". " + os_last_error_str(), LL_ERROR);
+			error = true;
+		}
+	}
+
+	return !error;
+}
+
+bool ParallelDirRemover::split(const std::string& path, std::vector<std::string>& split_dirs)
+{
+	ServerLinkDao link_dao(Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER_LINKS));
+
+	std::vector<std::string> level;
+	level.push_back(path);
+
+	for (size_t depth = 0; depth < c_max_split_depth && !level.empty()
+		&& level.size() < n_threads*c_subtrees_per_thread; ++depth)
+	{
+		std::vector<std::string> next_level;
+		for (size_t i = 0; i < level.size(); ++i)
+		{
+			bool has_error = false;
+			std::vector<SFile> files = getFiles(os_file_prefix(level[i]), &has_error);
+			if (has_error)
+			{
+				Server->Log("Error listing directory \"" + level[i] + "\" for deletion. " + os_last_error_str(), LL_ERROR);
+				return false;
+			}
+
+			split_dirs.push_back(level[i]);
+
+			for (size_t j = 0; j < files.size(); ++j)
+			{
+				std::string curr_path = level[i] + os_file_sep() + files[j].name;
+				if (files[j].issym)
+				{
+					remove_link(curr_path, link_dao);
+				}
+				else if (files[j].isdir)
+				{
+					next_level.push_back(curr_path);
+				}
+				else if (!Server->deleteFile(os_file_prefix(curr_path)))
+				{
+					Server->Log("Error deleting file \"" + curr_path + "\". " + os_last_error_str(), LL_ERROR);
+				}
+			}
+		}
+
+		level.swap(next_level);
+	}
+
+	subtrees = level;
+
+	return true;
+}
+
+bool ParallelDirRemover::get_next_subtree(std::string& path)
+{
+	IScopedLock lock(mutex);
+
+	if (next_subtree >= subtrees.size())
+	{
+		return false;
+	}
+
+	path = subtrees[next_subtree];
+	++next_subtree;
+	return true;
+}
+
+bool ParallelDirRemover::remove_link(const std::string& path, ServerLinkDao& link_dao)
+{
+	//remove() holds the client's directory link mutex. The workers remove
+	//links one at a time, so the reference counts are updated one after another
+	IScopedLock lock(link_mutex);
+
+	std::auto_ptr<DBScopedSynchronous> synchronous_link_dao;
+	return remove_directory_link(path, link_dao, clientid, synchronous_link_dao);
+}
+
+#ifdef _WIN32
+bool ParallelDirRemover::link_callback(const std::string &path, bool* isdir, void* userdata)
+{
+	if (isdir != NULL && !*isdir)
+	{
+		if (!Server->deleteFile(os_file_prefix(path)))
+		{
+			Server->Log("Error removing symlink file \"" + path + "\"", LL_ERROR);
+		}
+		return true;
+	}
+
+	SLinkCallbackData* data = reinterpret_cast<SLinkCallbackData*>(userdata);
+	return data->remover->remove_link(path, *data->link_dao);
+}
+
+bool ParallelDirRemover::remove_subtree(const std::string& path, ServerLinkDao& link_dao)
+{
+	SLinkCallbackData data = { this, &link_dao };
+	return os_remove_nonempty_dir(os_file_prefix(path), link_callback, &data, true);
+}
+#else
+bool ParallelDirRemover::remove_subtree(const std::string& path, ServerLinkDao& link_dao)
+{
+	int dirfd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (dirfd == -1)
+	{
+		Server->Log("Error opening directory \"" + path + "\" for deletion. " + os_last_error_str(), LL_ERROR);
+		return false;
+	}
+
+	bool ret = remove_tree_at(dirfd, path, link_dao);
+
+	if (rmdir(path.c_str()) != 0)
+	{
+		Server->Log("Error deleting directory \"" + path + "\". " + os_last_error_str(), LL_ERROR);
+		ret = false;
+	}
+
+	return ret;
+}
+
+bool ParallelDirRemover::remove_tree_at(int dirfd, const std::string& path, ServerLinkDao& link_dao)
+{
+	DIR* dp = fdopendir(dirfd);
+	if (dp == NULL)
+	{
+		Server->Log("Error reading directory \"" + path + "\" for deletion. " + os_last_error_str(), LL_ERROR);
+		close(dirfd);
+		return false;
+	}
+
+	//Read the whole directory first, then unlink the entries as one batch
+	std::vector<std::string> files;
+	std::vector<std::string> dirs;
+	std::vector<std::string> links;
+
+	struct dirent* dirp;
+	while ((dirp = readdir(dp)) != NULL)
+	{
+		if (strcmp(dirp->d_name, ".") == 0
+			|| strcmp(dirp->d_name, "..") == 0)
+		{
+			continue;
+		}
+
+		unsigned char d_type = dirp->d_type;
+		if (d_type == DT_UNKNOWN)
+		{
+			struct stat64 f_info;
+			if (fstatat64(dirfd, dirp->d_name, &f_info, AT_SYMLINK_NOFOLLOW) == 0)
+			{
+				if (S_ISLNK(f_info.st_mode))
+					d_type = DT_LNK;
+				else if (S_ISDIR(f_info.st_mode))
+					d_type = DT_DIR;
+			}
+		}
+
+		if (d_type == DT_DIR)
+		{
+			dirs.push_back(dirp->d_name);
+		}
+		else if (d_type == DT_LNK)
+		{
+			links.push_back(dirp->d_name);
+		}
+		else
+		{
+			files.push_back(dirp->d_name);
+		}
+	}
+
+	for (size_t i = 0; i < files.size(); ++i)
+	{
+		if (unlinkat(dirfd, files[i].c_str(), 0) != 0)
+		{
+			Server->Log("Error deleting file \"" + path + "/" + files[i] + "\". " + os_last_error_str(), LL_ERROR);
+		}
+	}
+
+	for (size_t i = 0; i < links.size(); ++i)
+	{
+		remove_link(path + "/" + links[i], link_dao);
+	}
+
+	bool ret = true;
+	for (size_t i = 0; i < dirs.size(); ++i)
+	{
+		std::string subpath = path + "/" + dirs[i];
+		int subdirfd = openat(dirfd, dirs[i].c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (subdirfd == -1)
+		{
+			Server->Log("Error opening directory \"" + subpath + "\" for deletion. " + os_last_error_str(), LL_ERROR);
+			ret = false;
+			continue;
+		}
+
+		if (!remove_tree_at(subdirfd, subpath, link_dao))
+		{
+			ret = false;
+		}
+
+		if (unlinkat(dirfd, dirs[i].c_str(), AT_REMOVEDIR) != 0)
+		{
+			Server->Log("Error deleting directory \"" + subpath + "\". " + os_last_error_str(), LL_ERROR);
+			ret = false;
+		}
+	}
+
+	closedir(dp);
+
+	return ret;
+}
+#endif
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "../Interface/Types.h"
+#include "../Interface/Mutex.h"
+#include <vector>
+#include <string>
+
+class ServerLinkDao;
+
+//Removes the directory tree of a backup with several threads. The tree is
+//split into subtrees near its root, which the workers take from a shared
+//list and remove independently. Entries are removed relative to the handle
+//of their directory, after the directory was read completely.
+//Directory links are removed like in remove_directory_link_dir(). The
+//client's directory link mutex is held for the whole removal, and the
+//workers remove one link at a time.
+class ParallelDirRemover
+{
+public:
+	ParallelDirRemover(int clientid, size_t n_threads);
+	~ParallelDirRemover();
+
+	bool remove(const std::string& path, bool delete_root=true);
+
+	static size_t get_num_threads();
+
+private:
+	class RemoveWorker;
+
+	bool split(const std::string& path, std::vector<std::string>& split_dirs);
+	bool get_next_subtree(std::string& path);
+	bool remove_link(const std::string& path, ServerLinkDao& link_dao);
+	bool remove_subtree(const std::string& path, ServerLinkDao& link_dao);
+#ifdef _WIN32
+	static bool link_callback(const std::string &path, bool* isdir, void* userdata);
+#else
+	bool remove_tree_at(int dirfd, const std::string& path, ServerLinkDao& link_dao);
+#endif
+
+	int clientid;
+	size_t n_threads;
+
+	IMutex* mutex;
+	IMutex* link_mutex;
+	std::vector<std::string> subtrees;
+	size_t next_subtree;
+	bool error;
+};
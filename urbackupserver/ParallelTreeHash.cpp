@@ -0,0 +1,276 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "ParallelTreeHash.h"
+#include "../Interface/Server.h"
+#include "../Interface/Thread.h"
+#include "../Interface/ThreadPool.h"
+#include "../stringtools.h"
+#include "../urbackupcommon/os_functions.h"
+#include <algorithm>
+#include <assert.h>
+#include <memory.h>
+
+namespace
+{
+	//Blocks which can wait for a worker or for being added to the tree, per thread
+	const size_t c_blocks_per_thread = 4;
+}
+
+class ParallelTreeHash::HashWorker : public IThread
+{
+public:
+	HashWorker(ParallelTreeHash& treehash)
+		: treehash(treehash)
+	{
+	}
+
+	void operator()()
+	{
+		SBlock* block;
+		while ((block = treehash.next_todo()) != NULL)
+		{
+			TreeHash::hashBlock(block->data.data(), block->hash);
+			treehash.block_done(block);
+		}
+	}
+
+private:
+	ParallelTreeHash& treehash;
+};
+
+ParallelTreeHash::ParallelTreeHash(size_t n_threads)
+	: treehash(NULL), n_threads(n_threads), max_blocks((std::max)(n_threads, static_cast<size_t>(1))*c_blocks_per_thread),
+	mutex(Server->createMutex()), cond_todo(Server->createCondition()), cond_done(Server->createCondition()),
+	do_exit(false), curr(NULL), curr_used(0)
+{
+}
+
+ParallelTreeHash::~ParallelTreeHash()
+{
+	if (!workers.empty())
+	{
+		{
+			IScopedLock lock(mutex);
+			do_exit = true;
+			cond_todo->notify_all();
+		}
+
+		Server->getThreadPool()->waitFor(tickets);
+
+		for (size_t i = 0; i < workers.size(); ++i)
+		{
+			delete workers[i];
+		}
+	}
+
+	for (size_t i = 0; i < blocks.size(); ++i)
+	{
+		delete blocks[i];
+	}
+	for (size_t i = 0; i < free_blocks.size(); ++i)
+	{
+		delete free_blocks[i];
+	}
+	delete curr;
+
+	Server->destroy(mutex);
+	Server->destroy(cond_todo);
+	Server->destroy(cond_done);
+}
+
+size_t ParallelTreeHash::get_num_threads()
+{
+	std::string threads = Server->getServerParameter("patch_hash_threads");
+	if (!threads.empty())
+	{
+		return (std::max)(static_cast<size_t>(watoi(threads)), static_cast<size_t>(1));
+	}
+
+	return (std::max)((std::min)(os_get_num_cpus(), static_cast<size_t>(4)), static_cast<size_t>(1));
+}
+
+void ParallelTreeHash::hash(const char* buf, _u32 bsize)
+{
+	while (bsize > 0)
+	{
+		if (curr == NULL)
+		{
+			curr = get_free_block();
+			curr_used = 0;
+		}
+
+		_u32 tocopy = (std::min)(bsize, static_cast<_u32>(treehash_blocksize - curr_used));
+		memcpy(curr->data.data() + curr_used, buf, tocopy);
+		curr_used += tocopy;
+		buf += tocopy;
+		bsize -= tocopy;
+
+		if (curr_used == treehash_blocksize)
+		{
+			curr->hashed_size = treehash_blocksize;
+			queue_block(curr);
+			curr = NULL;
+		}
+	}
+}
+
+void ParallelTreeHash::sparse_hash(const char* buf, _u32 bsize)
+{
+	//Sparse extents are hashed separately from the tree
+	treehash.sparse_hash(buf, bsize);
+}
+
+std::string ParallelTreeHash::finalize()
+{
+	add_done_blocks(true);
+
+	if (curr != NULL
+		&& curr_used > 0)
+	{
+		treehash.hash(curr->data.data(), static_cast<_u32>(curr_used));
+		curr_used = 0;
+	}
+
+	return treehash.finalize();
+}
+
+void ParallelTreeHash::addHashAllAdler(const char* h, size_t size, size_t hashed_size)
+{
+	//Unchanged hashes are only added at block boundaries
+	assert(curr == NULL);
+
+	SBlock* block = get_free_block();
+	TreeHash::allAdlerTo64byteHash(h, size, hashed_size, block->hash);
+	block->hashed_size = hashed_size;
+	block->done = true;
+
+	IScopedLock lock(mutex);
+	blocks.push_back(block);
+}
+
+ParallelTreeHash::SBlock* ParallelTreeHash::get_free_block()
+{
+	add_done_blocks(false);
+
+	IScopedLock lock(mutex);
+	while (blocks.size() >= max_blocks)
+	{
+		if (!blocks.front()->done)
+		{
+			cond_done->wait(&lock);
+		}
+
+		lock.relock(NULL);
+		add_done_blocks(false);
+		lock.relock(mutex);
+	}
+
+	SBlock* ret;
+	if (!free_blocks.empty())
+	{
+		ret = free_blocks.back();
+		free_blocks.pop_back();
+	}
+	else
+	{
+		ret = new SBlock;
+		ret->data.resize(treehash_blocksize);
+	}
+
+	ret->done = false;
+	return ret;
+}
+
+void ParallelTreeHash::queue_block(SBlock* block)
+{
+	if (n_threads <= 1)
+	{
+		TreeHash::hashBlock(block->data.data(), block->hash);
+		block->done = true;
+
+		IScopedLock lock(mutex);
+		blocks.push_back(block);
+		return;
+	}
+
+	IScopedLock lock(mutex);
+	blocks.push_back(block);
+	todo.push_back(block);
+
+	if (workers.size() < n_threads
+		&& workers.size() < todo.size())
+	{
+		//Start the workers once there is something to do for them
+		workers.push_back(new HashWorker(*this));
+		tickets.push_back(Server->getThreadPool()->execute(workers.back(), "patch hash"));
+	}
+	else
+	{
+		cond_todo->notify_one();
+	}
+}
+
+void ParallelTreeHash::add_done_blocks(bool wait_all)
+{
+	IScopedLock lock(mutex);
+	while (!blocks.empty())
+	{
+		SBlock* block = blocks.front();
+		if (!block->done)
+		{
+			if (!wait_all)
+			{
+				return;
+			}
+
+			cond_done->wait(&lock);
+			continue;
+		}
+
+		blocks.pop_front();
+		treehash.addHash(block->hash, block->hashed_size);
+		free_blocks.push_back(block);
+	}
+}
+
+ParallelTreeHash::SBlock* ParallelTreeHash::next_todo()
+{
+	IScopedLock lock(mutex);
+	while (todo.empty()
+		&& !do_exit)
+	{
+		cond_todo->wait(&lock);
+	}
+
+	if (todo.empty())
+	{
+		return NULL;
+	}
+
+	SBlock* ret = todo.front();
+	todo.pop_front();
+	return ret;
+}
+
+void ParallelTreeHash::block_done(SBlock* block)
+{
+	IScopedLock lock(mutex);
+	block->done = true;
+	cond_done->notify_all();
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "../Interface/Types.h"
+#include "../Interface/Mutex.h"
+#include "../Interface/Condition.h"
+#include "../urbackupcommon/TreeHash.h"
+#include <deque>
+#include <vector>
+
+//Tree hash (same result as TreeHash) which hashes the complete blocks with
+//several thread pool threads. Hashed data is collected into block buffers,
+//so callers can reuse their buffers immediately. The block hashes are added
+//to the tree in the order of the data, with the hashes of unchanged blocks
+//passed via addHashAllAdler() keeping their place in between.
+class ParallelTreeHash : public IHashFunc
+{
+public:
+	ParallelTreeHash(size_t n_threads);
+	~ParallelTreeHash();
+
+	virtual void hash(const char* buf, _u32 bsize);
+
+	virtual void sparse_hash(const char* buf, _u32 bsize);
+
+	virtual std::string finalize();
+
+	virtual void addHashAllAdler(const char* h, size_t size, size_t hashed_size);
+
+	static size_t get_num_threads();
+
+private:
+	class HashWorker;
+
+	struct SBlock
+	{
+		std::vector<char> data;
+		size_t hashed_size;
+		char hash[64];
+		bool done;
+	};
+
+	SBlock* get_free_block();
+	void queue_block(SBlock* block);
+	void add_done_blocks(bool wait_all);
+	SBlock* next_todo();
+	void block_done(SBlock* block);
+
+	TreeHash treehash;
+	size_t n_threads;
+	size_t max_blocks;
+
+	IMutex* mutex;
+	ICondition* cond_todo;
+	ICondition* cond_done;
+	bool do_exit;
+
+	//Blocks which are not added to the tree yet, in tree order
+	std::deque<SBlock*> blocks;
+	std::deque<SBlock*> todo;
+	std::vector<SBlock*> free_blocks;
+	SBlock* curr;
+	size_t curr_used;
+
+	std::vector<HashWorker*> workers;
+	std::vector<THREADPOOL_TICKET> tickets;
+};
@@ -43,7 +43,7 @@ namespace
 }
 
 ServerDownloadThread::ServerDownloadThread( FileClient& fc, FileClientChunked* fc_chunked, const std::string& backuppath, const std::string& backuppath_hashes, const std::string& last_backuppath, const std::string& last_backuppath_complete, bool hashed_transfer, bool save_incomplete_file, int clientid,
-	const std::string& clientname, const std::string& clientsubname, bool use_tmpfiles, const std::string& tmpfile_path, const std::string& server_token, bool use_reflink, int backupid, bool r_incremental, IPipe* hashpipe_prepare, ClientMain* client_main,
+	const std::string& clientname, const std::string& clientsubname, bool use_tmpfiles, const std::string& tmpfile_path, const std::string& server_token, bool use_reflink, int backupid, bool r_incremental, HashWorkQueue* hashpipe_prepare, ClientMain* client_main,
 	int filesrv_protocol_version, int incremental_num, logid_t logid, bool with_hashes, const std::vector<std::string>& shares_without_snapshot, bool with_sparse_hashing, server::FileMetadataDownloadThread* file_metadata_download, bool sc_failure_fatal,
 	FilePathCorrections& filepath_corrections, MaxFileId& max_file_id)
 	: fc(fc), fc_chunked(fc_chunked), backuppath(backuppath), backuppath_hashes(backuppath_hashes), 
@@ -986,32 +986,33 @@ void ServerDownloadThread::hashFile(int64 fileid, std::string dstpath, std::stri
 	int64 t_filesize, const FileMetadata& metadata, bool is_script, std::string sha_dig, IFile* sparse_extents_f, char hashing_method,
 	bool has_snapshot)
 {
-	int l_backup_id=backupid;
-
-	CWData data;
-	data.addVarInt(fileid);
-	data.addString(fd->getFilename());
-	data.addInt(l_backup_id);
-	data.addInt(r_incremental?1:0);
-	data.addChar(with_hashes?1:0);
-	data.addString(dstpath);
-	data.addString(hashpath);
+	//The hash stage opens the file again. Queued items do not hold file handles,
+	//otherwise there could be one open handle per item in the queues
+	SHashWorkItem* item = new SHashWorkItem;
+	item->fileid = fileid;
+	item->temp_fn = fd->getFilename();
+	item->backupid = backupid;
+	item->incremental = r_incremental ? 1 : 0;
+	item->with_hashes = with_hashes;
+	item->tfn = dstpath;
+	item->hashpath = hashpath;
 	if(hashoutput!=NULL)
 	{
-		data.addString(hashoutput->getFilename());
+		item->hashoutput_fn = hashoutput->getFilename();
 	}
-	else
+	item->old_file_fn = old_file;
+	item->t_filesize = t_filesize;
+	if(with_sparse_hashing)
 	{
-		data.addString("");
+		item->client_sha_dig = sha_dig;
 	}
-
-	data.addString(old_file);
-	data.addInt64(t_filesize);
-	data.addString(with_sparse_hashing ? sha_dig : std::string());
-	data.addString(sparse_extents_f!=NULL ? sparse_extents_f->getFilename() : "");
-	data.addChar(hashing_method);
-	data.addChar(has_snapshot ? 1 : 0);
-	metadata.serialize(data);
+	if(sparse_extents_f!=NULL)
+	{
+		item->sparse_extents_fn = sparse_extents_f->getFilename();
+	}
+	item->hash_func = hashing_method;
+	item->has_snapshot = has_snapshot;
+	item->metadata = metadata;
 
 	ServerLogger::Log(logid, "GT: Loaded file \""+ExtractFileName((dstpath))+"\"", LL_DEBUG);
 
@@ -1039,7 +1040,7 @@ void ServerDownloadThread::hashFile(int64 fileid, std::string dstpath, std::stri
 		}
 		
 	}
-	hashpipe_prepare->Write(data.getDataPtr(), data.getDataSize() );
+	hashpipe_prepare->push(item);
 }
 
 bool ServerDownloadThread::isOffline()
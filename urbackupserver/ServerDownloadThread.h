@@ -15,6 +15,7 @@
 #include "../urbackupcommon/fileclient/FileClientChunked.h"
 #include "ClientMain.h"
 #include "../urbackupcommon/file_metadata.h"
+#include "HashWorkQueue.h"
 
 
 class FileClient;
@@ -144,7 +145,7 @@ class ServerDownloadThread : public IThread, public FileClient::QueueCallback, p
 public:
 	ServerDownloadThread(FileClient& fc, FileClientChunked* fc_chunked, const std::string& backuppath, const std::string& backuppath_hashes, const std::string& last_backuppath, const std::string& last_backuppath_complete, bool hashed_transfer, bool save_incomplete_file, int clientid,
 		const std::string& clientname, const std::string& clientsubname,
-		bool use_tmpfiles, const std::string& tmpfile_path, const std::string& server_token, bool use_reflink, int backupid, bool r_incremental, IPipe* hashpipe_prepare, ClientMain* client_main,
+		bool use_tmpfiles, const std::string& tmpfile_path, const std::string& server_token, bool use_reflink, int backupid, bool r_incremental, HashWorkQueue* hashpipe_prepare, ClientMain* client_main,
 		int filesrv_protocol_version, int incremental_num, logid_t logid, bool with_hashes, const std::vector<std::string>& shares_without_snapshot,
 		bool with_sparse_hashing, server::FileMetadataDownloadThread* file_metadata_download, bool sc_failure_fatal, FilePathCorrections& filepath_corrections,
 		MaxFileId& max_file_id);
@@ -261,7 +262,7 @@ private:
 	bool use_reflink;
 	int backupid;
 	bool r_incremental;
-	IPipe* hashpipe_prepare;
+	HashWorkQueue* hashpipe_prepare;
 	ClientMain* client_main;
 	int filesrv_protocol_version;
 	bool skipping;
@@ -0,0 +1,211 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "../../Interface/Server.h"
+#include "../../Interface/File.h"
+#include "../../stringtools.h"
+#include "../../urbackupcommon/os_functions.h"
+#include "../../urbackupcommon/TreeHash.h"
+#include "../ChunkPatcher.h"
+#include "../ParallelTreeHash.h"
+#include <memory>
+#include <vector>
+
+namespace
+{
+	const char* bench_orig_fn = "chunk_patch_bench.orig";
+	const char* bench_patch_fn = "chunk_patch_bench.patch";
+	const size_t bench_buffer_size = 64 * 1024;
+	//One patch of this size per MB of the file
+	const unsigned int bench_patch_size = 16 * 1024;
+
+	class HashCallback : public IChunkPatcherCallback
+	{
+	public:
+		HashCallback(IHashFunc& hashf)
+			: hashf(hashf), pos(0)
+		{
+		}
+
+		virtual void next_chunk_patcher_bytes(const char *buf, size_t bsize, bool changed, bool* is_sparse)
+		{
+			hashf.hash(buf, static_cast<_u32>(bsize));
+			pos += bsize;
+		}
+
+		virtual void next_sparse_extent_bytes(const char *buf, size_t bsize)
+		{
+			hashf.sparse_hash(buf, static_cast<_u32>(bsize));
+		}
+
+		virtual int64 chunk_patcher_pos()
+		{
+			return pos;
+		}
+
+	private:
+		IHashFunc& hashf;
+		int64 pos;
+	};
+
+	void fill(std::vector<char>& buf, int64 pos, int seed)
+	{
+		for (size_t i = 0; i < buf.size(); ++i)
+		{
+			buf[i] = static_cast<char>((pos + i) * (131 + seed) + ((pos + i) >> 12));
+		}
+	}
+
+	bool write_patch(IFile* patch, int64 filesize)
+	{
+		int64 filesize_le = little_endian(filesize);
+		if (patch->Write(reinterpret_cast<char*>(&filesize_le), sizeof(filesize_le)) != sizeof(filesize_le))
+		{
+			return false;
+		}
+
+		std::vector<char> buf(bench_patch_size);
+		for (int64 pos = 4096; pos + bench_patch_size <= filesize; pos += 1024 * 1024)
+		{
+			_i64 patch_off = little_endian(static_cast<_i64>(pos));
+			unsigned int patch_size = little_endian(bench_patch_size);
+			fill(buf, pos, 1);
+			if (patch->Write(reinterpret_cast<char*>(&patch_off), sizeof(patch_off)) != sizeof(patch_off)
+				|| patch->Write(reinterpret_cast<char*>(&patch_size), sizeof(patch_size)) != sizeof(patch_size)
+				|| patch->Write(buf.data(), bench_patch_size) != bench_patch_size)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool run_patch(const std::string& name, IFile* orig, IFile* patch, size_t prefetch_size, IHashFunc& hashf, std::string& res)
+	{
+		HashCallback callback(hashf);
+		ChunkPatcher patcher;
+		patcher.setCallback(&callback);
+		//Passes the data in blocks aligned to the tree hash blocks, like BackupServerPrepareHash
+		patcher.setWithSparse(true);
+		patcher.setPrefetchSize(prefetch_size);
+
+		int64 starttime = Server->getTimeMS();
+		if (!patcher.ApplyPatch(orig, patch, NULL))
+		{
+			Server->Log(name + ": Applying patch failed", LL_ERROR);
+			return false;
+		}
+		res = hashf.finalize();
+		int64 passed_ms = Server->getTimeMS() - starttime;
+
+		Server->Log(name + ": " + PrettyPrintBytes(patcher.getFilesize()) + " in " + convert(passed_ms) + "ms ("
+			+ convert(static_cast<int64>(patcher.getFilesize() / 1000.0 / (std::max)(passed_ms, static_cast<int64>(1)))) + " MB/s)", LL_INFO);
+		return true;
+	}
+}
+
+int chunk_patch_bench()
+{
+	int64 bench_mb = 512;
+	if (!Server->getServerParameter("bench_size").empty())
+	{
+		bench_mb = watoi(Server->getServerParameter("bench_size"));
+	}
+
+	if (FileExists(bench_orig_fn))
+	{
+		Server->Log("Benchmark file exists in working directory. Please run the benchmark in an empty directory.", LL_ERROR);
+		return 1;
+	}
+
+	std::auto_ptr<IFile> orig(Server->openFile(bench_orig_fn, MODE_RW_CREATE));
+	std::auto_ptr<IFile> patch(Server->openFile(bench_patch_fn, MODE_RW_CREATE));
+	if (orig.get() == NULL
+		|| patch.get() == NULL)
+	{
+		Server->Log("Error creating benchmark files. " + os_last_error_str(), LL_ERROR);
+		return 1;
+	}
+
+	std::vector<char> buf(bench_buffer_size);
+	int64 filesize = bench_mb * 1024 * 1024;
+	for (int64 pos = 0; pos < filesize; pos += bench_buffer_size)
+	{
+		fill(buf, pos, 0);
+		if (orig->Write(pos, buf.data(), static_cast<_u32>(buf.size())) != buf.size())
+		{
+			Server->Log("Error writing benchmark file. " + os_last_error_str(), LL_ERROR);
+			return 1;
+		}
+	}
+
+	//Patched file is a bit larger than the original
+	if (!write_patch(patch.get(), filesize + 1000))
+	{
+		Server->Log("Error writing patch file. " + os_last_error_str(), LL_ERROR);
+		return 1;
+	}
+
+	size_t n_threads = ParallelTreeHash::get_num_threads();
+
+	Server->Log("Chunk patch benchmark. File size: " + PrettyPrintBytes(filesize) + " hash threads: " + convert(n_threads), LL_INFO);
+
+	int rc = 0;
+
+	std::string sync_hash;
+	{
+		TreeHash treehash(NULL);
+		if (!run_patch("Serial", orig.get(), patch.get(), 0, treehash, sync_hash))
+		{
+			rc = 1;
+		}
+	}
+
+	std::string prefetch_hash;
+	{
+		TreeHash treehash(NULL);
+		if (!run_patch("Prefetch", orig.get(), patch.get(), ChunkPatcher::get_default_prefetch_size(), treehash, prefetch_hash))
+		{
+			rc = 1;
+		}
+	}
+
+	std::string pipelined_hash;
+	{
+		ParallelTreeHash treehash(n_threads);
+		if (!run_patch("Prefetch and parallel hash", orig.get(), patch.get(), ChunkPatcher::get_default_prefetch_size(), treehash, pipelined_hash))
+		{
+			rc = 1;
+		}
+	}
+
+	if (rc == 0
+		&& (prefetch_hash != sync_hash
+			|| pipelined_hash != sync_hash))
+	{
+		Server->Log("Hash of patched file differs", LL_ERROR);
+		rc = 1;
+	}
+
+	orig.reset();
+	patch.reset();
+	Server->deleteFile(bench_orig_fn);
+	Server->deleteFile(bench_patch_fn);
+
+	return rc;
+}
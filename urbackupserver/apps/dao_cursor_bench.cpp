@@ -0,0 +1,149 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "../../Interface/Server.h"
+#include "../../Interface/Database.h"
+#include "../../Interface/DatabaseCursor.h"
+#include "../../Interface/Query.h"
+#include "../../stringtools.h"
+#include "../../urbackupcommon/os_functions.h"
+#include "../dao/ServerFilesDao.h"
+#include "../database.h"
+#include <string.h>
+#include <limits.h>
+
+namespace
+{
+	const char* bench_db_fn = "dao_cursor_bench.db";
+	const char* bench_sql = "SELECT id, shahash, filesize, rsize, clientid, backupid, incremental, next_entry, prev_entry, pointed_to FROM files WHERE backupid=?";
+
+	void log_rate(const std::string& name, size_t n_rows, int64 passed_ms, int64 checksum)
+	{
+		Server->Log(name + ": " + convert(n_rows) + " rows in " + convert(passed_ms) + "ms ("
+			+ convert(static_cast<int64>(n_rows*1000.0 / (std::max)(passed_ms, static_cast<int64>(1)))) + " rows/s, checksum " + convert(checksum) + ")", LL_INFO);
+	}
+}
+
+int dao_cursor_bench()
+{
+	size_t n_rows = 500000;
+	if (!Server->getServerParameter("bench_rows").empty())
+	{
+		n_rows = watoi(Server->getServerParameter("bench_rows"));
+	}
+
+	if (FileExists(bench_db_fn))
+	{
+		Server->Log("Benchmark database exists in working directory. Please run the benchmark in an empty directory.", LL_ERROR);
+		return 1;
+	}
+
+	if (!Server->openDatabase(bench_db_fn, URBACKUPDB_SERVER_FILES))
+	{
+		Server->Log("Error opening benchmark database", LL_ERROR);
+		return 1;
+	}
+
+	IDatabase* db = Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER_FILES);
+	db->Write("CREATE TABLE files (id INTEGER PRIMARY KEY, backupid INTEGER, fullpath TEXT, shahash BLOB, filesize INTEGER,"
+		"created INTEGER DEFAULT (CAST(strftime('%s','now') as INTEGER)),"
+		"rsize INTEGER, clientid INTEGER, incremental INTEGER, hashpath TEXT, next_entry INTEGER, prev_entry INTEGER, pointed_to INTEGER)");
+	db->Write("CREATE INDEX files_backupid ON files (backupid)");
+
+	Server->Log("Result row benchmark. Rows: " + convert(n_rows), LL_INFO);
+
+	int rc = 0;
+	{
+		ServerFilesDao filesdao(db);
+		filesdao.BeginWriteTransaction();
+		std::string shahash(64, 0);
+		for (size_t i = 0; i < n_rows; ++i)
+		{
+			memcpy(&shahash[0], &i, sizeof(i));
+			filesdao.addFileEntry(1, "/backup/client/dir/file" + convert(i), "/backup/client/.hashes/dir/file" + convert(i),
+				shahash, 1000 + i, 1000 + i, 1, static_cast<int>(i % 3), i + 2, i, static_cast<int>(i % 2));
+		}
+		filesdao.endTransaction();
+
+		int64 checksum = 0;
+		int64 starttime = Server->getTimeMS();
+		IQuery* q = db->Prepare(bench_sql, false);
+		q->Bind(1);
+		db_results res = q->Read();
+		q->Reset();
+		for (size_t i = 0; i < res.size(); ++i)
+		{
+			checksum += watoi64(res[i]["id"]) + watoi64(res[i]["filesize"]) + watoi64(res[i]["rsize"]) + watoi(res[i]["clientid"])
+				+ watoi(res[i]["backupid"]) + watoi(res[i]["incremental"]) + watoi64(res[i]["next_entry"])
+				+ watoi64(res[i]["prev_entry"]) + watoi(res[i]["pointed_to"]) + res[i]["shahash"][0];
+		}
+		size_t n_read = res.size();
+		res.clear();
+		log_rate("Read (string maps)", n_read, Server->getTimeMS() - starttime, checksum);
+		int64 expected_checksum = checksum;
+
+		checksum = 0;
+		n_read = 0;
+		starttime = Server->getTimeMS();
+		q->Bind(1);
+		IDatabaseCursor* cursor = q->Cursor();
+		db_single_result row;
+		while (cursor->next(row))
+		{
+			checksum += watoi64(row["id"]) + watoi64(row["filesize"]) + watoi64(row["rsize"]) + watoi(row["clientid"])
+				+ watoi(row["backupid"]) + watoi(row["incremental"]) + watoi64(row["next_entry"])
+				+ watoi64(row["prev_entry"]) + watoi(row["pointed_to"]) + row["shahash"][0];
+			++n_read;
+		}
+		db->destroyQuery(q);
+		log_rate("Cursor (string map per row)", n_read, Server->getTimeMS() - starttime, checksum);
+		if (checksum != expected_checksum)
+		{
+			rc = 1;
+		}
+
+		checksum = 0;
+		n_read = 0;
+		starttime = Server->getTimeMS();
+		cursor = filesdao.getFileBackupEntries(1, 0, LLONG_MAX);
+		ServerFilesDao::SFileBackupEntry entry;
+		while (filesdao.getFileBackupEntriesNext(cursor, entry))
+		{
+			checksum += entry.id + entry.filesize + entry.rsize + entry.clientid
+				+ entry.backupid + entry.incremental + entry.next_entry
+				+ entry.prev_entry + entry.pointed_to + entry.shahash[0];
+			++n_read;
+		}
+		cursor->shutdown();
+		log_rate("Typed cursor", n_read, Server->getTimeMS() - starttime, checksum);
+		if (checksum != expected_checksum)
+		{
+			rc = 1;
+		}
+	}
+
+	if (rc != 0)
+	{
+		Server->Log("Typed cursor rows differ from string rows", LL_ERROR);
+	}
+
+	Server->destroyAllDatabases();
+	Server->deleteFile(bench_db_fn);
+
+	return rc;
+}
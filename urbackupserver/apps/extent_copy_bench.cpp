@@ -0,0 +1,152 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "../../Interface/Server.h"
+#include "../../Interface/File.h"
+#include "../../stringtools.h"
+#include "../../urbackupcommon/os_functions.h"
+#include "../ExtentCopy.h"
+#include <memory>
+#include <vector>
+#include <string.h>
+
+namespace
+{
+	const char* bench_src_fn = "extent_copy_bench.src";
+	const char* bench_dst_fn = "extent_copy_bench.dst";
+	const size_t bench_buffer_size = 64 * 1024;
+
+	void log_rate(const std::string& name, int64 size, int64 passed_ms)
+	{
+		Server->Log(name + ": " + PrettyPrintBytes(size) + " in " + convert(passed_ms) + "ms ("
+			+ convert(static_cast<int64>(size / 1000.0 / (std::max)(passed_ms, static_cast<int64>(1)))) + " MB/s)", LL_INFO);
+	}
+
+	bool same_content(IFile* a, const std::string& b_fn)
+	{
+		std::auto_ptr<IFile> b(Server->openFile(b_fn, MODE_READ));
+		if (b.get() == NULL
+			|| a->Size() != b->Size())
+		{
+			return false;
+		}
+
+		std::vector<char> buf_a(bench_buffer_size);
+		std::vector<char> buf_b(bench_buffer_size);
+		for (int64 pos = 0; pos < a->Size(); pos += bench_buffer_size)
+		{
+			_u32 read_a = a->Read(pos, &buf_a[0], static_cast<_u32>(bench_buffer_size));
+			_u32 read_b = b->Read(pos, &buf_b[0], static_cast<_u32>(bench_buffer_size));
+			if (read_a != read_b
+				|| memcmp(&buf_a[0], &buf_b[0], read_a) != 0)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+}
+
+int extent_copy_bench()
+{
+	int64 bench_mb = 512;
+	if (!Server->getServerParameter("bench_size").empty())
+	{
+		bench_mb = watoi(Server->getServerParameter("bench_size"));
+	}
+
+	if (FileExists(bench_src_fn))
+	{
+		Server->Log("Benchmark file exists in working directory. Please run the benchmark in an empty directory.", LL_ERROR);
+		return 1;
+	}
+
+	std::auto_ptr<IFsFile> src(Server->openFile(bench_src_fn, MODE_RW_CREATE));
+	if (src.get() == NULL)
+	{
+		Server->Log("Error creating benchmark file. " + os_last_error_str(), LL_ERROR);
+		return 1;
+	}
+
+	std::vector<char> buf(bench_buffer_size);
+	for (int64 pos = 0; pos < bench_mb * 1024 * 1024; pos += bench_buffer_size)
+	{
+		for (size_t i = 0; i < buf.size(); ++i)
+		{
+			buf[i] = static_cast<char>((pos + i) * 131 + ((pos + i) >> 12));
+		}
+		if (src->Write(pos, &buf[0], static_cast<_u32>(buf.size())) != buf.size())
+		{
+			Server->Log("Error writing benchmark file. " + os_last_error_str(), LL_ERROR);
+			return 1;
+		}
+	}
+	src->Sync();
+
+	int64 src_size = src->Size();
+
+	Server->Log("Extent copy benchmark. File size: " + PrettyPrintBytes(src_size), LL_INFO);
+
+	int rc = 0;
+
+	{
+		std::auto_ptr<IFsFile> dst(Server->openFile(bench_dst_fn, MODE_WRITE));
+		int64 starttime = Server->getTimeMS();
+		for (int64 pos = 0; pos < src_size; pos += bench_buffer_size)
+		{
+			_u32 read = src->Read(pos, &buf[0], static_cast<_u32>(buf.size()));
+			dst->Write(pos, &buf[0], read);
+		}
+		dst->Sync();
+		log_rate("Buffered copy", src_size, Server->getTimeMS() - starttime);
+		dst.reset();
+		if (!same_content(src.get(), bench_dst_fn))
+		{
+			Server->Log("Buffered copy differs from source", LL_ERROR);
+			rc = 1;
+		}
+	}
+
+	for (int with_clone = 0; with_clone < 2; ++with_clone)
+	{
+		std::string name = with_clone ? "Reflink copy" : "Kernel copy";
+		std::auto_ptr<IFsFile> dst(Server->openFile(bench_dst_fn, MODE_WRITE));
+		int64 starttime = Server->getTimeMS();
+		bool unsupported;
+		int64 copied = ExtentCopy::copy_range(src.get(), 0, dst.get(), 0, src_size, with_clone != 0, unsupported);
+		dst->Sync();
+		if (copied != src_size)
+		{
+			Server->Log(name + ": " + (unsupported ? "not supported" : "failed") + " after " + PrettyPrintBytes(copied), LL_WARNING);
+			continue;
+		}
+		log_rate(name, src_size, Server->getTimeMS() - starttime);
+		dst.reset();
+		if (!same_content(src.get(), bench_dst_fn))
+		{
+			Server->Log(name + " differs from source", LL_ERROR);
+			rc = 1;
+		}
+	}
+
+	src.reset();
+	Server->deleteFile(bench_src_fn);
+	Server->deleteFile(bench_dst_fn);
+
+	return rc;
+}
@@ -0,0 +1,185 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "../../Interface/Server.h"
+#include "../../Interface/Database.h"
+#include "../../stringtools.h"
+#include "../../urbackupcommon/os_functions.h"
+#include "../server_hash.h"
+#include "../LMDBFileIndex.h"
+#include "../FileEntryBatch.h"
+#include "../dao/ServerFilesDao.h"
+#include "../database.h"
+#include <memory>
+
+namespace
+{
+	const char* bench_db_fn = "file_entry_batch_bench.db";
+	const char* bench_lmdb_fn = "urbackup/fileindex/backup_server_files_index.lmdb";
+	const int bench_clientid = 1;
+
+	std::string bench_hash(size_t i)
+	{
+		unsigned int state = static_cast<unsigned int>(i) * 2654435761U | 1;
+		std::string ret;
+		ret.resize(64);
+		for (size_t j = 0; j < ret.size(); ++j)
+		{
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			ret[j] = static_cast<char>(state & 0xFF);
+		}
+		return ret;
+	}
+
+	//Adds one entry per hash, which the benchmarked entries are linked to
+	void add_heads(ServerFilesDao& filesdao, int backupid, size_t n_entries)
+	{
+		filesdao.BeginWriteTransaction();
+		for (size_t i = 0; i < n_entries; ++i)
+		{
+			filesdao.addFileEntryExternal(backupid, "head" + convert(i), std::string(), bench_hash(i), 4096 + i, 4096 + i,
+				bench_clientid, 0, 0, 0, 1);
+		}
+		filesdao.endTransaction();
+	}
+
+	int64 count_linked(IDatabase* db, int backupid)
+	{
+		db_results res = db->Read("SELECT COUNT(*) AS c FROM files a, files b WHERE a.next_entry=b.id AND b.prev_entry=a.id AND b.backupid=" + convert(backupid));
+		if (res.empty())
+		{
+			return -1;
+		}
+		return watoi64(res[0]["c"]);
+	}
+
+	int64 head_id(IDatabase* db, int backupid, size_t i)
+	{
+		db_results res = db->Read("SELECT id FROM files WHERE backupid=" + convert(backupid) + " AND fullpath='head" + convert(i) + "'");
+		if (res.empty())
+		{
+			return 0;
+		}
+		return watoi64(res[0]["id"]);
+	}
+}
+
+int file_entry_batch_bench()
+{
+	size_t n_entries = 100000;
+	if (!Server->getServerParameter("bench_entries").empty())
+	{
+		n_entries = watoi(Server->getServerParameter("bench_entries"));
+	}
+
+	size_t batch_size = FileEntryBatch::get_default_max_entries();
+
+	if (FileExists(bench_db_fn) || FileExists(bench_lmdb_fn))
+	{
+		Server->Log("Benchmark database exists in working directory. Please run the benchmark in an empty directory.", LL_ERROR);
+		return 1;
+	}
+
+	os_create_dir("urbackup");
+
+	if (!Server->openDatabase(bench_db_fn, URBACKUPDB_SERVER_FILES))
+	{
+		Server->Log("Error opening benchmark database", LL_ERROR);
+		return 1;
+	}
+
+	IDatabase* db = Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER_FILES);
+	db->Write("PRAGMA journal_mode=WAL");
+	if (!db->Write("CREATE TABLE files (id INTEGER PRIMARY KEY, backupid INTEGER, fullpath TEXT, shahash BLOB, filesize INTEGER,"
+			"created INTEGER DEFAULT (CAST(strftime('%s','now') as INTEGER)),"
+			"rsize INTEGER, clientid INTEGER, incremental INTEGER, hashpath TEXT, next_entry INTEGER, prev_entry INTEGER, pointed_to INTEGER)")
+		|| !db->Write("CREATE TABLE files_incoming_stat (id INTEGER PRIMARY KEY, filesize INTEGER, clientid INTEGER, backupid INTEGER, existing_clients TEXT, direction INTEGER, incremental INTEGER)"))
+	{
+		Server->Log("Error creating benchmark tables", LL_ERROR);
+		return 1;
+	}
+
+	std::auto_ptr<LMDBFileIndex> fileindex(new LMDBFileIndex(true));
+	if (fileindex->has_error())
+	{
+		Server->Log("Error creating LMDB file index", LL_ERROR);
+		return 1;
+	}
+
+	Server->Log("File entry batch benchmark. Entries: " + convert(n_entries) + " Batch size: " + convert(batch_size), LL_INFO);
+
+	int rc = 0;
+
+	{
+		ServerFilesDao filesdao(db);
+
+		add_heads(filesdao, 1, n_entries);
+		add_heads(filesdao, 2, n_entries);
+		int64 first_head_1 = head_id(db, 1, 0);
+		int64 first_head_2 = head_id(db, 2, 0);
+
+		int64 starttime = Server->getTimeMS();
+		for (size_t i = 0; i < n_entries; ++i)
+		{
+			BackupServerHash::addFileSQL(filesdao, *fileindex, 3, bench_clientid, 0, "file" + convert(i), std::string(),
+				bench_hash(i), 4096 + i, 0, first_head_1 + i, bench_clientid, 0, false);
+		}
+		int64 single_ms = (std::max)(Server->getTimeMS() - starttime, static_cast<int64>(1));
+
+		starttime = Server->getTimeMS();
+		{
+			FileEntryBatch batch(batch_size);
+			for (size_t i = 0; i < n_entries; ++i)
+			{
+				batch.add(filesdao, *fileindex, BackupServerHash::prepareFileSQL(filesdao, *fileindex, 4, bench_clientid, 0, "file" + convert(i), std::string(),
+					bench_hash(i), 4096 + i, 0, first_head_2 + i, bench_clientid, 0, false));
+			}
+			batch.flush(filesdao, *fileindex);
+		}
+		int64 batch_ms = (std::max)(Server->getTimeMS() - starttime, static_cast<int64>(1));
+
+		int64 linked_single = count_linked(db, 3);
+		int64 linked_batch = count_linked(db, 4);
+
+		Server->Log("Single entries: " + convert(single_ms) + "ms (" + convert(static_cast<double>(single_ms) * 1000 / n_entries) + "us/entry), "
+			+ convert(linked_single) + " linked", LL_INFO);
+		Server->Log("Batched entries: " + convert(batch_ms) + "ms (" + convert(static_cast<double>(batch_ms) * 1000 / n_entries) + "us/entry), "
+			+ convert(linked_batch) + " linked", LL_INFO);
+
+		if (linked_single != static_cast<int64>(n_entries)
+			|| linked_batch != static_cast<int64>(n_entries))
+		{
+			Server->Log("Not all entries are linked into their chains", LL_ERROR);
+			rc = 1;
+		}
+	}
+
+	fileindex->destroy_env();
+	fileindex.reset();
+
+	Server->destroyAllDatabases();
+	Server->deleteFile(bench_db_fn);
+	Server->deleteFile(std::string(bench_db_fn) + "-wal");
+	Server->deleteFile(std::string(bench_db_fn) + "-shm");
+	Server->deleteFile(bench_lmdb_fn);
+	Server->deleteFile(std::string(bench_lmdb_fn) + "-lock");
+
+	return rc;
+}
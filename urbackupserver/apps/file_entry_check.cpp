@@ -0,0 +1,785 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "../../Interface/Server.h"
+#include "../../Interface/Database.h"
+#include "../../stringtools.h"
+#include "../../urbackupcommon/os_functions.h"
+#include "../server_hash.h"
+#include "../LMDBFileIndex.h"
+#include "../CompactFileIndex.h"
+#include "../FileEntryBatch.h"
+#include "../dao/ServerFilesDao.h"
+#include "../database.h"
+#include "app.h"
+#include <memory>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <limits.h>
+
+namespace
+{
+	const char* check_db_fn = "file_entry_check.db";
+	const char* check_lmdb_fn = "urbackup/fileindex/backup_server_files_index.lmdb";
+	const char* check_journal_fn = "urbackup/fileindex/backup_server_files_index.journal";
+	//Few hashes and clients, so the chains get long and entries are taken over and deleted often
+	const size_t check_n_hashes = 8;
+	const int check_n_clients = 3;
+	const size_t check_batch_size = 16;
+	//Chains are only broken for a short time if entries are not linked into the right one
+	const size_t check_verify_interval = 100;
+	const size_t check_max_errors = 20;
+	//SQLite uses the ids of the entries with the highest ids again after they are deleted
+	const size_t check_n_reused_ids = 50;
+
+	class CheckRandom
+	{
+	public:
+		CheckRandom(unsigned int seed)
+			: state(seed | 1)
+		{
+		}
+
+		unsigned int next()
+		{
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			return state;
+		}
+
+		template<typename T>
+		void shuffle(std::vector<T>& v)
+		{
+			for (size_t i = v.size(); i > 1; --i)
+			{
+				std::swap(v[i - 1], v[next() % i]);
+			}
+		}
+
+	private:
+		unsigned int state;
+	};
+
+	//Two file sizes per hash, so entries with the same hash are in different chains
+	const size_t check_n_kinds = check_n_hashes * 2;
+
+	std::string kind_hash(size_t kind)
+	{
+		CheckRandom rnd(static_cast<unsigned int>(kind / 2 + 1) * 2654435761U);
+		std::string ret;
+		ret.resize(64);
+		for (size_t j = 0; j < ret.size(); ++j)
+		{
+			ret[j] = static_cast<char>(rnd.next() & 0xFF);
+		}
+		return ret;
+	}
+
+	int64 kind_filesize(size_t kind)
+	{
+		return link_file_min_size + static_cast<int64>(kind % 2);
+	}
+
+	bool use_compact()
+	{
+		return Server->getServerParameter("fileindex_backend") == "compact";
+	}
+
+	size_t get_n_ops()
+	{
+		if (!Server->getServerParameter("bench_entries").empty())
+		{
+			return watoi(Server->getServerParameter("bench_entries"));
+		}
+		return 20000;
+	}
+
+	IDatabase* open_check_db()
+	{
+		if (FileExists(check_db_fn) || FileExists(check_lmdb_fn) || FileExists(check_journal_fn))
+		{
+			Server->Log("Check database exists in working directory. Please run the check in an empty directory.", LL_ERROR);
+			return NULL;
+		}
+
+		os_create_dir("urbackup");
+		os_create_dir("urbackup/fileindex");
+
+		if (!Server->openDatabase(check_db_fn, URBACKUPDB_SERVER_FILES))
+		{
+			Server->Log("Error opening check database", LL_ERROR);
+			return NULL;
+		}
+
+		IDatabase* db = Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER_FILES);
+		db->Write("PRAGMA journal_mode=WAL");
+		if (!db->Write("CREATE TABLE files (id INTEGER PRIMARY KEY, backupid INTEGER, fullpath TEXT, shahash BLOB, filesize INTEGER,"
+				"created INTEGER DEFAULT (CAST(strftime('%s','now') as INTEGER)),"
+				"rsize INTEGER, clientid INTEGER, incremental INTEGER, hashpath TEXT, next_entry INTEGER, prev_entry INTEGER, pointed_to INTEGER)")
+			|| !db->Write("CREATE INDEX files_idx ON files (shahash, filesize, clientid)")
+			|| !db->Write("CREATE TABLE files_incoming_stat (id INTEGER PRIMARY KEY, filesize INTEGER, clientid INTEGER, backupid INTEGER, existing_clients TEXT, direction INTEGER, incremental INTEGER)")
+			|| !db->Write("CREATE TABLE files_index_journal (id INTEGER PRIMARY KEY, shahash BLOB, filesize INTEGER, clientid INTEGER, target INTEGER)"))
+		{
+			Server->Log("Error creating check tables", LL_ERROR);
+			return NULL;
+		}
+
+		return db;
+	}
+
+	bool start_index_writer()
+	{
+		if (use_compact())
+		{
+			return CompactFileIndex::initFileIndex();
+		}
+		return LMDBFileIndex::initFileIndex();
+	}
+
+	//Waits until the writer put all changes into the index
+	void stop_index_writer()
+	{
+		if (use_compact())
+		{
+			CompactFileIndex::shutdownFileIndex();
+		}
+		else
+		{
+			LMDBFileIndex::shutdownFileIndex();
+		}
+	}
+
+	FileIndex* open_check_index()
+	{
+		if (use_compact())
+		{
+			return new CompactFileIndex(true);
+		}
+		return new LMDBFileIndex(true);
+	}
+
+	void remove_check_files(std::auto_ptr<FileIndex>& fileindex)
+	{
+		if (!use_compact())
+		{
+			static_cast<LMDBFileIndex*>(fileindex.get())->destroy_env();
+		}
+		fileindex.reset();
+
+		Server->destroyAllDatabases();
+		Server->deleteFile(check_db_fn);
+		Server->deleteFile(std::string(check_db_fn) + "-wal");
+		Server->deleteFile(std::string(check_db_fn) + "-shm");
+		delete_file_index();
+	}
+
+	class CheckErrors
+	{
+	public:
+		CheckErrors()
+			: n_errors(0)
+		{
+		}
+
+		void error(const std::string& msg)
+		{
+			if (n_errors < check_max_errors)
+			{
+				Server->Log(msg, LL_ERROR);
+			}
+			++n_errors;
+		}
+
+		bool ok()
+		{
+			return n_errors == 0;
+		}
+
+		size_t get_n_errors()
+		{
+			return n_errors;
+		}
+
+	private:
+		size_t n_errors;
+	};
+
+	//Adds and deletes file entries the way file backups and the cleanup do
+	class ChainOps
+	{
+	public:
+		ChainOps(IDatabase* db, ServerFilesDao& filesdao, FileIndex& fileindex, unsigned int seed)
+			: db(db), filesdao(filesdao), fileindex(fileindex), rnd(seed), batch(check_batch_size),
+			n_ops(0), n_added(0), n_deleted(0)
+		{
+			q_find_id = db->Prepare("SELECT id FROM files WHERE id>=? ORDER BY id ASC LIMIT 1", false);
+		}
+
+		~ChainOps()
+		{
+			flush();
+			db->destroyQuery(q_find_id);
+		}
+
+		void run(size_t n)
+		{
+			for (size_t i = 0; i < n; ++i, ++n_ops)
+			{
+				if (rnd.next() % 10 < 7)
+				{
+					add();
+				}
+				else
+				{
+					del();
+				}
+			}
+			flush();
+		}
+
+		void flush()
+		{
+			batch.flush(filesdao, fileindex);
+			FileEntryBatch::flush_all(filesdao, fileindex);
+		}
+
+		//Deletes the file entries with the highest ids
+		void del_newest(size_t n)
+		{
+			FileEntryBatch::flush_all(filesdao, fileindex);
+
+			for (size_t i = 0; i < n; ++i)
+			{
+				ServerFilesDao::CondInt64 max_id = filesdao.getMaxFileId();
+				if (!max_id.exists
+					|| max_id.value <= 0)
+				{
+					return;
+				}
+
+				BackupServerHash::deleteFileSQL(filesdao, fileindex, max_id.value);
+				++n_deleted;
+			}
+		}
+
+		int64 get_n_entries()
+		{
+			return n_added - n_deleted;
+		}
+
+		int64 get_n_deleted()
+		{
+			return n_deleted;
+		}
+
+		//Adds a file entry for each hash, file size and client, which takes over the index entry
+		void take_over_all()
+		{
+			for (size_t kind = 0; kind < check_n_kinds; ++kind)
+			{
+				for (int clientid = 1; clientid <= check_n_clients; ++clientid, ++n_ops)
+				{
+					add(kind, clientid, true);
+				}
+			}
+			flush();
+		}
+
+	private:
+		void add()
+		{
+			size_t kind = rnd.next() % check_n_kinds;
+			int clientid = 1 + rnd.next() % check_n_clients;
+			//The new entry takes over the index entry if the file was copied
+			add(kind, clientid, rnd.next() % 4 == 0);
+		}
+
+		void add(size_t kind, int clientid, bool update_fileindex)
+		{
+			int backupid = 1 + static_cast<int>(n_ops / 1000);
+			std::string shahash = kind_hash(kind);
+			int64 filesize = kind_filesize(kind);
+			std::string fp = "/backup/" + convert(backupid) + "/file" + convert(n_ops);
+
+			//As in BackupServerHash::findFileAndLink()
+			FileEntryBatch::flush_pending(filesdao, fileindex, shahash, filesize);
+
+			int64 prev_entry = fileindex.get_with_cache_prefer_client(FileIndex::SIndexKey(shahash.c_str(), filesize, clientid));
+			int64 prev_entry_clientid = 0;
+			int64 next_entry = 0;
+			if (prev_entry != 0)
+			{
+				ServerFilesDao::SFindFileEntry entry = filesdao.getFileEntry(prev_entry);
+				if (entry.exists)
+				{
+					prev_entry_clientid = entry.clientid;
+					next_entry = entry.next_entry;
+				}
+				else
+				{
+					prev_entry = 0;
+				}
+			}
+
+			if (rnd.next() % 2 == 0)
+			{
+				batch.add(filesdao, fileindex, BackupServerHash::prepareFileSQL(filesdao, fileindex, backupid, clientid, 0, fp, std::string(),
+					shahash, filesize, filesize, prev_entry, prev_entry_clientid, next_entry, update_fileindex));
+			}
+			else
+			{
+				BackupServerHash::addFileSQL(filesdao, fileindex, backupid, clientid, 0, fp, std::string(),
+					shahash, filesize, filesize, prev_entry, prev_entry_clientid, next_entry, update_fileindex);
+			}
+
+			++n_added;
+		}
+
+		void del()
+		{
+			//As in the cleanup
+			FileEntryBatch::flush_all(filesdao, fileindex);
+
+			ServerFilesDao::CondInt64 max_id = filesdao.getMaxFileId();
+			if (!max_id.exists
+				|| max_id.value <= 0)
+			{
+				return;
+			}
+
+			q_find_id->Bind(1 + static_cast<int64>(rnd.next() % max_id.value));
+			db_results res = q_find_id->Read();
+			q_find_id->Reset();
+
+			if (res.empty())
+			{
+				return;
+			}
+
+			BackupServerHash::deleteFileSQL(filesdao, fileindex, watoi64(res[0]["id"]));
+			++n_deleted;
+		}
+
+		IDatabase* db;
+		ServerFilesDao& filesdao;
+		FileIndex& fileindex;
+		CheckRandom rnd;
+		FileEntryBatch batch;
+		IQuery* q_find_id;
+		size_t n_ops;
+		int64 n_added;
+		int64 n_deleted;
+	};
+
+	struct SChainLinks
+	{
+		int64 next_entry;
+		int64 prev_entry;
+	};
+
+	//Checks that the file entries of each hash, file size and client form one chain
+	//with exactly one entry with pointed_to=1, which is the one in the index, and that
+	//there is no index entry without file entries (the client after the last one has none).
+	//Lookups go through the write-behind cache if with_cache is set
+	void verify_chains(IDatabase* db, FileIndex& fileindex, int64 n_entries, bool with_cache, CheckErrors& errors)
+	{
+		IQuery* q_entries = db->Prepare("SELECT id, next_entry, prev_entry, pointed_to FROM files WHERE shahash=? AND filesize=? AND clientid=?", false);
+
+		int64 n_found = 0;
+		for (size_t kind = 0; kind < check_n_kinds; ++kind)
+		{
+			std::string shahash = kind_hash(kind);
+			int64 filesize = kind_filesize(kind);
+
+			for (int clientid = 1; clientid <= check_n_clients + 1; ++clientid)
+			{
+				std::string chain_name = "Chain of hash " + convert(kind / 2) + " filesize " + convert(filesize) + " client " + convert(clientid);
+
+				q_entries->Bind(shahash.c_str(), static_cast<_u32>(shahash.size()));
+				q_entries->Bind(filesize);
+				q_entries->Bind(clientid);
+				db_results res = q_entries->Read();
+				q_entries->Reset();
+
+				FileIndex::SIndexKey key(shahash.c_str(), filesize, clientid);
+				int64 index_id = with_cache ? fileindex.get_with_cache_exact(key) : fileindex.get(key);
+
+				n_found += res.size();
+
+				std::map<int64, SChainLinks> links;
+				int64 head = 0;
+				size_t n_heads = 0;
+				int64 pointed_id = 0;
+				size_t n_pointed = 0;
+				for (size_t i = 0; i < res.size(); ++i)
+				{
+					int64 id = watoi64(res[i]["id"]);
+					SChainLinks& curr = links[id];
+					curr.next_entry = watoi64(res[i]["next_entry"]);
+					curr.prev_entry = watoi64(res[i]["prev_entry"]);
+					if (curr.prev_entry == 0)
+					{
+						head = id;
+						++n_heads;
+					}
+					if (watoi(res[i]["pointed_to"]) != 0)
+					{
+						pointed_id = id;
+						++n_pointed;
+					}
+				}
+
+				if (links.empty())
+				{
+					if (index_id != 0)
+					{
+						errors.error(chain_name + " has no file entries but the index points to " + convert(index_id));
+					}
+					continue;
+				}
+
+				if (n_pointed != 1)
+				{
+					errors.error(chain_name + " has " + convert(n_pointed) + " entries with pointed_to=1");
+				}
+				else if (index_id != pointed_id)
+				{
+					errors.error(chain_name + ": index points to " + convert(index_id) + " instead of " + convert(pointed_id));
+				}
+
+				if (n_heads != 1)
+				{
+					errors.error(chain_name + " has " + convert(n_heads) + " entries without previous entry");
+					continue;
+				}
+
+				int64 prev = 0;
+				int64 curr = head;
+				size_t n_visited = 0;
+				while (curr != 0
+					&& n_visited <= links.size())
+				{
+					std::map<int64, SChainLinks>::iterator it = links.find(curr);
+					if (it == links.end())
+					{
+						errors.error(chain_name + ": entry " + convert(prev) + " links to entry " + convert(curr) + " which is not in the chain");
+						break;
+					}
+					if (it->second.prev_entry != prev)
+					{
+						errors.error(chain_name + ": entry " + convert(curr) + " has previous entry " + convert(it->second.prev_entry) + " instead of " + convert(prev));
+					}
+					prev = curr;
+					curr = it->second.next_entry;
+					++n_visited;
+				}
+
+				if (n_visited != links.size())
+				{
+					errors.error(chain_name + " links " + convert(n_visited) + " of " + convert(links.size()) + " entries");
+				}
+			}
+		}
+
+		db->destroyQuery(q_entries);
+
+		if (n_found != n_entries)
+		{
+			errors.error("Files table has " + convert(n_found) + " entries instead of " + convert(n_entries));
+		}
+	}
+
+	void verify_journal_empty(IDatabase* db, CheckErrors& errors)
+	{
+		db_results res = db->Read("SELECT COUNT(*) AS c FROM files_index_journal");
+		if (res.empty()
+			|| watoi64(res[0]["c"]) != 0)
+		{
+			errors.error("Index journal has " + (res.empty() ? std::string("unknown") : res[0]["c"]) + " entries which are not applied");
+		}
+	}
+
+	void verify_checkpoint(ServerFilesDao& filesdao, FileIndex& fileindex, bool exact, CheckErrors& errors)
+	{
+		ServerFilesDao::CondInt64 max_id = filesdao.getMaxFileId();
+		int64 checkpoint = fileindex.get_checkpoint();
+		if (exact ? checkpoint != max_id.value : checkpoint < max_id.value)
+		{
+			errors.error("Index checkpoint is " + convert(checkpoint) + " with maximum file entry id " + convert(max_id.value));
+		}
+	}
+
+	std::vector<ServerFilesDao::SIndexJournalEntry> get_journal(ServerFilesDao& filesdao)
+	{
+		std::vector<ServerFilesDao::SIndexJournalEntry> ret;
+		while (true)
+		{
+			std::vector<ServerFilesDao::SIndexJournalEntry> journal = filesdao.getIndexJournalEntries(ret.empty() ? 0 : ret.back().id + 1, 10000);
+			if (journal.empty())
+			{
+				return ret;
+			}
+			ret.insert(ret.end(), journal.begin(), journal.end());
+		}
+	}
+
+	//Puts a random part of the index changes after the checkpoint into the index in random
+	//order, as the writer may have done before an unclean shutdown
+	size_t apply_partially(IDatabase* db, ServerFilesDao& filesdao, FileIndex& fileindex, int64 checkpoint, CheckRandom& rnd)
+	{
+		std::vector<std::pair<FileIndex::SIndexKey, int64> > changes;
+
+		IQuery* q_new = db->Prepare("SELECT id, shahash, filesize, clientid FROM files WHERE id>? AND pointed_to=1", false);
+		q_new->Bind(checkpoint);
+		db_results res = q_new->Read();
+		db->destroyQuery(q_new);
+
+		for (size_t i = 0; i < res.size(); ++i)
+		{
+			changes.push_back(std::make_pair(FileIndex::SIndexKey(res[i]["shahash"].c_str(), watoi64(res[i]["filesize"]), watoi(res[i]["clientid"])),
+				watoi64(res[i]["id"])));
+		}
+
+		std::vector<ServerFilesDao::SIndexJournalEntry> journal = get_journal(filesdao);
+		for (size_t i = 0; i < journal.size(); ++i)
+		{
+			changes.push_back(std::make_pair(FileIndex::SIndexKey(journal[i].shahash.c_str(), journal[i].filesize, journal[i].clientid),
+				journal[i].target));
+		}
+
+		rnd.shuffle(changes);
+
+		size_t n_applied = 0;
+		fileindex.start_transaction();
+		for (size_t i = 0; i < changes.size(); ++i)
+		{
+			if (rnd.next() % 2 == 0)
+			{
+				continue;
+			}
+
+			if (changes[i].second != 0)
+			{
+				fileindex.put(changes[i].first, changes[i].second);
+			}
+			else
+			{
+				fileindex.del(changes[i].first);
+			}
+			++n_applied;
+		}
+		fileindex.commit_transaction();
+
+		return n_applied;
+	}
+
+	//Writes the index journal again in random order, with changes to file entries which do not
+	//exist (anymore) and to keys without file entries added
+	void shuffle_journal(ServerFilesDao& filesdao, CheckRandom& rnd)
+	{
+		std::vector<ServerFilesDao::SIndexJournalEntry> journal = get_journal(filesdao);
+
+		ServerFilesDao::CondInt64 max_id = filesdao.getMaxFileId();
+		for (size_t kind = 0; kind < check_n_kinds; ++kind)
+		{
+			ServerFilesDao::SIndexJournalEntry stale;
+			stale.id = 0;
+			stale.shahash = kind_hash(kind);
+			stale.filesize = kind_filesize(kind);
+			stale.clientid = check_n_clients + 1;
+			stale.target = kind % 3 == 0 ? 0 : max_id.value + 1 + static_cast<int64>(kind);
+			journal.push_back(stale);
+
+			stale.clientid = 1 + rnd.next() % check_n_clients;
+			stale.target = max_id.value + 100 + static_cast<int64>(kind);
+			journal.push_back(stale);
+		}
+
+		rnd.shuffle(journal);
+
+		filesdao.BeginWriteTransaction();
+		filesdao.delIndexJournalEntriesUpTo(LLONG_MAX);
+		for (size_t i = 0; i < journal.size(); ++i)
+		{
+			filesdao.addIndexJournalEntry(journal[i].shahash, journal[i].filesize, journal[i].clientid, journal[i].target);
+		}
+		filesdao.endTransaction();
+	}
+
+	int check_result(const std::string& name, CheckErrors& errors)
+	{
+		if (!errors.ok())
+		{
+			Server->Log(name + " failed with " + convert(errors.get_n_errors()) + " errors", LL_ERROR);
+			return 1;
+		}
+
+		Server->Log(name + " passed", LL_INFO);
+		return 0;
+	}
+}
+
+int file_entry_chain_check()
+{
+	size_t n_ops = get_n_ops();
+
+	IDatabase* db = open_check_db();
+	if (db == NULL)
+	{
+		return 1;
+	}
+
+	Server->Log("File entry chain check. Operations: " + convert(n_ops) + " Index backend: " + (use_compact() ? "compact" : "lmdb"), LL_INFO);
+
+	if (!start_index_writer())
+	{
+		Server->Log("Error starting file entry index", LL_ERROR);
+		return 1;
+	}
+
+	std::auto_ptr<FileIndex> fileindex(open_check_index());
+
+	CheckErrors errors;
+
+	{
+		ServerFilesDao filesdao(db);
+		ChainOps ops(db, filesdao, *fileindex, 1);
+
+		for (size_t done = 0; done < n_ops; done += check_verify_interval)
+		{
+			//Otherwise the writer may keep all changes in the cache and lookups never go to the index
+			if (done % (check_verify_interval * 10) == 0)
+			{
+				FileIndex::flush();
+			}
+
+			ops.run((std::min)(check_verify_interval, n_ops - done));
+			verify_chains(db, *fileindex, ops.get_n_entries(), true, errors);
+		}
+
+		Server->Log("Added " + convert(ops.get_n_entries() + ops.get_n_deleted()) + " file entries and deleted "
+			+ convert(ops.get_n_deleted()), LL_INFO);
+
+		stop_index_writer();
+
+		verify_chains(db, *fileindex, ops.get_n_entries(), false, errors);
+		verify_checkpoint(filesdao, *fileindex, false, errors);
+
+		std::vector<ServerFilesDao::SIndexJournalEntry> journal = get_journal(filesdao);
+		if (!journal.empty()
+			&& FileIndex::get_flushed_journal_id() < journal.back().id)
+		{
+			errors.error("Index journal is flushed up to " + convert(FileIndex::get_flushed_journal_id()) + " instead of " + convert(journal.back().id));
+		}
+
+		filesdao.delIndexJournalEntriesUpTo(FileIndex::get_flushed_journal_id());
+		verify_journal_empty(db, errors);
+	}
+
+	remove_check_files(fileindex);
+
+	return check_result("File entry chain check", errors);
+}
+
+int fileindex_replay_check()
+{
+	size_t n_ops = get_n_ops();
+
+	IDatabase* db = open_check_db();
+	if (db == NULL)
+	{
+		return 1;
+	}
+
+	Server->Log("File entry index replay check. Operations: " + convert(n_ops) + " Index backend: " + (use_compact() ? "compact" : "lmdb"), LL_INFO);
+
+	if (!start_index_writer())
+	{
+		Server->Log("Error starting file entry index", LL_ERROR);
+		return 1;
+	}
+
+	std::auto_ptr<FileIndex> fileindex(open_check_index());
+
+	CheckErrors errors;
+
+	{
+		ServerFilesDao filesdao(db);
+		ChainOps ops(db, filesdao, *fileindex, 2);
+		CheckRandom rnd(3);
+
+		ops.run(n_ops);
+
+		stop_index_writer();
+
+		filesdao.delIndexJournalEntriesUpTo(FileIndex::get_flushed_journal_id());
+		verify_chains(db, *fileindex, ops.get_n_entries(), false, errors);
+
+		int64 checkpoint = fileindex->get_checkpoint();
+
+		//Without the writer the changes only reach the write-behind cache and are lost,
+		//as with an unclean shutdown
+		ops.run(n_ops / 4);
+
+		size_t n_applied = apply_partially(db, filesdao, *fileindex, checkpoint, rnd);
+		shuffle_journal(filesdao, rnd);
+
+		Server->Log("Replaying after checkpoint " + convert(checkpoint) + " with " + convert(n_applied) + " of the changes in the index", LL_INFO);
+
+		if (!fileindex->replay_after_checkpoint())
+		{
+			errors.error("Replaying file entries after checkpoint failed");
+		}
+
+		verify_chains(db, *fileindex, ops.get_n_entries(), false, errors);
+		verify_checkpoint(filesdao, *fileindex, true, errors);
+		verify_journal_empty(db, errors);
+
+		//File entries after the checkpoint were rolled back
+		ServerFilesDao::CondInt64 max_id = filesdao.getMaxFileId();
+		fileindex->set_checkpoint(max_id.value + 1000);
+
+		if (!fileindex->replay_after_checkpoint())
+		{
+			errors.error("Replaying with checkpoint after the last file entry failed");
+		}
+
+		verify_chains(db, *fileindex, ops.get_n_entries(), false, errors);
+		verify_checkpoint(filesdao, *fileindex, true, errors);
+
+		//The entries added after deleting the newest ones get ids at or below the checkpoint
+		ops.del_newest(check_n_reused_ids);
+		ops.take_over_all();
+
+		Server->Log("Replaying after adding entries with ids at or below checkpoint " + convert(fileindex->get_checkpoint()), LL_INFO);
+
+		if (!fileindex->replay_after_checkpoint())
+		{
+			errors.error("Replaying with ids at or below the checkpoint failed");
+		}
+
+		verify_chains(db, *fileindex, ops.get_n_entries(), false, errors);
+		verify_journal_empty(db, errors);
+	}
+
+	remove_check_files(fileindex);
+
+	return check_result("File entry index replay check", errors);
+}
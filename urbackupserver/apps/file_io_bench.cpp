@@ -0,0 +1,221 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "../../Interface/Server.h"
+#include "../../Interface/File.h"
+#include "../../stringtools.h"
+#include "../../urbackupcommon/os_functions.h"
+#include <memory>
+#include <vector>
+
+namespace
+{
+	const char* bench_fn = "file_io_bench.dat";
+
+	enum EPattern
+	{
+		//Large sequential writes (copying files into the backup)
+		EPattern_SeqWrite,
+		//Small sequential writes (hash output files)
+		EPattern_SmallAppend,
+		//Data blocks with a bitmap update at the start of the file after each block (VHD writer)
+		EPattern_VhdBlocks,
+		//Random small writes
+		EPattern_RandWrite,
+		//Writes with reads of data written before (chunk patching)
+		EPattern_ReadAfterWrite
+	};
+
+	struct SPattern
+	{
+		const char* name;
+		EPattern pattern;
+		size_t write_size;
+	};
+
+	const SPattern patterns[] = {
+		{ "seq_write", EPattern_SeqWrite, 64 * 1024 },
+		{ "small_append", EPattern_SmallAppend, 128 },
+		{ "vhd_blocks", EPattern_VhdBlocks, 64 * 1024 },
+		{ "rand_write", EPattern_RandWrite, 4096 },
+		{ "read_after_write", EPattern_ReadAfterWrite, 64 * 1024 }
+	};
+
+	const int64 vhd_bitmap_size = 512;
+
+	void fill(std::vector<char>& buf, int64 pos)
+	{
+		for (size_t i = 0; i < buf.size(); ++i)
+		{
+			buf[i] = static_cast<char>((pos + i) * 131 + ((pos + i) >> 12));
+		}
+	}
+
+	int64 checksum_file(const std::string& fn)
+	{
+		std::auto_ptr<IFile> f(Server->openFile(fn, MODE_READ));
+		if (f.get() == NULL)
+		{
+			return -1;
+		}
+
+		int64 checksum = f->Size();
+		std::vector<char> buf(64 * 1024);
+		_u32 read;
+		while ((read = f->Read(&buf[0], static_cast<_u32>(buf.size()))) > 0)
+		{
+			for (_u32 i = 0; i < read; ++i)
+			{
+				checksum = checksum * 31 + static_cast<unsigned char>(buf[i]);
+			}
+		}
+		return checksum;
+	}
+
+	//Returns the number of write operations or -1 on error
+	int64 run_pattern(const SPattern& pattern, int64 total_size)
+	{
+		std::auto_ptr<IFsFile> f(Server->openFile(bench_fn, MODE_RW_CREATE_ASYNC));
+		if (f.get() == NULL)
+		{
+			Server->Log("Error opening benchmark file. " + os_last_error_str(), LL_ERROR);
+			return -1;
+		}
+
+		std::vector<char> buf(pattern.write_size);
+		std::vector<char> read_buf(4096);
+		int64 n_ops = 0;
+		unsigned int rnd = 1;
+		int64 data_pos = pattern.pattern == EPattern_VhdBlocks ? vhd_bitmap_size : 0;
+
+		for (int64 done = 0; done < total_size; done += buf.size(), ++n_ops)
+		{
+			int64 wpos = data_pos + done;
+			if (pattern.pattern == EPattern_RandWrite)
+			{
+				rnd = rnd * 1103515245 + 12345;
+				wpos = (static_cast<int64>(rnd >> 8) % (total_size / buf.size())) * buf.size();
+			}
+
+			fill(buf, wpos);
+			if (f->Write(wpos, &buf[0], static_cast<_u32>(buf.size())) != buf.size())
+			{
+				Server->Log("Error writing benchmark file. " + os_last_error_str(), LL_ERROR);
+				return -1;
+			}
+
+			if (pattern.pattern == EPattern_VhdBlocks)
+			{
+				int64 block = done / buf.size();
+				char bits = static_cast<char>(block & 0xFF);
+				if (f->Write((block / 8) % vhd_bitmap_size, &bits, 1) != 1)
+				{
+					Server->Log("Error writing bitmap to benchmark file. " + os_last_error_str(), LL_ERROR);
+					return -1;
+				}
+				++n_ops;
+			}
+			else if (pattern.pattern == EPattern_ReadAfterWrite
+				&& done > 0)
+			{
+				int64 rpos = (done / 2) & ~static_cast<int64>(read_buf.size() - 1);
+				if (f->Read(rpos, &read_buf[0], static_cast<_u32>(read_buf.size())) != read_buf.size())
+				{
+					Server->Log("Error reading from benchmark file", LL_ERROR);
+					return -1;
+				}
+				++n_ops;
+			}
+		}
+
+		if (!f->Sync())
+		{
+			Server->Log("Error syncing benchmark file. " + os_last_error_str(), LL_ERROR);
+			return -1;
+		}
+
+		return n_ops;
+	}
+}
+
+int file_io_bench()
+{
+	int64 bench_mb = 256;
+	if (!Server->getServerParameter("bench_size").empty())
+	{
+		bench_mb = watoi(Server->getServerParameter("bench_size"));
+	}
+	std::string only_pattern = Server->getServerParameter("bench_pattern");
+
+	if (FileExists(bench_fn))
+	{
+		Server->Log("Benchmark file exists in working directory. Please run the benchmark in an empty directory.", LL_ERROR);
+		return 1;
+	}
+
+	std::string orig_io_uring = Server->getServerParameter("file_io_uring");
+
+	int rc = 0;
+	for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); ++i)
+	{
+		const SPattern& pattern = patterns[i];
+		if (!only_pattern.empty() && only_pattern != pattern.name)
+		{
+			continue;
+		}
+
+		int64 total_size = bench_mb * 1024 * 1024;
+		if (pattern.pattern == EPattern_SmallAppend)
+		{
+			total_size /= 16;
+		}
+
+		int64 checksums[2];
+		for (int with_uring = 0; with_uring < 2; ++with_uring)
+		{
+			Server->setServerParameter("file_io_uring", with_uring ? "true" : "false");
+
+			int64 starttime = Server->getTimeMS();
+			int64 n_ops = run_pattern(pattern, total_size);
+			int64 passed = (std::max)(Server->getTimeMS() - starttime, static_cast<int64>(1));
+
+			if (n_ops < 0)
+			{
+				rc = 1;
+				break;
+			}
+
+			Server->Log(std::string(pattern.name) + (with_uring ? " io_uring: " : " sync: ") + PrettyPrintBytes(total_size)
+				+ " in " + convert(passed) + "ms (" + convert(static_cast<int64>(total_size / 1000.0 / passed)) + " MB/s, "
+				+ convert(n_ops * 1000 / passed) + " ops/s)", LL_INFO);
+
+			checksums[with_uring] = checksum_file(bench_fn);
+			Server->deleteFile(bench_fn);
+		}
+
+		if (rc == 0 && checksums[0] != checksums[1])
+		{
+			Server->Log(std::string(pattern.name) + ": file written with io_uring differs", LL_ERROR);
+			rc = 1;
+		}
+	}
+
+	Server->setServerParameter("file_io_uring", orig_io_uring);
+
+	return rc;
+}
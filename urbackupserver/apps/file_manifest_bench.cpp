@@ -0,0 +1,192 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "../../Interface/Server.h"
+#include "../../Interface/Database.h"
+#include "../../Interface/File.h"
+#include "../../stringtools.h"
+#include "../../urbackupcommon/os_functions.h"
+#include "../FileManifest.h"
+#include "../dao/ServerFilesDao.h"
+#include "../database.h"
+#include <memory>
+
+namespace
+{
+	const char* bench_db_fn = "file_manifest_bench.db";
+	const char* bench_manifest_fn = "urbackup/file_manifests/1.manifest";
+	const char* bench_backuppath = "/media/backup/testclient/231016-1200";
+	const size_t bench_n_hashes = 1000;
+
+	ServerFilesDao::SNewFileEntry bench_entry(size_t i)
+	{
+		ServerFilesDao::SNewFileEntry ret;
+		std::string rel_path = "/dir" + convert(i / 1000) + "/subdir" + convert((i / 50) % 20) + "/file" + convert(i) + ".txt";
+		ret.backupid = 1;
+		ret.fullpath = bench_backuppath + rel_path;
+		ret.hashpath = std::string(bench_backuppath) + "/.hashes" + rel_path;
+		ret.shahash.resize(64);
+		unsigned int state = static_cast<unsigned int>(i % bench_n_hashes) * 2654435761U | 1;
+		for (size_t j = 0; j < ret.shahash.size(); ++j)
+		{
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			ret.shahash[j] = static_cast<char>(state & 0xFF);
+		}
+		ret.filesize = i % 2048;
+		ret.rsize = ret.filesize;
+		ret.clientid = 1;
+		ret.incremental = static_cast<int>(i % 3);
+		ret.next_entry = 0;
+		ret.prev_entry = 0;
+		ret.pointed_to = 0;
+		return ret;
+	}
+
+	unsigned int entry_checksum(const std::string& fullpath, const std::string& hashpath, const std::string& shahash, int64 filesize, int64 rsize, int incremental)
+	{
+		std::string data = fullpath + "|" + hashpath + "|" + shahash + "|" + convert(filesize) + "|" + convert(rsize) + "|" + convert(incremental);
+		unsigned int ret = 2166136261U;
+		for (size_t i = 0; i < data.size(); ++i)
+		{
+			ret = (ret ^ static_cast<unsigned char>(data[i])) * 16777619U;
+		}
+		return ret;
+	}
+
+	int64 file_size(const std::string& fn)
+	{
+		std::auto_ptr<IFile> f(Server->openFile(fn, MODE_READ));
+		if (f.get() == NULL)
+		{
+			return -1;
+		}
+		return f->Size();
+	}
+}
+
+int file_manifest_bench()
+{
+	size_t n_entries = 500000;
+	if (!Server->getServerParameter("bench_entries").empty())
+	{
+		n_entries = watoi(Server->getServerParameter("bench_entries"));
+	}
+
+	if (FileExists(bench_db_fn) || FileExists(bench_manifest_fn))
+	{
+		Server->Log("Benchmark files exist in working directory. Please run the benchmark in an empty directory.", LL_ERROR);
+		return 1;
+	}
+
+	Server->Log("File manifest benchmark. Entries: " + convert(n_entries), LL_INFO);
+
+	int rc = 0;
+
+	unsigned int written_checksum = 0;
+	int64 starttime = Server->getTimeMS();
+	{
+		FileManifest manifest(1, 1);
+		std::vector<ServerFilesDao::SNewFileEntry> unwritten;
+		for (size_t i = 0; i < n_entries; ++i)
+		{
+			ServerFilesDao::SNewFileEntry entry = bench_entry(i);
+			written_checksum += entry_checksum(entry.fullpath, entry.hashpath, entry.shahash, entry.filesize, entry.rsize, entry.incremental);
+			if (!FileManifest::add_entry(entry, unwritten)
+				|| !unwritten.empty())
+			{
+				Server->Log("Adding entry to manifest failed", LL_ERROR);
+				return 1;
+			}
+		}
+		if (!manifest.finish(unwritten)
+			|| !unwritten.empty())
+		{
+			Server->Log("Writing manifest failed", LL_ERROR);
+			return 1;
+		}
+	}
+	int64 write_ms = Server->getTimeMS() - starttime;
+
+	starttime = Server->getTimeMS();
+	unsigned int read_checksum = 0;
+	size_t n_read = 0;
+	{
+		FileManifest::Reader reader(1);
+		FileManifest::SEntry entry;
+		while (reader.next(entry))
+		{
+			read_checksum += entry_checksum(entry.fullpath, entry.hashpath, entry.shahash, entry.filesize, entry.rsize, entry.incremental);
+			++n_read;
+		}
+		if (reader.has_error())
+		{
+			rc = 1;
+		}
+	}
+	int64 read_ms = Server->getTimeMS() - starttime;
+
+	if (n_read != n_entries || read_checksum != written_checksum)
+	{
+		Server->Log("Manifest read back " + convert(n_read) + " entries with different content", LL_ERROR);
+		rc = 1;
+	}
+
+	int64 manifest_size = file_size(bench_manifest_fn);
+
+	if (!Server->openDatabase(bench_db_fn, URBACKUPDB_SERVER_FILES))
+	{
+		Server->Log("Error opening benchmark database", LL_ERROR);
+		return 1;
+	}
+
+	IDatabase* db = Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER_FILES);
+	db->Write("CREATE TABLE files (id INTEGER PRIMARY KEY, backupid INTEGER, fullpath TEXT, shahash BLOB, filesize INTEGER,"
+		"created INTEGER DEFAULT (CAST(strftime('%s','now') as INTEGER)),"
+		"rsize INTEGER, clientid INTEGER, incremental INTEGER, hashpath TEXT, next_entry INTEGER, prev_entry INTEGER, pointed_to INTEGER)");
+	db->Write("CREATE INDEX files_idx ON files (shahash, filesize, clientid)");
+	db->Write("CREATE INDEX files_backupid ON files (backupid)");
+
+	starttime = Server->getTimeMS();
+	{
+		ServerFilesDao filesdao(db);
+		filesdao.BeginWriteTransaction();
+		for (size_t i = 0; i < n_entries; ++i)
+		{
+			ServerFilesDao::SNewFileEntry entry = bench_entry(i);
+			filesdao.addFileEntry(entry.backupid, entry.fullpath, entry.hashpath, entry.shahash, entry.filesize, entry.rsize,
+				entry.clientid, entry.incremental, 0, 0, 0);
+		}
+		filesdao.endTransaction();
+	}
+	int64 db_ms = Server->getTimeMS() - starttime;
+
+	Server->destroyAllDatabases();
+	int64 db_size = file_size(bench_db_fn);
+
+	Server->Log("Manifest: " + PrettyPrintBytes(manifest_size) + " (" + convert(static_cast<double>(manifest_size) / n_entries) + " bytes/entry)"
+		+ ", write " + convert(write_ms) + "ms, read " + convert(read_ms) + "ms", LL_INFO);
+	Server->Log("Files table: " + PrettyPrintBytes(db_size) + " (" + convert(static_cast<double>(db_size) / n_entries) + " bytes/entry)"
+		+ ", insert " + convert(db_ms) + "ms", LL_INFO);
+
+	Server->deleteFile(bench_db_fn);
+	FileManifest::remove(1);
+
+	return rc;
+}
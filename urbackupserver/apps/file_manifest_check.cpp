@@ -0,0 +1,378 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "../../Interface/Server.h"
+#include "../../Interface/Database.h"
+#include "../../stringtools.h"
+#include "../../urbackupcommon/os_functions.h"
+#include "../server_hash.h"
+#include "../LMDBFileIndex.h"
+#include "../FileEntryBatch.h"
+#include "../FileManifest.h"
+#include "../dao/ServerFilesDao.h"
+#include "../database.h"
+#include <memory>
+#include <map>
+#include <set>
+#include <vector>
+#include <algorithm>
+
+namespace
+{
+	const char* check_db_fn = "file_manifest_check.db";
+	const char* check_lmdb_fn = "urbackup/fileindex/backup_server_files_index.lmdb";
+	const size_t check_batch_size = 64;
+	const size_t check_max_errors = 20;
+
+	//Every seventh entry is large enough to be linked and goes to the files table
+	bool is_large(size_t i)
+	{
+		return i % 7 == 3;
+	}
+
+	std::string entry_path(int backupid, size_t i)
+	{
+		return "/backup/" + convert(backupid) + "/dir" + convert(i % 13) + "/file" + convert(i);
+	}
+
+	FileEntryBatch::SEntry check_entry(ServerFilesDao& filesdao, FileIndex& fileindex, int backupid, int clientid, size_t i)
+	{
+		std::string shahash;
+		shahash.resize(64);
+		unsigned int state = static_cast<unsigned int>(i % 100) * 2654435761U | 1;
+		for (size_t j = 0; j < shahash.size(); ++j)
+		{
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			shahash[j] = static_cast<char>(state & 0xFF);
+		}
+
+		std::string fp = entry_path(backupid, i);
+		std::string hashpath = "/backup/" + convert(backupid) + "/.hashes/file" + convert(i);
+		int incremental = static_cast<int>(i % 3);
+
+		if (!is_large(i))
+		{
+			return BackupServerHash::prepareFileSQL(filesdao, fileindex, backupid, clientid, incremental, fp, hashpath,
+				shahash, static_cast<int64>(i % link_file_min_size), static_cast<int64>(i % 1000), 0, 0, 0, false);
+		}
+
+		//Not linked, so the check does not need the index writer
+		FileEntryBatch::SEntry ret;
+		ret.file.backupid = backupid;
+		ret.file.fullpath = fp;
+		ret.file.hashpath = hashpath;
+		ret.file.shahash = shahash;
+		ret.file.filesize = link_file_min_size + static_cast<int64>(i);
+		ret.file.rsize = ret.file.filesize;
+		ret.file.clientid = clientid;
+		ret.file.incremental = incremental;
+		ret.file.next_entry = 0;
+		ret.file.prev_entry = 0;
+		ret.file.pointed_to = 0;
+		return ret;
+	}
+
+	std::string entry_data(const std::string& fullpath, const std::string& hashpath, const std::string& shahash, int64 filesize, int64 rsize, int incremental)
+	{
+		return fullpath + "|" + hashpath + "|" + shahash + "|" + convert(filesize) + "|" + convert(rsize) + "|" + convert(incremental);
+	}
+
+	class CheckErrors
+	{
+	public:
+		CheckErrors()
+			: n_errors(0)
+		{
+		}
+
+		void error(const std::string& msg)
+		{
+			if (n_errors < check_max_errors)
+			{
+				Server->Log(msg, LL_ERROR);
+			}
+			++n_errors;
+		}
+
+		bool ok()
+		{
+			return n_errors == 0;
+		}
+
+		size_t get_n_errors()
+		{
+			return n_errors;
+		}
+
+	private:
+		size_t n_errors;
+	};
+
+	//Adds entries 0 to n_entries-1 of the backup with a file entry batch. Entries in
+	//[first_unmanifested, n_entries) are added after the manifest is finished
+	void add_entries(ServerFilesDao& filesdao, FileIndex& fileindex, int backupid, size_t n_entries, size_t first_unmanifested,
+		bool with_manifest, CheckErrors& errors)
+	{
+		std::auto_ptr<FileManifest> manifest;
+		if (with_manifest)
+		{
+			manifest.reset(new FileManifest(backupid, backupid));
+		}
+
+		FileEntryBatch batch(check_batch_size);
+		for (size_t i = 0; i < n_entries; ++i)
+		{
+			if (i == first_unmanifested
+				&& manifest.get() != NULL)
+			{
+				batch.flush(filesdao, fileindex);
+
+				std::vector<ServerFilesDao::SNewFileEntry> unwritten;
+				if (!manifest->finish(unwritten)
+					|| !unwritten.empty())
+				{
+					errors.error("Finishing manifest of backup " + convert(backupid) + " failed");
+				}
+			}
+
+			batch.add(filesdao, fileindex, check_entry(filesdao, fileindex, backupid, backupid, i));
+		}
+		batch.flush(filesdao, fileindex);
+
+		if (manifest.get() != NULL
+			&& first_unmanifested >= n_entries)
+		{
+			std::vector<ServerFilesDao::SNewFileEntry> unwritten;
+			if (!manifest->finish(unwritten)
+				|| !unwritten.empty())
+			{
+				errors.error("Finishing manifest of backup " + convert(backupid) + " failed");
+			}
+		}
+	}
+
+	//Checks that the small entries before first_unmanifested are in the manifest exactly once
+	//(if there is one) and all other entries in the files table exactly once
+	void verify_backup(IDatabase* db, ServerFilesDao& filesdao, FileIndex& fileindex, int backupid, size_t n_entries, size_t first_unmanifested,
+		bool with_manifest, CheckErrors& errors)
+	{
+		std::map<std::string, std::string> expected_manifest;
+		std::map<std::string, std::string> expected_table;
+		for (size_t i = 0; i < n_entries; ++i)
+		{
+			FileEntryBatch::SEntry entry = check_entry(filesdao, fileindex, backupid, backupid, i);
+			std::string data = entry_data(entry.file.fullpath, entry.file.hashpath, entry.file.shahash, entry.file.filesize, entry.file.rsize, entry.file.incremental);
+			if (with_manifest
+				&& i < first_unmanifested
+				&& !is_large(i))
+			{
+				expected_manifest[entry.file.fullpath] = data;
+			}
+			else
+			{
+				expected_table[entry.file.fullpath] = data;
+			}
+		}
+
+		std::string name = "Backup " + convert(backupid);
+
+		FileManifest::Reader reader(backupid);
+		if (reader.exists() != with_manifest)
+		{
+			errors.error(name + (with_manifest ? " has no manifest" : " has a manifest"));
+		}
+		else if (with_manifest
+			&& reader.get_clientid() != backupid)
+		{
+			errors.error(name + ": manifest has client " + convert(reader.get_clientid()));
+		}
+
+		FileManifest::SEntry mentry;
+		size_t n_read = 0;
+		while (reader.next(mentry))
+		{
+			++n_read;
+			std::map<std::string, std::string>::iterator it = expected_manifest.find(mentry.fullpath);
+			if (it == expected_manifest.end())
+			{
+				errors.error(name + ": unexpected or duplicate manifest entry \"" + mentry.fullpath + "\"");
+				continue;
+			}
+			if (it->second != entry_data(mentry.fullpath, mentry.hashpath, mentry.shahash, mentry.filesize, mentry.rsize, mentry.incremental))
+			{
+				errors.error(name + ": manifest entry \"" + mentry.fullpath + "\" differs");
+			}
+			expected_manifest.erase(it);
+		}
+
+		if (reader.has_error())
+		{
+			errors.error(name + ": error reading manifest");
+		}
+
+		if (!expected_manifest.empty())
+		{
+			errors.error(name + ": " + convert(expected_manifest.size()) + " entries are missing in the manifest (read " + convert(n_read) + ")");
+		}
+
+		IQuery* q_table = db->Prepare("SELECT fullpath, hashpath, shahash, filesize, rsize, clientid, incremental FROM files WHERE backupid=?", false);
+		q_table->Bind(backupid);
+		db_results res = q_table->Read();
+		db->destroyQuery(q_table);
+
+		for (size_t i = 0; i < res.size(); ++i)
+		{
+			std::map<std::string, std::string>::iterator it = expected_table.find(res[i]["fullpath"]);
+			if (it == expected_table.end())
+			{
+				errors.error(name + ": unexpected or duplicate file entry \"" + res[i]["fullpath"] + "\"");
+				continue;
+			}
+			if (it->second != entry_data(res[i]["fullpath"], res[i]["hashpath"], res[i]["shahash"], watoi64(res[i]["filesize"]), watoi64(res[i]["rsize"]), watoi(res[i]["incremental"]))
+				|| watoi(res[i]["clientid"]) != backupid)
+			{
+				errors.error(name + ": file entry \"" + res[i]["fullpath"] + "\" differs");
+			}
+			expected_table.erase(it);
+		}
+
+		if (!expected_table.empty())
+		{
+			errors.error(name + ": " + convert(expected_table.size()) + " entries are missing in the files table");
+		}
+	}
+
+	void verify_backupids(const std::set<int>& expected, CheckErrors& errors)
+	{
+		std::vector<int> backupids = FileManifest::get_backupids();
+		std::set<int> found(backupids.begin(), backupids.end());
+		if (found != expected
+			|| backupids.size() != found.size())
+		{
+			errors.error("Found " + convert(backupids.size()) + " manifests instead of " + convert(expected.size()));
+		}
+	}
+}
+
+int file_manifest_check()
+{
+	size_t n_entries = 20000;
+	if (!Server->getServerParameter("bench_entries").empty())
+	{
+		n_entries = watoi(Server->getServerParameter("bench_entries"));
+	}
+
+	if (FileExists(check_db_fn) || FileExists(check_lmdb_fn)
+		|| os_directory_exists("urbackup/file_manifests"))
+	{
+		Server->Log("Check files exist in working directory. Please run the check in an empty directory.", LL_ERROR);
+		return 1;
+	}
+
+	Server->setServerParameter("file_manifests", "true");
+
+	os_create_dir("urbackup");
+
+	if (!Server->openDatabase(check_db_fn, URBACKUPDB_SERVER_FILES))
+	{
+		Server->Log("Error opening check database", LL_ERROR);
+		return 1;
+	}
+
+	IDatabase* db = Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER_FILES);
+	db->Write("PRAGMA journal_mode=WAL");
+	if (!db->Write("CREATE TABLE files (id INTEGER PRIMARY KEY, backupid INTEGER, fullpath TEXT, shahash BLOB, filesize INTEGER,"
+			"created INTEGER DEFAULT (CAST(strftime('%s','now') as INTEGER)),"
+			"rsize INTEGER, clientid INTEGER, incremental INTEGER, hashpath TEXT, next_entry INTEGER, prev_entry INTEGER, pointed_to INTEGER)")
+		|| !db->Write("CREATE TABLE files_incoming_stat (id INTEGER PRIMARY KEY, filesize INTEGER, clientid INTEGER, backupid INTEGER, existing_clients TEXT, direction INTEGER, incremental INTEGER)"))
+	{
+		Server->Log("Error creating check tables", LL_ERROR);
+		return 1;
+	}
+
+	std::auto_ptr<LMDBFileIndex> fileindex(new LMDBFileIndex(true));
+	if (fileindex->has_error())
+	{
+		Server->Log("Error creating LMDB file index", LL_ERROR);
+		return 1;
+	}
+
+	Server->Log("File manifest check. Entries per backup: " + convert(n_entries), LL_INFO);
+
+	CheckErrors errors;
+
+	{
+		ServerFilesDao filesdao(db);
+
+		//Manifest with several blocks
+		add_entries(filesdao, *fileindex, 1, n_entries, n_entries, true, errors);
+		//Entries added after the manifest is finished
+		add_entries(filesdao, *fileindex, 2, n_entries, n_entries / 2, true, errors);
+		//Backup without manifest
+		add_entries(filesdao, *fileindex, 3, n_entries / 4, n_entries / 4, false, errors);
+		//Manifest without entries
+		add_entries(filesdao, *fileindex, 4, 0, 0, true, errors);
+
+		verify_backup(db, filesdao, *fileindex, 1, n_entries, n_entries, true, errors);
+		verify_backup(db, filesdao, *fileindex, 2, n_entries, n_entries / 2, true, errors);
+		verify_backup(db, filesdao, *fileindex, 3, n_entries / 4, n_entries / 4, false, errors);
+		verify_backup(db, filesdao, *fileindex, 4, 0, 0, true, errors);
+
+		std::set<int> backupids;
+		backupids.insert(1);
+		backupids.insert(2);
+		backupids.insert(4);
+		verify_backupids(backupids, errors);
+
+		//Backups 2 and 4 are deleted
+		backupids.erase(2);
+		backupids.erase(4);
+		backupids.insert(3);
+		FileManifest::remove_dangling(backupids);
+		backupids.erase(3);
+		verify_backupids(backupids, errors);
+		verify_backup(db, filesdao, *fileindex, 1, n_entries, n_entries, true, errors);
+
+		if (!FileManifest::remove(1))
+		{
+			errors.error("Removing manifest of backup 1 failed");
+		}
+		verify_backupids(std::set<int>(), errors);
+	}
+
+	fileindex->destroy_env();
+	fileindex.reset();
+
+	Server->destroyAllDatabases();
+	Server->deleteFile(check_db_fn);
+	Server->deleteFile(std::string(check_db_fn) + "-wal");
+	Server->deleteFile(std::string(check_db_fn) + "-shm");
+	Server->deleteFile(check_lmdb_fn);
+	Server->deleteFile(std::string(check_lmdb_fn) + "-lock");
+
+	if (!errors.ok())
+	{
+		Server->Log("File manifest check failed with " + convert(errors.get_n_errors()) + " errors", LL_ERROR);
+		return 1;
+	}
+
+	Server->Log("File manifest check passed", LL_INFO);
+	return 0;
+}
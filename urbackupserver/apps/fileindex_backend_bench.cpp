@@ -0,0 +1,236 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "../../Interface/Server.h"
+#include "../../stringtools.h"
+#include "../../urbackupcommon/os_functions.h"
+#include "../LMDBFileIndex.h"
+#include "../CompactFileIndex.h"
+#include <memory>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+namespace
+{
+	const char* bench_lmdb_fn = "urbackup/fileindex/backup_server_files_index.lmdb";
+	const char* bench_journal_fn = "urbackup/fileindex/backup_server_files_index.journal";
+	const size_t bench_commit_n = 10000;
+
+	int64 get_rss()
+	{
+#ifdef _WIN32
+		return -1;
+#else
+		std::vector<std::string> toks;
+		Tokenize(getStreamFile("/proc/self/statm"), toks, " ");
+		if (toks.size() < 2)
+		{
+			return -1;
+		}
+		return watoi64(toks[1])*sysconf(_SC_PAGESIZE);
+#endif
+	}
+
+	class BenchKeys
+	{
+	public:
+		BenchKeys(unsigned int seed)
+			: state(seed | 1)
+		{
+		}
+
+		FileIndex::SIndexKey next()
+		{
+			char hash[bytes_in_index];
+			for (size_t j = 0; j < bytes_in_index; j += sizeof(unsigned int))
+			{
+				unsigned int r = next_rand();
+				memcpy(hash + j, &r, sizeof(r));
+			}
+			return FileIndex::SIndexKey(hash, next_rand() % 10000000, next_rand() % 50);
+		}
+
+		unsigned int next_rand()
+		{
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			return state;
+		}
+
+	private:
+		unsigned int state;
+	};
+
+	void populate(FileIndex& fileindex, const std::vector<FileIndex::SIndexKey>& keys)
+	{
+		fileindex.start_transaction();
+		for (size_t i = 0; i < keys.size(); ++i)
+		{
+			fileindex.put(keys[i], i + 1);
+
+			if ((i + 1) % bench_commit_n == 0)
+			{
+				fileindex.commit_transaction();
+				fileindex.start_transaction();
+			}
+		}
+		fileindex.commit_transaction();
+	}
+
+	//Returns average lookup time in microseconds
+	double bench_lookups(FileIndex& fileindex, const std::vector<FileIndex::SIndexKey>& keys, size_t n_lookups, bool hits, size_t& n_found)
+	{
+		BenchKeys miss_keys(4711);
+		BenchKeys idx_rand(1234);
+		n_found = 0;
+
+		int64 starttime = Server->getTimeMS();
+		for (size_t i = 0; i < n_lookups; ++i)
+		{
+			int64 res;
+			if (hits)
+			{
+				res = fileindex.get_prefer_client(keys[idx_rand.next_rand() % keys.size()]);
+			}
+			else
+			{
+				res = fileindex.get_prefer_client(miss_keys.next());
+			}
+
+			if (res != 0)
+			{
+				++n_found;
+			}
+		}
+		int64 passed = (std::max)(Server->getTimeMS() - starttime, static_cast<int64>(1));
+
+		return static_cast<double>(passed) * 1000 / n_lookups;
+	}
+
+	void log_result(const std::string& name, int64 rss, int64 populate_ms, double hit_us, double miss_us, size_t n_found_hits, size_t n_found_misses)
+	{
+		Server->Log(name + ": populate " + convert(populate_ms) + "ms"
+			+ ", lookup hit " + convert(hit_us) + "us (" + convert(n_found_hits) + " found)"
+			+ ", lookup miss " + convert(miss_us) + "us (" + convert(n_found_misses) + " found)"
+			+ ", resident memory " + (rss >= 0 ? PrettyPrintBytes(rss) : "n/a"), LL_INFO);
+	}
+}
+
+int fileindex_backend_bench()
+{
+	size_t n_entries = 1000000;
+	if (!Server->getServerParameter("bench_entries").empty())
+	{
+		n_entries = watoi(Server->getServerParameter("bench_entries"));
+	}
+
+	size_t n_lookups = 1000000;
+	if (!Server->getServerParameter("bench_lookups").empty())
+	{
+		n_lookups = watoi(Server->getServerParameter("bench_lookups"));
+	}
+
+	if (FileExists(bench_lmdb_fn) || FileExists(bench_journal_fn))
+	{
+		Server->Log("File entry index exists in working directory. Please run the benchmark in an empty directory.", LL_ERROR);
+		return 1;
+	}
+
+	os_create_dir("urbackup");
+
+	Server->Log("File index backend benchmark. Entries: " + convert(n_entries) + " Lookups: " + convert(n_lookups), LL_INFO);
+
+	std::vector<FileIndex::SIndexKey> keys;
+	keys.reserve(n_entries);
+	BenchKeys key_gen(42);
+	for (size_t i = 0; i < n_entries; ++i)
+	{
+		keys.push_back(key_gen.next());
+	}
+
+	int rc = 0;
+
+	{
+		int64 rss_start = get_rss();
+
+		std::auto_ptr<LMDBFileIndex> lmdb(new LMDBFileIndex(true));
+		if (lmdb->has_error())
+		{
+			Server->Log("Error creating LMDB file index", LL_ERROR);
+			return 1;
+		}
+
+		int64 starttime = Server->getTimeMS();
+		populate(*lmdb, keys);
+		int64 populate_ms = Server->getTimeMS() - starttime;
+
+		size_t n_found_hits;
+		size_t n_found_misses;
+		double hit_us = bench_lookups(*lmdb, keys, n_lookups, true, n_found_hits);
+		double miss_us = bench_lookups(*lmdb, keys, n_lookups, false, n_found_misses);
+
+		int64 rss = get_rss();
+		log_result("LMDB", rss >= 0 ? rss - rss_start : -1, populate_ms, hit_us, miss_us, n_found_hits, n_found_misses);
+
+		if (lmdb->has_error())
+		{
+			rc = 1;
+		}
+
+		lmdb->destroy_env();
+	}
+
+	Server->deleteFile(bench_lmdb_fn);
+	Server->deleteFile(std::string(bench_lmdb_fn) + "-lock");
+
+	{
+		int64 rss_start = get_rss();
+
+		std::auto_ptr<CompactFileIndex> compact(new CompactFileIndex(true));
+		if (compact->has_error())
+		{
+			Server->Log("Error creating compact file index", LL_ERROR);
+			return 1;
+		}
+
+		int64 starttime = Server->getTimeMS();
+		populate(*compact, keys);
+		int64 populate_ms = Server->getTimeMS() - starttime;
+
+		size_t n_found_hits;
+		size_t n_found_misses;
+		double hit_us = bench_lookups(*compact, keys, n_lookups, true, n_found_hits);
+		double miss_us = bench_lookups(*compact, keys, n_lookups, false, n_found_misses);
+
+		int64 rss = get_rss();
+		log_result("Compact", rss >= 0 ? rss - rss_start : -1, populate_ms, hit_us, miss_us, n_found_hits, n_found_misses);
+
+		Server->Log("Compact index table and entries: " + PrettyPrintBytes(CompactFileIndex::get_memory_usage()), LL_INFO);
+
+		if (compact->has_error())
+		{
+			rc = 1;
+		}
+	}
+
+	Server->deleteFile(bench_journal_fn);
+
+	return rc;
+}
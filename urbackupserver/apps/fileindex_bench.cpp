@@ -0,0 +1,345 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "../../Interface/Server.h"
+#include "../../Interface/Thread.h"
+#include "../../Interface/ThreadPool.h"
+#include "../../Interface/Mutex.h"
+#include "../../stringtools.h"
+#include "../FileIndex.h"
+#include "../FileIndexCache.h"
+#include <memory>
+
+namespace
+{
+	const size_t bench_max_buffer_size = 100000;
+	const int64 bench_flush_interval_ms = 50;
+
+	class IBenchCache
+	{
+	public:
+		virtual ~IBenchCache() {}
+		virtual void put(const FileIndex::SIndexKey& key, int64 value) = 0;
+		virtual bool get_prefer_client(const FileIndex::SIndexKey& key, int64& res) = 0;
+		virtual void drain() = 0;
+	};
+
+	//The global mutex, double-buffered std::map cache FileIndex used before
+	class MapBenchCache : public IBenchCache
+	{
+	public:
+		MapBenchCache()
+			: mutex(Server->createMutex()),
+			active(&buf1), other(&buf2)
+		{
+		}
+
+		~MapBenchCache()
+		{
+			Server->destroy(mutex);
+		}
+
+		virtual void put(const FileIndex::SIndexKey& key, int64 value)
+		{
+			IScopedLock lock(mutex);
+			while (active->size() >= bench_max_buffer_size)
+			{
+				lock.relock(NULL);
+				Server->wait(10);
+				lock.relock(mutex);
+			}
+			(*active)[key] = value;
+		}
+
+		virtual bool get_prefer_client(const FileIndex::SIndexKey& key, int64& res)
+		{
+			IScopedLock lock(mutex);
+			return get_from(*active, key, res) || get_from(*other, key, res);
+		}
+
+		virtual void drain()
+		{
+			std::map<FileIndex::SIndexKey, int64>* local_buf;
+			{
+				IScopedLock lock(mutex);
+				local_buf = active;
+				active = other;
+				other = local_buf;
+			}
+
+			IScopedLock lock(mutex);
+			local_buf->clear();
+		}
+
+	private:
+		bool get_from(const std::map<FileIndex::SIndexKey, int64>& cache, const FileIndex::SIndexKey& key, int64& res)
+		{
+			std::map<FileIndex::SIndexKey, int64>::const_iterator it = cache.lower_bound(key);
+			if (it != cache.end() && it->first.isEqualWithoutClientid(key))
+			{
+				res = it->second;
+				return true;
+			}
+			if (it != cache.end() && it != cache.begin())
+			{
+				--it;
+				if (it->first.isEqualWithoutClientid(key))
+				{
+					res = it->second;
+					return true;
+				}
+			}
+			return false;
+		}
+
+		IMutex* mutex;
+		std::map<FileIndex::SIndexKey, int64> buf1;
+		std::map<FileIndex::SIndexKey, int64> buf2;
+		std::map<FileIndex::SIndexKey, int64>* active;
+		std::map<FileIndex::SIndexKey, int64>* other;
+	};
+
+	class ShardedBenchCache : public IBenchCache
+	{
+	public:
+		ShardedBenchCache()
+			: cache(bench_max_buffer_size)
+		{
+		}
+
+		virtual void put(const FileIndex::SIndexKey& key, int64 value)
+		{
+			size_t n_pending;
+			while (!cache.put(key, value, n_pending))
+			{
+				Server->wait(10);
+			}
+		}
+
+		virtual bool get_prefer_client(const FileIndex::SIndexKey& key, int64& res)
+		{
+			return cache.get_prefer_client(key, res);
+		}
+
+		virtual void drain()
+		{
+			FileIndexCache::entry_list_t entries;
+			for (size_t i = 0; i < FileIndexCache::n_shards; ++i)
+			{
+				entries.clear();
+				cache.swap_shard(i, entries);
+			}
+			for (size_t i = 0; i < FileIndexCache::n_shards; ++i)
+			{
+				cache.clear_flushed_shard(i);
+			}
+		}
+
+	private:
+		FileIndexCache cache;
+	};
+
+	class BenchFlusher : public IThread
+	{
+	public:
+		BenchFlusher(IBenchCache* cache)
+			: cache(cache), do_stop(false), mutex(Server->createMutex())
+		{
+		}
+
+		~BenchFlusher()
+		{
+			Server->destroy(mutex);
+		}
+
+		void operator()()
+		{
+			while (!stopped())
+			{
+				Server->wait(bench_flush_interval_ms);
+				cache->drain();
+			}
+		}
+
+		void stop()
+		{
+			IScopedLock lock(mutex);
+			do_stop = true;
+		}
+
+	private:
+		bool stopped()
+		{
+			IScopedLock lock(mutex);
+			return do_stop;
+		}
+
+		IBenchCache* cache;
+		bool do_stop;
+		IMutex* mutex;
+	};
+
+	class BenchWorker : public IThread
+	{
+	public:
+		BenchWorker(IBenchCache* cache, size_t n_ops, unsigned int seed, size_t gets_per_put)
+			: cache(cache), n_ops(n_ops), state(seed | 1), gets_per_put(gets_per_put), n_found(0)
+		{
+		}
+
+		void operator()()
+		{
+			char hash[bytes_in_index];
+			std::vector<FileIndex::SIndexKey> recent;
+			for (size_t i = 0; i < n_ops; ++i)
+			{
+				if (i % (gets_per_put + 1) == 0 || recent.empty())
+				{
+					for (size_t j = 0; j < bytes_in_index; j += sizeof(unsigned int))
+					{
+						unsigned int r = next_rand();
+						memcpy(hash + j, &r, sizeof(r));
+					}
+					FileIndex::SIndexKey key(hash, next_rand() % 100000, next_rand() % 50);
+					cache->put(key, i + 1);
+					if (recent.size() < 1024)
+					{
+						recent.push_back(key);
+					}
+					else
+					{
+						recent[next_rand() % recent.size()] = key;
+					}
+				}
+				else
+				{
+					int64 res;
+					//Every other lookup misses
+					if (i % 2 == 0)
+					{
+						if (cache->get_prefer_client(recent[next_rand() % recent.size()], res))
+						{
+							++n_found;
+						}
+					}
+					else
+					{
+						memcpy(hash, &i, sizeof(i));
+						if (cache->get_prefer_client(FileIndex::SIndexKey(hash, 1, 1), res))
+						{
+							++n_found;
+						}
+					}
+				}
+			}
+		}
+
+		size_t get_found()
+		{
+			return n_found;
+		}
+
+	private:
+		unsigned int next_rand()
+		{
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			return state;
+		}
+
+		IBenchCache* cache;
+		size_t n_ops;
+		unsigned int state;
+		size_t gets_per_put;
+		size_t n_found;
+	};
+
+	double run_bench(IBenchCache* cache, size_t n_threads, size_t n_ops, size_t gets_per_put)
+	{
+		BenchFlusher flusher(cache);
+		THREADPOOL_TICKET flusher_ticket = Server->getThreadPool()->execute(&flusher, "bench flusher");
+
+		std::vector<BenchWorker*> workers;
+		std::vector<THREADPOOL_TICKET> tickets;
+		int64 starttime = Server->getTimeMS();
+		for (size_t i = 0; i < n_threads; ++i)
+		{
+			workers.push_back(new BenchWorker(cache, n_ops, Server->getRandomNumber(), gets_per_put));
+			tickets.push_back(Server->getThreadPool()->execute(workers[i], "bench worker"));
+		}
+
+		Server->getThreadPool()->waitFor(tickets);
+		int64 passed = (std::max)(Server->getTimeMS() - starttime, static_cast<int64>(1));
+
+		flusher.stop();
+		Server->getThreadPool()->waitFor(flusher_ticket);
+
+		for (size_t i = 0; i < workers.size(); ++i)
+		{
+			delete workers[i];
+		}
+
+		return static_cast<double>(n_threads*n_ops) * 1000 / passed;
+	}
+}
+
+int fileindex_cache_bench()
+{
+	size_t max_threads = 64;
+	if (!Server->getServerParameter("bench_threads").empty())
+	{
+		max_threads = watoi(Server->getServerParameter("bench_threads"));
+	}
+
+	size_t n_ops = 1000000;
+	if (!Server->getServerParameter("bench_ops").empty())
+	{
+		n_ops = watoi(Server->getServerParameter("bench_ops"));
+	}
+
+	size_t gets_per_put = 4;
+	if (!Server->getServerParameter("bench_gets_per_put").empty())
+	{
+		gets_per_put = watoi(Server->getServerParameter("bench_gets_per_put"));
+	}
+
+	Server->Log("File index cache benchmark. Operations per thread: " + convert(n_ops) + " Lookups per put: " + convert(gets_per_put), LL_INFO);
+
+	for (size_t n_threads = 1; n_threads <= max_threads; n_threads *= 2)
+	{
+		double map_ops;
+		{
+			MapBenchCache cache;
+			map_ops = run_bench(&cache, n_threads, n_ops, gets_per_put);
+		}
+
+		double sharded_ops;
+		{
+			std::auto_ptr<ShardedBenchCache> cache(new ShardedBenchCache);
+			sharded_ops = run_bench(cache.get(), n_threads, n_ops, gets_per_put);
+		}
+
+		Server->Log("Threads: " + convert(n_threads)
+			+ " std::map cache: " + convert(static_cast<int64>(map_ops)) + " ops/s"
+			+ " sharded cache: " + convert(static_cast<int64>(sharded_ops)) + " ops/s"
+			+ " speedup: " + convert(sharded_ops / map_ops), LL_INFO);
+	}
+
+	return 0;
+}
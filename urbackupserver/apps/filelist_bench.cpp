@@ -0,0 +1,282 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "../../Interface/Server.h"
+#include "../../Interface/File.h"
+#include "../../stringtools.h"
+#include "../../urbackupcommon/os_functions.h"
+#include "../../urbackupcommon/filelist_utils.h"
+#include "../treediff/TreeDiff.h"
+#include <memory>
+
+namespace
+{
+	const char* bench_text_fn = "filelist_bench_text.ub";
+	const char* bench_text_mod_fn = "filelist_bench_text_mod.ub";
+	const char* bench_bin_fn = "filelist_bench_bin.ub";
+	const char* bench_bin_mod_fn = "filelist_bench_bin_mod.ub";
+
+	const size_t bench_files_per_dir = 50;
+	const size_t bench_dirs_per_dir = 20;
+
+	class BenchListWriter
+	{
+	public:
+		BenchListWriter(IFile* f, bool binary)
+			: f(f), binary(binary), pos(0)
+		{
+			if (binary)
+			{
+				add(binaryFileListHeader());
+			}
+		}
+
+		void write(const SFile& cf, const std::string& extra)
+		{
+			if (!binary)
+			{
+				writeFileItem(f, cf, extra);
+				return;
+			}
+
+			if (cf.isdir && cf.name != "..")
+			{
+				dir_offsets.push_back(pos);
+			}
+			add(binaryFileListItem(cf, extra));
+		}
+
+		void finish()
+		{
+			if (binary)
+			{
+				add(binaryFileListEnd(pos, dir_offsets));
+			}
+		}
+
+	private:
+		void add(const std::string& data)
+		{
+			writeFileRepeat(f, data);
+			pos += data.size();
+		}
+
+		IFile* f;
+		bool binary;
+		int64 pos;
+		std::vector<int64> dir_offsets;
+	};
+
+	size_t write_list(const std::string& fn, bool binary, size_t n_entries, bool modified)
+	{
+		std::auto_ptr<IFile> f(Server->openFile(fn, MODE_WRITE));
+		if (f.get() == NULL)
+		{
+			Server->Log("Cannot open " + fn + ". " + os_last_error_str(), LL_ERROR);
+			return 0;
+		}
+
+		BenchListWriter writer(f.get(), binary);
+		SFile cf;
+		size_t n_dirs = 0;
+		size_t depth = 0;
+		for (size_t i = 0; i < n_entries; ++i)
+		{
+			if (i % bench_files_per_dir == 0)
+			{
+				//Top level directories with bench_dirs_per_dir-1 sub directories each
+				size_t target_depth = (i / bench_files_per_dir) % bench_dirs_per_dir == 0 ? 0 : 1;
+				cf.isdir = true;
+				cf.name = "..";
+				for (; depth > target_depth; --depth)
+				{
+					writer.write(cf, std::string());
+				}
+
+				cf.isdir = true;
+				cf.name = "dir" + convert(i / bench_files_per_dir);
+				cf.size = 0;
+				cf.last_modified = 1000 + i;
+				writer.write(cf, "#orig_path=" + EscapeParamString("C:\\data\\" + cf.name) + "&orig_sep=" + EscapeParamString("\\"));
+				++depth;
+				++n_dirs;
+			}
+
+			cf.isdir = false;
+			cf.name = "file \"" + convert(i) + "\".txt";
+			cf.size = (i * 7919) % 100000;
+			cf.last_modified = 1500000000 + i;
+			if (modified && i % 1000 == 0)
+			{
+				++cf.last_modified;
+			}
+			std::string extra;
+			if (i % 3 == 0)
+			{
+				extra = "#sha512=" + base64_encode_dash(std::string(64, static_cast<char>(i)));
+			}
+			writer.write(cf, extra);
+		}
+
+		cf.isdir = true;
+		cf.name = "..";
+		for (; depth > 0; --depth)
+		{
+			writer.write(cf, std::string());
+		}
+
+		writer.finish();
+		return n_dirs;
+	}
+
+	bool parse_list(const std::string& fn, size_t& n_entries, unsigned int& checksum)
+	{
+		std::auto_ptr<IFile> f(Server->openFile(fn, MODE_READ_SEQUENTIAL));
+		if (f.get() == NULL)
+		{
+			return false;
+		}
+
+		FileListParser parser;
+		SFile cf;
+		str_map extra;
+		char buffer[32768];
+		_u32 read;
+		n_entries = 0;
+		checksum = 2166136261U;
+		while ((read = f->Read(buffer, sizeof(buffer))) > 0)
+		{
+			for (_u32 i = 0; i < read; ++i)
+			{
+				if (parser.nextEntry(buffer[i], cf, &extra))
+				{
+					std::string data = cf.name + "|" + convert(cf.size) + "|" + convert(cf.last_modified);
+					for (str_map::iterator it = extra.begin(); it != extra.end(); ++it)
+					{
+						data += "|" + it->first + "=" + it->second;
+					}
+					for (size_t j = 0; j < data.size(); ++j)
+					{
+						checksum = (checksum ^ static_cast<unsigned char>(data[j])) * 16777619U;
+					}
+					++n_entries;
+				}
+			}
+		}
+		return true;
+	}
+
+	int64 file_size(const std::string& fn)
+	{
+		std::auto_ptr<IFile> f(Server->openFile(fn, MODE_READ));
+		if (f.get() == NULL)
+		{
+			return -1;
+		}
+		return f->Size();
+	}
+
+	bool diff_lists(const std::string& t1, const std::string& t2, std::vector<size_t>& diffs, int64& diff_ms)
+	{
+		bool error = false;
+		std::vector<size_t> deleted_ids;
+		std::vector<size_t> dir_diffs;
+		int64 starttime = Server->getTimeMS();
+		diffs = TreeDiff::diffTrees(t1, t2, error, &deleted_ids, NULL, NULL, dir_diffs, NULL, false, false);
+		diff_ms = Server->getTimeMS() - starttime;
+		return !error;
+	}
+}
+
+int filelist_bench()
+{
+	size_t n_entries = 1000000;
+	if (!Server->getServerParameter("bench_entries").empty())
+	{
+		n_entries = watoi(Server->getServerParameter("bench_entries"));
+	}
+
+	if (FileExists(bench_text_fn) || FileExists(bench_bin_fn))
+	{
+		Server->Log("Benchmark files exist in working directory. Please run the benchmark in an empty directory.", LL_ERROR);
+		return 1;
+	}
+
+	Server->Log("File list benchmark. Files: " + convert(n_entries), LL_INFO);
+
+	int rc = 0;
+
+	int64 starttime = Server->getTimeMS();
+	size_t n_dirs = write_list(bench_text_fn, false, n_entries, false);
+	int64 text_write_ms = Server->getTimeMS() - starttime;
+	starttime = Server->getTimeMS();
+	write_list(bench_bin_fn, true, n_entries, false);
+	int64 bin_write_ms = Server->getTimeMS() - starttime;
+	write_list(bench_text_mod_fn, false, n_entries, true);
+	write_list(bench_bin_mod_fn, true, n_entries, true);
+
+	size_t text_entries, bin_entries;
+	unsigned int text_checksum, bin_checksum;
+	starttime = Server->getTimeMS();
+	bool text_ok = parse_list(bench_text_fn, text_entries, text_checksum);
+	int64 text_parse_ms = Server->getTimeMS() - starttime;
+	starttime = Server->getTimeMS();
+	bool bin_ok = parse_list(bench_bin_fn, bin_entries, bin_checksum);
+	int64 bin_parse_ms = Server->getTimeMS() - starttime;
+
+	if (!text_ok || !bin_ok
+		|| text_entries != bin_entries
+		|| text_checksum != bin_checksum)
+	{
+		Server->Log("Binary file list parsed to different entries (" + convert(bin_entries) + " binary, " + convert(text_entries) + " text)", LL_ERROR);
+		rc = 1;
+	}
+
+	std::vector<int64> dir_offsets;
+	{
+		std::auto_ptr<IFile> f(Server->openFile(bench_bin_fn, MODE_READ));
+		if (f.get() == NULL
+			|| !readBinaryFileListIndex(f.get(), dir_offsets)
+			|| dir_offsets.size() != n_dirs)
+		{
+			Server->Log("Reading directory index of binary file list failed", LL_ERROR);
+			rc = 1;
+		}
+	}
+
+	std::vector<size_t> text_diffs, bin_diffs;
+	int64 text_diff_ms, bin_diff_ms;
+	if (!diff_lists(bench_text_fn, bench_text_mod_fn, text_diffs, text_diff_ms)
+		|| !diff_lists(bench_bin_fn, bench_bin_mod_fn, bin_diffs, bin_diff_ms)
+		|| text_diffs != bin_diffs)
+	{
+		Server->Log("Tree diff of binary file lists differs (" + convert(bin_diffs.size()) + " binary, " + convert(text_diffs.size()) + " text)", LL_ERROR);
+		rc = 1;
+	}
+
+	Server->Log("Text: " + PrettyPrintBytes(file_size(bench_text_fn)) + " write " + convert(text_write_ms) + "ms parse " + convert(text_parse_ms) + "ms diff " + convert(text_diff_ms) + "ms", LL_INFO);
+	Server->Log("Binary: " + PrettyPrintBytes(file_size(bench_bin_fn)) + " write " + convert(bin_write_ms) + "ms parse " + convert(bin_parse_ms) + "ms diff " + convert(bin_diff_ms) + "ms", LL_INFO);
+	Server->Log("Entries: " + convert(bin_entries) + " Directories: " + convert(dir_offsets.size()) + " Changes: " + convert(bin_diffs.size()), LL_INFO);
+
+	Server->deleteFile(bench_text_fn);
+	Server->deleteFile(bench_text_mod_fn);
+	Server->deleteFile(bench_bin_fn);
+	Server->deleteFile(bench_bin_mod_fn);
+
+	return rc;
+}
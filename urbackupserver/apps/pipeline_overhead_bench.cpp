@@ -0,0 +1,462 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "../../Interface/Server.h"
+#include "../../Interface/ThreadPool.h"
+#include "../../Interface/Pipe.h"
+#include "../../stringtools.h"
+#include "../../common/data.h"
+#include "../../urbackupcommon/os_functions.h"
+#include "../../urbackupcommon/file_metadata.h"
+#include "../../urbackupcommon/sha2/sha2.h"
+#include "../HashWorkQueue.h"
+#include "../HashStageQueue.h"
+#include "../server_prepare_hash.h"
+#include "../server_log.h"
+#include <memory>
+
+namespace
+{
+	const char* bench_dir = "pipeline_overhead_bench";
+	const size_t bench_queue_capacity = 1000;
+
+	std::string empty_fn()
+	{
+		return std::string(bench_dir) + os_file_sep() + "empty";
+	}
+
+	FileMetadata bench_metadata(size_t i)
+	{
+		FileMetadata metadata;
+		metadata.file_permissions = "bench_permissions";
+		metadata.last_modified = 1500000000 + i;
+		metadata.created = 1400000000;
+		metadata.accessed = 1500000000;
+		metadata.set_orig_path("C:\\Users\\bench\\Documents\\file_" + convert(i) + ".txt");
+		return metadata;
+	}
+
+	std::string bench_tfn(size_t i)
+	{
+		return std::string("backup") + os_file_sep() + "Documents" + os_file_sep() + "file_" + convert(i) + ".txt";
+	}
+
+	//Download thread of the string-serialized pipeline the typed queues replaced
+	class LegacyProducer : public IThread
+	{
+	public:
+		LegacyProducer(IPipe* output, size_t n_files)
+			: output(output), n_files(n_files)
+		{
+		}
+
+		void operator()()
+		{
+			for (size_t i = 0; i < n_files; ++i)
+			{
+				CWData data;
+				data.addVarInt(i);
+				data.addString(empty_fn());
+				data.addInt(1);
+				data.addInt(0);
+				data.addChar(1);
+				data.addString(bench_tfn(i));
+				data.addString(bench_tfn(i) + ".hash");
+				data.addString(std::string());
+				data.addString(std::string());
+				data.addInt64(0);
+				data.addString(std::string());
+				data.addString(std::string());
+				data.addChar(HASH_FUNC_SHA512);
+				data.addChar(1);
+				bench_metadata(i).serialize(data);
+				output->Write(data.getDataPtr(), data.getDataSize());
+			}
+			output->Write("exit");
+			delete this;
+		}
+
+	private:
+		IPipe* output;
+		size_t n_files;
+	};
+
+	//Parses the download message and passes a link message on, like the
+	//hash preparation stage did (without hashing)
+	class LegacyRelay : public IThread
+	{
+	public:
+		LegacyRelay(IPipe* input, IPipe* output)
+			: input(input), output(output)
+		{
+		}
+
+		void operator()()
+		{
+			std::string msg;
+			while (input->Read(&msg) > 0
+				&& msg != "exit")
+			{
+				CRData rd(&msg);
+				int64 fileid;
+				std::string temp_fn;
+				int backupid;
+				int incremental;
+				char with_hashes;
+				std::string tfn;
+				std::string hashpath;
+				std::string hashoutput_fn;
+				std::string old_file_fn;
+				int64 t_filesize;
+				std::string client_sha_dig;
+				std::string sparse_extents_fn;
+				char hash_func;
+				char has_snapshot;
+				FileMetadata metadata;
+				rd.getVarInt(&fileid);
+				rd.getStr(&temp_fn);
+				rd.getInt(&backupid);
+				rd.getInt(&incremental);
+				rd.getChar(&with_hashes);
+				rd.getStr(&tfn);
+				rd.getStr(&hashpath);
+				rd.getStr(&hashoutput_fn);
+				rd.getStr(&old_file_fn);
+				rd.getInt64(&t_filesize);
+				rd.getStr(&client_sha_dig);
+				rd.getStr(&sparse_extents_fn);
+				rd.getChar(&hash_func);
+				rd.getChar(&has_snapshot);
+				metadata.read(rd);
+
+				CWData data;
+				data.addInt(0);
+				data.addVarInt(fileid);
+				data.addString(temp_fn);
+				data.addInt(backupid);
+				data.addInt(incremental);
+				data.addChar(with_hashes);
+				data.addString(tfn);
+				data.addString(hashpath);
+				data.addString(std::string(SHA512_DIGEST_SIZE, 0));
+				data.addString(hashoutput_fn);
+				data.addString(old_file_fn);
+				data.addInt64(t_filesize);
+				data.addString(sparse_extents_fn);
+				metadata.serialize(data);
+				output->Write(data.getDataPtr(), data.getDataSize());
+			}
+			output->Write("exit");
+			delete this;
+		}
+
+	private:
+		IPipe* input;
+		IPipe* output;
+	};
+
+	class TypedProducer : public IThread
+	{
+	public:
+		TypedProducer(HashWorkQueue* output, size_t n_files)
+			: output(output), n_files(n_files)
+		{
+		}
+
+		void operator()()
+		{
+			for (size_t i = 0; i < n_files; ++i)
+			{
+				SHashWorkItem* item = new SHashWorkItem;
+				item->fileid = i;
+				item->temp_fn = empty_fn();
+				item->backupid = 1;
+				item->with_hashes = true;
+				item->tfn = bench_tfn(i);
+				item->hashpath = bench_tfn(i) + ".hash";
+				item->hash_func = HASH_FUNC_SHA512;
+				item->has_snapshot = true;
+				item->metadata = bench_metadata(i);
+				output->push(item);
+			}
+			output->pushControl(SHashWorkItem::EType_Exit);
+			delete this;
+		}
+
+	private:
+		HashWorkQueue* output;
+		size_t n_files;
+	};
+
+	class TypedRelay : public IThread
+	{
+	public:
+		TypedRelay(HashWorkQueue* input, HashWorkQueue* output)
+			: input(input), output(output)
+		{
+		}
+
+		void operator()()
+		{
+			SHashWorkItem* item;
+			while ((item = input->pop())->type != SHashWorkItem::EType_Exit)
+			{
+				item->sha2.assign(SHA512_DIGEST_SIZE, 0);
+				item->type = SHashWorkItem::EType_LinkOrCopy;
+				output->push(item);
+			}
+			output->push(item);
+			delete this;
+		}
+
+	private:
+		HashWorkQueue* input;
+		HashWorkQueue* output;
+	};
+
+	int64 bench_legacy(size_t n_files, size_t& n_errors)
+	{
+		std::auto_ptr<IPipe> prepare_pipe(Server->createMemoryPipe());
+		std::auto_ptr<IPipe> link_pipe(Server->createMemoryPipe());
+
+		int64 starttime = Server->getTimeMS();
+
+		std::vector<THREADPOOL_TICKET> tickets;
+		tickets.push_back(Server->getThreadPool()->execute(new LegacyProducer(prepare_pipe.get(), n_files), "bench download"));
+		tickets.push_back(Server->getThreadPool()->execute(new LegacyRelay(prepare_pipe.get(), link_pipe.get()), "bench hash"));
+
+		n_errors = 0;
+		size_t n_out = 0;
+		std::string msg;
+		while (link_pipe->Read(&msg) > 0
+			&& msg != "exit")
+		{
+			CRData rd(&msg);
+			int action;
+			int64 fileid;
+			std::string temp_fn;
+			int backupid;
+			int incremental;
+			char with_hashes;
+			std::string tfn;
+			std::string hashpath;
+			std::string sha2;
+			std::string hashoutput_fn;
+			std::string old_file_fn;
+			int64 t_filesize;
+			std::string sparse_extents_fn;
+			FileMetadata metadata;
+			if (!rd.getInt(&action) || !rd.getVarInt(&fileid)
+				|| !rd.getStr(&temp_fn) || !rd.getInt(&backupid)
+				|| !rd.getInt(&incremental) || !rd.getChar(&with_hashes)
+				|| !rd.getStr(&tfn) || !rd.getStr(&hashpath)
+				|| !rd.getStr(&sha2) || !rd.getStr(&hashoutput_fn)
+				|| !rd.getStr(&old_file_fn) || !rd.getInt64(&t_filesize)
+				|| !rd.getStr(&sparse_extents_fn) || !metadata.read(rd)
+				|| fileid != static_cast<int64>(n_out))
+			{
+				++n_errors;
+			}
+			++n_out;
+		}
+
+		int64 passed = (std::max)(Server->getTimeMS() - starttime, static_cast<int64>(1));
+
+		Server->getThreadPool()->waitFor(tickets);
+
+		if (n_out != n_files)
+		{
+			++n_errors;
+		}
+
+		return passed;
+	}
+
+	int64 bench_typed(size_t n_files, size_t& n_errors)
+	{
+		std::auto_ptr<HashWorkQueue> prepare_queue(new HashWorkQueue(bench_queue_capacity));
+		std::auto_ptr<HashWorkQueue> link_queue(new HashWorkQueue(bench_queue_capacity));
+
+		int64 starttime = Server->getTimeMS();
+
+		std::vector<THREADPOOL_TICKET> tickets;
+		tickets.push_back(Server->getThreadPool()->execute(new TypedProducer(prepare_queue.get(), n_files), "bench download"));
+		tickets.push_back(Server->getThreadPool()->execute(new TypedRelay(prepare_queue.get(), link_queue.get()), "bench hash"));
+
+		n_errors = 0;
+		size_t n_out = 0;
+		while (true)
+		{
+			std::auto_ptr<SHashWorkItem> item(link_queue->pop());
+			if (item->type == SHashWorkItem::EType_Exit)
+			{
+				break;
+			}
+
+			if (item->fileid != static_cast<int64>(n_out))
+			{
+				++n_errors;
+			}
+			++n_out;
+		}
+
+		int64 passed = (std::max)(Server->getTimeMS() - starttime, static_cast<int64>(1));
+
+		Server->getThreadPool()->waitFor(tickets);
+
+		if (n_out != n_files)
+		{
+			++n_errors;
+		}
+
+		return passed;
+	}
+
+	//Download handing over file names, hash preparation workers and the
+	//link stage opening the files, without the database work
+	int64 bench_prepare_stage(size_t n_files, size_t n_workers, size_t& n_errors, size_t& max_depth)
+	{
+		HashWorkQueue* prepare_queue = new HashWorkQueue(bench_queue_capacity);
+		std::auto_ptr<HashWorkQueue> link_queue(new HashWorkQueue(bench_queue_capacity));
+		std::auto_ptr<HashStageQueue> stage_queue(new HashStageQueue(prepare_queue, link_queue.get(), n_workers));
+
+		std::string empty_hash;
+		empty_hash.resize(SHA512_DIGEST_SIZE);
+		sha512(reinterpret_cast<const unsigned char*>(""), 0, reinterpret_cast<unsigned char*>(&empty_hash[0]));
+
+		int64 starttime = Server->getTimeMS();
+
+		std::vector<THREADPOOL_TICKET> tickets;
+		tickets.push_back(Server->getThreadPool()->execute(new TypedProducer(prepare_queue, n_files), "bench download"));
+		logid_t logid = ServerLogger::getLogId(0);
+		for (size_t i = 0; i < n_workers; ++i)
+		{
+			tickets.push_back(Server->getThreadPool()->execute(new BackupServerPrepareHash(stage_queue.get(), 0, logid, false), "bench prepare hash"));
+		}
+
+		n_errors = 0;
+		max_depth = 0;
+		size_t n_out = 0;
+		while (true)
+		{
+			std::auto_ptr<SHashWorkItem> item(link_queue->pop());
+			if (item->type == SHashWorkItem::EType_Exit)
+			{
+				break;
+			}
+
+			IFile* tf = item->releaseTempFile(MODE_READ_SEQUENTIAL);
+			if (tf == NULL
+				|| item->fileid != static_cast<int64>(n_out)
+				|| item->sha2 != empty_hash)
+			{
+				++n_errors;
+			}
+			Server->destroy(tf);
+			++n_out;
+
+			if (n_out % 1000 == 0)
+			{
+				max_depth = (std::max)(max_depth, prepare_queue->getNumElements());
+			}
+		}
+
+		int64 passed = (std::max)(Server->getTimeMS() - starttime, static_cast<int64>(1));
+
+		Server->getThreadPool()->waitFor(tickets);
+
+		if (n_out != n_files)
+		{
+			++n_errors;
+		}
+
+		return passed;
+	}
+
+	void log_result(const std::string& name, size_t n_files, int64 passed, size_t n_errors)
+	{
+		Server->Log(name + ": " + convert(passed) + "ms, "
+			+ convert(static_cast<double>(passed) * 1000 / (std::max)(n_files, static_cast<size_t>(1))) + "us per file, "
+			+ convert(static_cast<int64>(n_files) * 1000 / passed) + " files/s", LL_INFO);
+
+		if (n_errors > 0)
+		{
+			Server->Log(name + ": " + convert(n_errors) + " files were output out of order or with wrong content", LL_ERROR);
+		}
+	}
+}
+
+int pipeline_overhead_bench()
+{
+	size_t n_files = 1000000;
+	if (!Server->getServerParameter("bench_files").empty())
+	{
+		n_files = watoi(Server->getServerParameter("bench_files"));
+	}
+
+	size_t n_workers = 1;
+	if (!Server->getServerParameter("bench_workers").empty())
+	{
+		n_workers = (std::max)(1, watoi(Server->getServerParameter("bench_workers")));
+	}
+
+	if (os_directory_exists(bench_dir))
+	{
+		Server->Log("Directory \"" + std::string(bench_dir) + "\" exists. Please run the benchmark in an empty directory.", LL_ERROR);
+		return 1;
+	}
+
+	if (!os_create_dir(bench_dir))
+	{
+		Server->Log("Error creating directory \"" + std::string(bench_dir) + "\". " + os_last_error_str(), LL_ERROR);
+		return 1;
+	}
+
+	{
+		std::auto_ptr<IFile> f(Server->openFile(empty_fn(), MODE_WRITE));
+		if (f.get() == NULL)
+		{
+			Server->Log("Error creating file \"" + empty_fn() + "\". " + os_last_error_str(), LL_ERROR);
+			os_remove_nonempty_dir(bench_dir);
+			return 1;
+		}
+	}
+
+	Server->Log("Hash pipeline overhead benchmark. Empty files: " + convert(n_files) + " Workers: " + convert(n_workers), LL_INFO);
+
+	int rc = 0;
+	size_t n_errors;
+
+	int64 passed = bench_legacy(n_files, n_errors);
+	log_result("Serialized messages (memory pipes)", n_files, passed, n_errors);
+	if (n_errors > 0) rc = 1;
+
+	passed = bench_typed(n_files, n_errors);
+	log_result("Typed work items (bounded queues)", n_files, passed, n_errors);
+	if (n_errors > 0) rc = 1;
+
+	size_t max_depth;
+	passed = bench_prepare_stage(n_files, n_workers, n_errors, max_depth);
+	log_result("Typed work items with hash preparation", n_files, passed, n_errors);
+	Server->Log("Maximum hash queue depth: " + convert(max_depth) + " (capacity " + convert(bench_queue_capacity) + ")", LL_INFO);
+	if (n_errors > 0) rc = 1;
+
+	os_remove_nonempty_dir(bench_dir);
+
+	return rc;
+}
@@ -0,0 +1,225 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "../../Interface/Server.h"
+#include "../../Interface/ThreadPool.h"
+#include "../../stringtools.h"
+#include "../../urbackupcommon/os_functions.h"
+#include "../../urbackupcommon/file_metadata.h"
+#include "../../urbackupcommon/sha2/sha2_impl.h"
+#include "../server_prepare_hash.h"
+#include "../server_log.h"
+#include <memory>
+
+namespace
+{
+	const char* bench_dir = "prepare_hash_bench";
+
+	class BenchRand
+	{
+	public:
+		BenchRand(unsigned int seed)
+			: state(seed | 1)
+		{
+		}
+
+		unsigned int next()
+		{
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			return state;
+		}
+
+	private:
+		unsigned int state;
+	};
+
+	std::string bench_fn(size_t i)
+	{
+		return std::string(bench_dir) + os_file_sep() + convert(i);
+	}
+
+	bool create_corpus(size_t n_files, size_t max_size, std::vector<std::string>& hashes, std::vector<int64>& sizes, int64& total_size)
+	{
+		BenchRand rand(42);
+		std::string buf;
+		total_size = 0;
+		for (size_t i = 0; i < n_files; ++i)
+		{
+			buf.resize(rand.next() % (max_size + 1));
+			for (size_t j = 0; j < buf.size(); ++j)
+			{
+				buf[j] = static_cast<char>(rand.next());
+			}
+
+			std::auto_ptr<IFile> f(Server->openFile(bench_fn(i), MODE_WRITE));
+			if (f.get() == NULL
+				|| f->Write(buf) != buf.size())
+			{
+				Server->Log("Error writing file \"" + bench_fn(i) + "\". " + os_last_error_str(), LL_ERROR);
+				return false;
+			}
+
+			std::string h;
+			h.resize(SHA512_DIGEST_SIZE);
+			sha512(reinterpret_cast<const unsigned char*>(buf.data()), static_cast<unsigned int>(buf.size()),
+				reinterpret_cast<unsigned char*>(&h[0]));
+			hashes.push_back(h);
+			sizes.push_back(buf.size());
+			total_size += buf.size();
+		}
+		return true;
+	}
+
+	//Queues all files at once (like a backlog from the download thread), then
+	//runs the hash preparation thread and checks output order and hashes
+	int64 bench_prepare_hash(size_t n_files, size_t n_workers, const std::vector<std::string>& hashes, const std::vector<int64>& sizes, size_t& n_errors)
+	{
+		HashWorkQueue* input = new HashWorkQueue(n_files + 1);
+		std::auto_ptr<HashWorkQueue> output(new HashWorkQueue(n_files + 1));
+		std::auto_ptr<HashStageQueue> queue(new HashStageQueue(input, output.get(), n_workers));
+
+		for (size_t i = 0; i < n_files; ++i)
+		{
+			SHashWorkItem* item = new SHashWorkItem;
+			item->fileid = i;
+			item->temp_fn = bench_fn(i);
+			item->tfn = bench_fn(i);
+			item->t_filesize = sizes[i];
+			item->hash_func = HASH_FUNC_SHA512;
+			item->has_snapshot = true;
+			input->push(item);
+		}
+		input->pushControl(SHashWorkItem::EType_Exit);
+
+		int64 starttime = Server->getTimeMS();
+
+		std::vector<THREADPOOL_TICKET> tickets;
+		logid_t logid = ServerLogger::getLogId(0);
+		for (size_t i = 0; i < n_workers; ++i)
+		{
+			tickets.push_back(Server->getThreadPool()->execute(new BackupServerPrepareHash(queue.get(), 0, logid, false), "bench prepare hash"));
+		}
+
+		n_errors = 0;
+		size_t n_out = 0;
+		while (true)
+		{
+			std::auto_ptr<SHashWorkItem> item(output->pop());
+			if (item->type == SHashWorkItem::EType_Exit)
+			{
+				break;
+			}
+
+			if (item->type != SHashWorkItem::EType_LinkOrCopy
+				|| item->fileid != static_cast<int64>(n_out)
+				|| item->sha2 != hashes[n_out])
+			{
+				++n_errors;
+			}
+			++n_out;
+		}
+
+		int64 passed = (std::max)(Server->getTimeMS() - starttime, static_cast<int64>(1));
+
+		Server->getThreadPool()->waitFor(tickets);
+
+		if (n_out != n_files)
+		{
+			n_errors += n_files > n_out ? n_files - n_out : n_out - n_files;
+		}
+
+		return passed;
+	}
+}
+
+int prepare_hash_bench()
+{
+	size_t n_files = 20000;
+	if (!Server->getServerParameter("bench_files").empty())
+	{
+		n_files = watoi(Server->getServerParameter("bench_files"));
+	}
+
+	size_t max_size = 64 * 1024;
+	if (!Server->getServerParameter("bench_max_size").empty())
+	{
+		max_size = watoi(Server->getServerParameter("bench_max_size"));
+	}
+
+	size_t n_workers = 1;
+	if (!Server->getServerParameter("bench_workers").empty())
+	{
+		n_workers = (std::max)(1, watoi(Server->getServerParameter("bench_workers")));
+	}
+
+	if (os_directory_exists(bench_dir))
+	{
+		Server->Log("Directory \"" + std::string(bench_dir) + "\" exists. Please run the benchmark in an empty directory.", LL_ERROR);
+		return 1;
+	}
+
+	if (!os_create_dir(bench_dir))
+	{
+		Server->Log("Error creating directory \"" + std::string(bench_dir) + "\". " + os_last_error_str(), LL_ERROR);
+		return 1;
+	}
+
+	std::vector<std::string> hashes;
+	std::vector<int64> sizes;
+	int64 total_size;
+	if (!create_corpus(n_files, max_size, hashes, sizes, total_size))
+	{
+		os_remove_nonempty_dir(bench_dir);
+		return 1;
+	}
+
+	Server->Log("Hash preparation benchmark. Files: " + convert(n_files) + " Size: " + PrettyPrintBytes(total_size) + " Workers: " + convert(n_workers), LL_INFO);
+
+	int rc = 0;
+	std::string mb_default = sha512_mb_get_impl();
+	std::vector<std::string> impls = sha512_mb_get_impls();
+	for (size_t i = 0; i < impls.size(); ++i)
+	{
+		if (!sha512_mb_set_impl(impls[i]))
+		{
+			Server->Log("SHA-512 multi-buffer " + impls[i] + ": failed self test", LL_ERROR);
+			continue;
+		}
+
+		size_t n_errors;
+		int64 passed = bench_prepare_hash(n_files, n_workers, hashes, sizes, n_errors);
+
+		Server->Log("SHA-512 multi-buffer " + impls[i] + " (" + convert(sha512_mb_lanes()) + " lanes): "
+			+ convert(passed) + "ms, " + convert(static_cast<int64>(n_files) * 1000 / passed) + " files/s, "
+			+ convert(static_cast<double>(total_size) / passed / 1000) + " MB/s"
+			+ (impls[i] == mb_default ? " (default)" : ""), LL_INFO);
+
+		if (n_errors > 0)
+		{
+			Server->Log(convert(n_errors) + " files were output out of order or with wrong hash", LL_ERROR);
+			rc = 1;
+		}
+	}
+	sha512_mb_set_impl(mb_default);
+
+	os_remove_nonempty_dir(bench_dir);
+
+	return rc;
+}
@@ -0,0 +1,191 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "../../Interface/Server.h"
+#include "../../stringtools.h"
+#include "../../urbackupcommon/sha2/sha2.h"
+#include "../../urbackupcommon/sha2/sha2_impl.h"
+#include <vector>
+
+#if defined(DO_NOT_USE_CRYPTOPP_SHA) && !defined(DO_NOT_USE_CRYPTOPP_MD5)
+//Crypto++ is linked, but not used for SHA-2. Compare with it
+#define SHA_BENCH_CRYPTOPP
+#ifdef _WIN32
+#include <sha.h>
+#else
+#include "../../config.h"
+#define CRYPTOPP_INCLUDE_SHA <CRYPTOPP_INCLUDE_PREFIX/sha.h>
+#include CRYPTOPP_INCLUDE_SHA
+#endif
+#endif
+
+namespace
+{
+	//Same update size as the file hashing
+	const size_t bench_update_size = 512 * 1024;
+
+	template<typename ctx_t, size_t digest_size>
+	double bench_hash(void(*init)(ctx_t*), void(*update)(ctx_t*, const unsigned char*, unsigned int),
+		void(*final)(ctx_t*, unsigned char*), const std::vector<unsigned char>& data, size_t rounds)
+	{
+		unsigned char digest[digest_size];
+		int64 starttime = Server->getTimeMS();
+		for (size_t r = 0; r < rounds; ++r)
+		{
+			ctx_t ctx;
+			init(&ctx);
+			for (size_t i = 0; i < data.size(); i += bench_update_size)
+			{
+				update(&ctx, &data[i], static_cast<unsigned int>((std::min)(bench_update_size, data.size() - i)));
+			}
+			final(&ctx, digest);
+		}
+		int64 passed = (std::max)(Server->getTimeMS() - starttime, static_cast<int64>(1));
+
+		return static_cast<double>(data.size())*rounds / passed / (1000 * 1000);
+	}
+
+#ifdef SHA_BENCH_CRYPTOPP
+	template<typename hash_t>
+	struct SCryptoppCtx
+	{
+		hash_t sha;
+	};
+
+	template<typename hash_t>
+	void cryptopp_init(SCryptoppCtx<hash_t>* ctx)
+	{
+		ctx->sha.Restart();
+	}
+
+	template<typename hash_t>
+	void cryptopp_update(SCryptoppCtx<hash_t>* ctx, const unsigned char* message, unsigned int len)
+	{
+		ctx->sha.Update(message, len);
+	}
+
+	template<typename hash_t>
+	void cryptopp_final(SCryptoppCtx<hash_t>* ctx, unsigned char* digest)
+	{
+		ctx->sha.Final(digest);
+	}
+#endif
+
+	void log_comparison(const std::string& name, double default_gbs, double cryptopp_gbs)
+	{
+		if (default_gbs <= 0 || cryptopp_gbs <= 0)
+		{
+			return;
+		}
+
+		if (cryptopp_gbs >= default_gbs)
+		{
+			Server->Log(name + ": Crypto++ is as fast or faster than the default. Build without --enable-portable-sha2", LL_INFO);
+		}
+		else
+		{
+			Server->Log(name + ": Default is " + convert(default_gbs / cryptopp_gbs) + " times as fast as Crypto++", LL_INFO);
+		}
+	}
+}
+
+int sha_bench()
+{
+	size_t bench_mb = 256;
+	if (!Server->getServerParameter("bench_size").empty())
+	{
+		bench_mb = watoi(Server->getServerParameter("bench_size"));
+	}
+
+	size_t rounds = 4;
+	if (!Server->getServerParameter("bench_rounds").empty())
+	{
+		rounds = watoi(Server->getServerParameter("bench_rounds"));
+	}
+
+	std::vector<unsigned char> data(bench_mb * 1024 * 1024);
+	for (size_t i = 0; i < data.size(); ++i)
+	{
+		data[i] = static_cast<unsigned char>(i * 131 + (i >> 12));
+	}
+
+	Server->Log("SHA-2 benchmark. Data: " + PrettyPrintBytes(data.size()) + " Rounds: " + convert(rounds), LL_INFO);
+#ifndef DO_NOT_USE_CRYPTOPP_SHA
+	Server->Log("Hashing with Crypto++. Configure with --enable-portable-sha2 to compare with the SHA-NI/ARMv8 code", LL_INFO);
+#endif
+
+	double default_gbs = 0;
+	double cryptopp_gbs = 0;
+
+	std::string sha256_default = sha256_get_impl();
+	std::vector<std::string> impls = sha256_get_impls();
+	for (size_t i = 0; i < impls.size(); ++i)
+	{
+		if (!sha256_set_impl(impls[i]))
+		{
+			Server->Log("SHA-256 " + impls[i] + ": failed self test", LL_ERROR);
+			continue;
+		}
+
+		double gbs = bench_hash<sha256_ctx, SHA256_DIGEST_SIZE>(sha256_init, sha256_update, sha256_final, data, rounds);
+		Server->Log("SHA-256 " + impls[i] + ": " + convert(gbs) + " GB/s" + (impls[i] == sha256_default ? " (default)" : ""), LL_INFO);
+		if (impls[i] == sha256_default)
+		{
+			default_gbs = gbs;
+		}
+	}
+	sha256_set_impl(sha256_default);
+
+#ifdef SHA_BENCH_CRYPTOPP
+	cryptopp_gbs = bench_hash<SCryptoppCtx<CryptoPP::SHA256>, SHA256_DIGEST_SIZE>(cryptopp_init<CryptoPP::SHA256>,
+		cryptopp_update<CryptoPP::SHA256>, cryptopp_final<CryptoPP::SHA256>, data, rounds);
+	Server->Log("SHA-256 Crypto++: " + convert(cryptopp_gbs) + " GB/s", LL_INFO);
+#endif
+	log_comparison("SHA-256", default_gbs, cryptopp_gbs);
+
+	default_gbs = 0;
+	cryptopp_gbs = 0;
+
+	std::string sha512_default = sha512_get_impl();
+	impls = sha512_get_impls();
+	for (size_t i = 0; i < impls.size(); ++i)
+	{
+		if (!sha512_set_impl(impls[i]))
+		{
+			Server->Log("SHA-512 " + impls[i] + ": failed self test", LL_ERROR);
+			continue;
+		}
+
+		double gbs = bench_hash<sha512_ctx, SHA512_DIGEST_SIZE>(sha512_init, sha512_update, sha512_final, data, rounds);
+		Server->Log("SHA-512 " + impls[i] + ": " + convert(gbs) + " GB/s" + (impls[i] == sha512_default ? " (default)" : ""), LL_INFO);
+		if (impls[i] == sha512_default)
+		{
+			default_gbs = gbs;
+		}
+	}
+	sha512_set_impl(sha512_default);
+
+#ifdef SHA_BENCH_CRYPTOPP
+	cryptopp_gbs = bench_hash<SCryptoppCtx<CryptoPP::SHA512>, SHA512_DIGEST_SIZE>(cryptopp_init<CryptoPP::SHA512>,
+		cryptopp_update<CryptoPP::SHA512>, cryptopp_final<CryptoPP::SHA512>, data, rounds);
+	Server->Log("SHA-512 Crypto++: " + convert(cryptopp_gbs) + " GB/s", LL_INFO);
+#endif
+	log_comparison("SHA-512", default_gbs, cryptopp_gbs);
+
+	return 0;
+}
@@ -0,0 +1,247 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "../../Interface/Server.h"
+#include "../../Interface/File.h"
+#include "../../stringtools.h"
+#include "../../urbackupcommon/os_functions.h"
+#include "../../urbackupcommon/filelist_utils.h"
+#include "../treediff/TreeDiff.h"
+#include "../treediff/TreeReader.h"
+#include "../treediff/StreamingTreeDiff.h"
+#include <memory>
+#include <fstream>
+
+namespace
+{
+	const char* bench_list_fn = "treediff_bench_1.ub";
+	const char* bench_list_mod_fn = "treediff_bench_2.ub";
+
+	const size_t bench_files_per_dir = 50;
+	const size_t bench_dirs_per_dir = 20;
+
+	bool write_list(const std::string& fn, bool binary, bool dir_digests, size_t n_entries, bool modified)
+	{
+		std::auto_ptr<IFile> f(Server->openFile(fn, MODE_WRITE));
+		if (f.get() == NULL)
+		{
+			Server->Log("Cannot open " + fn + ". " + os_last_error_str(), LL_ERROR);
+			return false;
+		}
+
+		FileListWriter writer(f.get(), binary, dir_digests);
+		SFile cf;
+		size_t depth = 0;
+		for (size_t i = 0; i < n_entries; ++i)
+		{
+			if (i % bench_files_per_dir == 0)
+			{
+				//Top level directories with bench_dirs_per_dir-1 sub directories each
+				size_t target_depth = (i / bench_files_per_dir) % bench_dirs_per_dir == 0 ? 0 : 1;
+				cf.isdir = true;
+				cf.name = "..";
+				for (; depth > target_depth; --depth)
+				{
+					writer.write(cf);
+				}
+
+				cf.name = "dir" + convert(i / bench_files_per_dir);
+				cf.size = 0;
+				cf.last_modified = 1000 + i;
+				writer.write(cf);
+				++depth;
+			}
+
+			if (modified && i % 5000 == 1)
+			{
+				continue;
+			}
+
+			cf.isdir = false;
+			cf.name = "file" + convert(i) + ".txt";
+			cf.size = (i * 7919) % 100000;
+			cf.last_modified = 1500000000 + i;
+			if (modified && i % 1000 == 0)
+			{
+				++cf.last_modified;
+			}
+			writer.write(cf);
+		}
+
+		cf.isdir = true;
+		cf.name = "..";
+		for (; depth > 0; --depth)
+		{
+			writer.write(cf);
+		}
+
+		writer.finish();
+		return true;
+	}
+
+	//Resets the peak resident set size (Linux only)
+	void reset_peak_rss()
+	{
+		std::ofstream clear_refs("/proc/self/clear_refs");
+		if (clear_refs.is_open())
+		{
+			clear_refs << "5";
+		}
+	}
+
+	std::string peak_rss()
+	{
+		std::ifstream status("/proc/self/status");
+		std::string line;
+		while (std::getline(status, line))
+		{
+			if (next(line, 0, "VmHWM:"))
+			{
+				return trim(line.substr(6));
+			}
+		}
+		return "n/a";
+	}
+
+	unsigned int ids_checksum(const std::vector<size_t>& ids)
+	{
+		unsigned int ret = 2166136261U;
+		for (size_t i = 0; i < ids.size(); ++i)
+		{
+			ret = (ret ^ static_cast<unsigned int>(ids[i])) * 16777619U;
+		}
+		return ret;
+	}
+}
+
+int treediff_bench()
+{
+	size_t n_entries = 1000000;
+	if (!Server->getServerParameter("bench_entries").empty())
+	{
+		n_entries = watoi(Server->getServerParameter("bench_entries"));
+	}
+
+	bool binary = Server->getServerParameter("bench_text") != "1";
+	bool dir_digests = Server->getServerParameter("bench_no_digests") != "1";
+
+	if (FileExists(bench_list_fn) || FileExists(bench_list_mod_fn))
+	{
+		Server->Log("Benchmark files exist in working directory. Please run the benchmark in an empty directory.", LL_ERROR);
+		return 1;
+	}
+
+	Server->Log(std::string("Tree diff benchmark. Files: ") + convert(n_entries) + (binary ? (dir_digests ? " (binary list with directory digests)" : " (binary list)") : " (text list)"), LL_INFO);
+
+	if (!write_list(bench_list_fn, binary, dir_digests, n_entries, false)
+		|| !write_list(bench_list_mod_fn, binary, dir_digests, n_entries, true))
+	{
+		return 1;
+	}
+
+	int rc = 0;
+
+	reset_peak_rss();
+	int64 starttime = Server->getTimeMS();
+	{
+		TreeReader reader;
+		if (!reader.readTree(bench_list_fn))
+		{
+			rc = 1;
+		}
+		else
+		{
+			Server->Log("Read tree with " + convert(reader.getNumNodes()) + " nodes in " + convert(Server->getTimeMS() - starttime) + "ms. Tree memory: "
+				+ PrettyPrintBytes(reader.getMemoryUsage()) + " (" + convert(reader.getMemoryUsage() / reader.getNumNodes()) + " bytes per node)", LL_INFO);
+		}
+	}
+
+	reset_peak_rss();
+	starttime = Server->getTimeMS();
+	bool error = false;
+	std::vector<size_t> deleted_ids;
+	std::vector<size_t> large_unchanged_subtrees;
+	std::vector<size_t> modified_inplace_ids;
+	std::vector<size_t> dir_diffs;
+	std::vector<size_t> deleted_inplace_ids;
+	std::vector<size_t> diffs = TreeDiff::diffTrees(bench_list_fn, bench_list_mod_fn, error,
+		&deleted_ids, &large_unchanged_subtrees, &modified_inplace_ids, dir_diffs, &deleted_inplace_ids, true, false);
+	int64 diff_ms = Server->getTimeMS() - starttime;
+
+	if (error)
+	{
+		Server->Log("Tree diff failed", LL_ERROR);
+		rc = 1;
+	}
+
+	Server->Log("Diff time: " + convert(diff_ms) + "ms. Peak RSS: " + peak_rss(), LL_INFO);
+	Server->Log("Changes: " + convert(diffs.size()) + " (checksum " + convert(ids_checksum(diffs)) + ") deleted: " + convert(deleted_ids.size())
+		+ " (checksum " + convert(ids_checksum(deleted_ids)) + ") modified in place: " + convert(modified_inplace_ids.size())
+		+ " large unchanged subtrees: " + convert(large_unchanged_subtrees.size()) + " (checksum " + convert(ids_checksum(large_unchanged_subtrees)) + ")"
+		+ " changed directories: " + convert(dir_diffs.size()), LL_INFO);
+
+	reset_peak_rss();
+	starttime = Server->getTimeMS();
+	std::vector<size_t> streaming_diffs;
+	std::vector<size_t> streaming_dir_diffs;
+	std::vector<size_t> streaming_modified_inplace_ids;
+	{
+		StreamingTreeDiff streaming_diff(streaming_diffs, streaming_dir_diffs, &streaming_modified_inplace_ids);
+		std::auto_ptr<IFile> f(Server->openFile(bench_list_mod_fn, MODE_READ));
+		if (f.get() == NULL
+			|| !streaming_diff.readTree(bench_list_fn))
+		{
+			Server->Log("Streaming tree diff failed", LL_ERROR);
+			rc = 1;
+		}
+		else
+		{
+			FileListParser list_parser;
+			SFile cf;
+			char buffer[4096];
+			_u32 read;
+			while ((read = f->Read(buffer, sizeof(buffer))) > 0)
+			{
+				for (_u32 i = 0; i < read; ++i)
+				{
+					if (list_parser.nextEntry(buffer[i], cf, NULL))
+					{
+						streaming_diff.nextEntry(cf);
+					}
+				}
+			}
+		}
+	}
+
+	bool streaming_equal = streaming_diffs == diffs
+		&& streaming_dir_diffs == dir_diffs
+		&& streaming_modified_inplace_ids == modified_inplace_ids;
+
+	Server->Log("Streaming diff time: " + convert(Server->getTimeMS() - starttime) + "ms. Peak RSS: " + peak_rss()
+		+ ". Result " + (streaming_equal ? "equals" : "differs from") + " tree diff", streaming_equal ? LL_INFO : LL_ERROR);
+
+	if (!streaming_equal)
+	{
+		rc = 1;
+	}
+
+	Server->deleteFile(bench_list_fn);
+	Server->deleteFile(bench_list_mod_fn);
+
+	return rc;
+}
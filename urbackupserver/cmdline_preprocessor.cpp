@@ -280,6 +280,166 @@ void read_config_file(std::string fn, std::vector<std::string>& real_args)
 				real_args.push_back(strlower(val));
 			}
 		}
+		if (settings->getValue("FILEINDEX_FILTER_FP_RATE", &val))
+		{
+			val = trim(unquote_value(val));
+
+			if (!val.empty())
+			{
+				real_args.push_back("--fileindex_filter_fp_rate");
+				real_args.push_back(val);
+			}
+		}
+		if (settings->getValue("FILEINDEX_REBUILD_THREADS", &val))
+		{
+			val = trim(unquote_value(val));
+
+			if (!val.empty())
+			{
+				real_args.push_back("--fileindex_rebuild_threads");
+				real_args.push_back(val);
+			}
+		}
+		if (settings->getValue("FILEINDEX_BACKEND", &val))
+		{
+			val = trim(unquote_value(val));
+
+			if (!val.empty())
+			{
+				real_args.push_back("--fileindex_backend");
+				real_args.push_back(strlower(val));
+			}
+		}
+		if (settings->getValue("CHUNK_STORE", &val))
+		{
+			val = trim(unquote_value(val));
+
+			if (!val.empty())
+			{
+				real_args.push_back("--chunk_store");
+				real_args.push_back(strlower(val));
+			}
+		}
+		if (settings->getValue("CHUNK_STORE_MIN_SIZE", &val))
+		{
+			val = trim(unquote_value(val));
+
+			if (!val.empty())
+			{
+				real_args.push_back("--chunk_store_min_size");
+				real_args.push_back(val);
+			}
+		}
+		if (settings->getValue("FILE_HASH_WORKERS", &val))
+		{
+			val = trim(unquote_value(val));
+
+			if (!val.empty())
+			{
+				real_args.push_back("--file_hash_workers");
+				real_args.push_back(val);
+			}
+		}
+		if (settings->getValue("FILE_ENTRY_BATCH_SIZE", &val))
+		{
+			val = trim(unquote_value(val));
+
+			if (!val.empty())
+			{
+				real_args.push_back("--file_entry_batch_size");
+				real_args.push_back(val);
+			}
+		}
+		if (settings->getValue("FILE_DELETE_THREADS", &val))
+		{
+			val = trim(unquote_value(val));
+
+			if (!val.empty())
+			{
+				real_args.push_back("--file_delete_threads");
+				real_args.push_back(val);
+			}
+		}
+		if (settings->getValue("FILE_DELETE_BATCH_SIZE", &val))
+		{
+			val = trim(unquote_value(val));
+
+			if (!val.empty())
+			{
+				real_args.push_back("--file_delete_batch_size");
+				real_args.push_back(val);
+			}
+		}
+		if (settings->getValue("FILE_IO_URING", &val))
+		{
+			val = trim(unquote_value(val));
+
+			if (!val.empty())
+			{
+				real_args.push_back("--file_io_uring");
+				real_args.push_back(val);
+			}
+		}
+		if (settings->getValue("PATCH_PREFETCH_SIZE", &val))
+		{
+			val = trim(unquote_value(val));
+
+			if (!val.empty())
+			{
+				real_args.push_back("--patch_prefetch_size");
+				real_args.push_back(val);
+			}
+		}
+		if (settings->getValue("PATCH_HASH_THREADS", &val))
+		{
+			val = trim(unquote_value(val));
+
+			if (!val.empty())
+			{
+				real_args.push_back("--patch_hash_threads");
+				real_args.push_back(val);
+			}
+		}
+		if (settings->getValue("TREEDIFF_THREADS", &val))
+		{
+			val = trim(unquote_value(val));
+
+			if (!val.empty())
+			{
+				real_args.push_back("--treediff_threads");
+				real_args.push_back(val);
+			}
+		}
+		if (settings->getValue("FILE_MANIFESTS", &val))
+		{
+			val = trim(unquote_value(val));
+
+			if (!val.empty())
+			{
+				real_args.push_back("--file_manifests");
+				real_args.push_back(strlower(val));
+			}
+		}
+		if (settings->getValue("STREAMING_FILELIST", &val))
+		{
+			val = trim(unquote_value(val));
+
+			if (!val.empty())
+			{
+				real_args.push_back("--streaming_filelist");
+				real_args.push_back(strlower(val));
+			}
+		}
+		if (settings->getValue("BINARY_FILELISTS", &val))
+		{
+			val = trim(unquote_value(val));
+
+			if (!val.empty())
+			{
+				real_args.push_back("--binary_filelists");
+				real_args.push_back(strlower(val));
+			}
+		}
 		if (settings->getValue("HTTP_PROXY", &val))
 		{
 			val = trim(unquote_value(val));
@@ -23,6 +23,8 @@
 #include "database.h"
 #include "server_settings.h"
 #include "LMDBFileIndex.h"
+#include "CompactFileIndex.h"
+#include "FileIndexRebuild.h"
 #include "../stringtools.h"
 #include "../urbackupcommon/os_functions.h"
 #include "serverinterface/helper.h"
@@ -158,17 +160,41 @@ bool create_files_index_common(FileIndex& fileindex, SStartupStatus& status)
 
 	Server->Log("Starting creating files index...", LL_INFO);
 
-	IQuery *q_read=db->Prepare("SELECT id, shahash, filesize, clientid, next_entry, prev_entry, pointed_to FROM files ORDER BY shahash ASC, filesize ASC, clientid ASC, created DESC");
+	bool read_error;
+	size_t n_threads = FileIndexRebuild::get_num_threads();
+	if(n_threads>0)
+	{
+		FileIndexRebuild rebuild(status, n_files);
+
+		if(!rebuild.sort_runs(n_threads))
+		{
+			Server->Log("Sorting file entries failed", LL_ERROR);
+			return false;
+		}
 
-	SCallbackData data;
-	data.cur=q_read->Cursor();
-	data.pos=0;
-	data.max_pos=n_files;
-	data.status=&status;
+		{
+			DBScopedWriteTransaction write_transaction(db_files_new);
+			fileindex.create_sorted(FileIndexRebuild::get_entries_callback, &rebuild);
+		}
 
+		read_error = rebuild.has_error();
+	}
+	else
 	{
-		DBScopedWriteTransaction write_transaction(db_files_new);
-		fileindex.create(create_callback, &data);
+		IQuery *q_read=db->Prepare("SELECT id, shahash, filesize, clientid, next_entry, prev_entry, pointed_to FROM files ORDER BY shahash ASC, filesize ASC, clientid ASC, created DESC");
+
+		SCallbackData data;
+		data.cur=q_read->Cursor();
+		data.pos=0;
+		data.max_pos=n_files;
+		data.status=&status;
+
+		{
+			DBScopedWriteTransaction write_transaction(db_files_new);
+			fileindex.create(create_callback, &data);
+		}
+
+		read_error = data.cur->has_error();
 	}
 
 	if(fileindex.has_error())
@@ -177,7 +203,7 @@ bool create_files_index_common(FileIndex& fileindex, SStartupStatus& status)
 	}
 	else
 	{
-		if (data.cur->has_error())
+		if (read_error)
 		{
 			return false;
 		}
@@ -238,12 +264,32 @@ bool setup_lmdb_file_index(SStartupStatus& status)
 	return create_files_index_common(fileindex, status);
 }
 
+bool setup_compact_file_index(SStartupStatus& status)
+{
+	CompactFileIndex fileindex(true);
+	if(fileindex.has_error())
+	{
+		Server->Log("Error creating file index", LL_ERROR);
+		return false;
+	}
+
+	return create_files_index_common(fileindex, status);
+}
+
+bool use_compact_file_index()
+{
+	return Server->getServerParameter("fileindex_backend")=="compact";
+}
+
 }
 
 void delete_file_index(void)
 {
 	Server->deleteFile("urbackup/fileindex/backup_server_files_index.lmdb");
 	Server->deleteFile("urbackup/fileindex/backup_server_files_index.lmdb-lock");
+	Server->deleteFile("urbackup/fileindex/backup_server_files_index.filter");
+	Server->deleteFile("urbackup/fileindex/backup_server_files_index.checkpoint");
+	Server->deleteFile("urbackup/fileindex/backup_server_files_index.journal");
 }
 
 bool create_files_index(SStartupStatus& status)
@@ -257,7 +303,13 @@ bool create_files_index(SStartupStatus& status)
 		creating_index = backupdao.getMiscValue("creating_file_entry_index").value == "true";
 	}
 
-	if(!FileExists("urbackup/fileindex/backup_server_files_index.lmdb") || creating_index)
+	bool compact = use_compact_file_index();
+
+	std::string index_fn = compact ? "urbackup/fileindex/backup_server_files_index.journal"
+		: "urbackup/fileindex/backup_server_files_index.lmdb";
+
+	//Deletes the index of the other backend as well, so it is not stale if the backend is switched back
+	if(!FileExists(index_fn) || creating_index)
 	{
 		delete_file_index();
 
@@ -273,7 +325,7 @@ bool create_files_index(SStartupStatus& status)
 		status.upgrading_database=false;
 		status.creating_filesindex=true;
 
-		if(!setup_lmdb_file_index(status))
+		if(compact ? !setup_compact_file_index(status) : !setup_lmdb_file_index(status))
 		{
 			Server->Log("Setting up file index failed", LL_ERROR);
 			return false;
@@ -286,11 +338,27 @@ bool create_files_index(SStartupStatus& status)
 		}
 	}
 	
+	if(compact)
+	{
+		return CompactFileIndex::initFileIndex();
+	}
+
 	return LMDBFileIndex::initFileIndex();
 }
 
+//Returns the index of the configured backend
 FileIndex* create_lmdb_files_index(void)
 {
+	if(use_compact_file_index())
+	{
+		if(!FileExists("urbackup/fileindex/backup_server_files_index.journal"))
+		{
+			return NULL;
+		}
+
+		return new CompactFileIndex();
+	}
+
 	if(!FileExists("urbackup/fileindex/backup_server_files_index.lmdb"))
 	{
 		return NULL;
@@ -548,6 +548,23 @@ void ServerCleanupDao::removeFileBackup(int backupid)
 	q_removeFileBackup->Reset();
 }
 
+/**
+* @-SQLGenAccess
+* @func void ServerCleanupDao::setFileBackupDeletePending
+* @sql
+*	UPDATE backups SET delete_pending=1 WHERE id=:backupid(int)
+*/
+void ServerCleanupDao::setFileBackupDeletePending(int backupid)
+{
+	if(q_setFileBackupDeletePending==NULL)
+	{
+		q_setFileBackupDeletePending=db->Prepare("UPDATE backups SET delete_pending=1 WHERE id=?", false);
+	}
+	q_setFileBackupDeletePending->Bind(backupid);
+	q_setFileBackupDeletePending->Write();
+	q_setFileBackupDeletePending->Reset();
+}
+
 /**
 * @-SQLGenAccess
 * @func void ServerCleanupDao::changeImagePath
@@ -1283,6 +1300,22 @@ ServerCleanupDao::CondInt ServerCleanupDao::hasMoreRecentFileBackup(int backupid
 	return ret;
 }
 
+/**
+* @-SQLGenAccess
+* @func cursor<SFileBackupId> ServerCleanupDao::getFileBackupIds
+* @return int id
+* @sql
+*    SELECT id FROM backups
+*/
+IDatabaseCursor* ServerCleanupDao::getFileBackupIds(void)
+{
+	if(q_getFileBackupIds==NULL)
+	{
+		q_getFileBackupIds=db->Prepare("SELECT id FROM backups", false);
+	}
+	return q_getFileBackupIds->Cursor();
+}
+
 //@-SQLGenSetup
 void ServerCleanupDao::createQueries(void)
 {
@@ -1306,6 +1339,7 @@ void ServerCleanupDao::createQueries(void)
 	q_getClientName=NULL;
 	q_getFileBackupPath=NULL;
 	q_removeFileBackup=NULL;
+	q_setFileBackupDeletePending=NULL;
 	q_changeImagePath=NULL;
 	q_getFileBackupInfo=NULL;
 	q_getImageBackupInfo=NULL;
@@ -1335,6 +1369,7 @@ void ServerCleanupDao::createQueries(void)
 	q_insertClientHistoryId=NULL;
 	q_insertClientHistoryItem=NULL;
 	q_hasMoreRecentFileBackup=NULL;
+	q_getFileBackupIds=NULL;
 }
 
 //@-SQLGenDestruction
@@ -1360,6 +1395,7 @@ void ServerCleanupDao::destroyQueries(void)
 	db->destroyQuery(q_getClientName);
 	db->destroyQuery(q_getFileBackupPath);
 	db->destroyQuery(q_removeFileBackup);
+	db->destroyQuery(q_setFileBackupDeletePending);
 	db->destroyQuery(q_changeImagePath);
 	db->destroyQuery(q_getFileBackupInfo);
 	db->destroyQuery(q_getImageBackupInfo);
@@ -1389,4 +1425,5 @@ void ServerCleanupDao::destroyQueries(void)
 	db->destroyQuery(q_insertClientHistoryId);
 	db->destroyQuery(q_insertClientHistoryItem);
 	db->destroyQuery(q_hasMoreRecentFileBackup);
+	db->destroyQuery(q_getFileBackupIds);
 }
\ No newline at end of file
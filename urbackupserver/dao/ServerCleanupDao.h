@@ -1,5 +1,6 @@
 #pragma once
 #include "../../Interface/Database.h"
+#include "../../Interface/DatabaseCursor.h"
 
 class ServerCleanupDao
 {
@@ -31,6 +32,10 @@ public:
 		int id;
 		std::string name;
 	};
+	struct SFileBackupId
+	{
+		int id;
+	};
 	struct SFileBackupInfo
 	{
 		bool exists;
@@ -108,6 +113,7 @@ public:
 	CondString getClientName(int clientid);
 	CondString getFileBackupPath(int backupid);
 	void removeFileBackup(int backupid);
+	void setFileBackupDeletePending(int backupid);
 	void changeImagePath(const std::string& path, int backupid);
 	SFileBackupInfo getFileBackupInfo(int backupid);
 	SImageBackupInfo getImageBackupInfo(int backupid);
@@ -137,6 +143,16 @@ public:
 	void insertClientHistoryId(const std::string& created);
 	void insertClientHistoryItem(int id, const std::string& name, const std::string& lastbackup, const std::string& lastseen, const std::string& lastbackup_image, int64 bytes_used_files, int64 bytes_used_images, const std::string& created, int64 hist_id);
 	CondInt hasMoreRecentFileBackup(int backupid);
+	IDatabaseCursor* getFileBackupIds(void);
+	bool getFileBackupIdsNext(IDatabaseCursor* cursor, SFileBackupId& row)
+	{
+		if(!cursor->nextRow())
+		{
+			return false;
+		}
+		row.id=cursor->getInt(0);
+		return true;
+	}
 	//@-SQLGenFunctionsEnd
 
 private:
@@ -166,6 +182,7 @@ private:
 	IQuery* q_getClientName;
 	IQuery* q_getFileBackupPath;
 	IQuery* q_removeFileBackup;
+	IQuery* q_setFileBackupDeletePending;
 	IQuery* q_changeImagePath;
 	IQuery* q_getFileBackupInfo;
 	IQuery* q_getImageBackupInfo;
@@ -195,5 +212,6 @@ private:
 	IQuery* q_insertClientHistoryId;
 	IQuery* q_insertClientHistoryItem;
 	IQuery* q_hasMoreRecentFileBackup;
+	IQuery* q_getFileBackupIds;
 	//@-SQLGenVariablesEnd
 };
\ No newline at end of file
@@ -18,8 +18,10 @@
 
 #include "ServerFilesDao.h"
 #include "../../stringtools.h"
+#include "../../Interface/Server.h"
 #include <assert.h>
 #include <string.h>
+#include <limits.h>
 
 /**
 * @-SQLGenTempSetup
@@ -45,7 +47,7 @@ const int ServerFilesDao::c_direction_outgoing = 1;
 const int ServerFilesDao::c_direction_outgoing_nobackupstat = 2;
 
 ServerFilesDao::ServerFilesDao(IDatabase * db)
-	: db(db)
+	: db(db), q_addFileEntries(NULL)
 {
 	prepareQueries();
 }
@@ -53,6 +55,7 @@ ServerFilesDao::ServerFilesDao(IDatabase * db)
 ServerFilesDao::~ServerFilesDao()
 {
 	destroyQueries();
+	db->destroyQuery(q_addFileEntries);
 }
 
 int64 ServerFilesDao::getLastId()
@@ -447,32 +450,36 @@ void ServerFilesDao::delIncomingStatEntry(int64 id)
 
 /**
 * @-SQLGenAccess
-* @func vector<SIncomingStat> ServerFilesDao::getIncomingStats
+* @func void ServerFilesDao::delIncomingStatEntriesUpTo
+* @sql
+*       DELETE FROM files_incoming_stat WHERE id<=:max_id(int64)
+*/
+void ServerFilesDao::delIncomingStatEntriesUpTo(int64 max_id)
+{
+	if(q_delIncomingStatEntriesUpTo==NULL)
+	{
+		q_delIncomingStatEntriesUpTo=db->Prepare("DELETE FROM files_incoming_stat WHERE id<=?", false);
+	}
+	q_delIncomingStatEntriesUpTo->Bind(max_id);
+	q_delIncomingStatEntriesUpTo->Write();
+	q_delIncomingStatEntriesUpTo->Reset();
+}
+
+/**
+* @-SQLGenAccess
+* @func cursor<SIncomingStat> ServerFilesDao::getIncomingStats
 * @return int64 id, int64 filesize, int clientid, int backupid, string existing_clients, int direction, int incremental
 * @sql
 *       SELECT id, filesize, clientid, backupid, existing_clients, direction, incremental
-*       FROM files_incoming_stat LIMIT 10000
+*       FROM files_incoming_stat ORDER BY id LIMIT 10000
 */
-std::vector<ServerFilesDao::SIncomingStat> ServerFilesDao::getIncomingStats(void)
+IDatabaseCursor* ServerFilesDao::getIncomingStats(void)
 {
 	if(q_getIncomingStats==NULL)
 	{
-		q_getIncomingStats=db->Prepare("SELECT id, filesize, clientid, backupid, existing_clients, direction, incremental FROM files_incoming_stat LIMIT 10000", false);
+		q_getIncomingStats=db->Prepare("SELECT id, filesize, clientid, backupid, existing_clients, direction, incremental FROM files_incoming_stat ORDER BY id LIMIT 10000", false);
 	}
-	db_results res=q_getIncomingStats->Read();
-	std::vector<ServerFilesDao::SIncomingStat> ret;
-	ret.resize(res.size());
-	for(size_t i=0;i<res.size();++i)
-	{
-		ret[i].id=watoi64(res[i]["id"]);
-		ret[i].filesize=watoi64(res[i]["filesize"]);
-		ret[i].clientid=watoi(res[i]["clientid"]);
-		ret[i].backupid=watoi(res[i]["backupid"]);
-		ret[i].existing_clients=res[i]["existing_clients"];
-		ret[i].direction=watoi(res[i]["direction"]);
-		ret[i].incremental=watoi(res[i]["incremental"]);
-	}
-	return ret;
+	return q_getIncomingStats->Cursor();
 }
 
 /**
@@ -492,6 +499,25 @@ void ServerFilesDao::deleteFiles(int backupid)
 	q_deleteFiles->Reset();
 }
 
+/**
+* @-SQLGenAccess
+* @func void ServerFilesDao::deleteFilesRange
+* @sql
+*	DELETE FROM files WHERE backupid=:backupid(int) AND id>=:min_id(int64) AND id<=:max_id(int64)
+*/
+void ServerFilesDao::deleteFilesRange(int backupid, int64 min_id, int64 max_id)
+{
+	if(q_deleteFilesRange==NULL)
+	{
+		q_deleteFilesRange=db->Prepare("DELETE FROM files WHERE backupid=? AND id>=? AND id<=?", false);
+	}
+	q_deleteFilesRange->Bind(backupid);
+	q_deleteFilesRange->Bind(min_id);
+	q_deleteFilesRange->Bind(max_id);
+	q_deleteFilesRange->Write();
+	q_deleteFilesRange->Reset();
+}
+
 /**
 * @-SQLGenAccess
 * @func void ServerFilesDao::removeDanglingFiles
@@ -590,6 +616,28 @@ bool ServerFilesDao::copyToTemporaryLastFilesTable(int backupid)
 	return ret;
 }
 
+/**
+* @-SQLGenAccess
+* @func bool ServerFilesDao::addToTemporaryLastFilesTable
+* @sql
+*      INSERT INTO files_last (fullpath, hashpath, shahash, filesize)
+*			VALUES (:fullpath(string), :hashpath(string), :shahash(blob), :filesize(int64))
+*/
+bool ServerFilesDao::addToTemporaryLastFilesTable(const std::string& fullpath, const std::string& hashpath, const std::string& shahash, int64 filesize)
+{
+	if(q_addToTemporaryLastFilesTable==NULL)
+	{
+		q_addToTemporaryLastFilesTable=db->Prepare("INSERT INTO files_last (fullpath, hashpath, shahash, filesize) VALUES (?, ?, ?, ?)", false);
+	}
+	q_addToTemporaryLastFilesTable->Bind(fullpath);
+	q_addToTemporaryLastFilesTable->Bind(hashpath);
+	q_addToTemporaryLastFilesTable->Bind(shahash.c_str(), (_u32)shahash.size());
+	q_addToTemporaryLastFilesTable->Bind(filesize);
+	bool ret = q_addToTemporaryLastFilesTable->Write();
+	q_addToTemporaryLastFilesTable->Reset();
+	return ret;
+}
+
 /**
 * @-SQLGenAccess
 * @func SFileEntry ServerFilesDao::getFileEntryFromTemporaryTable
@@ -676,6 +724,174 @@ ServerFilesDao::SBackupIdMinMax ServerFilesDao::getBackupIdMinMax(int backupid)
 	return ret;
 }
 
+/**
+* @-SQLGenAccess
+* @func SBackupIdMinMax ServerFilesDao::getBackupIdBatchMinMax
+* @return int64 tmin, int64 tmax
+* @sql
+*      SELECT MIN(id) AS tmin, MAX(id) AS tmax FROM
+*		(SELECT id FROM files WHERE backupid=:backupid(int) ORDER BY id LIMIT :limit(int64))
+*/
+ServerFilesDao::SBackupIdMinMax ServerFilesDao::getBackupIdBatchMinMax(int backupid, int64 limit)
+{
+	if(q_getBackupIdBatchMinMax==NULL)
+	{
+		q_getBackupIdBatchMinMax=db->Prepare("SELECT MIN(id) AS tmin, MAX(id) AS tmax FROM (SELECT id FROM files WHERE backupid=? ORDER BY id LIMIT ?)", false);
+	}
+	q_getBackupIdBatchMinMax->Bind(backupid);
+	q_getBackupIdBatchMinMax->Bind(limit);
+	db_results res=q_getBackupIdBatchMinMax->Read();
+	q_getBackupIdBatchMinMax->Reset();
+	SBackupIdMinMax ret = { false, 0, 0 };
+	if(!res.empty())
+	{
+		ret.exists=true;
+		ret.tmin=watoi64(res[0]["tmin"]);
+		ret.tmax=watoi64(res[0]["tmax"]);
+	}
+	return ret;
+}
+
+/**
+* @-SQLGenAccess
+* @func int64 ServerFilesDao::getMaxFileId
+* @return int64 max_id
+* @sql
+*      SELECT MAX(id) AS max_id FROM files
+*/
+ServerFilesDao::CondInt64 ServerFilesDao::getMaxFileId(void)
+{
+	if(q_getMaxFileId==NULL)
+	{
+		q_getMaxFileId=db->Prepare("SELECT MAX(id) AS max_id FROM files", false);
+	}
+	db_results res=q_getMaxFileId->Read();
+	q_getMaxFileId->Reset();
+	CondInt64 ret = { false, 0 };
+	if(!res.empty())
+	{
+		ret.exists=true;
+		ret.value=watoi64(res[0]["max_id"]);
+	}
+	return ret;
+}
+
+/**
+* @-SQLGenAccess
+* @func int64 ServerFilesDao::getFileIdRangeCount
+* @return int64 c
+* @sql
+*      SELECT COUNT(*) AS c FROM files WHERE id>=:min_id(int64) AND id<=:max_id(int64)
+*/
+ServerFilesDao::CondInt64 ServerFilesDao::getFileIdRangeCount(int64 min_id, int64 max_id)
+{
+	if(q_getFileIdRangeCount==NULL)
+	{
+		q_getFileIdRangeCount=db->Prepare("SELECT COUNT(*) AS c FROM files WHERE id>=? AND id<=?", false);
+	}
+	q_getFileIdRangeCount->Bind(min_id);
+	q_getFileIdRangeCount->Bind(max_id);
+	db_results res=q_getFileIdRangeCount->Read();
+	q_getFileIdRangeCount->Reset();
+	CondInt64 ret = { false, 0 };
+	if(!res.empty())
+	{
+		ret.exists=true;
+		ret.value=watoi64(res[0]["c"]);
+	}
+	return ret;
+}
+
+/**
+* @-SQLGenAccess
+* @func void ServerFilesDao::addIndexJournalEntry
+* @sql
+*      INSERT INTO files_index_journal (shahash, filesize, clientid, target)
+*      VALUES (:shahash(blob), :filesize(int64), :clientid(int), :target(int64))
+*/
+void ServerFilesDao::addIndexJournalEntry(const std::string& shahash, int64 filesize, int clientid, int64 target)
+{
+	if(q_addIndexJournalEntry==NULL)
+	{
+		q_addIndexJournalEntry=db->Prepare("INSERT INTO files_index_journal (shahash, filesize, clientid, target) VALUES (?, ?, ?, ?)", false);
+	}
+	q_addIndexJournalEntry->Bind(shahash.c_str(), (_u32)shahash.size());
+	q_addIndexJournalEntry->Bind(filesize);
+	q_addIndexJournalEntry->Bind(clientid);
+	q_addIndexJournalEntry->Bind(target);
+	q_addIndexJournalEntry->Write();
+	q_addIndexJournalEntry->Reset();
+}
+
+/**
+* @-SQLGenAccess
+* @func vector<SIndexJournalEntry> ServerFilesDao::getIndexJournalEntries
+* @return int64 id, blob shahash, int64 filesize, int clientid, int64 target
+* @sql
+*      SELECT id, shahash, filesize, clientid, target FROM files_index_journal
+*       WHERE id>=:min_id(int64) ORDER BY id ASC LIMIT :limit(int64)
+*/
+std::vector<ServerFilesDao::SIndexJournalEntry> ServerFilesDao::getIndexJournalEntries(int64 min_id, int64 limit)
+{
+	if(q_getIndexJournalEntries==NULL)
+	{
+		q_getIndexJournalEntries=db->Prepare("SELECT id, shahash, filesize, clientid, target FROM files_index_journal WHERE id>=? ORDER BY id ASC LIMIT ?", false);
+	}
+	q_getIndexJournalEntries->Bind(min_id);
+	q_getIndexJournalEntries->Bind(limit);
+	db_results res=q_getIndexJournalEntries->Read();
+	q_getIndexJournalEntries->Reset();
+	std::vector<ServerFilesDao::SIndexJournalEntry> ret;
+	ret.resize(res.size());
+	for(size_t i=0;i<res.size();++i)
+	{
+		ret[i].id=watoi64(res[i]["id"]);
+		ret[i].shahash=res[i]["shahash"];
+		ret[i].filesize=watoi64(res[i]["filesize"]);
+		ret[i].clientid=watoi(res[i]["clientid"]);
+		ret[i].target=watoi64(res[i]["target"]);
+	}
+	return ret;
+}
+
+/**
+* @-SQLGenAccess
+* @func void ServerFilesDao::delIndexJournalEntriesUpTo
+* @sql
+*      DELETE FROM files_index_journal WHERE id<=:max_id(int64)
+*/
+void ServerFilesDao::delIndexJournalEntriesUpTo(int64 max_id)
+{
+	if(q_delIndexJournalEntriesUpTo==NULL)
+	{
+		q_delIndexJournalEntriesUpTo=db->Prepare("DELETE FROM files_index_journal WHERE id<=?", false);
+	}
+	q_delIndexJournalEntriesUpTo->Bind(max_id);
+	q_delIndexJournalEntriesUpTo->Write();
+	q_delIndexJournalEntriesUpTo->Reset();
+}
+
+/**
+* @-SQLGenAccess
+* @func cursor<SFileBackupEntry> ServerFilesDao::getFileBackupEntries
+* @return int64 id, blob shahash, int64 filesize, int64 rsize, int clientid, int backupid, int incremental, int64 next_entry, int64 prev_entry, int pointed_to
+* @sql
+*      SELECT id, shahash, filesize, rsize, clientid, backupid, incremental, next_entry, prev_entry, pointed_to
+*      FROM files WHERE backupid=:backupid(int) AND id>=:min_id(int64) AND id<=:max_id(int64)
+*/
+IDatabaseCursor* ServerFilesDao::getFileBackupEntries(int backupid, int64 min_id, int64 max_id)
+{
+	if(q_getFileBackupEntries==NULL)
+	{
+		q_getFileBackupEntries=db->Prepare("SELECT id, shahash, filesize, rsize, clientid, backupid, incremental, next_entry, prev_entry, pointed_to FROM files WHERE backupid=? AND id>=? AND id<=?", false);
+	}
+	q_getFileBackupEntries->Bind(backupid);
+	q_getFileBackupEntries->Bind(min_id);
+	q_getFileBackupEntries->Bind(max_id);
+	q_getFileBackupEntries->Reset();
+	return q_getFileBackupEntries->Cursor();
+}
+
 //@-SQLGenSetup
 void ServerFilesDao::prepareQueries()
 {
@@ -696,17 +912,27 @@ void ServerFilesDao::prepareQueries()
 	q_addIncomingFile=NULL;
 	q_getIncomingStatsCount=NULL;
 	q_delIncomingStatEntry=NULL;
+	q_delIncomingStatEntriesUpTo=NULL;
 	q_getIncomingStats=NULL;
 	q_deleteFiles=NULL;
+	q_deleteFilesRange=NULL;
 	q_removeDanglingFiles=NULL;
 	q_createTemporaryLastFilesTable=NULL;
 	q_dropTemporaryLastFilesTable=NULL;
 	q_createTemporaryLastFilesTableIndex=NULL;
 	q_dropTemporaryLastFilesTableIndex=NULL;
 	q_copyToTemporaryLastFilesTable=NULL;
+	q_addToTemporaryLastFilesTable=NULL;
 	q_getFileEntryFromTemporaryTable=NULL;
 	q_getFileEntriesFromTemporaryTableGlob=NULL;
 	q_getBackupIdMinMax=NULL;
+	q_getBackupIdBatchMinMax=NULL;
+	q_getMaxFileId=NULL;
+	q_getFileIdRangeCount=NULL;
+	q_addIndexJournalEntry=NULL;
+	q_getIndexJournalEntries=NULL;
+	q_delIndexJournalEntriesUpTo=NULL;
+	q_getFileBackupEntries=NULL;
 }
 
 //@-SQLGenDestruction
@@ -729,17 +955,27 @@ void ServerFilesDao::destroyQueries()
 	db->destroyQuery(q_addIncomingFile);
 	db->destroyQuery(q_getIncomingStatsCount);
 	db->destroyQuery(q_delIncomingStatEntry);
+	db->destroyQuery(q_delIncomingStatEntriesUpTo);
 	db->destroyQuery(q_getIncomingStats);
 	db->destroyQuery(q_deleteFiles);
+	db->destroyQuery(q_deleteFilesRange);
 	db->destroyQuery(q_removeDanglingFiles);
 	db->destroyQuery(q_createTemporaryLastFilesTable);
 	db->destroyQuery(q_dropTemporaryLastFilesTable);
 	db->destroyQuery(q_createTemporaryLastFilesTableIndex);
 	db->destroyQuery(q_dropTemporaryLastFilesTableIndex);
 	db->destroyQuery(q_copyToTemporaryLastFilesTable);
+	db->destroyQuery(q_addToTemporaryLastFilesTable);
 	db->destroyQuery(q_getFileEntryFromTemporaryTable);
 	db->destroyQuery(q_getFileEntriesFromTemporaryTableGlob);
 	db->destroyQuery(q_getBackupIdMinMax);
+	db->destroyQuery(q_getBackupIdBatchMinMax);
+	db->destroyQuery(q_getMaxFileId);
+	db->destroyQuery(q_getFileIdRangeCount);
+	db->destroyQuery(q_addIndexJournalEntry);
+	db->destroyQuery(q_getIndexJournalEntries);
+	db->destroyQuery(q_delIndexJournalEntriesUpTo);
+	db->destroyQuery(q_getFileBackupEntries);
 }
 
 int64 ServerFilesDao::addFileEntryExternal(int backupid, const std::string& fullpath, const std::string& hashpath, const std::string& shahash, int64 filesize, int64 rsize, int clientid, int incremental, int64 next_entry, int64 prev_entry, int pointed_to)
@@ -759,4 +995,113 @@ int64 ServerFilesDao::addFileEntryExternal(int backupid, const std::string& full
 	}
 
 	return id;
+}
+
+std::vector<int64> ServerFilesDao::addFileEntriesExternal(const std::vector<const SNewFileEntry*>& entries)
+{
+	//32 rows with 11 parameters each stay below the SQLite parameter limit
+	const size_t multi_insert_rows = 32;
+
+	std::vector<int64> ids;
+	ids.reserve(entries.size());
+
+	size_t i = 0;
+	if (entries.size() >= multi_insert_rows)
+	{
+		//The ids of the rows of a multi-row insert are only known if they are consecutive.
+		//SQLite gives a new row the largest id plus one (if that is below the maximum id).
+		//This is checked after each insert and if it does not hold the inserts are
+		//rolled back and all entries are inserted one by one
+		db->Write("SAVEPOINT add_file_entries");
+
+		CondInt64 max_id = getMaxFileId();
+		int64 prev_id = max_id.value;
+		bool consecutive = max_id.exists
+			&& prev_id >= 0
+			&& prev_id < LLONG_MAX - static_cast<int64>(entries.size());
+
+		for (; consecutive && entries.size() - i >= multi_insert_rows; i += multi_insert_rows)
+		{
+			if (q_addFileEntries == NULL)
+			{
+				std::string sql = "INSERT INTO files (backupid, fullpath, hashpath, shahash, filesize, rsize, clientid, incremental, next_entry, prev_entry, pointed_to) VALUES ";
+				for (size_t j = 0; j < multi_insert_rows; ++j)
+				{
+					if (j > 0)
+					{
+						sql += ", ";
+					}
+					sql += "(?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)";
+				}
+				q_addFileEntries = db->Prepare(sql, false);
+			}
+
+			for (size_t j = 0; j < multi_insert_rows; ++j)
+			{
+				const SNewFileEntry& entry = *entries[i + j];
+				q_addFileEntries->Bind(entry.backupid);
+				q_addFileEntries->Bind(entry.fullpath);
+				q_addFileEntries->Bind(entry.hashpath);
+				q_addFileEntries->Bind(entry.shahash.c_str(), (_u32)entry.shahash.size());
+				q_addFileEntries->Bind(entry.filesize);
+				q_addFileEntries->Bind(entry.rsize);
+				q_addFileEntries->Bind(entry.clientid);
+				q_addFileEntries->Bind(entry.incremental);
+				q_addFileEntries->Bind(entry.next_entry);
+				q_addFileEntries->Bind(entry.prev_entry);
+				q_addFileEntries->Bind(entry.pointed_to);
+			}
+			q_addFileEntries->Write();
+			q_addFileEntries->Reset();
+
+			int64 last_id = db->getLastInsertID();
+			CondInt64 range_count = getFileIdRangeCount(prev_id + 1, last_id);
+			if (last_id != prev_id + static_cast<int64>(multi_insert_rows)
+				|| !range_count.exists
+				|| range_count.value != static_cast<int64>(multi_insert_rows))
+			{
+				Server->Log("Ids of multi-row file entry insert are not consecutive (last id " + convert(last_id) + ", previous maximum id " + convert(prev_id) + "). Inserting file entries one by one.", LL_WARNING);
+				consecutive = false;
+				break;
+			}
+
+			for (size_t j = 0; j < multi_insert_rows; ++j)
+			{
+				ids.push_back(prev_id + 1 + static_cast<int64>(j));
+			}
+			prev_id = last_id;
+		}
+
+		if (!consecutive)
+		{
+			db->Write("ROLLBACK TO add_file_entries");
+			ids.clear();
+			i = 0;
+		}
+
+		db->Write("RELEASE add_file_entries");
+	}
+
+	for (; i < entries.size(); ++i)
+	{
+		const SNewFileEntry& entry = *entries[i];
+		addFileEntry(entry.backupid, entry.fullpath, entry.hashpath, entry.shahash, entry.filesize, entry.rsize,
+			entry.clientid, entry.incremental, entry.next_entry, entry.prev_entry, entry.pointed_to);
+		ids.push_back(db->getLastInsertID());
+	}
+
+	for (size_t j = 0; j < entries.size(); ++j)
+	{
+		if (entries[j]->prev_entry != 0)
+		{
+			setNextEntry(ids[j], entries[j]->prev_entry);
+		}
+
+		if (entries[j]->next_entry != 0)
+		{
+			setPrevEntry(ids[j], entries[j]->next_entry);
+		}
+	}
+
+	return ids;
 }
\ No newline at end of file
@@ -1,5 +1,6 @@
 #pragma once
 #include "../../Interface/Database.h"
+#include "../../Interface/DatabaseCursor.h"
 
 class ServerFilesDao
 {
@@ -30,6 +31,19 @@ public:
 		int64 tmin;
 		int64 tmax;
 	};
+	struct SFileBackupEntry
+	{
+		int64 id;
+		std::string shahash;
+		int64 filesize;
+		int64 rsize;
+		int clientid;
+		int backupid;
+		int incremental;
+		int64 next_entry;
+		int64 prev_entry;
+		int pointed_to;
+	};
 	struct SFileEntry
 	{
 		bool exists;
@@ -76,6 +90,14 @@ public:
 		int64 next_entry;
 		int64 prev_entry;
 	};
+	struct SIndexJournalEntry
+	{
+		int64 id;
+		std::string shahash;
+		int64 filesize;
+		int clientid;
+		int64 target;
+	};
 
 
 	void setNextEntry(int64 next_entry, int64 id);
@@ -95,21 +117,82 @@ public:
 	void addIncomingFile(int64 filesize, int clientid, int backupid, const std::string& existing_clients, int direction, int incremental);
 	CondInt64 getIncomingStatsCount(void);
 	void delIncomingStatEntry(int64 id);
-	std::vector<SIncomingStat> getIncomingStats(void);
+	void delIncomingStatEntriesUpTo(int64 max_id);
+	IDatabaseCursor* getIncomingStats(void);
+	bool getIncomingStatsNext(IDatabaseCursor* cursor, SIncomingStat& row)
+	{
+		if(!cursor->nextRow())
+		{
+			return false;
+		}
+		row.id=cursor->getInt64(0);
+		row.filesize=cursor->getInt64(1);
+		row.clientid=cursor->getInt(2);
+		row.backupid=cursor->getInt(3);
+		cursor->getStr(4, row.existing_clients);
+		row.direction=cursor->getInt(5);
+		row.incremental=cursor->getInt(6);
+		return true;
+	}
 	void deleteFiles(int backupid);
+	void deleteFilesRange(int backupid, int64 min_id, int64 max_id);
 	void removeDanglingFiles(void);
 	bool createTemporaryLastFilesTable(void);
 	void dropTemporaryLastFilesTable(void);
 	bool createTemporaryLastFilesTableIndex(void);
 	bool dropTemporaryLastFilesTableIndex(void);
 	bool copyToTemporaryLastFilesTable(int backupid);
+	bool addToTemporaryLastFilesTable(const std::string& fullpath, const std::string& hashpath, const std::string& shahash, int64 filesize);
 	SFileEntry getFileEntryFromTemporaryTable(const std::string& fullpath);
 	std::vector<SFileEntry> getFileEntriesFromTemporaryTableGlob(const std::string& fullpath_glob);
 	SBackupIdMinMax getBackupIdMinMax(int backupid);
+	SBackupIdMinMax getBackupIdBatchMinMax(int backupid, int64 limit);
+	CondInt64 getMaxFileId(void);
+	CondInt64 getFileIdRangeCount(int64 min_id, int64 max_id);
+	void addIndexJournalEntry(const std::string& shahash, int64 filesize, int clientid, int64 target);
+	std::vector<SIndexJournalEntry> getIndexJournalEntries(int64 min_id, int64 limit);
+	void delIndexJournalEntriesUpTo(int64 max_id);
+	IDatabaseCursor* getFileBackupEntries(int backupid, int64 min_id, int64 max_id);
+	bool getFileBackupEntriesNext(IDatabaseCursor* cursor, SFileBackupEntry& row)
+	{
+		if(!cursor->nextRow())
+		{
+			return false;
+		}
+		row.id=cursor->getInt64(0);
+		cursor->getStr(1, row.shahash);
+		row.filesize=cursor->getInt64(2);
+		row.rsize=cursor->getInt64(3);
+		row.clientid=cursor->getInt(4);
+		row.backupid=cursor->getInt(5);
+		row.incremental=cursor->getInt(6);
+		row.next_entry=cursor->getInt64(7);
+		row.prev_entry=cursor->getInt64(8);
+		row.pointed_to=cursor->getInt(9);
+		return true;
+	}
 	//@-SQLGenFunctionsEnd
 
 	int64 addFileEntryExternal(int backupid, const std::string& fullpath, const std::string& hashpath, const std::string& shahash, int64 filesize, int64 rsize, int clientid, int incremental, int64 next_entry, int64 prev_entry, int pointed_to);
 
+	struct SNewFileEntry
+	{
+		int backupid;
+		std::string fullpath;
+		std::string hashpath;
+		std::string shahash;
+		int64 filesize;
+		int64 rsize;
+		int clientid;
+		int incremental;
+		int64 next_entry;
+		int64 prev_entry;
+		int pointed_to;
+	};
+
+	//Like addFileEntryExternal() for many entries, using multi-row inserts. Returns the ids of the new entries
+	std::vector<int64> addFileEntriesExternal(const std::vector<const SNewFileEntry*>& entries);
+
 private:
 	ServerFilesDao(ServerFilesDao& other) {}
 	void operator=(ServerFilesDao& other) {}
@@ -135,18 +218,29 @@ private:
 	IQuery* q_addIncomingFile;
 	IQuery* q_getIncomingStatsCount;
 	IQuery* q_delIncomingStatEntry;
+	IQuery* q_delIncomingStatEntriesUpTo;
 	IQuery* q_getIncomingStats;
 	IQuery* q_deleteFiles;
+	IQuery* q_deleteFilesRange;
 	IQuery* q_removeDanglingFiles;
 	IQuery* q_createTemporaryLastFilesTable;
 	IQuery* q_dropTemporaryLastFilesTable;
 	IQuery* q_createTemporaryLastFilesTableIndex;
 	IQuery* q_dropTemporaryLastFilesTableIndex;
 	IQuery* q_copyToTemporaryLastFilesTable;
+	IQuery* q_addToTemporaryLastFilesTable;
 	IQuery* q_getFileEntryFromTemporaryTable;
 	IQuery* q_getFileEntriesFromTemporaryTableGlob;
 	IQuery* q_getBackupIdMinMax;
+	IQuery* q_getBackupIdBatchMinMax;
+	IQuery* q_getMaxFileId;
+	IQuery* q_getFileIdRangeCount;
+	IQuery* q_addIndexJournalEntry;
+	IQuery* q_getIndexJournalEntries;
+	IQuery* q_delIndexJournalEntriesUpTo;
+	IQuery* q_getFileBackupEntries;
 	//@-SQLGenVariablesEnd
 
 	IDatabase *db;
+	IQuery* q_addFileEntries;
 };
@@ -98,6 +98,11 @@ SStartupStatus startup_status;
 #include "FileMetadataDownloadThread.h"
 #include "../urbackupcommon/chunk_hasher.h"
 #include "LogReport.h"
+#include "FileIndexStats.h"
+#include "FileIndex.h"
+#include "ChunkStore.h"
+#include "FileEntryBatch.h"
+#include "FileManifest.h"
 
 #define MINIZ_NO_ZLIB_COMPATIBLE_NAMES
 #include "../common/miniz.h"
@@ -151,6 +156,24 @@ bool verify_hashes(std::string arg);
 void updateRights(int t_userid, std::string s_rights, IDatabase *db);
 int md5sum_check();
 int blockalign();
+#ifdef WITH_BENCHMARKS
+int fileindex_cache_bench();
+int fileindex_backend_bench();
+int sha_bench();
+int prepare_hash_bench();
+int pipeline_overhead_bench();
+int file_entry_batch_bench();
+int file_manifest_bench();
+int dao_cursor_bench();
+int extent_copy_bench();
+int file_io_bench();
+int chunk_patch_bench();
+int filelist_bench();
+int treediff_bench();
+int file_entry_chain_check();
+int fileindex_replay_check();
+int file_manifest_check();
+#endif
 
 std::string lang="en";
 std::string time_format_str="%Y-%m-%d %H:%M";
@@ -454,6 +477,11 @@ DLLEXPORT void LoadActions(IServer* pServer)
 	ServerLogger::init_mutex();
 	init_dir_link_mutex();
 	WalCheckpointThread::init_mutex();
+	FileIndexStats::init_mutex();
+	FileIndex::init_mutex();
+	ChunkStore::init_mutex();
+	FileEntryBatch::init_mutex();
+	FileManifest::init_mutex();
 
 	std::string app=Server->getServerParameter("app", "");
 
@@ -522,10 +550,80 @@ DLLEXPORT void LoadActions(IServer* pServer)
 		{
 			rc = blockalign();
 		}
+#ifdef WITH_BENCHMARKS
+		else if (app == "fileindex_cache_bench")
+		{
+			rc = fileindex_cache_bench();
+		}
+		else if (app == "fileindex_backend_bench")
+		{
+			rc = fileindex_backend_bench();
+		}
+		else if (app == "sha_bench")
+		{
+			rc = sha_bench();
+		}
+		else if (app == "prepare_hash_bench")
+		{
+			rc = prepare_hash_bench();
+		}
+		else if (app == "pipeline_overhead_bench")
+		{
+			rc = pipeline_overhead_bench();
+		}
+		else if (app == "file_entry_batch_bench")
+		{
+			rc = file_entry_batch_bench();
+		}
+		else if (app == "file_manifest_bench")
+		{
+			rc = file_manifest_bench();
+		}
+		else if (app == "dao_cursor_bench")
+		{
+			rc = dao_cursor_bench();
+		}
+		else if (app == "extent_copy_bench")
+		{
+			rc = extent_copy_bench();
+		}
+		else if (app == "file_io_bench")
+		{
+			rc = file_io_bench();
+		}
+		else if (app == "chunk_patch_bench")
+		{
+			rc = chunk_patch_bench();
+		}
+		else if (app == "filelist_bench")
+		{
+			rc = filelist_bench();
+		}
+		else if (app == "treediff_bench")
+		{
+			rc = treediff_bench();
+		}
+		else if (app == "file_entry_chain_check")
+		{
+			rc = file_entry_chain_check();
+		}
+		else if (app == "fileindex_replay_check")
+		{
+			rc = fileindex_replay_check();
+		}
+		else if (app == "file_manifest_check")
+		{
+			rc = file_manifest_check();
+		}
+#endif
 		else
 		{
 			rc=100;
-			Server->Log("App not found. Available apps: cleanup, remove_unknown, cleanup_database, repair_database, defrag_database, export_auth_log, check_fileindex, skiphash_copy, md5sum_check, hash, blockalign");
+			std::string available_apps = "cleanup, remove_unknown, cleanup_database, repair_database, defrag_database, export_auth_log, check_fileindex, skiphash_copy, md5sum_check, hash, blockalign";
+#ifdef WITH_BENCHMARKS
+			available_apps += ", fileindex_cache_bench, fileindex_backend_bench, sha_bench, prepare_hash_bench, pipeline_overhead_bench, file_entry_batch_bench, file_manifest_bench, dao_cursor_bench, extent_copy_bench, file_io_bench, chunk_patch_bench, filelist_bench, treediff_bench, file_entry_chain_check, fileindex_replay_check, file_manifest_check";
+#endif
+			Server->Log("App not found. Available apps: " + available_apps);
 		}
 		exit(rc);
 	}
@@ -821,6 +919,7 @@ DLLEXPORT void LoadActions(IServer* pServer)
 	ADD_ACTION(scripts);
 	ADD_ACTION(status_check);
 	ADD_ACTION(restore_image);
+	ADD_ACTION(fileindex_stats);
 
 	if(Server->getServerParameter("allow_shutdown")=="true")
 	{
@@ -2224,6 +2323,12 @@ bool upgrade61_62()
 	return b;
 }
 
+bool upgrade62_63()
+{
+	IDatabase* db = Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER);
+	return db->Write("CREATE TABLE files_db.files_index_journal (id INTEGER PRIMARY KEY, shahash BLOB, filesize INTEGER, clientid INTEGER, target INTEGER)");
+}
+
 void upgrade(void)
 {
 	Server->destroyAllDatabases();
@@ -2245,7 +2350,7 @@ void upgrade(void)
 	
 	int ver=watoi(res_v[0]["tvalue"]);
 	int old_v;
-	int max_v=62;
+	int max_v=63;
 	{
 		IScopedLock lock(startup_status.mutex);
 		startup_status.target_db_version=max_v;
@@ -2615,6 +2720,13 @@ void upgrade(void)
 					has_error = true;
 				}
 				++ver;
+				break;
+			case 62:
+				if (!upgrade62_63())
+				{
+					has_error = true;
+				}
+				++ver;
 				break;				
 			default:
 				break;
@@ -43,6 +43,9 @@
 #include "create_files_index.h"
 #include "../urbackupcommon/WalCheckpointThread.h"
 #include "copy_storage.h"
+#include "ChunkStore.h"
+#include "FileManifest.h"
+#include "ParallelDirRemover.h"
 #include <assert.h>
 #include <set>
 
@@ -735,9 +738,8 @@ void ServerCleanupThread::do_remove_unknown(void)
 
 	Server->Log("Removing dangling file entries...", LL_INFO);
 
-	IQuery* q_backup_ids = db->Prepare("SELECT id FROM backups", false);
-	IDatabaseCursor* cur = q_backup_ids->Cursor();
-	db_single_result res;
+	IDatabaseCursor* cur = cleanupdao->getFileBackupIds();
+	ServerCleanupDao::SFileBackupId backup_id;
 
 	IDatabase* files_db = Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER_FILES);
 
@@ -746,20 +748,23 @@ void ServerCleanupThread::do_remove_unknown(void)
 	IQuery* q_insert = files_db->Prepare("INSERT INTO backups (id) VALUES (?)", false);
 
 	bool ok = true;
-	while (cur->next(res))
+	std::set<int> backupids;
+	while (cleanupdao->getFileBackupIdsNext(cur, backup_id))
 	{
-		q_insert->Bind(res["id"]);
+		q_insert->Bind(backup_id.id);
 		ok &= q_insert->Write();
 		q_insert->Reset();
+		backupids.insert(backup_id.id);
 	}
-
-	db->destroyQuery(q_backup_ids);
+	cur->shutdown();
 	files_db->destroyQuery(q_insert);
 
 	if (ok)
 	{
 		filesdao->removeDanglingFiles();
 		Server->Log("Deleted " + convert(files_db->getLastChanges()) + " file entries", LL_INFO);
+
+		FileManifest::remove_dangling(backupids);
 	}
 
 	files_db->Write("DROP TABLE backups");
@@ -1489,6 +1494,9 @@ bool ServerCleanupThread::deleteFileBackup(const std::string &backupfolder, int
 		path += ".startup-del";
 	}
 
+	//Continued by delete_pending_file_backups() if the deletion is interrupted
+	cleanupdao->setFileBackupDeletePending(backupid);
+
 	bool b=false;
 	if( BackupServer::isFileSnapshotsEnabled())
 	{
@@ -1518,9 +1526,9 @@ bool ServerCleanupThread::deleteFileBackup(const std::string &backupfolder, int
 	}
 	else
 	{
-		ServerLinkDao link_dao(Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER_LINKS));
+		ParallelDirRemover dir_remover(clientid, ParallelDirRemover::get_num_threads());
 
-		b=remove_directory_link_dir(path, link_dao, clientid);
+		b=dir_remover.remove(path);
 	}
 
 	bool del=true;
@@ -1552,9 +1560,11 @@ bool ServerCleanupThread::deleteFileBackup(const std::string &backupfolder, int
 	}
 	if(del || force_remove)
 	{
-		removeFileBackupSql(backupid);
-
-
+		if(!removeFileBackupSql(backupid))
+		{
+			err=true;
+			removeerr.push_back(backupid);
+		}
 	}
 
 	ServerStatus::updateActive();
@@ -1596,6 +1606,11 @@ void ServerCleanupThread::removeClient(int clientid)
 				ServerLogger::Log(logid, "Removing file backup with id \""+convert(backupid)+"\" successful.", LL_INFO);
 			else
 				ServerLogger::Log(logid, "Removing file backup with id \""+convert(backupid)+"\" failed.", LL_ERROR);
+
+			if(!b && do_quit)
+			{
+				return;
+			}
 		}
 	}while(!res_filebackups.empty());
 
@@ -2057,6 +2072,7 @@ bool ServerCleanupThread::enforce_quota(int clientid, std::ostringstream& log)
 		}
 
 		did_remove_something=false;
+		bool did_remove_image=false;
 		int state=0;
 		int nopc=0;
 		while(used_storage.value>client_quota && nopc<2)
@@ -2090,6 +2106,7 @@ bool ServerCleanupThread::enforce_quota(int clientid, std::ostringstream& log)
 					{
 						log << "Removed image backupd with id " << imagebid << std::endl;
 						did_remove_something = true;
+						did_remove_image = true;
 						//TODO: wait here for btrfs subvol remove to finish
 						if (hasEnoughFreeSpace(target_minspace, &client_settings))
 						{
@@ -2135,7 +2152,8 @@ bool ServerCleanupThread::enforce_quota(int clientid, std::ostringstream& log)
 
 		if(did_remove_something)
 		{
-			ServerUpdateStats sus(false, false);
+			//Image sizes are only updated by a full statistics update
+			ServerUpdateStats sus(false, false, !did_remove_image);
 			sus();
 		}
 	}
@@ -2534,37 +2552,114 @@ void ServerCleanupThread::cleanup_other()
 
 }
 
-void ServerCleanupThread::removeFileBackupSql( int backupid )
+void ServerCleanupThread::removeFileManifestStats(int backupid)
+{
+	FileManifest::Reader manifest(backupid);
+	if (!manifest.exists())
+	{
+		return;
+	}
+
+	//Entries in the manifest are not linked, so the sizes of each incremental backup level can be removed at once
+	std::map<int, int64> incremental_sizes;
+	FileManifest::SEntry entry;
+	while (manifest.next(entry))
+	{
+		incremental_sizes[entry.incremental] += entry.filesize;
+	}
+
+	for (std::map<int, int64>::iterator it = incremental_sizes.begin(); it != incremental_sizes.end(); ++it)
+	{
+		filesdao->addIncomingFile(it->second, manifest.get_clientid(), backupid, convert(manifest.get_clientid()),
+			ServerFilesDao::c_direction_outgoing, it->first);
+	}
+}
+
+bool ServerCleanupThread::removeFileBackupSql( int backupid )
 {
 	DBScopedSynchronous synchronous_files(filesdao->getDatabase());
-	filesdao->BeginWriteTransaction();
 
-	BackupServerHash::SInMemCorrection correction;
+	int64 batch_size = (std::max)(static_cast<int64>(1), watoi64(Server->getServerParameter("file_delete_batch_size", "10000")));
+
+	//Deletes the entries in chunks of ids, each in its own transaction, so the files
+	//database is not locked for the whole deletion. The backup stays marked as delete pending
+	//until all chunks are deleted, so an interrupted deletion is continued later
+	while (true)
+	{
+		if (do_quit)
+		{
+			ServerLogger::Log(logid, "Deleting entries of file backup " + convert(backupid) + " interrupted. Continuing later.", LL_INFO);
+			return false;
+		}
 
-	ServerFilesDao::SBackupIdMinMax minmax = filesdao->getBackupIdMinMax(backupid);
+		//Pending file entries may be linked to entries of this backup. Backups
+		//can add new pending entries while the chunks are deleted
+		FileEntryBatch::flush_all(*filesdao, *fileindex.get());
 
-	correction.max_correct = minmax.tmax;
-	correction.min_correct = minmax.tmin;
+		filesdao->BeginWriteTransaction();
 
-	IQuery* q_iterate = filesdao->getDatabase()->Prepare("SELECT id, shahash, filesize, rsize, clientid, backupid, incremental, next_entry, prev_entry, pointed_to FROM files WHERE backupid=?", false);
-	q_iterate->Bind(backupid);
-	IDatabaseCursor* cursor = q_iterate->Cursor();
+		ServerFilesDao::SBackupIdMinMax minmax = filesdao->getBackupIdBatchMinMax(backupid, batch_size);
+
+		if (!minmax.exists || minmax.tmax == 0)
+		{
+			break;
+		}
+
+		removeFileBackupEntriesSql(backupid, minmax.tmin, minmax.tmax);
+
+		//Index journal entries of changes which are in the index are not needed anymore
+		int64 flushed_journal_id = FileIndex::get_flushed_journal_id();
+		if (flushed_journal_id > 0)
+		{
+			filesdao->delIndexJournalEntriesUpTo(flushed_journal_id);
+		}
+
+		filesdao->endTransaction();
+
+		ServerStatus::updateActive();
+	}
+
+	removeFileManifestStats(backupid);
+
+	filesdao->endTransaction();
+
+	FileManifest::remove(backupid);
+
+	cleanupdao->removeFileBackup(backupid);
+
+	ServerSettings settings(db);
+	if (!ChunkStore::remove_backup(settings.getSettings()->backupfolder, backupid))
+	{
+		ServerLogger::Log(logid, "Error releasing chunks of file backup " + convert(backupid) + " in chunk store", LL_WARNING);
+	}
+
+	return true;
+}
+
+void ServerCleanupThread::removeFileBackupEntriesSql(int backupid, int64 min_id, int64 max_id)
+{
+	BackupServerHash::SInMemCorrection correction;
+
+	correction.max_correct = max_id;
+	correction.min_correct = min_id;
+
+	IDatabaseCursor* cursor = filesdao->getFileBackupEntries(backupid, min_id, max_id);
 
 	bool modified_file_entry_index = false;
 
-	db_single_result res;
-	while(cursor->next(res))
+	ServerFilesDao::SFileBackupEntry entry;
+	while(filesdao->getFileBackupEntriesNext(cursor, entry))
 	{
-		int64 id = watoi64(res["id"]);
+		int64 id = entry.id;
 
-		int64 filesize = watoi64(res["filesize"]);
-		int64 rsize = watoi64(res["rsize"]);
-		int clientid = watoi(res["clientid"]);
-		int backupid = watoi(res["backupid"]);
-		int incremental = watoi(res["incremental"]);
-		int64 next_entry = watoi64(res["next_entry"]);
-		int64 prev_entry = watoi64(res["prev_entry"]);
-		int pointed_to = watoi(res["pointed_to"]);
+		int64 filesize = entry.filesize;
+		int64 rsize = entry.rsize;
+		int clientid = entry.clientid;
+		int backupid = entry.backupid;
+		int incremental = entry.incremental;
+		int64 next_entry = entry.next_entry;
+		int64 prev_entry = entry.prev_entry;
+		int pointed_to = entry.pointed_to;
 
 		std::map<int64, int64>::iterator it_next = correction.next_entries.find(id);
 		if (it_next != correction.next_entries.end())
@@ -2610,10 +2705,10 @@ void ServerCleanupThread::removeFileBackupSql( int backupid )
 			modified_file_entry_index = true;
 		}
 
-		BackupServerHash::deleteFileSQL(*filesdao, *fileindex.get(), res["shahash"].c_str(),
+		BackupServerHash::deleteFileSQL(*filesdao, *fileindex.get(), entry.shahash.c_str(),
 			filesize, rsize, clientid, backupid, incremental, id, prev_entry, next_entry, pointed_to, false, false, false, true, &correction);
 	}
-	filesdao->getDatabase()->destroyQuery(q_iterate);
+	cursor->shutdown();
 
 	for (std::map<int64, int64>::iterator it_next = correction.next_entries.begin();
 		 it_next != correction.next_entries.end(); ++it_next)
@@ -2633,16 +2728,12 @@ void ServerCleanupThread::removeFileBackupSql( int backupid )
 		filesdao->setPointedTo(it_pointed_to->second, it_pointed_to->first);
 	}
 
-	filesdao->deleteFiles(backupid);
+	filesdao->deleteFilesRange(backupid, min_id, max_id);
 
 	if (modified_file_entry_index)
 	{
 		FileIndex::flush();
 	}
-
-	filesdao->endTransaction();
-
-	cleanupdao->removeFileBackup(backupid);
 }
 
 bool ServerCleanupThread::backup_clientlists()
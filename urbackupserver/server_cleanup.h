@@ -164,7 +164,10 @@ private:
 
 	bool deleteFileBackup(const std::string &backupfolder, int clientid, int backupid, bool force_remove=false);
 
-	void removeFileBackupSql( int backupid );
+	bool removeFileBackupSql( int backupid );
+	void removeFileBackupEntriesSql(int backupid, int64 min_id, int64 max_id);
+
+	void removeFileManifestStats(int backupid);
 
 	void deletePendingClients(void);
 
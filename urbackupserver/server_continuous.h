@@ -67,7 +67,7 @@ public:
 
 	BackupServerContinuous(ClientMain* client_main, const std::string& continuous_path, const std::string& continuous_hash_path, const std::string& continuous_path_backup,
 		const std::string& tmpfile_path, bool use_tmpfiles, int clientid, const std::string& clientname, int backupid, bool use_snapshots, bool use_reflink,
-		IPipe* hashpipe_prepare)
+		HashWorkQueue* hashpipe_prepare)
 		: client_main(client_main), collect_only(true), first_compaction(true), stop(false), continuous_path(continuous_path), continuous_hash_path(continuous_hash_path),
 		continuous_path_backup(continuous_path_backup),
 		tmpfile_path(tmpfile_path), use_tmpfiles(use_tmpfiles), clientid(clientid), clientname(clientname), backupid(backupid),
@@ -930,7 +930,7 @@ private:
 	std::string clientname;
 
 	int backupid;
-	IPipe* hashpipe_prepare;
+	HashWorkQueue* hashpipe_prepare;
 
 	std::auto_ptr<BackupServerHash> local_hash;
 
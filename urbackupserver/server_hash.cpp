@@ -33,6 +33,8 @@
 #include <memory.h>
 #include "../urbackupcommon/file_metadata.h"
 #include "FileBackup.h"
+#include "ChunkStore.h"
+#include "ExtentCopy.h"
 #include <assert.h>
 #ifdef _WIN32
 #include <Windows.h>
@@ -40,6 +42,7 @@
 
 const size_t freespace_mod=50*1024*1024; //50 MB
 const size_t BUFFER_SIZE=64*1024; //64KB
+const size_t index_prefetch_size=32;
 
 IMutex * delete_mutex=NULL;
 
@@ -53,19 +56,23 @@ void destroy_mutex1(void)
 	Server->destroy(delete_mutex);
 }
 
-BackupServerHash::BackupServerHash(IPipe *pPipe, int pClientid, bool use_snapshots, bool use_reflink, bool use_tmpfiles, logid_t logid,
+BackupServerHash::BackupServerHash(HashStageQueue* queue, int pClientid, bool use_snapshots, bool use_reflink, bool use_tmpfiles, logid_t logid,
 	bool snapshot_file_inplace, MaxFileId& max_file_id)
 	: use_snapshots(use_snapshots), use_reflink(use_reflink), use_tmpfiles(use_tmpfiles), filesdao(NULL), old_backupfolders_loaded(false),
 	  logid(logid), snapshot_file_inplace(snapshot_file_inplace), max_file_id(max_file_id)
 {
-	pipe=pPipe;
+	this->queue=queue;
+	curr_seq=-1;
+	entry_batch=NULL;
 	clientid=pClientid;
 	link_logcnt=0;
 	space_logcnt=0;
-	working=false;
 	has_error=false;
 	chunk_patcher.setCallback(this);
+	chunk_patcher.setPrefetchSize(ChunkPatcher::get_default_prefetch_size());
 	fileindex=NULL;
+	index_stats=FileIndexStats::get_client_counters(clientid);
+	kernel_copy_unsupported=false;
 
 	if(use_reflink)
 		ServerLogger::Log(logid, "Reflink copying is enabled", LL_DEBUG);
@@ -73,11 +80,6 @@ BackupServerHash::BackupServerHash(IPipe *pPipe, int pClientid, bool use_snapsho
 
 BackupServerHash::~BackupServerHash(void)
 {
-	if(pipe!=NULL)
-	{
-		Server->destroy(pipe);
-	}
-
 	delete fileindex;
 }
 
@@ -105,196 +107,206 @@ void BackupServerHash::operator()(void)
 {
 	setupDatabase();
 
+	std::deque<SHashWorkItem*> items;
+
 	while(true)
 	{
-		working=false;
-		std::string data;
-		size_t rc=pipe->Read(&data, static_cast<int>(60000) );
-		if(rc==0)
+		int flush_timeout=-1;
+		if(entry_batch!=NULL)
 		{
-			link_logcnt=0;
-			space_logcnt=0;
-			continue;
+			flush_timeout=entry_batch->flush_due(*filesdao, *fileindex);
 		}
-		
-		working=true;
-		if(data=="exit")
+
+		if(items.empty())
+		{
+			SHashWorkItem* next_item=queue->next(flush_timeout>=0 ? flush_timeout : 60000);
+			if(next_item==NULL)
+			{
+				if(flush_timeout<0)
+				{
+					link_logcnt=0;
+					space_logcnt=0;
+				}
+				continue;
+			}
+
+			items.push_back(next_item);
+			prefetchIndex(items);
+		}
+
+		std::auto_ptr<SHashWorkItem> item(items.front());
+		items.pop_front();
+
+		if(item->type==SHashWorkItem::EType_Exit)
 		{
+			if(entry_batch!=NULL)
+			{
+				entry_batch->flush(*filesdao, *fileindex);
+			}
+			queue->worker_exit();
 			deinitDatabase();
 			Server->Log("server_hash Thread finished - normal");
 			Server->destroyDatabases(Server->getThreadID());
 			delete this;
 			return;
 		}
-		else if(data=="flush")
+		else if(item->type==SHashWorkItem::EType_Flush)
 		{
+			if(entry_batch!=NULL)
+			{
+				entry_batch->flush(*filesdao, *fileindex);
+			}
 			continue;
 		}
 
-		if(rc>0)
-		{
-			CRData rd(&data);
-
-			int iaction;
-			rd.getInt(&iaction);
-			EAction action=static_cast<EAction>(iaction);
-
-			if(action==EAction_LinkOrCopy)
-			{
-				int64 fileid;
-				rd.getVarInt(&fileid);
-
-				std::string temp_fn;
-				rd.getStr(&temp_fn);
-
-				int backupid;
-				rd.getInt(&backupid);
-
-				int incremental;
-				rd.getInt(&incremental);
-
-				char with_hashes;
-				rd.getChar(&with_hashes);
-
-				std::string tfn;
-				rd.getStr(&tfn);
-
-				std::string hashpath;
-				rd.getStr(&hashpath);
+		int64 seq=item->seq;
+		curr_seq=seq;
 
-				std::string sha2;
-				if(!rd.getStr(&sha2))
-					ServerLogger::Log(logid, "Reading hash from pipe failed", LL_ERROR);
-
-				if(sha2.size()!=SHA_DEF_DIGEST_SIZE)
-					ServerLogger::Log(logid, "SHA length of file hash of \""+tfn+"\" wrong.", LL_ERROR);
-
-				std::string hashoutput_fn;
-				rd.getStr(&hashoutput_fn);
-
-				std::string old_file_fn;
-				rd.getStr(&old_file_fn);
-
-				int64 t_filesize;
-				rd.getInt64(&t_filesize);
+		if(item->type==SHashWorkItem::EType_LinkOrCopy)
+		{
+			const std::string& sha2=item->sha2;
 
-				std::string sparse_extents_fn;
-				rd.getStr(&sparse_extents_fn);
+			if(sha2.size()!=SHA_DEF_DIGEST_SIZE)
+				ServerLogger::Log(logid, "SHA length of file hash of \""+item->tfn+"\" wrong.", LL_ERROR);
 
-				FileMetadata metadata;
-				metadata.read(rd);
-				metadata.set_shahash(sha2);
+			item->metadata.set_shahash(sha2);
 
-				IFile *tf=Server->openFile(os_file_prefix((temp_fn)), MODE_READ_SEQUENTIAL);
+			IFile *tf=item->releaseTempFile(MODE_READ_SEQUENTIAL);
 
-				if(tf==NULL)
-				{
-					ServerLogger::Log(logid, "Error opening file \""+temp_fn+"\" from pipe for reading ec="+convert(os_last_error()), LL_ERROR);
-					has_error=true;
-				}
-				else
+			if(tf==NULL)
+			{
+				ServerLogger::Log(logid, "Error opening file \""+item->temp_fn+"\" from pipe for reading ec="+convert(os_last_error()), LL_ERROR);
+				has_error=true;
+			}
+			else
+			{
+				std::auto_ptr<ExtentIterator> extent_iterator;
+				if (!item->sparse_extents_fn.empty())
 				{
-					std::auto_ptr<ExtentIterator> extent_iterator;
-					if (!sparse_extents_fn.empty())
-					{
-						IFile* sparse_extents_f = Server->openFile(sparse_extents_fn, MODE_READ);
-
-						if (sparse_extents_f != NULL)
-						{
-							extent_iterator.reset(new ExtentIterator(sparse_extents_f));
-						}
-					}
+					IFile* sparse_extents_f = Server->openFile(item->sparse_extents_fn, MODE_READ);
 
-					addFile(backupid, incremental, tf, tfn, hashpath, sha2,
-						old_file_fn, hashoutput_fn, t_filesize, metadata, with_hashes!=0, extent_iterator.get(), fileid);
+					if (sparse_extents_f != NULL)
+					{
+						extent_iterator.reset(new ExtentIterator(sparse_extents_f));
+					}
 				}
 
-				if(!hashoutput_fn.empty())
-				{
-					Server->deleteFile(hashoutput_fn);
-				}
+				//Files with the same hash may link to each other
+				queue->wait_key(seq);
 
-				max_file_id.setMaxDownloaded(fileid);
+				addFile(item->backupid, item->incremental, tf, item->tfn, item->hashpath, sha2,
+					item->old_file_fn, item->hashoutput_fn, item->t_filesize, item->metadata, item->with_hashes,
+					extent_iterator.get(), item->fileid);
 			}
-			else if(action==EAction_Copy)
-			{
-				int64 fileid;
-				bool b = rd.getVarInt(&fileid);
-				assert(b);
 
-				std::string source;
-				b = rd.getStr(&source);
-				assert(b);
-				
-				std::string dest;
-				b = rd.getStr(&dest);
-				assert(b);
-
-				std::string hash_src;
-				b = rd.getStr(&hash_src);
-				assert(b);
+			if(!item->hashoutput_fn.empty())
+			{
+				Server->deleteFile(item->hashoutput_fn);
+			}
 
-				std::string hash_dest;
-				b = rd.getStr(&hash_dest);
-				assert(b);
+			queue->wait_turn(seq);
+			max_file_id.setMaxDownloaded(item->fileid);
+		}
+		else if(item->type==SHashWorkItem::EType_Copy)
+		{
+			const std::string& source=item->temp_fn;
+			const std::string& dest=item->tfn;
+			const std::string& hash_src=item->hashpath;
+			const std::string& hash_dest=item->hashoutput_fn;
 
-				FileMetadata metadata;
-				metadata.read(rd);
-				
-				FileMetadata src_metadata;
-				if(read_metadata(os_file_prefix(hash_src),
-					src_metadata))
-				{
-					metadata.set_shahash(src_metadata.shahash);
-				}
+			FileMetadata src_metadata;
+			if(read_metadata(os_file_prefix(hash_src),
+				src_metadata))
+			{
+				item->metadata.set_shahash(src_metadata.shahash);
+			}
 
-				std::auto_ptr<IFile> tf(Server->openFile(os_file_prefix(source), MODE_READ_SEQUENTIAL));
+			std::auto_ptr<IFile> tf(Server->openFile(os_file_prefix(source), MODE_READ_SEQUENTIAL));
 
-				if(!tf.get())
+			if(!tf.get())
+			{
+				ServerLogger::Log(logid, "Error opening file \""+source+"\" from pipe for reading ec="+convert(os_last_error()), LL_ERROR);
+				has_error=true;
+			}
+			else
+			{
+				if(!copyFile(tf.get(), dest, NULL))
 				{
-					ServerLogger::Log(logid, "Error opening file \""+source+"\" from pipe for reading ec="+convert(os_last_error()), LL_ERROR);
+					ServerLogger::Log(logid, "Error while copying file \""+source+"\" to \""+dest+"\"", LL_ERROR);
 					has_error=true;
 				}
-				else
-				{
-					if(!copyFile(tf.get(), dest, NULL))
-					{
-						ServerLogger::Log(logid, "Error while copying file \""+source+"\" to \""+dest+"\"", LL_ERROR);
-						has_error=true;
-					}
 
-					if(!hash_src.empty())
+				if(!hash_src.empty())
+				{
+					std::auto_ptr<IFile> hashf(Server->openFile(os_file_prefix(hash_src), MODE_READ_SEQUENTIAL));
+					if(hashf.get())
 					{
-						std::auto_ptr<IFile> hashf(Server->openFile(os_file_prefix(hash_src), MODE_READ_SEQUENTIAL));
-						if(hashf.get())
-						{
-							copyFile(hashf.get(), hash_dest, NULL);
-						}
+						copyFile(hashf.get(), hash_dest, NULL);
 					}
 				}
 			}
 		}
+
+		queue->done(seq);
+		curr_seq=-1;
 	}
 }
 
 void BackupServerHash::addFileSQL(int backupid, int clientid, int incremental, const std::string &fp, const std::string &hash_path, const std::string &shahash, _i64 filesize, _i64 rsize, int64 prev_entry, int64 prev_entry_clientid, int64 next_entry, bool update_fileindex)
 {
+	if(curr_seq!=-1)
+	{
+		//File entries are added in input order
+		queue->wait_turn(curr_seq);
+	}
+
+	if(entry_batch!=NULL && queue!=NULL)
+	{
+		entry_batch->add(*filesdao, *fileindex, prepareFileSQL(*filesdao, *fileindex, backupid, clientid, incremental, fp, hash_path,
+			shahash, filesize, rsize, prev_entry, prev_entry_clientid, next_entry, update_fileindex));
+		return;
+	}
+
 	addFileSQL(*filesdao, *fileindex, backupid, clientid, incremental, fp, hash_path, shahash, filesize, rsize, prev_entry, prev_entry_clientid, next_entry, update_fileindex);
 }
 
 void BackupServerHash::addFileSQL(ServerFilesDao& filesdao, FileIndex& fileindex, int backupid, const int clientid, int incremental, const std::string &fp,
 	const std::string &hash_path, const std::string &shahash, _i64 filesize, _i64 rsize, int64 prev_entry, int64 prev_entry_clientid, int64 next_entry, bool update_fileindex)
 {
+	std::vector<FileEntryBatch::SEntry> entries;
+	entries.push_back(prepareFileSQL(filesdao, fileindex, backupid, clientid, incremental, fp, hash_path,
+		shahash, filesize, rsize, prev_entry, prev_entry_clientid, next_entry, update_fileindex));
+	FileEntryBatch::write(filesdao, fileindex, entries, false);
+}
+
+FileEntryBatch::SEntry BackupServerHash::prepareFileSQL(ServerFilesDao& filesdao, FileIndex& fileindex, int backupid, const int clientid, int incremental, const std::string &fp,
+	const std::string &hash_path, const std::string &shahash, _i64 filesize, _i64 rsize, int64 prev_entry, int64 prev_entry_clientid, int64 next_entry, bool update_fileindex)
+{
+	FileEntryBatch::SEntry ret;
+	ret.file.backupid = backupid;
+	ret.file.fullpath = fp;
+	ret.file.hashpath = hash_path;
+	ret.file.shahash = shahash;
+	ret.file.filesize = filesize;
+	ret.file.rsize = rsize;
+	ret.file.clientid = clientid;
+	ret.file.incremental = incremental;
+	ret.file.next_entry = 0;
+	ret.file.prev_entry = 0;
+	ret.file.pointed_to = 0;
+
 	if (filesize < link_file_min_size)
 	{
 		assert(prev_entry_clientid == 0);
 		assert(prev_entry == 0);
 		assert(next_entry == 0);
-		filesdao.addIncomingFile(filesize, clientid, backupid, std::string(), ServerFilesDao::c_direction_incoming, incremental);
-		filesdao.addFileEntryExternal(backupid, fp, hash_path, shahash, filesize, rsize, clientid, incremental, next_entry, prev_entry, 0);
-		return;
+		ret.add_incoming = true;
+		ret.manifest = true;
+		return ret;
 	}
 
+	FileEntryBatch::flush_pending(filesdao, fileindex, shahash, filesize);
+
 	bool new_for_client=false;
 
 	if(prev_entry_clientid!=clientid || prev_entry==0)
@@ -335,7 +347,8 @@ void BackupServerHash::addFileSQL(ServerFilesDao& filesdao, FileIndex& fileindex
 		
 		if(prev_entry==0)
 		{
-			filesdao.addIncomingFile(filesize, clientid, backupid, clients, ServerFilesDao::c_direction_incoming, incremental);
+			ret.add_incoming = true;
+			ret.incoming_clients = clients;
 		}
 		else
 		{
@@ -366,28 +379,45 @@ void BackupServerHash::addFileSQL(ServerFilesDao& filesdao, FileIndex& fileindex
 
 			if(fentry.exists && fentry.value!=0)
 			{
-				filesdao.setPointedTo(0, prev_entry);
+				ret.clear_pointed_to = prev_entry;
 			}
 			else
 			{
-				int64 client_entryid = fileindex.get_with_cache_exact(FileIndex::SIndexKey(shahash.c_str(), filesize, clientid));
-				if(client_entryid!=0)
-				{
-					filesdao.setPointedTo(0, client_entryid);
-				}
+				ret.clear_pointed_to = fileindex.get_with_cache_exact(FileIndex::SIndexKey(shahash.c_str(), filesize, clientid));
 			}
 		}
 	}
 
-	int64 entryid = filesdao.addFileEntryExternal(backupid, fp, hash_path, shahash, filesize, rsize, clientid, incremental, next_entry, prev_entry, (new_for_client || update_fileindex)?1:0);
+	ret.file.next_entry = next_entry;
+	ret.file.prev_entry = prev_entry;
+	ret.file.pointed_to = (new_for_client || update_fileindex)?1:0;
+	ret.put_index = new_for_client || update_fileindex;
+
+	return ret;
+}
+
+void BackupServerHash::setFileEntryBatch(FileEntryBatch* batch)
+{
+	entry_batch = batch;
+}
+
+void BackupServerHash::changeFileIndexDelayed(ServerFilesDao& filesdao, FileIndex& fileindex, const char* pHash, _i64 filesize, int clientid, int64 value)
+{
+	FileIndex::start_add_entry();
+
+	filesdao.addIndexJournalEntry(std::string(pHash, bytes_in_index), filesize, clientid, value);
+	FileIndex::added_journal_entry(filesdao.getLastId());
 
-	if(new_for_client || update_fileindex)
+	if (value == 0)
 	{
-		FILEENTRY_DEBUG(Server->Log("New fileindex entry for \"" + fp + "\""
-			" id=" + convert(entryid)
-			+" hash="+base64_encode(reinterpret_cast<const unsigned char*>(shahash.c_str()), bytes_in_index), LL_DEBUG));
-		fileindex.put_delayed(FileIndex::SIndexKey(shahash.c_str(), filesize, clientid), entryid);
+		fileindex.del_delayed(FileIndex::SIndexKey(pHash, filesize, clientid));
 	}
+	else
+	{
+		fileindex.put_delayed(FileIndex::SIndexKey(pHash, filesize, clientid), value);
+	}
+
+	FileIndex::end_add_entry();
 }
 
 void BackupServerHash::deleteFileSQL(ServerFilesDao& filesdao, FileIndex& fileindex, int64 id)
@@ -509,7 +539,7 @@ void BackupServerHash::deleteFileSQL(ServerFilesDao& filesdao, FileIndex& filein
 		{
 			FILEENTRY_DEBUG(Server->Log("Delete file index entry id=" + convert(id)+ " filesize="+convert(filesize)+" hash=" 
 				+ base64_encode(reinterpret_cast<const unsigned char*>(pHash), bytes_in_index), LL_DEBUG));
-			fileindex.del_delayed(FileIndex::SIndexKey(pHash, filesize, clientid));
+			changeFileIndexDelayed(filesdao, fileindex, pHash, filesize, clientid, 0);
 		}
 	}
 	else if(pointed_to)
@@ -529,7 +559,7 @@ void BackupServerHash::deleteFileSQL(ServerFilesDao& filesdao, FileIndex& filein
 				filesdao.setPointedTo(1, next_id);
 			}
 
-			fileindex.put_delayed(FileIndex::SIndexKey(pHash, filesize, clientid), next_id);
+			changeFileIndexDelayed(filesdao, fileindex, pHash, filesize, clientid, next_id);
 
 			FILEENTRY_DEBUG(Server->Log("Changed file index entry filesize="+convert(filesize)+" hash=" 
 				+ base64_encode(reinterpret_cast<const unsigned char*>(pHash), bytes_in_index)
@@ -550,7 +580,7 @@ void BackupServerHash::deleteFileSQL(ServerFilesDao& filesdao, FileIndex& filein
 				filesdao.setPointedTo(1, prev_id);
 			}
 
-			fileindex.put_delayed(FileIndex::SIndexKey(pHash, filesize, clientid), prev_id);
+			changeFileIndexDelayed(filesdao, fileindex, pHash, filesize, clientid, prev_id);
 
 			FILEENTRY_DEBUG(Server->Log("Changed file index entry filesize="+convert(filesize)+" hash = " 
 				+ base64_encode(reinterpret_cast<const unsigned char*>(pHash), bytes_in_index)
@@ -614,6 +644,9 @@ bool BackupServerHash::findFileAndLink(const std::string &tfn, IFile *tf, std::s
 	bool first_logmsg=true;
 	bool copy=true;
 
+	//Entries of this hash may still be pending in a batch
+	FileEntryBatch::flush_pending(*filesdao, *fileindex, sha2, t_filesize);
+
 	SFindState find_state;
 	ServerFilesDao::SFindFileEntry existing_file = findFileHash(sha2, t_filesize, clientid, find_state);
 
@@ -1046,6 +1079,12 @@ void BackupServerHash::addFile(int backupid, int incremental, IFile *tf, const s
 						metadata.rsize=cow_filesize;
 					}
 
+					if(use_reflink && ChunkStore::is_enabled()
+						&& t_filesize>=ChunkStore::get_min_filesize())
+					{
+						addFileChunks(backupid, tfn, hash_fn, t_filesize);
+					}
+
 					if(!write_file_metadata(hash_fn, this, metadata, false))
 					{
 						ServerLogger::Log(logid, "Writing metadata to "+hash_fn+" failed", LL_ERROR);
@@ -1059,6 +1098,28 @@ void BackupServerHash::addFile(int backupid, int incremental, IFile *tf, const s
 	}
 }
 
+void BackupServerHash::addFileChunks(int backupid, const std::string &tfn, const std::string &hash_fn, int64 t_filesize)
+{
+	if(backupfolder.empty())
+	{
+		ServerSettings settings(Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER));
+		backupfolder = settings.getSettings()->backupfolder;
+	}
+
+	int64 shared_bytes;
+	if(ChunkStore::dedup_file(backupfolder, backupid, tfn, hash_fn, t_filesize, shared_bytes))
+	{
+		if(shared_bytes>0)
+		{
+			ServerLogger::Log(logid, "HT: "+PrettyPrintBytes(shared_bytes)+" of \""+tfn+"\" already in chunk store", LL_DEBUG);
+		}
+	}
+	else
+	{
+		ServerLogger::Log(logid, "HT: Could not add \""+tfn+"\" to chunk store", LL_DEBUG);
+	}
+}
+
 bool BackupServerHash::freeSpace(int64 fs, const std::string &fp)
 {
 	IScopedLock lock(delete_mutex);
@@ -1090,6 +1151,48 @@ bool BackupServerHash::freeSpace(int64 fs, const std::string &fp)
 	return b;
 }
 
+void BackupServerHash::prefetchIndex(std::deque<SHashWorkItem*>& items)
+{
+	//Leave queued files to the other workers as well
+	size_t prefetch_size=(std::max)(index_prefetch_size/queue->get_n_workers(), static_cast<size_t>(1));
+
+	SHashWorkItem* item;
+	while(items.size()<prefetch_size
+		&& !items.back()->isControl()
+		&& (item=queue->next(0))!=NULL)
+	{
+		items.push_back(item);
+	}
+
+	std::vector<FileIndex::SIndexKey> keys;
+	for(size_t i=0;i<items.size();++i)
+	{
+		const SHashWorkItem& curr=*items[i];
+		if(curr.type==SHashWorkItem::EType_LinkOrCopy
+			&& curr.sha2.size()==SHA_DEF_DIGEST_SIZE
+			&& curr.t_filesize>=0)
+		{
+			keys.push_back(FileIndex::SIndexKey(curr.sha2.c_str(), curr.t_filesize, clientid));
+		}
+	}
+
+	if(!keys.empty())
+	{
+		//One read transaction for all queued files instead of one per file
+		fileindex->prefetch_batch(keys, index_prefetch);
+	}
+}
+
+std::string BackupServerHash::getStageKey(const SHashWorkItem& item)
+{
+	if(item.type!=SHashWorkItem::EType_LinkOrCopy)
+	{
+		return std::string();
+	}
+
+	return item.sha2+convert(item.t_filesize);
+}
+
 ServerFilesDao::SFindFileEntry BackupServerHash::findFileHash(const std::string &pHash, _i64 filesize, int clientid, SFindState& state)
 {
 	int64 entryid;
@@ -1099,7 +1202,7 @@ ServerFilesDao::SFindFileEntry BackupServerHash::findFileHash(const std::string
 	bool switch_to_next_client=false;
 	if(state.state==0)
 	{
-		entryid = fileindex->get_with_cache_prefer_client(FileIndex::SIndexKey(pHash.c_str(), filesize, clientid));
+		entryid = fileindex->get_with_cache_prefer_client(FileIndex::SIndexKey(pHash.c_str(), filesize, clientid), index_prefetch, index_stats);
 		state.state=1;
 		save_orig=true;
 	}
@@ -1168,7 +1271,7 @@ ServerFilesDao::SFindFileEntry BackupServerHash::findFileHash(const std::string
 	if(switch_to_all_clients)
 	{
 		state.state=3;
-		state.entryids = fileindex->get_all_clients_with_cache(FileIndex::SIndexKey(pHash.c_str(), filesize, 0), false);
+		state.entryids = fileindex->get_all_clients_with_cache(FileIndex::SIndexKey(pHash.c_str(), filesize, 0), false, index_stats);
 		state.client = state.entryids.begin();
 		if(state.client!=state.entryids.end())
 		{
@@ -1205,6 +1308,7 @@ ServerFilesDao::SFindFileEntry BackupServerHash::findFileHash(const std::string
 
 	if(!state.prev.exists)
 	{
+		FileIndexStats::count(index_stats, FileIndexStats::ECounter_DbMiss);
 		ServerLogger::Log(logid, "Entry from file entry index not found. File entry index probably out of sync. (id="+convert(entryid)+")", LL_DEBUG);
 		ServerFilesDao::SFindFileEntry ret;
 		ret.exists=false;
@@ -1213,6 +1317,7 @@ ServerFilesDao::SFindFileEntry BackupServerHash::findFileHash(const std::string
 
 	if(memcmp(state.prev.shahash.data(), pHash.data(), pHash.size())!=0)
 	{
+		FileIndexStats::count(index_stats, FileIndexStats::ECounter_DbMiss);
 		ServerLogger::Log(logid, "Hash of file entry differs from file entry index result. Something may be wrong with the file entry index or this is a hash collision. Ignoring existing file and downloading anew.", LL_DEBUG);
 		ServerLogger::Log(logid, "While searching for file with size "+convert(filesize)+" and clientid "+convert(clientid)+". Resulting file path is \""+state.prev.fullpath+"\". (id="+convert(entryid)+")", LL_DEBUG);
 		ServerFilesDao::SFindFileEntry ret;
@@ -1222,6 +1327,8 @@ ServerFilesDao::SFindFileEntry BackupServerHash::findFileHash(const std::string
 
 	assert(state.prev.filesize == filesize);
 
+	FileIndexStats::count(index_stats, FileIndexStats::ECounter_DbHit);
+
 	if(save_orig && state.prev.exists)
 	{
 		state.orig_prev=state.prev.prev_entry;
@@ -1266,6 +1373,13 @@ bool BackupServerHash::copyFile(IFile *tf, const std::string &dest, ExtentIterat
 		return false;
 	}
 
+	return copyFileData(tf, dst.get(), extent_iterator);
+}
+
+bool BackupServerHash::copyFileData(IFile *tf, IFsFile *dst, ExtentIterator* extent_iterator)
+{
+	std::string dest = dst->getFilename();
+
 	tf->Seek(0);
 	_u32 read;
 	char buf[BUFFER_SIZE];
@@ -1279,7 +1393,12 @@ bool BackupServerHash::copyFile(IFile *tf, const std::string &dest, ExtentIterat
 
 	int64 sparse_max = -1;
 
-	do
+	//The data between the sparse extents is copied in the kernel (or shared
+	//via reflinks) if possible. Falls back to copying it in user space
+	IFsFile* tf_fs = kernel_copy_unsupported ? NULL : dynamic_cast<IFsFile*>(tf);
+	int64 tf_size = tf_fs != NULL ? tf->Size() : -1;
+
+	while(true)
 	{
 		while (curr_extent.offset != -1
 			&& fpos >= curr_extent.offset
@@ -1295,7 +1414,7 @@ bool BackupServerHash::copyFile(IFile *tf, const std::string &dest, ExtentIterat
 				return false;
 			}
 
-			if (!punchHoleOrZero(dst.get(), curr_extent.offset, curr_extent.size))
+			if (!punchHoleOrZero(dst, curr_extent.offset, curr_extent.size))
 			{
 				ServerLogger::Log(logid, "Error adding sparse extent to \"" + dest + "\"", LL_ERROR);
 				return false;
@@ -1310,6 +1429,42 @@ bool BackupServerHash::copyFile(IFile *tf, const std::string &dest, ExtentIterat
 			curr_extent = extent_iterator->nextExtent();
 		}
 
+		if (tf_fs != NULL)
+		{
+			int64 copy_end = tf_size;
+			if (curr_extent.offset != -1)
+			{
+				copy_end = (std::min)(copy_end, curr_extent.offset);
+			}
+
+			if (copy_end > fpos)
+			{
+				bool unsupported;
+				int64 copied = ExtentCopy::copy_range(tf_fs, fpos, dst, fpos, copy_end - fpos, use_reflink, unsupported);
+				fpos += copied;
+
+				if (copied > 0
+					&& (!tf->Seek(fpos) || !dst->Seek(fpos)))
+				{
+					ServerLogger::Log(logid, "Error seeking in \"" + dest + "\" after copying range", LL_ERROR);
+					return false;
+				}
+
+				if (fpos == copy_end)
+				{
+					continue;
+				}
+
+				if (unsupported)
+				{
+					ServerLogger::Log(logid, "Copying file data in the kernel is not supported. Copying in user space.", LL_DEBUG);
+					kernel_copy_unsupported = true;
+				}
+
+				tf_fs = NULL;
+			}
+		}
+
 		_u32 toread = BUFFER_SIZE;
 
 		if (curr_extent.offset != -1
@@ -1327,7 +1482,12 @@ bool BackupServerHash::copyFile(IFile *tf, const std::string &dest, ExtentIterat
 			return false;
 		}
 
-		bool b=writeRepeatFreeSpace(dst.get(), buf, read, this);
+		if (read == 0)
+		{
+			break;
+		}
+
+		bool b=writeRepeatFreeSpace(dst, buf, read, this);
 		if(!b)
 		{
 			ServerLogger::Log(logid, "Error writing to file \""+dest+"\" -2. "+os_last_error_str(), LL_ERROR);
@@ -1338,7 +1498,6 @@ bool BackupServerHash::copyFile(IFile *tf, const std::string &dest, ExtentIterat
 			fpos += read;
 		}
 	}
-	while(read>0);
 
 	if (sparse_max!=-1
 		&& sparse_max > dst->Size())
@@ -1372,17 +1531,29 @@ bool BackupServerHash::copyFileWithHashoutput(IFile *tf, const std::string &dest
 		}
 		ObjectScope dst_hash_s(dst_hash);
 
+		if (!kernel_copy_unsupported
+			&& dynamic_cast<IFsFile*>(tf) != NULL)
+		{
+			//Copy the data in the kernel, then read it only once for the hashes
+			if (!copyFileData(tf, dst, extent_iterator))
+			{
+				return false;
+			}
+
+			if (extent_iterator != NULL)
+			{
+				extent_iterator->reset();
+			}
+
+			return build_chunk_hashs(tf, dst_hash, this, NULL, false, NULL, NULL, false, NULL, extent_iterator);
+		}
+
 		return build_chunk_hashs(tf, dst_hash, this, dst, false, NULL, NULL, false, NULL, extent_iterator);
 	}
 	
 	return true;
 }
 
-bool BackupServerHash::isWorking(void)
-{
-	return working;
-}
-
 bool BackupServerHash::hasError(void)
 {
 	volatile bool r=has_error;
@@ -8,10 +8,13 @@
 #include "../urbackupcommon/os_functions.h"
 #include "ChunkPatcher.h"
 #include "server_prepare_hash.h"
+#include "HashStageQueue.h"
 #include "FileIndex.h"
+#include "FileEntryBatch.h"
 #include "dao/ServerFilesDao.h"
 #include <vector>
 #include <map>
+#include <deque>
 #include "../urbackupcommon/chunk_hasher.h"
 #include "server_log.h"
 #include "../urbackupcommon/ExtentIterator.h"
@@ -37,23 +40,17 @@ struct STmpFile
 class BackupServerHash : public IThread, public INotEnoughSpaceCallback, public IChunkPatcherCallback
 {
 public:
-
-	enum EAction
-	{
-		EAction_LinkOrCopy,
-		EAction_Copy
-	};
-
-	BackupServerHash(IPipe *pPipe, int pClientid, bool use_snapshots, bool use_reflink,
+	BackupServerHash(HashStageQueue* queue, int pClientid, bool use_snapshots, bool use_reflink,
 		bool use_tmpfiles, logid_t logid, bool snapshot_file_inplace, MaxFileId& max_file_id);
 	~BackupServerHash(void);
 
 	void operator()(void);
-	
-	bool isWorking(void);
 
 	bool hasError(void);
 
+	//Key for HashStageQueue, so that files with the same hash are linked in order
+	static std::string getStageKey(const SHashWorkItem& item);
+
 	virtual bool handle_not_enough_space(const std::string &path);
 
 	virtual void next_chunk_patcher_bytes(const char *buf, size_t bsize, bool changed, bool* is_sparse);
@@ -75,6 +72,14 @@ public:
 	static void addFileSQL(ServerFilesDao& filesdao, FileIndex& fileindex, int backupid, int clientid, int incremental, const std::string &fp,
 		const std::string &hash_path, const std::string &shahash, _i64 filesize, _i64 rsize, int64 prev_entry, int64 prev_entry_clientid,
 		int64 next_entry, bool update_fileindex);
+
+	//Does the reads for adding a file entry and returns the writes to do
+	static FileEntryBatch::SEntry prepareFileSQL(ServerFilesDao& filesdao, FileIndex& fileindex, int backupid, int clientid, int incremental, const std::string &fp,
+		const std::string &hash_path, const std::string &shahash, _i64 filesize, _i64 rsize, int64 prev_entry, int64 prev_entry_clientid,
+		int64 next_entry, bool update_fileindex);
+
+	//File entries added by the worker are written in groups with this batch
+	void setFileEntryBatch(FileEntryBatch* batch);
 		
 		
 	static void deleteFileSQL(ServerFilesDao& filesdao, FileIndex& fileindex, int64 id);
@@ -97,6 +102,10 @@ public:
 		bool use_transaction, bool del_entry, bool detach_dbs, bool with_backupstat, SInMemCorrection* correction);
 
 private:
+	//Changes the file entry index entry of a file entry which is deleted (value=0 deletes the index entry).
+	//The change is written to the index journal in the files database, so it is redone if it is lost with the write-behind cache
+	static void changeFileIndexDelayed(ServerFilesDao& filesdao, FileIndex& fileindex, const char* pHash, _i64 filesize, int clientid, int64 value);
+
 	void addFile(int backupid, int incremental, IFile *tf, const std::string &tfn,
 			std::string hash_fn, const std::string &sha2, const std::string &orig_fn, const std::string &hashoutput_fn, int64 t_filesize,
 			FileMetadata& metadata, bool with_hashes, ExtentIterator* extent_iterator, int64 fileid);
@@ -115,9 +124,13 @@ private:
 
 	ServerFilesDao::SFindFileEntry findFileHash(const std::string &pHash, _i64 filesize, int clientid, SFindState& state);
 
+	void prefetchIndex(std::deque<SHashWorkItem*>& items);
+
 	bool copyFile(IFile *tf, const std::string &dest, ExtentIterator* extent_iterator);
+	bool copyFileData(IFile *tf, IFsFile *dst, ExtentIterator* extent_iterator);
 	bool copyFileWithHashoutput(IFile *tf, const std::string &dest, const std::string hash_dest, ExtentIterator* extent_iterator);
 	bool freeSpace(int64 fs, const std::string &fp);
+	void addFileChunks(int backupid, const std::string &tfn, const std::string &hash_fn, int64 t_filesize);
 	
 	int countFilesInTmp(void);
 	IFsFile* openFileRetry(const std::string &dest, int mode, std::string& errstr);
@@ -139,7 +152,9 @@ private:
 
 	ServerFilesDao* filesdao;
 
-	IPipe *pipe;
+	HashStageQueue* queue;
+	int64 curr_seq;
+	FileEntryBatch* entry_batch;
 
 	IDatabase *db;
 
@@ -149,7 +164,6 @@ private:
 
 	int clientid;
 
-	volatile bool working;
 	volatile bool has_error;
 
 	IFsFile *chunk_output_fn;
@@ -160,11 +174,14 @@ private:
 	bool use_reflink;
 	bool use_tmpfiles;
 	bool has_reflink;
+	bool kernel_copy_unsupported;
 	_i64 chunk_patch_pos;
 
 	_i64 cow_filesize;
 
 	FileIndex *fileindex;
+	FileIndex::SBatchPrefetch index_prefetch;
+	FileIndexStats::SCounters* index_stats;
 
 	std::string backupfolder;
 	bool old_backupfolders_loaded;
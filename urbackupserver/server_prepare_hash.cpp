@@ -30,6 +30,8 @@
 #include <memory.h>
 #include "../common/adler32.h"
 #include "../urbackupcommon/file_metadata.h"
+#include "../urbackupcommon/sha2/sha2_impl.h"
+#include "ParallelTreeHash.h"
 
 namespace
 {
@@ -47,242 +49,360 @@ namespace
 	}
 
 	const size_t hash_bsize = 512*1024;
+
+	const size_t max_hash_batch = 64;
 }
 
-BackupServerPrepareHash::BackupServerPrepareHash(IPipe *pPipe, IPipe *pOutput, int pClientid,
+BackupServerPrepareHash::BackupServerPrepareHash(HashStageQueue* queue, int pClientid,
 	logid_t logid, bool ignore_hash_mismatch)
 	: logid(logid), ignore_hash_mismatch(ignore_hash_mismatch)
 {
-	pipe=pPipe;
-	output=pOutput;
+	this->queue=queue;
 	clientid=pClientid;
-	working=false;
 	chunk_patcher.setCallback(this);
 	chunk_patcher.setWithSparse(true);
+	chunk_patcher.setPrefetchSize(ChunkPatcher::get_default_prefetch_size());
 	has_error=false;
+
+#ifdef DO_NOT_USE_CRYPTOPP_SHA
+	//Files are only taken together if they can be hashed in multi-buffer lanes.
+	//Leave queued files to the other workers as well
+	size_t lanes=sha512_mb_lanes();
+	max_batch=lanes>1 ? (std::max)(max_hash_batch/queue->get_n_workers(), lanes) : 1;
+#else
+	max_batch=1;
+#endif
 }
 
 BackupServerPrepareHash::~BackupServerPrepareHash(void)
 {
-	Server->destroy(pipe);
 }
 
 void BackupServerPrepareHash::operator()(void)
 {
 	while(true)
 	{
-		working=false;
-		std::string data;
-		size_t rc=pipe->Read(&data);
-		if(data=="exit")
-		{
-			output->Write("exit");
-			Server->Log("server_prepare_hash Thread finished (exit)");
-			delete this;
-			return;
-		}
-		else if(data=="flush")
+		SHashWorkItem* item=queue->next();
+		if(item==NULL)
 		{
 			continue;
 		}
 
-		if(rc>0)
+		std::vector<SHashWorkItem*> items;
+		SHashWorkItem* control=NULL;
+		if(item->isControl())
 		{
-			working=true;
-			
-			CRData rd(&data);
+			control=item;
+		}
+		else
+		{
+			items.reserve(max_batch);
+			items.push_back(item);
 
-			int64 fileid;
-			rd.getVarInt(&fileid);
+			//Take the files which are already queued as well, so small files can be hashed together
+			while(items.size()<max_batch
+				&& (item=queue->next(0))!=NULL)
+			{
+				if(item->isControl())
+				{
+					control=item;
+					break;
+				}
 
-			std::string temp_fn;
-			rd.getStr(&temp_fn);
+				items.push_back(item);
+			}
+		}
+
+		for(size_t i=0;i<items.size();++i)
+		{
+			if(!openItem(*items[i]))
+			{
+				queue->put(items[i]->seq, NULL);
+				delete items[i];
+				items[i]=NULL;
+			}
+		}
 
-			int backupid;
-			rd.getInt(&backupid);
+#ifdef DO_NOT_USE_CRYPTOPP_SHA
+		hashItemsMulti(items);
+#endif
 
-			int incremental;
-			rd.getInt(&incremental);
+		for(size_t i=0;i<items.size();++i)
+		{
+			SHashWorkItem* curr=items[i];
+			if(curr==NULL)
+			{
+				continue;
+			}
 
-			char with_hashes;
-			rd.getChar(&with_hashes);
+			if(curr->sha2.empty())
+			{
+				hashItem(*curr);
+			}
 
-			std::string tfn;
-			rd.getStr(&tfn);
+			finishItem(*curr);
 
-			std::string hashpath;
-			rd.getStr(&hashpath);
+			queue->put(curr->seq, curr);
+		}
 
-			std::string hashoutput_fn;
-			rd.getStr(&hashoutput_fn);
+		if(control!=NULL)
+		{
+			bool is_exit=control->type==SHashWorkItem::EType_Exit;
+			delete control;
 
-			bool diff_file=!hashoutput_fn.empty();
+			if(is_exit)
+			{
+				if(queue->worker_exit())
+				{
+					queue->put_output(SHashWorkItem::EType_Exit);
+				}
+				Server->Log("server_prepare_hash Thread finished (exit)");
+				delete this;
+				return;
+			}
+		}
+	}
+}
 
-			std::string old_file_fn;
-			rd.getStr(&old_file_fn);
+bool BackupServerPrepareHash::openItem(SHashWorkItem& item)
+{
+	bool diff_file=!item.hashoutput_fn.empty();
 
-			int64 t_filesize;
-			rd.getInt64(&t_filesize);
+	IFile *tf=item.releaseTempFile(MODE_READ);
+	IFile *old_file=NULL;
+	if(diff_file)
+	{
+		old_file=Server->openFile(os_file_prefix((item.old_file_fn)), MODE_READ);
+		if(old_file==NULL)
+		{
+			ServerLogger::Log(logid, "Error opening file \""+item.old_file_fn+"\" for reading. File: old_file. "+os_last_error_str()+" Target path: \""+item.tfn+"\"", LL_ERROR);
+			has_error=true;
+			if(tf!=NULL) Server->destroy(tf);
+			return false;
+		}
+	}
 
-			std::string client_sha_dig;
-			rd.getStr(&client_sha_dig);
+	if(tf==NULL)
+	{
+		ServerLogger::Log(logid, "Error opening file \""+item.temp_fn+"\" for reading file. File: temp_fn. "+os_last_error_str()+" Target path: \""+item.tfn+"\"", LL_ERROR);
+		has_error=true;
+		if(old_file!=NULL)
+		{
+			Server->destroy(old_file);
+		}
+		return false;
+	}
 
-			std::string sparse_extents_fn;
-			rd.getStr(&sparse_extents_fn);
+	item.tf = tf;
+	item.old_file = old_file;
+	return true;
+}
 
-			char c_hash_func;
-			rd.getChar(&c_hash_func);
+void BackupServerPrepareHash::hashItem(SHashWorkItem& item)
+{
+	IFile* tf = item.tf;
+	bool diff_file=!item.hashoutput_fn.empty();
 
-			char c_has_snapshot;
-			rd.getChar(&c_has_snapshot);
+	std::auto_ptr<ExtentIterator> extent_iterator;
+	if (!item.sparse_extents_fn.empty())
+	{
+		IFile* sparse_extents_f = Server->openFile(item.sparse_extents_fn, MODE_READ);
 
-			bool has_snapshot = c_has_snapshot == 1;
-			
-			FileMetadata metadata;
-			metadata.read(rd);
+		if (sparse_extents_f != NULL)
+		{
+			extent_iterator.reset(new ExtentIterator(sparse_extents_f, true, hash_bsize));
+		}
+	}
 
-			IFile *tf=Server->openFile(os_file_prefix((temp_fn)), MODE_READ);
-			IFile *old_file=NULL;
-			if(diff_file)
+	ServerLogger::Log(logid, "PT: Hashing file \""+ExtractFileName(item.tfn)+"\"", LL_DEBUG);
+	std::string& h = item.sha2;
+	if(!diff_file)
+	{
+		if (item.hash_func == HASH_FUNC_SHA512_NO_SPARSE
+			|| item.hash_func == HASH_FUNC_SHA512)
+		{
+			HashSha512 hashsha;
+			if (hash_sha(tf, extent_iterator.get(), item.hash_func != HASH_FUNC_SHA512_NO_SPARSE, hashsha))
 			{
-				old_file=Server->openFile(os_file_prefix((old_file_fn)), MODE_READ);
-				if(old_file==NULL)
-				{
-					ServerLogger::Log(logid, "Error opening file \""+old_file_fn+"\" for reading. File: old_file. "+os_last_error_str()+" Target path: \""+tfn+"\"", LL_ERROR);
-					has_error=true;
-					if(tf!=NULL) Server->destroy(tf);
-					continue;
-				}
+				h = hashsha.finalize();
 			}
-
-			if(tf==NULL)
+		}
+		else
+		{
+			TreeHash treehash(NULL);
+			if (hash_sha(tf, extent_iterator.get(), true, treehash))
 			{
-				ServerLogger::Log(logid, "Error opening file \""+temp_fn+"\" for reading file. File: temp_fn. "+os_last_error_str()+" Target path: \""+tfn+"\"", LL_ERROR);
-				has_error=true;
-				if(old_file!=NULL)
-				{
-					Server->destroy(old_file);
-				}
+				h = treehash.finalize();
 			}
-			else
+		}
+		
+	}
+	else
+	{
+		if (item.hash_func == HASH_FUNC_SHA512_NO_SPARSE
+			|| item.hash_func == HASH_FUNC_SHA512)
+		{
+			hashoutput_f = NULL;
+			HashSha512 hashsha;
+			hashf = &hashsha;
+			if (hash_with_patch(item.old_file, tf, extent_iterator.get(), item.hash_func != HASH_FUNC_SHA512_NO_SPARSE))
 			{
-				std::auto_ptr<ExtentIterator> extent_iterator;
-				if (!sparse_extents_fn.empty())
-				{
-					IFile* sparse_extents_f = Server->openFile(sparse_extents_fn, MODE_READ);
+				h = hashsha.finalize();
+			}
+		}
+		else
+		{
+			std::auto_ptr<IFile> l_hashoutput_f(Server->openFile(os_file_prefix(item.hashoutput_fn), MODE_READ));
+			hashoutput_f = l_hashoutput_f.get();
+			ParallelTreeHash treehash(ParallelTreeHash::get_num_threads());
+			hashf = &treehash;
+			if (hash_with_patch(item.old_file, tf, extent_iterator.get(), true))
+			{
+				h = treehash.finalize();
+			}
+			hashoutput_f = NULL;
+		}
+	}
+}
 
-					if (sparse_extents_f != NULL)
-					{
-						extent_iterator.reset(new ExtentIterator(sparse_extents_f, true, hash_bsize));
-					}
-				}
+#ifdef DO_NOT_USE_CRYPTOPP_SHA
+void BackupServerPrepareHash::hashItemsMulti(std::vector<SHashWorkItem*>& items)
+{
+	size_t lanes = sha512_mb_lanes();
+	if (lanes < 2)
+	{
+		return;
+	}
 
-				ServerLogger::Log(logid, "PT: Hashing file \""+ExtractFileName(tfn)+"\"", LL_DEBUG);
-				std::string h;
-				if(!diff_file)
-				{
-					if (c_hash_func == HASH_FUNC_SHA512_NO_SPARSE
-						|| c_hash_func == HASH_FUNC_SHA512)
-					{
-						HashSha512 hashsha;
-						if (hash_sha(tf, extent_iterator.get(), c_hash_func != HASH_FUNC_SHA512_NO_SPARSE, hashsha))
-						{
-							h = hashsha.finalize();
-						}
-					}
-					else
-					{
-						TreeHash treehash(NULL);
-						if (hash_sha(tf, extent_iterator.get(), true, treehash))
-						{
-							h = treehash.finalize();
-						}
-					}
-					
-				}
-				else
-				{
-					if (c_hash_func == HASH_FUNC_SHA512_NO_SPARSE
-						|| c_hash_func == HASH_FUNC_SHA512)
-					{
-						hashoutput_f = NULL;
-						HashSha512 hashsha;
-						hashf = &hashsha;
-						if (hash_with_patch(old_file, tf, extent_iterator.get(), c_hash_func != HASH_FUNC_SHA512_NO_SPARSE))
-						{
-							h = hashsha.finalize();
-						}
-					}
-					else
-					{
-						std::auto_ptr<IFile> l_hashoutput_f(Server->openFile(os_file_prefix(hashoutput_fn), MODE_READ));
-						hashoutput_f = l_hashoutput_f.get();
-						TreeHash treehash(NULL);
-						hashf = &treehash;
-						if (hash_with_patch(old_file, tf, extent_iterator.get(), true))
-						{
-							h = treehash.finalize();
-						}
-						hashoutput_f = NULL;
-					}
-				}
+	//Files which fit into one read and have no sparse extents. They are
+	//read completely and hashed together in SIMD lanes
+	std::vector<SHashWorkItem*> group;
+	for (size_t i = 0; i < items.size(); ++i)
+	{
+		SHashWorkItem* item = items[i];
+		if (item != NULL
+			&& item->old_file == NULL
+			&& (item->hash_func == HASH_FUNC_SHA512_NO_SPARSE
+				|| item->hash_func == HASH_FUNC_SHA512)
+			&& item->sparse_extents_fn.empty()
+			&& item->t_filesize < static_cast<int64>(hash_bsize))
+		{
+			group.push_back(item);
+		}
 
-				if (h.empty())
-				{
-					ServerLogger::Log(logid, "Error while hashing file \"" + tf->getFilename() + "\" (destination: \""+ tfn+"\"). Failing backup.", LL_ERROR);
-					has_error = true;
-				}
-				else if(!client_sha_dig.empty() && h!=client_sha_dig)
-				{
-					if (has_snapshot)
-					{
-						ServerLogger::Log(logid, "Client calculated hash of \"" + tfn + "\" differs from server calculated hash. "
-							"This may be caused by a bug or by random bit flips on the client or server hard disk. "
-							+(ignore_hash_mismatch?"":"Failing backup. ")+
-							"(Hash: "+ print_hash_func(c_hash_func)+
-							", client hash: "+base64_encode(reinterpret_cast<const unsigned char*>(client_sha_dig.data()), static_cast<unsigned int>(client_sha_dig.size()))+
-							", server hash: "+ base64_encode(reinterpret_cast<const unsigned char*>(h.data()), static_cast<unsigned int>(h.size()))+")", LL_ERROR);
-
-						if (!ignore_hash_mismatch)
-						{
-							has_error = true;
-						}
-					}
-					else
-					{
-						ServerLogger::Log(logid, "Client calculated hash of \"" + tfn + "\" differs from server calculated hash. "
-							"The file is being backed up without a snapshot so this is most likely caused by the file changing during the backup. "
-							"The backed up file may be corrupt and not a valid, consistent backup. "
-							"(Hash: "+print_hash_func(c_hash_func) + ")", LL_WARNING);
-					}
-				}
+		if (group.size() == lanes
+			|| (i + 1 == items.size() && !group.empty()))
+		{
+			hashGroupMulti(group);
+			group.clear();
+		}
+	}
+}
 
-				Server->destroy(tf);
-				if(old_file!=NULL)
-				{
-					Server->destroy(old_file);
-				}
-				
-				CWData data;
-				data.addInt(BackupServerHash::EAction_LinkOrCopy);
-				data.addVarInt(fileid);
-				data.addString(temp_fn);
-				data.addInt(backupid);
-				data.addInt(incremental);
-				data.addChar(with_hashes);
-				data.addString(tfn);
-				data.addString(hashpath);
-				data.addString(h);
-				data.addString(hashoutput_fn);
-				data.addString(old_file_fn);
-				data.addInt64(t_filesize);
-				data.addString(sparse_extents_fn);
-				metadata.serialize(data);
-
-				output->Write(data.getDataPtr(), data.getDataSize() );
+void BackupServerPrepareHash::hashGroupMulti(const std::vector<SHashWorkItem*>& group)
+{
+	if (mb_bufs.size() < group.size())
+	{
+		mb_bufs.resize(group.size());
+	}
+
+	std::vector<sha512_ctx> ctxs(group.size());
+	std::vector<sha512_ctx*> ctx_ptrs;
+	std::vector<const unsigned char*> msgs;
+	std::vector<size_t> lens;
+	std::vector<SHashWorkItem*> hashed_items;
+
+	for (size_t i = 0; i < group.size(); ++i)
+	{
+		SHashWorkItem& item = *group[i];
+		std::vector<char>& buf = mb_bufs[i];
+		if (buf.size() < hash_bsize)
+		{
+			buf.resize(hash_bsize);
+		}
+
+		//Files which turn out to be larger (or have read errors) are hashed normally
+		bool has_read_error = false;
+		item.tf->Seek(0);
+		_u32 rc = item.tf->Read(buf.data(), hash_bsize, &has_read_error);
+		if (has_read_error || rc == hash_bsize)
+		{
+			continue;
+		}
+
+		ServerLogger::Log(logid, "PT: Hashing file \"" + ExtractFileName(item.tfn) + "\"", LL_DEBUG);
+
+		sha512_init(&ctxs[i]);
+		ctx_ptrs.push_back(&ctxs[i]);
+		msgs.push_back(reinterpret_cast<const unsigned char*>(buf.data()));
+		lens.push_back(rc);
+		hashed_items.push_back(&item);
+	}
+
+	if (hashed_items.empty())
+	{
+		return;
+	}
+
+	sha512_update_multi(ctx_ptrs.data(), msgs.data(), lens.data(), ctx_ptrs.size());
+
+	for (size_t i = 0; i < hashed_items.size(); ++i)
+	{
+		SHashWorkItem& item = *hashed_items[i];
+		item.sha2.resize(SHA512_DIGEST_SIZE);
+		sha512_final(ctx_ptrs[i], reinterpret_cast<unsigned char*>(&item.sha2[0]));
+	}
+}
+#endif //DO_NOT_USE_CRYPTOPP_SHA
+
+void BackupServerPrepareHash::finishItem(SHashWorkItem& item)
+{
+	const std::string& h = item.sha2;
+	const std::string& tfn = item.tfn;
+	if (h.empty())
+	{
+		ServerLogger::Log(logid, "Error while hashing file \"" + item.tf->getFilename() + "\" (destination: \""+ tfn+"\"). Failing backup.", LL_ERROR);
+		has_error = true;
+	}
+	else if(!item.client_sha_dig.empty() && h!=item.client_sha_dig)
+	{
+		if (item.has_snapshot)
+		{
+			ServerLogger::Log(logid, "Client calculated hash of \"" + tfn + "\" differs from server calculated hash. "
+				"This may be caused by a bug or by random bit flips on the client or server hard disk. "
+				+(ignore_hash_mismatch?"":"Failing backup. ")+
+				"(Hash: "+ print_hash_func(item.hash_func)+
+				", client hash: "+base64_encode(reinterpret_cast<const unsigned char*>(item.client_sha_dig.data()), static_cast<unsigned int>(item.client_sha_dig.size()))+
+				", server hash: "+ base64_encode(reinterpret_cast<const unsigned char*>(h.data()), static_cast<unsigned int>(h.size()))+")", LL_ERROR);
+
+			if (!ignore_hash_mismatch)
+			{
+				has_error = true;
 			}
 		}
+		else
+		{
+			ServerLogger::Log(logid, "Client calculated hash of \"" + tfn + "\" differs from server calculated hash. "
+				"The file is being backed up without a snapshot so this is most likely caused by the file changing during the backup. "
+				"The backed up file may be corrupt and not a valid, consistent backup. "
+				"(Hash: "+print_hash_func(item.hash_func) + ")", LL_WARNING);
+		}
 	}
+
+	//The link stage opens the temporary file again, so items waiting in its
+	//queue do not hold file handles
+	if(item.tf!=NULL)
+	{
+		Server->destroy(item.tf);
+		item.tf = NULL;
+	}
+	if(item.old_file!=NULL)
+	{
+		Server->destroy(item.old_file);
+		item.old_file = NULL;
+	}
+
+	item.type = SHashWorkItem::EType_LinkOrCopy;
 }
 
 std::string BackupServerPrepareHash::calc_hash(IFsFile * f, std::string method)
@@ -471,7 +591,7 @@ void BackupServerPrepareHash::addUnchangedHashes(int64 start, size_t size, bool*
 		return;
 	}
 
-	reinterpret_cast<TreeHash*>(hashf)->addHashAllAdler(chunkhashes, r, size);
+	hashf->addHashAllAdler(chunkhashes, r, size);
 }
 
 void BackupServerPrepareHash::next_sparse_extent_bytes(const char * buf, size_t bsize)
@@ -499,11 +619,6 @@ void BackupServerPrepareHash::next_chunk_patcher_bytes(const char *buf, size_t b
 	file_pos += bsize;
 }
 
-bool BackupServerPrepareHash::isWorking(void)
-{
-	return working;
-}
-
 bool BackupServerPrepareHash::hasError(void)
 {
 	return has_error;
@@ -10,6 +10,8 @@
 #include "server_log.h"
 #include "../urbackupcommon/ExtentIterator.h"
 #include "../urbackupcommon/TreeHash.h"
+#include "../urbackupcommon/file_metadata.h"
+#include "HashStageQueue.h"
 
 const char HASH_FUNC_SHA512_NO_SPARSE = 0;
 const char HASH_FUNC_SHA512 = 1;
@@ -32,12 +34,10 @@ namespace
 class BackupServerPrepareHash : public IThread, public IChunkPatcherCallback
 {
 public:
-	BackupServerPrepareHash(IPipe *pPipe, IPipe *pOutput, int pClientid, logid_t logid, bool ignore_hash_mismatch);
+	BackupServerPrepareHash(HashStageQueue* queue, int pClientid, logid_t logid, bool ignore_hash_mismatch);
 	~BackupServerPrepareHash(void);
 
 	void operator()(void);
-	
-	bool isWorking(void);
 
 	void next_chunk_patcher_bytes(const char *buf, size_t bsize, bool changed, bool* is_sparse);
 
@@ -59,6 +59,13 @@ public:
 	static bool hash_sha(IFile *f, IExtentIterator* extent_iterator, bool hash_with_sparse, IHashFunc& hashf, IHashProgressCallback* progress_callback=NULL);
 
 private:
+	bool openItem(SHashWorkItem& item);
+	void hashItem(SHashWorkItem& item);
+#ifdef DO_NOT_USE_CRYPTOPP_SHA
+	void hashItemsMulti(std::vector<SHashWorkItem*>& items);
+	void hashGroupMulti(const std::vector<SHashWorkItem*>& group);
+#endif
+	void finishItem(SHashWorkItem& item);
 	
 	bool hash_with_patch(IFile *f, IFile *patch, ExtentIterator* extent_iterator, bool hash_with_sparse);
 
@@ -66,8 +73,8 @@ private:
 
 	void addUnchangedHashes(int64 start, size_t size, bool* is_sparse);
 
-	IPipe *pipe;
-	IPipe *output;
+	HashStageQueue* queue;
+	size_t max_batch;
 
 	int clientid;
 
@@ -80,12 +87,15 @@ private:
 
 	ChunkPatcher chunk_patcher;
 	
-	volatile bool working;
 	volatile bool has_error;
 
 	logid_t logid;
 
 	bool ignore_hash_mismatch;
+
+#ifdef DO_NOT_USE_CRYPTOPP_SHA
+	std::vector<std::vector<char> > mb_bufs;
+#endif
 
 };
 
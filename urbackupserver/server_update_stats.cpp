@@ -32,8 +32,15 @@
 #include "dao/ServerFilesDao.h"
 #include <algorithm>
 
-ServerUpdateStats::ServerUpdateStats(bool image_repair_mode, bool interruptible)
-	: image_repair_mode(image_repair_mode), interruptible(interruptible)
+namespace
+{
+	//Id of the last statistics entry applied to the sizes. Stored in the same
+	//transaction as the sizes
+	const char* c_applied_incoming_stat_key = "files_incoming_stat_applied";
+}
+
+ServerUpdateStats::ServerUpdateStats(bool image_repair_mode, bool interruptible, bool files_only)
+	: image_repair_mode(image_repair_mode), interruptible(interruptible), files_only(files_only)
 {
 }
 
@@ -41,10 +48,8 @@ void ServerUpdateStats::createQueries(void)
 {
 	q_get_images=db->Prepare("SELECT id,clientid,path FROM backup_images WHERE complete=1 AND running<datetime('now','-300 seconds')", false);
 	q_update_images_size=db->Prepare("UPDATE clients SET bytes_used_images=? WHERE id=?", false);
-	q_get_sizes=db->Prepare("SELECT id, bytes_used_files FROM clients", false);
-	q_size_update=db->Prepare("UPDATE clients SET bytes_used_files=? WHERE id=?", false);
-	q_update_backups=db->Prepare("UPDATE backups SET size_bytes=? WHERE id=?", false);
-	q_get_backup_size=db->Prepare("SELECT size_bytes FROM backups WHERE id=?", false);
+	q_size_update=db->Prepare("UPDATE clients SET bytes_used_files=bytes_used_files+? WHERE id=?", false);
+	q_update_backups=db->Prepare("UPDATE backups SET size_bytes=(CASE WHEN size_bytes=-1 THEN 0 ELSE size_bytes END)+? WHERE id=?", false);
 	q_get_del_size=db->Prepare("SELECT delsize FROM del_stats WHERE backupid=? AND image=0 AND created>datetime('now','-4 days')", false);
 	q_add_del_size=db->Prepare("INSERT INTO del_stats (backupid, image, delsize, clientid, incremental, stoptime) VALUES (?, 0, ?, ?, ?, CURRENT_TIMESTAMP)", false);
 	q_update_del_size=db->Prepare("UPDATE del_stats SET delsize=?,stoptime=CURRENT_TIMESTAMP WHERE backupid=? AND image=0 AND created>datetime('now','-4 days')", false);
@@ -58,10 +63,8 @@ void ServerUpdateStats::destroyQueries(void)
 {
 	db->destroyQuery(q_get_images);
 	db->destroyQuery(q_update_images_size);
-	db->destroyQuery(q_get_sizes);
 	db->destroyQuery(q_size_update);
 	db->destroyQuery(q_update_backups);
-	db->destroyQuery(q_get_backup_size);
 	db->destroyQuery(q_get_del_size);
 	db->destroyQuery(q_add_del_size);
 	db->destroyQuery(q_update_del_size);
@@ -94,8 +97,27 @@ void ServerUpdateStats::operator()(void)
 
 	createQueries();
 
+	if(files_only)
+	{
+		update_files();
+	}
+	else
+	{
+		update_all();
+	}
 
+	destroyQueries();
+	if(!cache_res.empty())
+	{
+		db->Write("PRAGMA cache_size = "+cache_res[0]["cache_size"]);
+		db->freeMemory();
+	}
+
+	backupdao.reset();
+}
 
+void ServerUpdateStats::update_all(void)
+{
 	if(!image_repair_mode)
 	{
 		q_create_hist->Write();
@@ -122,15 +144,6 @@ void ServerUpdateStats::operator()(void)
 		q_set_file_backup_null->Write();
 		q_set_file_backup_null->Reset();
 	}
-
-	destroyQueries();
-	if(!cache_res.empty())
-	{
-		db->Write("PRAGMA cache_size = "+cache_res[0]["cache_size"]);
-		db->freeMemory();
-	}
-
-	backupdao.reset();
 }
 
 void ServerUpdateStats::repairImages(void)
@@ -219,40 +232,60 @@ void ServerUpdateStats::update_files(void)
 	size_t total_num = static_cast<size_t>(filesdao.getIncomingStatsCount().value);
 	size_t total_i=0;
 
-	std::map<int, _i64> size_data_clients=getFilebackupSizesClients();
-	std::map<int, _i64> size_data_backups;
-	std::map<int, SDelInfo> del_sizes;
-
 	DBScopedSynchronous synchonous_db(db);
 	DBScopedSynchronous synchonous_files_db(files_db);
-
-	DBScopedWriteTransaction files_db_transaction(NULL);
-	bool started_transaction = false;
 	
 	std::vector<ServerFilesDao::SIncomingStat> stat_entries;
 
+	//The statistics entries are a log of the changes of the file sizes. Each batch
+	//of entries is applied to the sizes of the clients and backups as a delta, then
+	//the entries are removed, so the progress is kept if the update is interrupted.
+	//Entries up to the stored id were applied already, but their removal may not
+	//have been committed. The entry with that id is kept, so its id (and lower ids)
+	//are not used again for new entries
+	int64 applied_id=0;
+	ServerBackupDao::CondString applied_id_str = backupdao->getMiscValue(c_applied_incoming_stat_key);
+	if(applied_id_str.exists)
+	{
+		applied_id=watoi64(applied_id_str.value);
+		filesdao.delIncomingStatEntriesUpTo(applied_id-1);
+	}
+
 	int last_pc=0;
-	do
+	while(true)
 	{
 		if(interruptible)
 		{
 			if( ClientMain::getNumberOfRunningFileBackups()>0 )
 			{
-				files_db_transaction.rollback();
 				return;
 			}
 		}
 
 		ServerStatus::updateActive();
 
-		stat_entries = filesdao.getIncomingStats();
+		stat_entries.clear();
+		{
+			ScopedDatabaseCursor cursor(filesdao.getIncomingStats());
+			ServerFilesDao::SIncomingStat stat_entry;
+			while (filesdao.getIncomingStatsNext(cursor.get(), stat_entry))
+			{
+				stat_entries.push_back(stat_entry);
+			}
+		}
 
-		if(!started_transaction && !stat_entries.empty())
+		if(stat_entries.empty()
+			|| stat_entries[stat_entries.size()-1].id<=applied_id)
 		{
-			files_db_transaction.reset(files_db);
-			started_transaction = true;
+			break;
 		}
 
+		int64 last_id = stat_entries[stat_entries.size()-1].id;
+
+		std::map<int, _i64> size_data_clients;
+		std::map<int, _i64> size_data_backups;
+		std::map<int, SDelInfo> del_sizes;
+
 		for(size_t i=0;i<stat_entries.size();++i,++total_i)
 		{
 			++num_updated_files;
@@ -270,6 +303,11 @@ void ServerUpdateStats::update_files(void)
 
 			ServerFilesDao::SIncomingStat& entry = stat_entries[i];
 
+			if(entry.id<=applied_id)
+			{
+				continue;
+			}
+
 			std::vector<int> clients;
 			std::vector<std::string> s_clients;
 			Tokenize(entry.existing_clients, s_clients, ",");
@@ -295,7 +333,7 @@ void ServerUpdateStats::update_files(void)
 				
 				add(clients, current_size_per_client, size_data_clients);
 
-				add(size_data_backups, entry.backupid, entry.filesize);
+				size_data_backups[entry.backupid]+=entry.filesize;
 			}
 			else if(entry.direction== ServerFilesDao::c_direction_outgoing ||
 				entry.direction== ServerFilesDao::c_direction_outgoing_nobackupstat)
@@ -332,32 +370,25 @@ void ServerUpdateStats::update_files(void)
 				Server->Log("Unknown direction in ServerUpdateStats::update_files " + convert((int)entry.direction), LL_ERROR);
 				assert(false);
 			}
-
-			filesdao.delIncomingStatEntry(entry.id);
 		}
-	}
-	while(!stat_entries.empty());
 
+		{
+			DBScopedWriteTransaction db_transaction(db);
 
-	DBScopedWriteTransaction db_transaction(db);
+			updateSizes(size_data_clients);
+			updateDels(del_sizes);
+			updateBackups(size_data_backups);
 
-	updateSizes(size_data_clients);
-	updateDels(del_sizes);
-	updateBackups(size_data_backups);
+			backupdao->delMiscValue(c_applied_incoming_stat_key);
+			backupdao->addMiscValue(c_applied_incoming_stat_key, convert(last_id));
+		}
 
-	db->Write("UPDATE backups SET size_calculated=1 WHERE size_calculated=0 AND done=1");
-}
+		applied_id=last_id;
 
-std::map<int, _i64> ServerUpdateStats::getFilebackupSizesClients(void)
-{
-	std::map<int, _i64> ret;
-	db_results res=q_get_sizes->Read();
-	q_get_sizes->Reset();
-	for(size_t i=0;i<res.size();++i)
-	{
-		ret.insert(std::pair<int, _i64>(watoi(res[i]["id"]), os_atoi64(res[i]["bytes_used_files"])));
+		filesdao.delIncomingStatEntriesUpTo(last_id-1);
 	}
-	return ret;
+
+	db->Write("UPDATE backups SET size_calculated=1 WHERE size_calculated=0 AND done=1");
 }
 
 void ServerUpdateStats::updateSizes(std::map<int, _i64> & size_data)
@@ -379,30 +410,6 @@ void ServerUpdateStats::add(const std::vector<int>& subset, int64 num, std::map<
 	}
 }
 
-void ServerUpdateStats::add(std::map<int, _i64> &data, int backupid, _i64 filesize)
-{
-	std::map<int, _i64>::iterator it=data.find(backupid);
-	if(it==data.end())
-	{
-		q_get_backup_size->Bind(backupid);
-		db_results res=q_get_backup_size->Read();
-		q_get_backup_size->Reset();
-		if(!res.empty())
-		{
-			_i64 b_fs=os_atoi64(res[0]["size_bytes"]);
-			if(b_fs!=-1)
-			{
-				filesize+=b_fs;
-			}
-		}
-		data.insert(std::pair<int, _i64>(backupid, filesize));
-	}
-	else
-	{
-		it->second+=filesize;
-	}
-}
-
 void ServerUpdateStats::updateBackups(std::map<int, _i64> &data)
 {
 	for(std::map<int, _i64>::iterator it=data.begin();it!=data.end();++it)
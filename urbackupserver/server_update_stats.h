@@ -18,7 +18,8 @@ struct SDelInfo
 class ServerUpdateStats : public IThread
 {
 public:
-	ServerUpdateStats(bool image_repair_mode=false, bool interruptible=false);
+	//If files_only is set only the pending file statistics entries are applied
+	ServerUpdateStats(bool image_repair_mode=false, bool interruptible=false, bool files_only=false);
 
 	void operator()(void);
 
@@ -26,16 +27,15 @@ public:
 
 private:
 
+	void update_all(void);
 	void update_files(void);
 	void update_images(void);
 
 	void createQueries(void);
 	void destroyQueries(void);
 
-	std::map<int, _i64> getFilebackupSizesClients(void);
 	void add(const std::vector<int>& subset, int64 num, std::map<int, _i64> &data);
 	void updateSizes(std::map<int, _i64> & size_data);
-	void add(std::map<int, _i64> &data, int backupid, _i64 filesize);
 	void add_del(std::map<int, SDelInfo> &data, int backupid, _i64 filesize, int clientid, int incremental);
 	void updateBackups(std::map<int, _i64> &data);
 	void updateDels(std::map<int, SDelInfo> &data);
@@ -46,13 +46,12 @@ private:
 
 	bool image_repair_mode;
 	bool interruptible;
+	bool files_only;
 
 	IQuery *q_get_images;
 	IQuery *q_update_images_size;
-    IQuery *q_get_sizes;
 	IQuery *q_size_update;
 	IQuery *q_update_backups;
-	IQuery *q_get_backup_size;
 	IQuery *q_get_del_size;
 	IQuery *q_add_del_size;
 	IQuery *q_update_del_size;
@@ -0,0 +1,115 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#ifndef CLIENT_ONLY
+
+#include "action_header.h"
+#include "../FileIndexStats.h"
+
+namespace
+{
+	JSON::Object counters_to_json(const int64* counters)
+	{
+		JSON::Object ret;
+		for (size_t i = 0; i < FileIndexStats::ECounter_Max; ++i)
+		{
+			ret.set(FileIndexStats::get_counter_name(static_cast<FileIndexStats::ECounter>(i)), counters[i]);
+		}
+		return ret;
+	}
+
+	JSON::Object histogram_to_json(const FileIndexStats::SHistogram& hist)
+	{
+		JSON::Object ret;
+		ret.set("count", hist.count);
+		ret.set("sum_us", hist.sum_us);
+		ret.set("max_us", hist.max_us);
+
+		JSON::Array buckets;
+		for (size_t i = 0; i < FileIndexStats::histogram_buckets; ++i)
+		{
+			if (hist.buckets[i] == 0)
+			{
+				continue;
+			}
+
+			JSON::Object bucket;
+			bucket.set("lt_us", static_cast<int64>(1) << i);
+			bucket.set("count", hist.buckets[i]);
+			buckets.add(bucket);
+		}
+		ret.set("buckets", buckets);
+
+		return ret;
+	}
+}
+
+ACTION_IMPL(fileindex_stats)
+{
+	Helper helper(tid, &POST, &PARAMS);
+	JSON::Object ret;
+
+	std::string rights = helper.getRights("status");
+	SUser *session = helper.getSession();
+	if (session != NULL && session->id == SESSION_ID_INVALID) return;
+	if (session != NULL && rights == "all")
+	{
+		IDatabase *db = helper.getDatabase();
+
+		FileIndexStats::SStats stats = FileIndexStats::get_stats();
+
+		ret.set("global", counters_to_json(stats.global));
+
+		IQuery* q_name = db->Prepare("SELECT name FROM clients WHERE id=?", false);
+		JSON::Array clients;
+		for (std::map<int, std::vector<int64> >::iterator it = stats.clients.begin(); it != stats.clients.end(); ++it)
+		{
+			JSON::Object client = counters_to_json(&it->second[0]);
+			client.set("id", it->first);
+
+			q_name->Bind(it->first);
+			db_results res = q_name->Read();
+			q_name->Reset();
+			if (!res.empty())
+			{
+				client.set("name", res[0]["name"]);
+			}
+
+			clients.add(client);
+		}
+		db->destroyQuery(q_name);
+		ret.set("clients", clients);
+
+		JSON::Object histograms;
+		for (size_t i = 0; i < FileIndexStats::EHistogram_Max; ++i)
+		{
+			histograms.set(FileIndexStats::get_histogram_name(static_cast<FileIndexStats::EHistogram>(i)), histogram_to_json(stats.histograms[i]));
+		}
+		ret.set("latency", histograms);
+
+		ret.set("flush_queue_depth", stats.flush_queue_depth);
+		ret.set("max_flush_queue_depth", stats.max_flush_queue_depth);
+	}
+	else
+	{
+		ret.set("error", 1);
+	}
+	helper.Write(ret.stringify(false));
+}
+
+#endif //CLIENT_ONLY
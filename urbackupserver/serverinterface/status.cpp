@@ -26,6 +26,8 @@
 #include "../server.h"
 #include "../ClientMain.h"
 #include "../dao/ServerBackupDao.h"
+#include "../LMDBFileIndex.h"
+#include "../FileIndexStats.h"
 
 #include <algorithm>
 #include <memory>
@@ -580,6 +582,29 @@ ACTION_IMPL(status)
 		{
 			ret.set("admin", JSON::Value(true));
 			set_server_version_info(db, ret);
+
+			FileIndexFilter::SStats filter_stats;
+			if (LMDBFileIndex::getFilterStats(filter_stats))
+			{
+				JSON::Object filter_obj;
+				filter_obj.set("entries", filter_stats.n_entries);
+				filter_obj.set("capacity", filter_stats.capacity);
+				filter_obj.set("fp_rate", filter_stats.fp_rate);
+				filter_obj.set("negative", filter_stats.n_negative);
+				filter_obj.set("positive", filter_stats.n_positive);
+				filter_obj.set("false_positive", filter_stats.n_false_positive);
+				ret.set("fileindex_filter", filter_obj);
+			}
+
+			FileIndexStats::SStats index_stats = FileIndexStats::get_stats();
+			JSON::Object index_stats_obj;
+			for (size_t i = 0; i < FileIndexStats::ECounter_Max; ++i)
+			{
+				index_stats_obj.set(FileIndexStats::get_counter_name(static_cast<FileIndexStats::ECounter>(i)), index_stats.global[i]);
+			}
+			index_stats_obj.set("flush_queue_depth", index_stats.flush_queue_depth);
+			index_stats_obj.set("max_flush_queue_depth", index_stats.max_flush_queue_depth);
+			ret.set("fileindex_stats", index_stats_obj);
 		}
 
 		if(is_big_endian())
@@ -0,0 +1,164 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "StreamingTreeDiff.h"
+#include "../../urbackupcommon/filelist_utils.h"
+
+StreamingTreeDiff::StreamingTreeDiff(std::vector<size_t>& diffs, std::vector<size_t>& dir_diffs,
+	std::vector<size_t>* modified_inplace_ids)
+	: next_id(0), diffs(diffs), dir_diffs(dir_diffs), modified_inplace_ids(modified_inplace_ids)
+{
+}
+
+bool StreamingTreeDiff::readTree(const std::string& t1)
+{
+	if (!r1.readTree(t1))
+	{
+		return false;
+	}
+
+	levels.clear();
+	SLevel root;
+	root.t1 = 0;
+	root.c1 = r1.getFirstChild(0);
+	levels.push_back(root);
+	next_id = 0;
+	return true;
+}
+
+void StreamingTreeDiff::nextEntry(const SFile& cf)
+{
+	size_t id = next_id++;
+
+	if (cf.isdir
+		&& cf.name == "..")
+	{
+		if (levels.size() > 1)
+		{
+			levels.pop_back();
+		}
+		return;
+	}
+
+	char type = cf.isdir ? 'd' : 'f';
+	_u32 match = TreeReader::no_node;
+	SLevel& level = levels.back();
+
+	//Entries below a new directory are not diffed (the directory is a change)
+	if (level.t1 != TreeReader::no_node)
+	{
+		//Same merge as TreeDiff::gatherDiffs, with the new list's side advancing one entry per call
+		_u32 c1_end = r1.getFirstChild(level.t1) + r1.getNumChildren(level.t1);
+		int cmp;
+		while (true)
+		{
+			cmp = 1;
+			if (level.c1 < c1_end)
+			{
+				if (r1.getType(level.c1) == 'f'
+					&& type == 'd')
+				{
+					cmp = -1;
+				}
+				else if (r1.getType(level.c1) == 'd'
+					&& type == 'f')
+				{
+					cmp = 1;
+				}
+				else
+				{
+					cmp = r1.nameCompare(level.c1, cf.name);
+				}
+			}
+
+			//root may be unsorted
+			if (cmp != 0
+				&& levels.size() == 1)
+			{
+				for (_u32 sn = r1.getFirstChild(level.t1); sn < c1_end; ++sn)
+				{
+					if (type == r1.getType(sn)
+						&& r1.nameEquals(sn, cf.name)
+						&& !r1.isMapped(sn))
+					{
+						cmp = 0;
+						level.c1 = sn;
+						break;
+					}
+				}
+			}
+
+			if (cmp < 0)
+			{
+				++level.c1;
+			}
+			else
+			{
+				break;
+			}
+		}
+
+		if (cmp == 0)
+		{
+			_u32 c1 = level.c1;
+			bool equal_dir = (r1.getType(c1) == 'd' && type == 'd');
+			bool data_equals = r1.getType(c1) == type
+				&& r1.getSize(c1) == cf.size
+				&& r1.getLastModified(c1) == cf.last_modified;
+
+			if (equal_dir && !data_equals)
+			{
+				dir_diffs.push_back(id);
+			}
+
+			if (equal_dir
+				|| data_equals)
+			{
+				r1.setMapped(c1);
+				if (equal_dir)
+				{
+					match = c1;
+				}
+			}
+			else
+			{
+				if (modified_inplace_ids != NULL
+					&& r1.getType(c1) == type)
+				{
+					modified_inplace_ids->push_back(id);
+				}
+
+				diffs.push_back(id);
+			}
+
+			++level.c1;
+		}
+		else
+		{
+			diffs.push_back(id);
+		}
+	}
+
+	if (cf.isdir)
+	{
+		SLevel new_level;
+		new_level.t1 = match;
+		new_level.c1 = match != TreeReader::no_node ? r1.getFirstChild(match) : 0;
+		levels.push_back(new_level);
+	}
+}
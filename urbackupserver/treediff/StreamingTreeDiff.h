@@ -0,0 +1,46 @@
+#ifndef STREAMINGTREEDIFF_H
+#define STREAMINGTREEDIFF_H
+
+#include <string>
+#include <vector>
+#include "../../Interface/Types.h"
+#include "TreeReader.h"
+
+struct SFile;
+
+//Diff of a file list against a previous one (same changes, directory changes
+//and modified in place ids as TreeDiff::diffTrees) where the new list is
+//passed entry by entry in list order, e.g. while it is being downloaded. The
+//ids are added to the result vectors in increasing order, so they stay sorted.
+//Deleted entries and large unchanged subtrees are only known at the end of the
+//list and are not computed.
+class StreamingTreeDiff
+{
+public:
+	StreamingTreeDiff(std::vector<size_t>& diffs, std::vector<size_t>& dir_diffs,
+		std::vector<size_t>* modified_inplace_ids);
+
+	//Reads the previous file list
+	bool readTree(const std::string& t1);
+
+	//Next entry of the new file list (including the directory up entries)
+	void nextEntry(const SFile& cf);
+
+private:
+	struct SLevel
+	{
+		//Matching directory in the previous list or TreeReader::no_node
+		_u32 t1;
+		_u32 c1;
+	};
+
+	TreeReader r1;
+	std::vector<SLevel> levels;
+	size_t next_id;
+
+	std::vector<size_t>& diffs;
+	std::vector<size_t>& dir_diffs;
+	std::vector<size_t>* modified_inplace_ids;
+};
+
+#endif //STREAMINGTREEDIFF_H
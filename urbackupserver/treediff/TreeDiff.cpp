@@ -18,9 +18,38 @@
 
 #include "TreeDiff.h"
 #include "TreeReader.h"
+#include "../../Interface/Server.h"
+#include "../../Interface/Thread.h"
+#include "../../Interface/ThreadPool.h"
+#include "../../stringtools.h"
+#include "../../urbackupcommon/os_functions.h"
+#include "../../urbackupcommon/filelist_utils.h"
 #include <algorithm>
 #include <memory.h>
 
+namespace
+{
+	//Subtrees with less file list lines are not split off into their own task
+	const size_t c_min_task_lines = 10000;
+}
+
+class TreeDiff::DiffWorker : public IThread
+{
+public:
+	DiffWorker(SDiffState& state)
+		: state(state)
+	{
+	}
+
+	void operator()()
+	{
+		TreeDiff::runTasks(state);
+	}
+
+private:
+	SDiffState& state;
+};
+
 std::vector<size_t> TreeDiff::diffTrees(const std::string &t1, const std::string &t2, bool &error,
 	std::vector<size_t> *deleted_ids, std::vector<size_t>* large_unchanged_subtrees,
 	std::vector<size_t> *modified_inplace_ids, std::vector<size_t> &dir_diffs,
@@ -42,16 +71,86 @@ std::vector<size_t> TreeDiff::diffTrees(const std::string &t1, const std::string
 		return ret;
 	}
 
-	gatherDiffs(&(*r1.getNodes())[0], &(*r2.getNodes())[0], 0, ret, modified_inplace_ids, 
-		dir_diffs, deleted_inplace_ids, has_symbit, is_windows);
+	SDiffState state;
+	state.r1 = &r1;
+	state.r2 = &r2;
+	state.has_modified_inplace = modified_inplace_ids != NULL;
+	state.has_deleted_inplace = deleted_inplace_ids != NULL;
+	state.has_symbit = has_symbit;
+	state.is_windows = is_windows;
+	state.n_threads = get_num_threads();
+	if (r2.getSubtreeLines(0) < 2 * c_min_task_lines)
+	{
+		state.n_threads = 1;
+	}
+	state.mutex = Server->createMutex();
+	state.cond = Server->createCondition();
+	state.n_running = 0;
+
+	SDiffTask* root_task = new SDiffTask;
+	root_task->t1 = 0;
+	root_task->t2 = 0;
+	root_task->depth = 0;
+	root_task->boundary = TreeReader::no_node;
+	root_task->boundary_changed = false;
+	state.tasks.push_back(root_task);
+	state.todo.push_back(root_task);
+
+	std::vector<DiffWorker*> workers;
+	std::vector<THREADPOOL_TICKET> tickets;
+	for (size_t i = 1; i < state.n_threads; ++i)
+	{
+		workers.push_back(new DiffWorker(state));
+		tickets.push_back(Server->getThreadPool()->execute(workers.back(), "treediff"));
+	}
+
+	runTasks(state);
+
+	if (!tickets.empty())
+	{
+		Server->getThreadPool()->waitFor(tickets);
+	}
+
+	for (size_t i = 0; i < workers.size(); ++i)
+	{
+		delete workers[i];
+	}
+
+	Server->destroy(state.mutex);
+	Server->destroy(state.cond);
+
+	for (size_t i = 0; i < state.tasks.size(); ++i)
+	{
+		SDiffTask* task = state.tasks[i];
+		ret.insert(ret.end(), task->diffs.begin(), task->diffs.end());
+		dir_diffs.insert(dir_diffs.end(), task->dir_diffs.begin(), task->dir_diffs.end());
+		if (modified_inplace_ids != NULL)
+		{
+			modified_inplace_ids->insert(modified_inplace_ids->end(), task->modified_inplace_ids.begin(), task->modified_inplace_ids.end());
+		}
+		if (deleted_inplace_ids != NULL)
+		{
+			deleted_inplace_ids->insert(deleted_inplace_ids->end(), task->deleted_inplace_ids.begin(), task->deleted_inplace_ids.end());
+		}
+		if (task->boundary_changed)
+		{
+			subtreeChangedParent(r2, task->boundary, *root_task);
+		}
+	}
+
+	for (size_t i = 0; i < state.tasks.size(); ++i)
+	{
+		delete state.tasks[i];
+	}
+
 	if(deleted_ids!=NULL)
 	{
-		gatherDeletes(&(*r1.getNodes())[0], *deleted_ids);
+		gatherDeletes(r1, 0, *deleted_ids);
 		std::sort(deleted_ids->begin(), deleted_ids->end());
 	}
 	if(large_unchanged_subtrees!=NULL)
 	{
-		gatherLargeUnchangedSubtrees(&(*r2.getNodes())[0], *large_unchanged_subtrees);
+		gatherLargeUnchangedSubtrees(r2, 0, *large_unchanged_subtrees);
 		std::sort(large_unchanged_subtrees->begin(), large_unchanged_subtrees->end());
 	}
 
@@ -71,33 +170,126 @@ std::vector<size_t> TreeDiff::diffTrees(const std::string &t1, const std::string
 	return ret;
 }
 
-void TreeDiff::gatherDiffs(TreeNode *t1, TreeNode *t2, size_t depth, std::vector<size_t> &diffs,
-	std::vector<size_t> *modified_inplace_ids, std::vector<size_t> &dir_diffs,
-	std::vector<size_t> *deleted_inplace_ids, bool has_symbit, bool is_windows)
+size_t TreeDiff::get_num_threads()
+{
+	std::string threads = Server->getServerParameter("treediff_threads");
+	if (!threads.empty())
+	{
+		return (std::max)(static_cast<size_t>(watoi(threads)), static_cast<size_t>(1));
+	}
+
+	return (std::max)((std::min)(os_get_num_cpus(), static_cast<size_t>(4)), static_cast<size_t>(1));
+}
+
+void TreeDiff::runTasks(SDiffState& state)
+{
+	IScopedLock lock(state.mutex);
+	while (true)
+	{
+		if (!state.todo.empty())
+		{
+			SDiffTask* task = state.todo.front();
+			state.todo.pop_front();
+			++state.n_running;
+			lock.relock(NULL);
+
+			gatherDiffs(state, *task, task->t1, task->t2, task->depth);
+
+			lock.relock(state.mutex);
+			--state.n_running;
+			if (state.todo.empty()
+				&& state.n_running == 0)
+			{
+				state.cond->notify_all();
+			}
+		}
+		else if (state.n_running == 0)
+		{
+			return;
+		}
+		else
+		{
+			state.cond->wait(&lock);
+		}
+	}
+}
+
+bool TreeDiff::subtreeEqual(SDiffState& state, _u32 c1, _u32 c2)
+{
+	const char* digest1 = state.r1->getDirDigest(c1);
+	const char* digest2 = state.r2->getDirDigest(c2);
+	if (digest1 == NULL
+		|| digest2 == NULL
+		|| memcmp(digest1, digest2, binary_filelist_dir_digest_size) != 0)
+	{
+		return false;
+	}
+
+#ifndef _WIN32
+	//Symbolic links in the subtree change it (see below)
+	if (!state.has_symbit
+		|| state.r2->getSubtreeSymlink(c2))
+	{
+		return false;
+	}
+#endif
+
+	return true;
+}
+
+bool TreeDiff::splitTask(SDiffState& state, SDiffTask& task, _u32 c1, _u32 c2, size_t depth)
 {
-	size_t nc_2=t2->getNumChildren();
-	size_t nc_1=t1->getNumChildren();
-	TreeNode *c2=t2->getFirstChild();
-	TreeNode *c1=t1->getFirstChild();
-	bool did_subtree_change=false;
-	while(c2!=NULL)
+	if (state.n_threads <= 1
+		|| (std::max)(state.r1->getSubtreeLines(c1), state.r2->getSubtreeLines(c2)) < c_min_task_lines)
+	{
+		return false;
+	}
+
+	IScopedLock lock(state.mutex);
+	if (state.todo.size() >= state.n_threads)
+	{
+		return false;
+	}
+
+	SDiffTask* new_task = new SDiffTask;
+	new_task->t1 = c1;
+	new_task->t2 = c2;
+	new_task->depth = depth;
+	new_task->boundary = state.r2->getParent(c2);
+	new_task->boundary_changed = false;
+	state.tasks.push_back(new_task);
+	state.todo.push_back(new_task);
+	state.cond->notify_one();
+
+	return true;
+}
+
+void TreeDiff::gatherDiffs(SDiffState& state, SDiffTask& task, _u32 t1, _u32 t2, size_t depth)
+{
+	TreeReader& r1 = *state.r1;
+	TreeReader& r2 = *state.r2;
+	_u32 c2=r2.getFirstChild(t2);
+	_u32 c2_end=c2+r2.getNumChildren(t2);
+	_u32 c1=r1.getFirstChild(t1);
+	_u32 c1_end=c1+r1.getNumChildren(t1);
+	while(c2<c2_end)
 	{		
 		int cmp = 1;
-		if(c1!=NULL)
+		if(c1<c1_end)
 		{
-			if (c1->getType() == 'f'
-				&& c2->getType() == 'd')
+			if (r1.getType(c1) == 'f'
+				&& r2.getType(c2) == 'd')
 			{
 				cmp = -1;
 			}
-			else if (c1->getType() == 'd'
-				&& c2->getType() == 'f')
+			else if (r1.getType(c1) == 'd'
+				&& r2.getType(c2) == 'f')
 			{
 				cmp = 1;
 			}
 			else
 			{
-				cmp = c1->nameCompare(*c2);
+				cmp = r1.nameCompare(c1, r2, c2);
 			}
 		}
 
@@ -105,57 +297,65 @@ void TreeDiff::gatherDiffs(TreeNode *t1, TreeNode *t2, size_t depth, std::vector
 		if (cmp != 0
 			&& depth == 0)
 		{
-			TreeNode* sn = t1->getFirstChild();
-			while (sn != NULL)
+			for (_u32 sn = r1.getFirstChild(t1); sn < c1_end; ++sn)
 			{
-				if (c2->getType() == sn->getType()
-					&& c2->nameEquals(*sn)
-					&& sn->getMappedNode()==NULL)
+				if (r2.getType(c2) == r1.getType(sn)
+					&& r1.nameEquals(sn, r2, c2)
+					&& !r1.isMapped(sn))
 				{
 					cmp = 0;
 					c1 = sn;
 					break;
 				}
-				sn = sn->getNextSibling();
 			}
 		}
 
 		if(cmp==0)
 		{
-			bool equal_dir = (c1->getType()=='d' && c2->getType()=='d');
-			bool data_equals = c1->dataEquals(*c2);
+			bool equal_dir = (r1.getType(c1)=='d' && r2.getType(c2)=='d');
+			bool data_equals = r1.dataEquals(c1, r2, c2);
 
 			if(equal_dir && !data_equals)
 			{
-				dir_diffs.push_back(c2->getId());
-				subtreeChanged(c2);
+				task.dir_diffs.push_back(r2.getId(c2));
+				subtreeChanged(r2, c2, task);
 			}
 
 			if( equal_dir
 				|| data_equals )
 			{
-				gatherDiffs(c1, c2, depth+1, diffs, modified_inplace_ids, 
-					dir_diffs, deleted_inplace_ids, has_symbit, is_windows);
-				c2->setMappedNode(c1);
-				c1->setMappedNode(c2);
+				//Mapped before the subtree is diffed, so no other task writes the flags of c1, c2
+				r2.setMapped(c2);
+				r1.setMapped(c1);
+				if (equal_dir
+					&& data_equals
+					&& subtreeEqual(state, c1, c2))
+				{
+					r1.setSubtreeSkipped(c1);
+				}
+				else if (!equal_dir
+					|| !splitTask(state, task, c1, c2, depth + 1))
+				{
+					gatherDiffs(state, task, c1, c2, depth + 1);
+				}
 			}
 			else
 			{
-				if( modified_inplace_ids!=NULL
-					&& c1->getType() == c2->getType() )
+				if( state.has_modified_inplace
+					&& r1.getType(c1) == r2.getType(c2) )
 				{
-					modified_inplace_ids->push_back(c2->getId());
+					task.modified_inplace_ids.push_back(r2.getId(c2));
 				}
 
-				if (deleted_inplace_ids != NULL
-					&& c1->getType() == c2->getType()
-					&& isSymlink(c1, has_symbit, is_windows) == isSymlink(c2, has_symbit, is_windows) )
+				if (state.has_deleted_inplace
+					&& r1.getType(c1) == r2.getType(c2)
+					&& isSymlink(r1, c1, state.has_symbit, state.is_windows) == isSymlink(r2, c2, state.has_symbit, state.is_windows) )
 				{
-					deleted_inplace_ids->push_back(c1->getId());
+					task.deleted_inplace_ids.push_back(r1.getId(c1));
 				}
 				
-				diffs.push_back(c2->getId());
-				subtreeChanged(c2);				
+				task.diffs.push_back(r2.getId(c2));
+				subtreeChanged(r2, c2, task);				
 			}
 
 #ifndef _WIN32
@@ -167,114 +367,110 @@ void TreeDiff::gatherDiffs(TreeNode *t1, TreeNode *t2, size_t depth, std::vector
 			* On Windows this works. Could be because it uses junctions for the
 			* symlinks to the directory pool.
 			**/
-			if (isSymlink(c2, has_symbit, is_windows))
+			if (isSymlink(r2, c2, state.has_symbit, state.is_windows))
 			{
-				subtreeChanged(c2);
+				subtreeChanged(r2, c2, task);
 			}
 #endif
 
-			c1=c1->getNextSibling();
-			c2=c2->getNextSibling();
+			++c1;
+			++c2;
 		}
 		else if(cmp<0)
 		{
-			c1=c1->getNextSibling();
-			subtreeChangedParent(t2);
+			++c1;
+			subtreeChangedParent(r2, t2, task);
 		}
 		else
 		{
-			diffs.push_back(c2->getId());
-			subtreeChanged(c2);
+			task.diffs.push_back(r2.getId(c2));
+			subtreeChanged(r2, c2, task);
 
-			c2=c2->getNextSibling();
+			++c2;
 		}
 	}
 }
 
-void TreeDiff::gatherDeletes(TreeNode *t1, std::vector<size_t> &deleted_ids)
+void TreeDiff::gatherDeletes(TreeReader& r1, _u32 t1, std::vector<size_t> &deleted_ids)
 {
-	TreeNode *c1=t1->getFirstChild();
-	while(c1!=NULL)
+	_u32 c1_end=r1.getFirstChild(t1)+r1.getNumChildren(t1);
+	for(_u32 c1=r1.getFirstChild(t1);c1<c1_end;++c1)
 	{
-		if(c1->getMappedNode()==NULL)
+		if(!r1.isMapped(c1))
+		{
+			deleted_ids.push_back(r1.getId(c1));
+		}
+		if(!r1.getSubtreeSkipped(c1))
 		{
-			deleted_ids.push_back(c1->getId());
+			gatherDeletes(r1, c1, deleted_ids);
 		}
-		gatherDeletes(c1, deleted_ids);
-		c1=c1->getNextSibling();
 	}
 }
 
-void TreeDiff::subtreeChanged(TreeNode* t2)
+void TreeDiff::subtreeChanged(TreeReader& r2, _u32 t2, SDiffTask& task)
 {
-	TreeNode* p = t2->getParent();
-	if(p==NULL) return;
+	_u32 p = r2.getParent(t2);
+	if(p==TreeReader::no_node) return;
 
-	subtreeChangedParent(p);
+	subtreeChangedParent(r2, p, task);
 }
 
-void TreeDiff::subtreeChangedParent(TreeNode * p)
+void TreeDiff::subtreeChangedParent(TreeReader& r2, _u32 p, SDiffTask& task)
 {
 	do
 	{
-		if (p->getSubtreeChanged())
+		if (p == task.boundary)
+		{
+			task.boundary_changed = true;
+			return;
+		}
+
+		if (r2.getSubtreeChanged(p))
 		{
 			return;
 		}
 
-		p->setSubtreeChanged(true);
-		p = p->getParent();
-	} while (p != NULL);
+		r2.setSubtreeChanged(p);
+		p = r2.getParent(p);
+	} while (p != TreeReader::no_node);
 }
 
-void TreeDiff::gatherLargeUnchangedSubtrees( TreeNode *t2, std::vector<size_t> &large_unchanged_subtrees )
+void TreeDiff::gatherLargeUnchangedSubtrees(TreeReader& r2, _u32 t2, std::vector<size_t> &large_unchanged_subtrees )
 {
-	TreeNode *c2=t2->getFirstChild();
-	while(c2!=NULL)
+	_u32 c2_end=r2.getFirstChild(t2)+r2.getNumChildren(t2);
+	for(_u32 c2=r2.getFirstChild(t2);c2<c2_end;++c2)
 	{
-		if(!c2->getSubtreeChanged()
-			&& c2->getMappedNode()!=NULL
-			&& getTreesize(c2,10)>10)
+		if(!r2.getSubtreeChanged(c2)
+			&& r2.isMapped(c2)
+			&& getTreesize(r2, c2, 10)>10)
 		{
-			large_unchanged_subtrees.push_back(c2->getId());
+			large_unchanged_subtrees.push_back(r2.getId(c2));
 		}
 		else
 		{
-			gatherLargeUnchangedSubtrees(c2, large_unchanged_subtrees);
+			gatherLargeUnchangedSubtrees(r2, c2, large_unchanged_subtrees);
 		}
-		c2=c2->getNextSibling();
 	}
 }
 
-size_t TreeDiff::getTreesize( TreeNode* t, size_t limit )
+size_t TreeDiff::getTreesize(TreeReader& r, _u32 t, size_t limit )
 {
 	size_t treesize=1;
-	TreeNode *c=t->getFirstChild();
-	while(c!=NULL)
+	_u32 c_end=r.getFirstChild(t)+r.getNumChildren(t);
+	for(_u32 c=r.getFirstChild(t);c<c_end;++c)
 	{
-		treesize+=getTreesize(c, limit);
+		treesize+=getTreesize(r, c, limit);
 		if(treesize>limit)
 		{
 			return treesize;
 		}
-		c=c->getNextSibling();
 	}
 	return treesize;
 }
 
-bool TreeDiff::isSymlink(TreeNode * n, bool has_symbit, bool is_windows)
+bool TreeDiff::isSymlink(TreeReader& r, _u32 n, bool has_symbit, bool is_windows)
 {
-	uint64 change_indicator = 0;
-	if (n->getType() == 'd'
-		&& n->getDataSize() == sizeof(uint64))
-	{
-		memcpy(&change_indicator, n->getDataPtr(), sizeof(uint64));
-	}
-	else if (n->getType() == 'f'
-		&& n->getDataSize() == 2 * sizeof(uint64))
-	{
-		memcpy(&change_indicator, n->getDataPtr()+sizeof(uint64), sizeof(uint64));
-	}
+	uint64 change_indicator = static_cast<uint64>(r.getLastModified(n));
 
 	if (has_symbit)
 	{
@@ -294,7 +490,7 @@ bool TreeDiff::isSymlink(TreeNode * n, bool has_symbit, bool is_windows)
 
 		if (is_windows)
 		{
-			if ((!(change_indicator & neg_bit) || n->getType() == 'd')
+			if ((!(change_indicator & neg_bit) || r.getType(n) == 'd')
 				&& (change_indicator & symlink_mask) > 0)
 			{
 				return true;
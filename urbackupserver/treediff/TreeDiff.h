@@ -1,7 +1,11 @@
 #include <string>
 #include <vector>
+#include <deque>
+#include "../../Interface/Types.h"
+#include "../../Interface/Mutex.h"
+#include "../../Interface/Condition.h"
 
-class TreeNode;
+class TreeReader;
 
 class TreeDiff
 {
@@ -11,14 +15,52 @@ public:
 		std::vector<size_t> *modified_inplace_ids, std::vector<size_t> &dir_diffs,
 		std::vector<size_t> *deleted_inplace_ids, bool has_symbit, bool is_windows);
 
+	static size_t get_num_threads();
+
 private:
-	static void gatherDiffs(TreeNode *t1, TreeNode *t2, size_t depth, std::vector<size_t> &diffs,
-		std::vector<size_t> *modified_inplace_ids, std::vector<size_t> &dir_diffs,
-		std::vector<size_t> *deleted_inplace_ids, bool has_symbit, bool is_window);
-	static void gatherDeletes(TreeNode *t1, std::vector<size_t> &deleted_ids);
-	static void gatherLargeUnchangedSubtrees(TreeNode *t2, std::vector<size_t> &changed_subtrees);
-	static void subtreeChanged(TreeNode* t2);
-	static void subtreeChangedParent(TreeNode* p);
-	static size_t getTreesize(TreeNode* t, size_t limit);
-	static bool isSymlink(TreeNode* n, bool has_symbit, bool is_window);
+	class DiffWorker;
+
+	//Diff of a subtree pair. Large subtrees are split off into tasks of their own
+	//while other threads are idle. A task does not mark the subtree changed above its
+	//root (boundary is the parent of t2), that is done after all tasks are finished.
+	struct SDiffTask
+	{
+		_u32 t1;
+		_u32 t2;
+		size_t depth;
+		_u32 boundary;
+		bool boundary_changed;
+		std::vector<size_t> diffs;
+		std::vector<size_t> modified_inplace_ids;
+		std::vector<size_t> dir_diffs;
+		std::vector<size_t> deleted_inplace_ids;
+	};
+
+	struct SDiffState
+	{
+		TreeReader* r1;
+		TreeReader* r2;
+		bool has_modified_inplace;
+		bool has_deleted_inplace;
+		bool has_symbit;
+		bool is_windows;
+		size_t n_threads;
+
+		IMutex* mutex;
+		ICondition* cond;
+		std::deque<SDiffTask*> todo;
+		size_t n_running;
+		std::vector<SDiffTask*> tasks;
+	};
+
+	static void gatherDiffs(SDiffState& state, SDiffTask& task, _u32 t1, _u32 t2, size_t depth);
+	static bool subtreeEqual(SDiffState& state, _u32 c1, _u32 c2);
+	static bool splitTask(SDiffState& state, SDiffTask& task, _u32 c1, _u32 c2, size_t depth);
+	static void runTasks(SDiffState& state);
+	static void gatherDeletes(TreeReader& r1, _u32 t1, std::vector<size_t> &deleted_ids);
+	static void gatherLargeUnchangedSubtrees(TreeReader& r2, _u32 t2, std::vector<size_t> &changed_subtrees);
+	static void subtreeChanged(TreeReader& r2, _u32 t2, SDiffTask& task);
+	static void subtreeChangedParent(TreeReader& r2, _u32 p, SDiffTask& task);
+	static size_t getTreesize(TreeReader& r, _u32 t, size_t limit);
+	static bool isSymlink(TreeReader& r, _u32 n, bool has_symbit, bool is_window);
 };
\ No newline at end of file
@@ -17,357 +17,517 @@
 **************************************************************************/
 
 #include "TreeReader.h"
-#include <fstream>
-#include <iostream>
 #include <memory.h>
 #include <stack>
 #include "../../stringtools.h"
 #include "../../urbackupcommon/os_functions.h"
+#include "../../urbackupcommon/filelist_utils.h"
 #include "../../Interface/Server.h"
 #include <assert.h>
 
-const size_t buffer_size=4096;
+namespace
+{
+	int64 parse_int64(const char* p, const char* end)
+	{
+		bool neg = false;
+		if (p < end && *p == '-')
+		{
+			neg = true;
+			++p;
+		}
+		uint64 ret = 0;
+		for (; p < end && *p >= '0' && *p <= '9'; ++p)
+		{
+			ret = ret * 10 + (*p - '0');
+		}
+		return neg ? -static_cast<int64>(ret) : static_cast<int64>(ret);
+	}
+}
+
+TreeReader::TreeReader()
+	: list_size(0), list_pos(0), list_binary(false), parse_error(false), num_lines(0)
+{
+}
+
+TreeReader::~TreeReader()
+{
+	view.unmap();
+}
 
-bool TreeReader::readTree(const std::string &fn)
+bool TreeReader::readTree(const std::string &pfn)
 {
-	std::fstream in;
-	in.open(fn.c_str(), std::ios::in | std::ios::binary );
-	if (!in.is_open())
+	fn = pfn;
+	file.reset(Server->openFile(fn, MODE_READ));
+	if (file.get()==NULL)
 	{
 		Log("Cannot read file tree from file \"" + fn + "\"");
 		return false;
 	}
 
-	size_t read;
-	char buffer[buffer_size];
-	int state=0;
-	size_t lines=0;
-	size_t stringbuffer_size=0;
+	list_size = file->Size();
+	list_binary = isBinaryFileList(file.get());
+	int64 list_start = 0;
+	if (list_binary)
+	{
+		list_start = binary_filelist_header_size;
+	}
+
+	if (list_size > 0
+		&& !view.map(file.get(), list_size, true))
+	{
+		Log("Cannot map file tree from file \"" + fn + "\". " + os_last_error_str());
+		return false;
+	}
+
+	if (list_binary
+		&& view.data()[binary_filelist_header_size - 1] != binary_filelist_version)
+	{
+		Log("Unsupported binary file list version in \"" + fn + "\"");
+		return false;
+	}
+
+	//First pass: Count nodes and the children of each directory (in list order)
+	std::vector<_u32> dir_num_children;
+	std::stack<size_t> dirs;
+	dir_num_children.push_back(0);
+	dirs.push(0);
+	size_t n_nodes = 1;
+	size_t name_buffer_size = 0;
+	size_t lines = 0;
+
+	list_pos = list_start;
+	parse_error = false;
+	SEntry entry;
+	while (nextEntry(entry))
+	{
+		++lines;
+		if (entry.type == 'u')
+		{
+			if (dirs.size() <= 1)
+			{
+				Log("TreeReader: parents empty");
+				return false;
+			}
+			dirs.pop();
+			continue;
+		}
+
+		++n_nodes;
+		++dir_num_children[dirs.top()];
+
+		if (entry.name_escaped)
+		{
+			name_buffer_size += entry.name_len;
+		}
+
+		if (entry.type == 'd')
+		{
+			dirs.push(dir_num_children.size());
+			dir_num_children.push_back(0);
+		}
+	}
+
+	if (parse_error)
+	{
+		return false;
+	}
+
+	if (lines >= no_node)
+	{
+		Log("File tree in \"" + fn + "\" has too many entries");
+		return false;
+	}
+
+	node_name_off.resize(n_nodes);
+	node_name_len.resize(n_nodes);
+	node_size.resize(n_nodes);
+	node_last_modified.resize(n_nodes);
+	node_id.resize(n_nodes);
+	node_parent.resize(n_nodes);
+	node_first_child.resize(n_nodes);
+	node_num_children.resize(n_nodes);
+	node_flags.resize(n_nodes);
+	name_buffer.reserve(name_buffer_size);
+
+	node_name_off[0] = 0;
+	node_name_len[0] = 0;
+	node_size[0] = 0;
+	node_last_modified[0] = 0;
+	node_id[0] = 0;
+	node_parent[0] = no_node;
+	node_first_child[0] = 1;
+	node_num_children[0] = dir_num_children[0];
+	node_flags[0] = flag_dir;
+
+	//Second pass: Place each node in the children range of its parent
+	//and reserve the range for its own children after the used ranges
+	std::stack<std::pair<_u32, _u32> > parents;
+	parents.push(std::make_pair(static_cast<_u32>(0), static_cast<_u32>(1)));
+	size_t next_free = 1 + dir_num_children[0];
+	size_t dir_idx = 1;
+	_u32 id = 0;
+
+	list_pos = list_start;
 	std::string name;
-	char ltype=0;
-	do
+	while (nextEntry(entry))
 	{
-		in.read(buffer, buffer_size);
-		read=(size_t)in.gcount();
-		
-		for(size_t i=0;i<read;++i)
+		if (entry.type == 'u')
 		{
-			const char ch=buffer[i];
-			switch(state)
+			if (parents.size() <= 1)
 			{
-			case 0:
-				if(ch=='f' || ch=='d')
-				{
-					ltype = ch;
-					state = 1;
-				}
-				else if(ch=='u')
-				{
-					state = 10;
-					ltype = 'd';
-					name = "..";
-				}
-				else
-				{
-					Log("Error parsing file readTree - 0. Expected 'f', 'd', or 'u'. Got '"+std::string(1, ch)+"' at line "+convert(lines)+" while reading "+fn);
-					return false;
-				}
-				break;
-			case 1:
-				//"
-				state=2;
-				break;
-			case 2:
-				if(ch=='"')
-				{
-					state=3;
-				}
-				else if(ch=='\\')
-				{
-					state=5;
-				}
-				else
-				{
-					name+=ch;
-				}
-				break;
-			case 5:
-				if(ch!='\"' && ch!='\\')
-				{
-					name+='\\';
-				}
-				name+=ch;
-				state=2;
-				break;
-			case 3:
-				if(ch==' ')
-				{
-					state=4;
-					break;
-				}
-				else
+				Log("File tree in \"" + fn + "\" changed while reading it");
+				return false;
+			}
+			if (entry.digest_off >= 0)
+			{
+				if (node_digest_idx.empty())
 				{
-					state=10;
+					node_digest_idx.resize(n_nodes, static_cast<_u32>(no_node));
 				}
-			case 4:
-				if(state==4)
+				node_digest_idx[parents.top().first] = static_cast<_u32>(digest_off.size());
+				digest_off.push_back(entry.digest_off);
+			}
+			parents.pop();
+			++id;
+			continue;
+		}
+
+		if (parents.top().second >= n_nodes)
+		{
+			Log("File tree in \"" + fn + "\" changed while reading it");
+			return false;
+		}
+
+		_u32 n = parents.top().second++;
+		node_id[n] = id;
+		node_parent[n] = parents.top().first;
+		node_size[n] = entry.size;
+		node_last_modified[n] = entry.last_modified;
+		node_flags[n] = 0;
+
+		if (static_cast<uint64>(entry.last_modified) & symlink_bit)
+		{
+			for (_u32 p = node_parent[n]; p != no_node && !(node_flags[p] & flag_subtree_symlink); p = node_parent[p])
+			{
+				node_flags[p] |= flag_subtree_symlink;
+			}
+		}
+
+		if (entry.name_escaped)
+		{
+			const char* raw_name = view.data() + entry.name_off;
+			name.clear();
+			for (_u32 i = 0; i < entry.name_len; ++i)
+			{
+				if (raw_name[i] == '\\' && i + 1 < entry.name_len)
 				{
-					if(ch!='\n')
+					++i;
+					if (raw_name[i] != '"' && raw_name[i] != '\\')
 					{
-						break;
+						name += '\\';
 					}
 				}
-			case 10:
-				if(ch=='\n')
-				{
-					state=0;
-					if(ltype=='f')
-					{
-						stringbuffer_size+=2*sizeof(int64);
-					}
-					if(ltype!='d' || name!="..")
-					{
-						if(ltype=='d')
-						{
-							stringbuffer_size+=sizeof(int64);
-						}
+				name += raw_name[i];
+			}
+			node_name_off[n] = name_buffer.size();
+			node_name_len[n] = static_cast<_u32>(name.size());
+			name_buffer.insert(name_buffer.end(), name.begin(), name.end());
+			node_flags[n] |= flag_name_unescaped;
+		}
+		else
+		{
+			node_name_off[n] = entry.name_off;
+			node_name_len[n] = entry.name_len;
+		}
 
-						++lines;
-						stringbuffer_size+=name.size()+1;
-					}
-					name.clear();
-					ltype=0;
-				}
-			}		
+		if (entry.type == 'd')
+		{
+			if (dir_idx >= dir_num_children.size())
+			{
+				Log("File tree in \"" + fn + "\" changed while reading it");
+				return false;
+			}
+			node_flags[n] |= flag_dir;
+			node_first_child[n] = static_cast<_u32>(next_free);
+			node_num_children[n] = dir_num_children[dir_idx];
+			next_free += dir_num_children[dir_idx];
+			++dir_idx;
+			parents.push(std::make_pair(n, node_first_child[n]));
+		}
+		else
+		{
+			node_first_child[n] = no_node;
+			node_num_children[n] = 0;
+		}
+
+		++id;
+	}
+
+	if (parse_error)
+	{
+		return false;
+	}
+
+	assert(next_free == n_nodes);
+	num_lines = id;
+	assert(dir_idx == dir_num_children.size());
+
+	return true;
+}
+
+bool TreeReader::nextEntry(SEntry& entry)
+{
+	if (parse_error
+		|| list_pos >= list_size)
+	{
+		return false;
+	}
+
+	entry.digest_off = -1;
+
+	if (list_binary)
+	{
+		return nextBinaryEntry(entry);
+	}
+	else
+	{
+		return nextTextEntry(entry);
+	}
+}
+
+bool TreeReader::nextTextEntry(SEntry& entry)
+{
+	const char* data = view.data();
+	char ch = data[list_pos++];
+
+	entry.size = 0;
+	entry.last_modified = 0;
+	entry.name_escaped = false;
+
+	if (ch == 'u')
+	{
+		while (list_pos < list_size && data[list_pos++] != '\n');
+		entry.type = 'u';
+		return true;
+	}
+	else if (ch != 'f' && ch != 'd')
+	{
+		Log("Error parsing file readTree. Expected 'f', 'd', or 'u'. Got '" + std::string(1, ch) + "' at offset " + convert(list_pos - 1) + " while reading " + fn);
+		parse_error = true;
+		return false;
+	}
+
+	entry.type = ch;
+
+	//"
+	++list_pos;
+	entry.name_off = list_pos;
+	while (list_pos < list_size && data[list_pos] != '"')
+	{
+		if (data[list_pos] == '\\')
+		{
+			entry.name_escaped = true;
+			++list_pos;
 		}
+		++list_pos;
 	}
-	while(read>0);
 
-	in.clear();
-	name.clear();
-	in.seekg(0, std::ios::beg);
+	if (list_pos >= list_size)
+	{
+		Log("Error parsing file readTree. Unexpected end of file while reading " + fn);
+		parse_error = true;
+		return false;
+	}
 
+	entry.name_len = static_cast<_u32>(list_pos - entry.name_off);
+	++list_pos;
 
-	size_t stringbuffer_pos=0;
-	stringbuffer.resize(stringbuffer_size+5);
-	
-	
-	state=0;
-	bool isdir=false;
-	std::string data;
-	std::stack<TreeNode*> parents;
-	std::stack<TreeNode*> lastNodes;
-	bool firstChild=true;
+	if (entry.type == 'd'
+		&& entry.name_len == 2
+		&& data[entry.name_off] == '.'
+		&& data[entry.name_off + 1] == '.')
+	{
+		entry.type = 'u';
+	}
 
-	size_t idx=1;
-	nodes.resize(lines+1);
+	if (list_pos < list_size
+		&& data[list_pos] == ' ')
+	{
+		int64 data_start = ++list_pos;
+		int64 data_space = -1;
+		while (list_pos < list_size && data[list_pos] != '\n')
+		{
+			if (data_space == -1 && data[list_pos] == ' ')
+			{
+				data_space = list_pos;
+			}
+			++list_pos;
+		}
 
-	std::string root_str = "root";
-	memcpy(&stringbuffer[0], root_str.c_str(), root_str.size()+1);
-	stringbuffer_pos+=root_str.size()+1;
+		if (data_space != -1)
+		{
+			if (entry.type == 'f')
+			{
+				entry.size = parse_int64(data + data_start, data + data_space);
+			}
+			entry.last_modified = parse_int64(data + data_space + 1, data + list_pos);
+		}
+	}
 
-	nodes[0].setName(&stringbuffer[0]);
+	while (list_pos < list_size && data[list_pos++] != '\n');
 
-	parents.push(&nodes[0]);
-	lastNodes.push(&nodes[0]);
+	return true;
+}
 
-	lines=0;
+bool TreeReader::nextBinaryEntry(SEntry& entry)
+{
+	char ch = view.data()[list_pos++];
 
+	entry.size = 0;
+	entry.last_modified = 0;
+	entry.name_escaped = false;
 
-	do
+	if (ch == 'u')
+	{
+		entry.type = 'u';
+		return true;
+	}
+	else if (ch == 'U')
 	{
-		in.read(buffer, buffer_size);
-		read=(size_t)in.gcount();
-		
-		for(size_t i=0;i<read;++i)
+		entry.type = 'u';
+
+		int64 digest_len;
+		if (!readVarint(digest_len)
+			|| digest_len < 0
+			|| digest_len > list_size - list_pos)
 		{
-			const char ch=buffer[i];
-			switch(state)
+			parse_error = true;
+			return false;
+		}
+
+		if (digest_len == binary_filelist_dir_digest_size)
+		{
+			entry.digest_off = list_pos;
+		}
+		list_pos += digest_len;
+		return true;
+	}
+	else if (ch == 'e')
+	{
+		list_pos = list_size;
+		return false;
+	}
+	else if (ch != 'f' && ch != 'd')
+	{
+		Log("Error parsing binary file list. Unexpected entry type '" + std::string(1, ch) + "' at offset " + convert(list_pos - 1) + " while reading " + fn);
+		parse_error = true;
+		return false;
+	}
+
+	entry.type = ch;
+
+	int64 name_len;
+	if (!readVarint(name_len)
+		|| name_len < 0
+		|| name_len > list_size - list_pos)
+	{
+		parse_error = true;
+		return false;
+	}
+
+	entry.name_off = list_pos;
+	entry.name_len = static_cast<_u32>(name_len);
+	list_pos += name_len;
+
+	if (entry.type == 'f'
+		&& !readVarint(entry.size))
+	{
+		parse_error = true;
+		return false;
+	}
+
+	int64 n_extra;
+	if (!readVarint(entry.last_modified)
+		|| !readVarint(n_extra))
+	{
+		parse_error = true;
+		return false;
+	}
+
+	for (int64 i = 0; i < n_extra; ++i)
+	{
+		int64 key_id;
+		if (!readVarint(key_id))
+		{
+			parse_error = true;
+			return false;
+		}
+
+		//Key (if it is not in the key table) and value
+		int n_strings = key_id == 0 ? 2 : 1;
+		for (int j = 0; j < n_strings; ++j)
+		{
+			int64 str_len;
+			if (!readVarint(str_len)
+				|| str_len < 0
+				|| str_len > list_size - list_pos)
 			{
-				case 0:
-					if(ch=='f')
-					{
-						data+='f';
-						state=1;
-					}
-					else if(ch=='d')
-					{
-						data+='d';
-						state=1;
-					}
-					else if(ch=='u')
-					{
-						name="..";
-						state=10;
-					}
-					else
-					{
-						Log("Error parsing file readTree - 1. Expected 'f', 'd', or 'u'. Got '" + std::string(1, ch) + "' at line " + convert(lines)+" while reading "+fn);
-						return false;
-					}					
-					break;
-				case 1:
-					//"
-					state=2;
-					break;
-				case 2:
-					if(ch=='"')
-					{
-						state=3;
-					}
-					else if(ch=='\\')
-					{
-						state=5;
-					}
-					else
-					{
-						name+=ch;
-					}
-					break;
-				case 5:
-					if(ch!='\"' && ch!='\\')
-					{
-						name+='\\';
-					}
-					name+=ch;
-					state=2;
-					break;
-				case 3:
-					if(ch==' ')
-					{
-						state=4;
-						break;
-					}
-					else
-					{
-						state=10;
-					}
-				case 4:
-					if(state==4)
-					{
-						if(ch!='\n')
-						{
-							data+=ch;
-							break;
-						}
-					}
-				case 10:
-					if(ch=='\n')
-					{
-						if(name!="..")
-						{
-							memcpy(&stringbuffer[stringbuffer_pos], name.c_str(), name.size()+1);
-							nodes[idx].setName(&stringbuffer[stringbuffer_pos]);
-							stringbuffer_pos+=name.size()+1;
-							nodes[idx].setId(lines);
-
-							char ch=data[0];
-							nodes[idx].setType(ch);
-							if(ch=='f')
-							{
-								std::string sdata=data.substr(1);
-								std::string filesize=getuntil(" ", sdata);
-								std::string last_mod=getafter(" ", sdata);
-
-								_i64 ifilesize=os_atoi64(filesize);
-								_i64 ilast_mod=os_atoi64(last_mod);
-
-								char* ndata=&stringbuffer[stringbuffer_pos];
-								memcpy(&stringbuffer[stringbuffer_pos], &ifilesize, sizeof(_i64));
-								stringbuffer_pos+=sizeof(_i64);
-								memcpy(&stringbuffer[stringbuffer_pos], &ilast_mod, sizeof(_i64));
-								stringbuffer_pos+=sizeof(_i64);
-
-								nodes[idx].setData(ndata);
-							}
-							else
-							{
-								std::string sdata=data.substr(1);
-								std::string last_mod=getafter(" ", sdata);
-
-								_i64 ilast_mod=os_atoi64(last_mod);
-								char* ndata=&stringbuffer[stringbuffer_pos];
-
-								memcpy(&stringbuffer[stringbuffer_pos], &ilast_mod, sizeof(_i64));
-								stringbuffer_pos+=sizeof(_i64);
-
-								nodes[idx].setData(ndata);
-							}
-
-							if(firstChild)
-							{
-								lastNodes.push(&nodes[idx]);
-								firstChild=false;
-							}
-							else
-							{
-								lastNodes.top()->setNextSibling(&nodes[idx]);
-								lastNodes.pop();
-								lastNodes.push(&nodes[idx]);
-							}
-
-							if(!parents.empty())
-							{
-								parents.top()->incrementNumChildren();
-								nodes[idx].setParent(parents.top());
-							}
-
-							if(ch=='d')
-							{
-								parents.push(&nodes[idx]);
-								firstChild=true;
-							}
-
-							++idx;
-						}
-						else
-						{
-							if(!parents.empty())
-							{
-								parents.pop();
-							}
-							else
-							{
-								Log("TreeReader: parents empty");
-								return false;
-							}
-							if(!firstChild)
-							{
-								if(lastNodes.empty())
-								{
-									Log("TreeReader: lastNodes empty");
-									return false;
-								}
-								lastNodes.top()->setNextSibling(NULL);
-								lastNodes.pop();
-							}
-							firstChild=false;
-						}
-
-						name.clear();
-						data.clear();
-						state=0;
-						++lines;
-					}
-			}		
+				parse_error = true;
+				return false;
+			}
+			list_pos += str_len;
 		}
 	}
-	while(read==buffer_size);
 
-	assert(idx == nodes.size());
-	assert(stringbuffer_pos == stringbuffer.size());
+	return true;
+}
+
+bool TreeReader::readVarint(int64& val)
+{
+	const unsigned char* data = reinterpret_cast<const unsigned char*>(view.data());
+	uint64 ret = 0;
+	for (int i = 0; i < 9; ++i)
+	{
+		if (list_pos >= list_size)
+		{
+			Log("Error parsing binary file list. Unexpected end of file while reading " + fn);
+			return false;
+		}
 
-	nodes[0].setNextSibling(NULL);
+		unsigned char b = data[list_pos++];
+		if (i == 8)
+		{
+			ret = (ret << 8) | b;
+			break;
+		}
 
+		ret = (ret << 7) | (b & 0x7f);
+		if ((b & 0x80) == 0)
+		{
+			break;
+		}
+	}
+	val = static_cast<int64>(ret);
 	return true;
 }
 
-void TreeReader::Log(const std::string &str)
+size_t TreeReader::getMemoryUsage()
 {
-	Server->Log(str, LL_ERROR);
+	return node_name_off.capacity()*sizeof(int64)
+		+ node_name_len.capacity()*sizeof(_u32)
+		+ node_size.capacity()*sizeof(int64)
+		+ node_last_modified.capacity()*sizeof(int64)
+		+ node_id.capacity()*sizeof(_u32)
+		+ node_parent.capacity()*sizeof(_u32)
+		+ node_first_child.capacity()*sizeof(_u32)
+		+ node_num_children.capacity()*sizeof(_u32)
+		+ node_flags.capacity()
+		+ name_buffer.capacity()
+		+ node_digest_idx.capacity()*sizeof(_u32)
+		+ digest_off.capacity()*sizeof(int64);
 }
 
-std::vector<TreeNode> * TreeReader::getNodes(void)
+void TreeReader::Log(const std::string &str)
 {
-	return &nodes;
-}
\ No newline at end of file
+	Server->Log(str, LL_ERROR);
+}
@@ -1,15 +1,255 @@
-#include "TreeNode.h"
+#ifndef TREEREADER_H
+#define TREEREADER_H
 
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <string.h>
+
+#include "../../Interface/Types.h"
+#include "../MemoryMappedFile.h"
+
+//File list tree stored as arrays indexed by node number. The file list is
+//memory mapped and the node names point into it (names which are escaped in
+//text lists are stored unescaped in a separate buffer). The children of a
+//directory are stored next to each other, node 0 is the root.
 class TreeReader
 {
 public:
+	TreeReader();
+	~TreeReader();
+
 	bool readTree(const std::string &fn);
 
-	std::vector<TreeNode> * getNodes(void);
+	static const _u32 no_node = 0xFFFFFFFF;
+
+	_u32 getNumNodes()
+	{
+		return static_cast<_u32>(node_id.size());
+	}
+
+	char getType(_u32 n)
+	{
+		return (node_flags[n] & flag_dir) ? 'd' : 'f';
+	}
+
+	//Line in the file list (counting directory up entries)
+	size_t getId(_u32 n)
+	{
+		return node_id[n];
+	}
+
+	_u32 getParent(_u32 n)
+	{
+		return node_parent[n];
+	}
+
+	_u32 getFirstChild(_u32 n)
+	{
+		return node_first_child[n];
+	}
+
+	_u32 getNumChildren(_u32 n)
+	{
+		return node_num_children[n];
+	}
+
+	//Number of file list lines of the subtree of n (including n and
+	//the directory up entries)
+	size_t getSubtreeLines(_u32 n)
+	{
+		if (n == 0)
+		{
+			return num_lines;
+		}
+
+		_u32 orig = n;
+		size_t n_up = 0;
+		while (true)
+		{
+			_u32 p = node_parent[n];
+			if (n + 1 < node_first_child[p] + node_num_children[p])
+			{
+				return node_id[n + 1] - n_up - node_id[orig];
+			}
+			if (p == 0)
+			{
+				return num_lines - n_up - node_id[orig];
+			}
+			++n_up;
+			n = p;
+		}
+	}
+
+	int64 getSize(_u32 n)
+	{
+		return node_size[n];
+	}
+
+	//Last modified time or change indicator
+	int64 getLastModified(_u32 n)
+	{
+		return node_last_modified[n];
+	}
+
+	const char* getName(_u32 n)
+	{
+		if (node_flags[n] & flag_name_unescaped)
+		{
+			return &name_buffer[static_cast<size_t>(node_name_off[n])];
+		}
+		return view.data() + node_name_off[n];
+	}
+
+	_u32 getNameLength(_u32 n)
+	{
+		return node_name_len[n];
+	}
+
+	int nameCompare(_u32 n, TreeReader& other, _u32 o)
+	{
+		_u32 len = node_name_len[n];
+		_u32 olen = other.node_name_len[o];
+		int rc = memcmp(getName(n), other.getName(o), (std::min)(len, olen));
+		if (rc != 0)
+		{
+			return rc;
+		}
+		return len < olen ? -1 : (len > olen ? 1 : 0);
+	}
+
+	bool nameEquals(_u32 n, TreeReader& other, _u32 o)
+	{
+		return node_name_len[n] == other.node_name_len[o]
+			&& memcmp(getName(n), other.getName(o), node_name_len[n]) == 0;
+	}
+
+	int nameCompare(_u32 n, const std::string& name)
+	{
+		_u32 len = node_name_len[n];
+		int rc = memcmp(getName(n), name.data(), (std::min)(static_cast<size_t>(len), name.size()));
+		if (rc != 0)
+		{
+			return rc;
+		}
+		return len < name.size() ? -1 : (len > name.size() ? 1 : 0);
+	}
+
+	bool nameEquals(_u32 n, const std::string& name)
+	{
+		return node_name_len[n] == name.size()
+			&& memcmp(getName(n), name.data(), name.size()) == 0;
+	}
+
+	bool dataEquals(_u32 n, TreeReader& other, _u32 o)
+	{
+		return getType(n) == other.getType(o)
+			&& node_size[n] == other.node_size[o]
+			&& node_last_modified[n] == other.node_last_modified[o];
+	}
+
+	bool isMapped(_u32 n)
+	{
+		return (node_flags[n] & flag_mapped) != 0;
+	}
+
+	void setMapped(_u32 n)
+	{
+		node_flags[n] |= flag_mapped;
+	}
+
+	//Digest of the subtree of a directory (binary_filelist_dir_digest_size bytes)
+	//or NULL if the list has none for it
+	const char* getDirDigest(_u32 n)
+	{
+		if (node_digest_idx.empty()
+			|| node_digest_idx[n] == no_node)
+		{
+			return NULL;
+		}
+		return view.data() + digest_off[node_digest_idx[n]];
+	}
+
+	//Change indicator of an entry in the subtree (not counting n) has the symlink bit
+	bool getSubtreeSymlink(_u32 n)
+	{
+		return (node_flags[n] & flag_subtree_symlink) != 0;
+	}
+
+	//Subtree was not diffed because it is equal to the other tree's
+	bool getSubtreeSkipped(_u32 n)
+	{
+		return (node_flags[n] & flag_subtree_skipped) != 0;
+	}
+
+	void setSubtreeSkipped(_u32 n)
+	{
+		node_flags[n] |= flag_subtree_skipped;
+	}
+
+	bool getSubtreeChanged(_u32 n)
+	{
+		return (node_flags[n] & flag_subtree_changed) != 0;
+	}
+
+	void setSubtreeChanged(_u32 n)
+	{
+		node_flags[n] |= flag_subtree_changed;
+	}
+
+	//Bytes used by the tree (not counting the mapped file list)
+	size_t getMemoryUsage();
+
 private:
+	static const char flag_dir = 1;
+	static const char flag_mapped = 2;
+	static const char flag_subtree_changed = 4;
+	static const char flag_name_unescaped = 8;
+	static const char flag_subtree_symlink = 16;
+	static const char flag_subtree_skipped = 32;
+
+	static const uint64 symlink_bit = 0x4000000000000000ULL;
+
+	struct SEntry
+	{
+		char type;
+		int64 name_off;
+		_u32 name_len;
+		bool name_escaped;
+		int64 size;
+		int64 last_modified;
+		int64 digest_off;
+	};
+
+	bool nextEntry(SEntry& entry);
+	bool nextTextEntry(SEntry& entry);
+	bool nextBinaryEntry(SEntry& entry);
+	bool readVarint(int64& val);
 
 	void Log(const std::string &str);
 
-	std::vector<TreeNode> nodes;
-	std::vector<char> stringbuffer;
-};
\ No newline at end of file
+	std::auto_ptr<IFsFile> file;
+	MemoryMappedFile view;
+	int64 list_size;
+	int64 list_pos;
+	bool list_binary;
+	bool parse_error;
+	std::string fn;
+	size_t num_lines;
+
+	std::vector<int64> node_name_off;
+	std::vector<_u32> node_name_len;
+	std::vector<int64> node_size;
+	std::vector<int64> node_last_modified;
+	std::vector<_u32> node_id;
+	std::vector<_u32> node_parent;
+	std::vector<_u32> node_first_child;
+	std::vector<_u32> node_num_children;
+	std::vector<char> node_flags;
+	std::vector<char> name_buffer;
+	std::vector<_u32> node_digest_idx;
+	std::vector<int64> digest_off;
+};
+
+#endif //TREEREADER_H
@@ -35,6 +35,7 @@
 #include "serverinterface/helper.h"
 #include "server.h"
 #include "../urbackupcommon/TreeHash.h"
+#include "FileManifest.h"
 
 const _u32 c_read_blocksize=4096;
 const size_t draw_segments=30;
@@ -205,6 +206,26 @@ bool verify_file(db_single_result &res, _i64 &curr_verified, _i64 verify_size, b
 	return true;
 }
 
+std::string get_backuppath(IQuery* q_get_backuppath, std::map<int, std::string>& backuppaths, int backupid)
+{
+	std::map<int, std::string>::iterator it_backuppath = backuppaths.find(backupid);
+	if (it_backuppath != backuppaths.end())
+	{
+		return it_backuppath->second;
+	}
+
+	std::string backuppath;
+	q_get_backuppath->Bind(backupid);
+	db_results res_backuppath = q_get_backuppath->Read();
+	q_get_backuppath->Reset();
+	if (!res_backuppath.empty())
+	{
+		backuppath = res_backuppath[0]["path"];
+		backuppaths.insert(std::make_pair(backupid, backuppath));
+	}
+	return backuppath;
+}
+
 bool verify_hashes(std::string arg)
 {
 	IDatabase *db=Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER);
@@ -385,23 +406,7 @@ bool verify_hashes(std::string arg)
 	while(cursor->next(res_single))
 	{
 		int backupid = watoi(res_single["backupid"]);
-		std::string backuppath;
-		std::map<int, std::string>::iterator it_backuppath = backuppaths.find(backupid);
-		if (it_backuppath == backuppaths.end())
-		{
-			q_get_backuppath->Bind(backupid);
-			db_results res_backuppath = q_get_backuppath->Read();
-			q_get_backuppath->Reset();
-			if (!res_backuppath.empty())
-			{
-				backuppath = res_backuppath[0]["path"];
-				backuppaths.insert(std::make_pair(backupid, backuppath));
-			}
-		}
-		else
-		{
-			backuppath = it_backuppath->second;
-		}
+		std::string backuppath = get_backuppath(q_get_backuppath, backuppaths, backupid);
 
 		bool is_missing=false;
 		if(! verify_file( res_single, curr_verified, verify_size, is_missing, backuppath) )
@@ -423,6 +428,53 @@ bool verify_hashes(std::string arg)
 		}
 	}
 
+	//Small files of backups which have a file manifest
+	std::vector<int> manifest_backupids = FileManifest::get_backupids();
+	IQuery* q_manifest_filter = files_db->Prepare("SELECT 1 AS c FROM (SELECT ? AS backupid, ? AS clientid) WHERE "+filter, false);
+	for(size_t i=0;i<manifest_backupids.size();++i)
+	{
+		int backupid = manifest_backupids[i];
+		FileManifest::Reader manifest(backupid);
+		if(!manifest.exists())
+		{
+			continue;
+		}
+
+		q_manifest_filter->Bind(backupid);
+		q_manifest_filter->Bind(manifest.get_clientid());
+		db_results res_filter = q_manifest_filter->Read();
+		q_manifest_filter->Reset();
+		if(res_filter.empty())
+		{
+			continue;
+		}
+
+		std::string backuppath = get_backuppath(q_get_backuppath, backuppaths, backupid);
+
+		FileManifest::SEntry entry;
+		while(manifest.next(entry))
+		{
+			db_single_result res_single;
+			res_single["fullpath"] = entry.fullpath;
+			res_single["shahash"] = entry.shahash;
+			res_single["filesize"] = convert(entry.filesize);
+
+			bool is_missing=false;
+			if(! verify_file( res_single, curr_verified, verify_size, is_missing, backuppath) )
+			{
+				v_failure << "Verification of \"" << (entry.fullpath) << "\" failed\r\n";
+				is_okay=false;
+			}
+		}
+
+		if(manifest.has_error())
+		{
+			v_failure << "Reading file manifest of backup " << backupid << " failed\r\n";
+			is_okay=false;
+		}
+	}
+	files_db->destroyQuery(q_manifest_filter);
+
 	std::cout << std::endl;
 	
 	if(v_failure.is_open() && is_okay)